@@ -0,0 +1,111 @@
+#!/bin/bash
+# Benchmark script for company daemon
+# Runs one transfer/backup cycle over a generated workload for each
+# durability mode and reports the time spent syncing, the heap
+# allocations made and the memory used, then measures how long the daemon
+# takes to start with and without a saved monitor state. A file size of 0
+# benchmarks the per-file metadata alone, e.g. ./bench.sh 1000000 0
+#
+# Usage: ./bench.sh [file_count] [file_size_kb]
+
+FILE_COUNT=${1:-2000}
+FILE_SIZE_KB=${2:-16}
+
+echo "Building the daemon..."
+make > /dev/null || exit 1
+
+BIN="$(pwd)/bin/test_mode"
+DAEMON="$(pwd)/bin/company_daemon"
+ALLOC_COUNT="$(pwd)/bin/alloc_count.so"
+BENCH_DIR=$(mktemp -d)
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+# Fill the upload directory from the template, many files per process
+make_uploads() {
+    seq -f "$BENCH_DIR/data/upload/bench_%.0f.xml" 1 "$FILE_COUNT" |
+        xargs -n 512 sh -c 'tee "$@" < "$0" > /dev/null' "$BENCH_DIR/template.xml"
+}
+
+# Run a single test mode cycle in the bench directory and stop it once
+# done. The allocation counter writes its totals when the run is stopped.
+run_cycle() {
+    ALLOC_COUNT_OUTPUT="$BENCH_DIR/alloc.txt" LD_PRELOAD="$ALLOC_COUNT" \
+        "$BIN" > "$BENCH_DIR/output.txt" 2>&1 &
+    local pid=$!
+    # stdout is block buffered, so watch the log for the end of the cycle
+    while ! grep -q "IPC message queue cleaned up" "$BENCH_DIR/logs/error.log" 2>/dev/null; do
+        if ! kill -0 $pid 2>/dev/null; then
+            echo "ERROR: test mode exited early"
+            cat "$BENCH_DIR/output.txt"
+            return 1
+        fi
+        sleep 0.1
+    done
+    PEAK_RSS_KB=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status")
+    kill $pid
+    wait $pid 2>/dev/null
+    return 0
+}
+
+# Report the allocations and memory of the last cycle
+report_memory() {
+    local allocations bytes peak
+    read -r allocations bytes peak < "$BENCH_DIR/alloc.txt" || return
+    awk -v a="$allocations" -v b="$bytes" -v p="$peak" -v r="$PEAK_RSS_KB" -v n="$FILE_COUNT" 'BEGIN {
+        printf "  Heap allocations: %d (%.2f per file), %.1f MiB allocated\n", a, a / n, b / 1048576
+        printf "  Peak heap: %.1f MiB, peak RSS: %.1f MiB\n", p / 1048576, r / 1024
+    }'
+}
+
+echo "Workload: $FILE_COUNT files of ${FILE_SIZE_KB} KiB"
+
+for mode in none batch strict; do
+    rm -rf "$BENCH_DIR/data" "$BENCH_DIR/logs"
+    mkdir -p "$BENCH_DIR/data/upload" "$BENCH_DIR/data/reporting" "$BENCH_DIR/data/backup" "$BENCH_DIR/logs"
+
+    head -c $((FILE_SIZE_KB * 1024)) /dev/urandom > "$BENCH_DIR/template.xml"
+    make_uploads
+    sync
+
+    echo "durability = $mode" > "$BENCH_DIR/company.conf"
+
+    cd "$BENCH_DIR" || exit 1
+    start=$(date +%s.%N)
+    run_cycle || exit 1
+    end=$(date +%s.%N)
+    cd - > /dev/null || exit 1
+
+    echo -e "\nDurability mode: $mode"
+    awk -v s="$start" -v e="$end" 'BEGIN { printf "  Cycle time: %.3f s\n", e - s }'
+    grep "Durability" "$BENCH_DIR/logs/error.log" | sed 's/^.*INFO: /  /'
+    report_memory
+done
+
+# Start the daemon in the bench directory and report its startup time
+run_startup() {
+    local label=$1
+    : > "$BENCH_DIR/logs/error.log"
+    "$DAEMON" || return 1
+    while ! grep -q "Startup completed" "$BENCH_DIR/logs/error.log" 2>/dev/null; do
+        sleep 0.05
+    done
+    # Let the first monitoring pass save its state before stopping
+    sleep 1
+    kill "$(cat /tmp/company_daemon.pid)"
+    sleep 0.2
+    grep "Startup completed" "$BENCH_DIR/logs/error.log" | sed "s/^.*INFO: /  $label: /"
+}
+
+echo -e "\nStartup with $FILE_COUNT files in the upload directory"
+rm -rf "$BENCH_DIR/data" "$BENCH_DIR/logs" "$BENCH_DIR/company.conf"
+mkdir -p "$BENCH_DIR/data/upload" "$BENCH_DIR/data/reporting" "$BENCH_DIR/data/backup" "$BENCH_DIR/logs"
+make_uploads
+
+# A large descriptor limit is what made closing them one by one slow
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+echo "  Descriptor limit: $(ulimit -n)"
+
+cd "$BENCH_DIR" || exit 1
+run_startup "Cold (no saved state)" || exit 1
+run_startup "Warm (saved state)" || exit 1
+cd - > /dev/null || exit 1
@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Default size of each block of memory the arena carves allocations from
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+// A block of arena memory, allocations are bumped out of data
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// Bump allocator for short-lived metadata, everything is freed at once
+struct arena {
+    struct arena_chunk *head;
+    size_t chunk_size;
+    size_t bytes_used;
+    size_t chunk_count;
+};
+
+// Function declarations for the arena allocator
+void arena_init(struct arena *arena, size_t chunk_size);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+void arena_free(struct arena *arena);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef ATTRIBUTION_H
+#define ATTRIBUTION_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Slots of the pid to uid cache, a power of two
+#define ATTRIBUTION_PID_CACHE_SIZE 1024
+
+// How long a cached pid is trusted before /proc is read again, pids are
+// reused so it cannot be forever
+#define ATTRIBUTION_PID_TTL_MS 5000
+
+// Buckets of the table of last writers per file
+#define ATTRIBUTION_BUCKETS 1024
+
+// Writers not picked up by the monitor within this time are forgotten
+#define ATTRIBUTION_MAX_AGE_SEC 600
+
+// Read buffer for fanotify events
+#define ATTRIBUTION_EVENT_BUFFER (64 * 1024)
+
+// Longest process name the kernel reports
+#define ATTRIBUTION_COMM_MAX 16
+
+// How upload changes are attributed to a user, selected with the
+// attribution setting (owner or fanotify)
+enum attribution_mode {
+    ATTRIBUTION_OWNER,      // The file's owner, cheap but wrong for shared files
+    ATTRIBUTION_FANOTIFY    // The process that wrote the file, needs CAP_SYS_ADMIN
+};
+
+#define DEFAULT_ATTRIBUTION_MODE ATTRIBUTION_OWNER
+
+// The process that last wrote to a file
+struct attribution_writer {
+    pid_t pid;
+    uid_t uid;
+    char comm[ATTRIBUTION_COMM_MAX];
+    time_t when;
+};
+
+// Function declarations for change attribution
+int attribution_start(const char *upload_dir);
+int attribution_watch(const char *upload_dir);
+int attribution_lookup(const struct stat *st, struct attribution_writer *writer);
+void attribution_expire(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "durability.h"
+#include "arena.h"
+
+// Per snapshot list of the CRC32C and size of every backed up file
+#define BACKUP_CHECKSUMS ".checksums"
+
+// Upper bound on the threads used to verify a snapshot
+#define VERIFY_MAX_THREADS 16
+
+// Read buffer used when checksumming a file on its own
+#define CHECKSUM_BUFFER_SIZE (128 * 1024)
+
+// One file listed in a snapshot's checksum list
+struct checksum_entry {
+    char *path;             // Relative to the snapshot directory
+    long long size;
+    uint32_t crc;
+};
+
+// The checksum list of a snapshot, sorted by path. A zeroed list is
+// empty, the paths are stored in the arena once the first is added.
+struct checksum_list {
+    struct checksum_entry *entries;
+    size_t count, capacity;
+    struct arena arena;
+};
+
+// Totals for one verification run
+struct verify_stats {
+    size_t files_ok;
+    size_t files_corrupt;
+    size_t files_missing;
+    unsigned long long bytes_read;
+};
+
+// Function declarations for checksums and snapshot verification
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+const char *crc32c_implementation(void);
+int checksum_file(const char *path, uint32_t *crc, long long *size);
+int checksum_list_add(struct checksum_list *list, const char *path, long long size, uint32_t crc);
+int checksum_list_load(struct checksum_list *list, const char *snapshot_dir);
+int checksum_list_save(struct checksum_list *list, const char *snapshot_dir, struct durability_batch *batch);
+const struct checksum_entry *checksum_list_find(const struct checksum_list *list, const char *path);
+void checksum_list_free(struct checksum_list *list);
+int verify_snapshot(const char *snapshot_dir, int threads, struct verify_stats *stats);
+
+#endif
@@ -2,23 +2,36 @@
 #define COMPANY_H
 
 #include "daemon.h"
+#include "durability.h"
+#include "dir_scan.h"
+#include "config.h"
 #include "sys/msg.h"
-#include "dirent.h"
 #include "pwd.h"
 
-// The Directory Paths
-#define UPLOAD_DIR "./data/upload"
-#define REPORTING_DIR "./data/reporting"
-#define BACKUP_DIR "./data/backup"
-#define LOG_DIR "./logs"
-#define CHANGE_LOG "./logs/change.log"
-#define ERROR_LOG "./logs/error.log"
+// Identify the running instance, so they are fixed at build time
 #define LOCK_FILE "/tmp/company_daemon.lock"
 #define PID_FILE "/tmp/company_daemon.pid"
 
-// Transfer time at 1AM
-#define TRANSFER_TIME_HOUR 1
-#define TRANSFER_TIME_MIN 0
+// Only files with this suffix are treated as reports
+#define REPORT_SUFFIX ".xml"
+
+// Suffix of a destination file that is still being copied
+#define PARTIAL_SUFFIX ".part"
+
+// Block size of the file copy loop
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+// Longest message written to the logs, room for two full paths
+#define LOG_MESSAGE_MAX (2 * PATH_MAX + 256)
+
+struct partition_index;
+struct checksum_entry;
+
+// Where transfer_uploads() put one upload of the scan it was given
+struct transfer_outcome {
+    int moved;
+    char dst[PATH_MAX];
+};
 
 // Message Structure
 struct msg_buffer {
@@ -29,11 +42,19 @@ struct msg_buffer {
 // Function declartions for the company operations
 int lock_directories(void);
 int unlock_directories(void);
-int backup_reporting_dir(void);
-int transfer_uploads(void);
-int check_missing_uploads(void);
+int backup_reporting_dir(const struct dir_scan *reports);
+int backup_snapshot_dir(const char *name, char *snapshot_dir, size_t size);
+int transfer_uploads(const struct dir_scan *uploads, struct transfer_outcome *outcomes);
+int copy_file(const char *src_path, const char *dst_path, struct durability_batch *batch,
+              struct checksum_entry *sum);
+int move_file(const char *src_path, const char *dst_path, struct durability_batch *batch);
+int transfer_record(const char *dst_path, struct partition_index *partitions);
+int check_missing_uploads(const struct dir_scan *uploads, const struct dir_scan *reports);
+int run_cycle(int throttled);
 void monitor_uploads(void);
+int monitor_init(const char *upload_dir);
 void log_message(int priority, const char *format, ...);
+int format_path(char *path, size_t size, const char *format, ...);
 int setup_ipc(int msgid, long type, const char *msg);
 void cleanup_ipc(int msgid);
 void monitor_uploads_with_path(const char *upload_dir);
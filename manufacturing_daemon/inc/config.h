@@ -0,0 +1,103 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <limits.h>
+#include "durability.h"
+#include "partition.h"
+#include "throttle.h"
+#include "attribution.h"
+#include "versions.h"
+#include "intake.h"
+
+// Configuration file read at startup and again on SIGHUP
+#define CONFIG_FILE "./company.conf"
+
+// Defaults for every setting the configuration file leaves out
+#define DEFAULT_UPLOAD_DIR "./data/upload"
+#define DEFAULT_REPORTING_DIR "./data/reporting"
+#define DEFAULT_BACKUP_DIR "./data/backup"
+#define DEFAULT_LOG_DIR "./logs"
+#define DEFAULT_CHANGE_LOG "./logs/change.log"
+#define DEFAULT_ERROR_LOG "./logs/error.log"
+#define DEFAULT_TRANSFER_JOURNAL "./data/transfer.journal"
+#define DEFAULT_MONITOR_STATE "./data/monitor.state"
+#define DEFAULT_DEPARTMENTS_FILE "./departments.conf"
+#define DEFAULT_TRANSFER_HOUR 1
+#define DEFAULT_TRANSFER_MINUTE 0
+#define DEFAULT_MISSING_REPORT_WINDOW_DAYS 7
+#define DEFAULT_RETENTION_DAILY 7
+#define DEFAULT_RETENTION_WEEKLY 4
+#define DEFAULT_RETENTION_MONTHLY 12
+#define DEFAULT_IO_BYTES_PER_SEC (32LL * 1024 * 1024)
+#define DEFAULT_IO_OPS_PER_SEC 2000
+#define DEFAULT_IO_CLASS IOPRIO_CLASS_BE
+#define DEFAULT_VERIFY_THREADS 0
+#define DEFAULT_REPLICATION_TARGET ""
+#define DEFAULT_REPLICATION_LOG "./data/replication.log"
+#define DEFAULT_URGENT_DEADLINE_SEC 300
+#define DEFAULT_STANDARD_DEADLINE_SEC 3600
+#define DEFAULT_TRANSFER_STATS "./data/transfer.stats"
+#define DEFAULT_SITES_FILE "./sites.conf"
+#define DEFAULT_SITE_WORKERS 0
+#define DEFAULT_INTAKE_QUEUE_DEPTH 64
+#define DEFAULT_INTAKE_SUMMARY "./data/intake.summary"
+
+// Longest name of a site in the sites file
+#define SITE_NAME_MAX 64
+
+// Name of the file in the backup directory naming the latest snapshot
+#define LATEST_BACKUP_NAME "latest"
+
+// One immutable version of the configuration. A reload builds a new
+// version and swaps it in; the old one is freed once the last thread
+// still using it lets go, so in-flight work finishes with the settings
+// it started with.
+struct config {
+    char upload_dir[PATH_MAX];
+    char reporting_dir[PATH_MAX];
+    char backup_dir[PATH_MAX];
+    char log_dir[PATH_MAX];
+    char change_log[PATH_MAX];
+    char error_log[PATH_MAX];
+    char transfer_journal[PATH_MAX];
+    char monitor_state[PATH_MAX];
+    char departments_file[PATH_MAX];
+    char latest_backup[PATH_MAX];
+    int transfer_hour;
+    int transfer_minute;
+    int missing_report_window_days;
+    enum durability_mode durability;
+    enum reporting_layout layout;
+    int retention_daily;
+    int retention_weekly;
+    int retention_monthly;
+    long long io_bytes_per_sec;
+    long long io_ops_per_sec;
+    int io_class;
+    int verify_threads;
+    char replication_target[PATH_MAX];
+    char replication_log[PATH_MAX];
+    enum attribution_mode attribution;
+    enum version_storage report_versions;
+    int urgent_deadline_sec;
+    int standard_deadline_sec;
+    char transfer_stats[PATH_MAX];
+    char sites_file[PATH_MAX];
+    int site_workers;
+    char site[SITE_NAME_MAX];       // Set in the settings of one site, "" otherwise
+    enum intake_mode intake;
+    int intake_queue_depth;
+    char intake_summary[PATH_MAX];
+    unsigned long generation;
+    int refs;
+};
+
+// Function declarations for the configuration
+int config_load(const char *path);
+int config_reload(void);
+const struct config *config_current(void);
+const struct config *config_get(void);
+void config_put(const struct config *config);
+void config_use(const struct config *config);
+
+#endif
@@ -13,10 +13,21 @@
 #include <errno.h>
 #include <time.h>
 
+// Set when a manual backup/transfer cycle was requested with SIGUSR1
+extern volatile sig_atomic_t cycle_requested;
+
+// Set when the configuration file should be reloaded after a SIGHUP
+extern volatile sig_atomic_t reload_requested;
+
+// Set when the daemon should clean up and exit after a SIGTERM or SIGINT
+extern volatile sig_atomic_t terminate_requested;
+
 // Function declarations for daemon management
 void daemonize(void);
 void setup_signals(void);
 void signal_handler(int sig);
+void block_signals(sigset_t *saved);
+void restore_signals(const sigset_t *saved);
 int check_singleton(const char *lock_file);
 void write_pid(const char *pid_file);
 void cleanup(void);
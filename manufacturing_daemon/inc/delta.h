@@ -0,0 +1,32 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+
+// Identifies a delta file, followed by the version of the format
+#define DELTA_MAGIC "RDL1"
+#define DELTA_MAGIC_LEN 4
+
+// Size of the base blocks matched against the target. Smaller finds
+// more matches in reports with many small edits, larger indexes faster.
+#define DELTA_BLOCK_SIZE 16
+
+// Instructions of the delta format, applied in order
+#define DELTA_OP_COPY 'C'   // Copy a range of the base
+#define DELTA_OP_ADD 'A'    // Insert the bytes that follow
+#define DELTA_OP_END 'E'    // End of the delta
+
+// A growable byte buffer, as produced by the encoder and decoder
+struct delta_buffer {
+    unsigned char *data;
+    size_t size, capacity;
+};
+
+// Function declarations for the binary delta codec
+int delta_encode(const unsigned char *base, size_t base_size,
+                 const unsigned char *target, size_t target_size, struct delta_buffer *out);
+int delta_apply(const unsigned char *base, size_t base_size,
+                const unsigned char *delta, size_t delta_size, struct delta_buffer *out);
+void delta_buffer_free(struct delta_buffer *buffer);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef DEPARTMENTS_H
+#define DEPARTMENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dir_scan.h"
+
+// Departments used when no registry file is present
+#define DEFAULT_DEPARTMENTS { "warehouse", "manufacturing", "sales", "distribution" }
+
+// Longest department name accepted from the registry file
+#define DEPARTMENT_NAME_MAX 64
+
+// Widest rolling window the missing report index can track (one bit per day)
+#define REPORT_INDEX_MAX_DAYS 64
+
+// How urgently a department's reports are transferred, given after the
+// department's name in the registry file
+enum transfer_class {
+    TRANSFER_URGENT,        // As soon as the upload has settled
+    TRANSFER_STANDARD,      // In batches, within standard_deadline_sec
+    TRANSFER_BULK,          // At the scheduled transfer time
+    TRANSFER_CLASS_COUNT
+};
+
+#define DEFAULT_TRANSFER_CLASS TRANSFER_BULK
+
+// Registered department names with a hash table for O(1) lookup by name
+struct department_registry {
+    char **names;
+    enum transfer_class *classes;
+    size_t count;
+    int *slots;
+    size_t slot_count;
+};
+
+// Which departments reported on which days of a rolling window. Bit d of
+// days[i] is set when department i has a report for window_end - d.
+struct report_index {
+    const struct department_registry *registry;
+    uint64_t *days;
+    long window_end;
+    int window_days;
+};
+
+// Function declarations for the department registry
+int departments_load(struct department_registry *registry, const char *path);
+void departments_free(struct department_registry *registry);
+const struct department_registry *departments_get(void);
+int department_lookup(const struct department_registry *registry, const char *name, size_t len);
+enum transfer_class department_class(const struct department_registry *registry, const char *name, size_t len);
+const char *transfer_class_name(enum transfer_class class);
+long date_to_day(int year, int month, int day);
+void day_to_date(long day_number, char *buffer, size_t size);
+int parse_report_name(const char *name, size_t len, size_t *department_len, long *day_number);
+int report_index_init(struct report_index *index, const struct department_registry *registry,
+                      long window_end, int window_days);
+void report_index_add_name(struct report_index *index, const char *name, size_t len);
+void report_index_add_scan(struct report_index *index, const struct dir_scan *scan);
+void report_index_free(struct report_index *index);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef DIR_SCAN_H
+#define DIR_SCAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "arena.h"
+
+// Size of the buffer handed to getdents64, large enough that big
+// directories are read in a handful of system calls
+#define DIR_SCAN_BUFFER_SIZE (256 * 1024)
+
+// A file found by a directory scan
+struct scan_entry {
+    const char *name;
+    size_t name_len;
+    ino_t ino;
+};
+
+// The files of one directory, names are stored in the arena
+struct dir_scan {
+    const char *path;
+    struct scan_entry *entries;
+    size_t count;
+    struct arena arena;
+};
+
+// Function declarations for directory scanning
+int dir_scan(struct dir_scan *scan, const char *path, const char *suffix);
+int dir_scan_type(struct dir_scan *scan, const char *path, const char *suffix, unsigned char type_wanted);
+void dir_scan_free(struct dir_scan *scan);
+int has_suffix(const char *name, size_t name_len, const char *suffix);
+
+#endif
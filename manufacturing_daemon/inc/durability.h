@@ -0,0 +1,45 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Default durability mode, can be overridden with the durability setting
+// (none, batch or strict)
+#define DEFAULT_DURABILITY_MODE DURABILITY_BATCH
+
+// How written files are made durable
+enum durability_mode {
+    DURABILITY_NONE,    // Leave it to the kernel's normal writeback
+    DURABILITY_BATCH,   // Start writeback early, one syncfs per filesystem per cycle
+    DURABILITY_STRICT   // fdatasync every file and fsync its directory immediately
+};
+
+// A directory whose entries changed during the cycle
+struct durability_dir {
+    char *path;
+    dev_t dev;
+};
+
+// Files and directories written during one transfer or backup cycle
+struct durability_batch {
+    enum durability_mode mode;
+    struct durability_dir *dirs;
+    size_t dir_count, dir_capacity;
+    char **unlinks;
+    size_t unlink_count, unlink_capacity;
+    size_t files;
+    long long sync_ns;
+};
+
+// Function declarations for the durability layer
+enum durability_mode durability_get_mode(void);
+const char *durability_mode_name(enum durability_mode mode);
+void durability_begin(struct durability_batch *batch);
+int durability_file_written(struct durability_batch *batch, int fd, const char *path);
+int durability_dir_changed(struct durability_batch *batch, const char *dir);
+int durability_entry_changed(struct durability_batch *batch, const char *path);
+int durability_unlink(struct durability_batch *batch, const char *path);
+int durability_commit(struct durability_batch *batch);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef FILE_STATE_H
+#define FILE_STATE_H
+
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// What the monitor last saw of one file
+struct file_state {
+    char *name;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    int seen;
+};
+
+// Files known to the monitor, sorted by name
+struct file_state_table {
+    struct file_state *entries;
+    size_t count, capacity;
+    int dirty;
+};
+
+// Background check of a loaded snapshot against the directory. The
+// names of files that changed while the daemon was down are collected
+// in changed and handed to the monitor once done is set.
+struct file_state_verify {
+    pthread_mutex_t lock;
+    char dir[PATH_MAX];
+    struct file_state *entries;
+    size_t count;
+    char **changed;
+    size_t changed_count;
+    int running;
+    int done;
+};
+
+// Function declarations for the monitor's file state
+int file_state_load(struct file_state_table *table, const char *path);
+int file_state_save(struct file_state_table *table, const char *path);
+struct file_state *file_state_find(const struct file_state_table *table, const char *name);
+struct file_state *file_state_insert(struct file_state_table *table, const char *name);
+void file_state_sweep(struct file_state_table *table);
+void file_state_free(struct file_state_table *table);
+int file_state_verify_start(struct file_state_verify *verify, const struct file_state_table *table, const char *dir);
+int file_state_verify_done(struct file_state_verify *verify);
+void file_state_verify_free(struct file_state_verify *verify);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef INTAKE_H
+#define INTAKE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+
+// How uploads reach the reporting directory, selected with the intake
+// setting (scheduled or streaming)
+enum intake_mode {
+    INTAKE_SCHEDULED,   // By transfer class, bulk reports at the transfer time
+    INTAKE_STREAMING    // Every report as soon as it has settled
+};
+
+#define DEFAULT_INTAKE_MODE INTAKE_SCHEDULED
+
+// Upper bound on the intake_queue_depth setting
+#define INTAKE_QUEUE_MAX 4096
+
+// Most reports moved under one journal and durability commit
+#define INTAKE_BATCH_MAX 64
+
+// How often a stage retries uploads it held back while a cycle of their
+// site had its transfer lock
+#define INTAKE_HELD_RETRY_MS 100
+
+// Bytes read from the end of an upload to check that it is complete
+#define INTAKE_TAIL_SIZE 64
+
+// Summaries checked by the scheduled cycle are kept under this suffix
+#define INTAKE_CHECKED_SUFFIX ".checked"
+
+struct site;
+struct config;
+
+// An upload on its way through the pipeline. It holds a reference to the
+// settings of its site, so a reload does not free them under it.
+struct intake_item {
+    struct site *site;
+    const struct config *config;
+    char name[NAME_MAX + 1];
+    time_t arrived;             // First seen by the monitor
+    off_t size;                 // As validated, the move is skipped if it changed
+    time_t mtime;
+    uint32_t crc;
+    char dst[PATH_MAX];         // Where the move put it
+};
+
+// Function declarations for streaming intake
+int intake_submit(const char *name, time_t arrived);
+void intake_pause(void);
+void intake_resume(void);
+int intake_check(void);
+
+#endif
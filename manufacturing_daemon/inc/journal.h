@@ -0,0 +1,46 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Number of completed moves recorded before the journal is flushed to disk
+#define JOURNAL_SYNC_BATCH 32
+
+// A journal recovery could not finish is kept under this suffix, so a
+// new cycle does not overwrite its intents
+#define JOURNAL_FAILED_SUFFIX ".failed"
+
+// Journal record tags (one record per line, fields separated by tabs)
+#define JOURNAL_TAG_BEGIN  'B'
+#define JOURNAL_TAG_INTENT 'I'
+#define JOURNAL_TAG_DONE   'D'
+#define JOURNAL_TAG_COMMIT 'C'
+
+// Handle for the write-ahead intent log of a single transfer cycle
+struct transfer_journal {
+    int fd;
+    long next_seq;
+    int unsynced;
+};
+
+// What an upload was when its move was journaled, so recovery can tell
+// it from a re-upload under the same name made while the daemon was down
+struct journal_source {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+// Function declarations for the transfer journal
+int journal_begin(struct transfer_journal *journal, const char *path);
+long journal_intent(struct transfer_journal *journal, const char *src, const char *dst,
+                    const struct stat *src_st);
+int journal_sync(struct transfer_journal *journal);
+int journal_done(struct transfer_journal *journal, long seq);
+int journal_commit(struct transfer_journal *journal);
+int journal_recover(const char *path);
+
+#endif
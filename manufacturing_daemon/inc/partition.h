@@ -0,0 +1,58 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include "departments.h"
+#include "durability.h"
+
+// Reporting layout, selected with the reporting_layout setting (flat or
+// partitioned)
+#define DEFAULT_REPORTING_LAYOUT LAYOUT_FLAT
+
+// Per partition list of the reports it holds
+#define PARTITION_MANIFEST ".manifest"
+
+// Generation number of every partition, bumped whenever one changes
+#define PARTITION_INDEX ".partitions"
+
+// Longest relative partition path: department/YYYY/MM
+#define PARTITION_PATH_MAX (DEPARTMENT_NAME_MAX + 16)
+
+// How reports are arranged inside the reporting directory
+enum reporting_layout {
+    LAYOUT_FLAT,        // Every report directly in the reporting directory
+    LAYOUT_PARTITIONED  // reporting/<department>/<YYYY>/<MM>/
+};
+
+// A partition and the number of times its contents have changed
+struct partition_entry {
+    char path[PARTITION_PATH_MAX];
+    unsigned long generation;
+};
+
+// The partition index of a reporting directory or backup snapshot
+struct partition_index {
+    struct partition_entry *entries;
+    size_t count;
+    size_t capacity;
+    int dirty;
+};
+
+// Function declarations for the partitioned reporting layout
+enum reporting_layout reporting_layout(void);
+int partition_for_report(const char *name, size_t len, char *partition, size_t size);
+int partition_prepare(const char *base_dir, const char *partition);
+int partition_manifest_add(const char *base_dir, const char *partition,
+                           const char *name, const struct stat *st);
+int partition_manifest_rename(const char *partition_dir, const char *old_name, const char *new_name,
+                              const struct stat *st, struct durability_batch *batch);
+int partition_manifest_add_to_index(const char *base_dir, const char *partition,
+                                    struct report_index *index);
+int partition_index_load(struct partition_index *index, const char *base_dir);
+int partition_index_save(const struct partition_index *index, const char *base_dir);
+struct partition_entry *partition_index_find(const struct partition_index *index, const char *partition);
+int partition_index_touch(struct partition_index *index, const char *partition);
+void partition_index_free(struct partition_index *index);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PATH_TABLE_H
+#define PATH_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+// Initial number of hash slots, doubled whenever the table is half full
+#define PATH_TABLE_SLOTS 1024
+
+// Returned by path_table_intern() when the string could not be stored
+#define PATH_TABLE_NONE UINT32_MAX
+
+// A path as a directory and a file name, both interned in a path table
+struct path_ref {
+    uint32_t dir;
+    uint32_t name;
+};
+
+// One interned string
+struct path_string {
+    const char *str;
+    uint32_t len;
+    uint32_t hash;
+};
+
+// Every directory and file name used during a cycle stored once, so a
+// path costs two ids instead of a PATH_MAX buffer or a heap copy
+struct path_table {
+    struct arena arena;             // The string bytes
+    struct path_string *strings;    // By id
+    size_t count, capacity;
+    uint32_t *slots;                // Open addressed index, id + 1 or 0 if free
+    size_t slot_count;
+};
+
+// Function declarations for path interning
+void path_table_init(struct path_table *table);
+uint32_t path_table_intern(struct path_table *table, const char *str, size_t len);
+const char *path_table_string(const struct path_table *table, uint32_t id);
+int path_table_format(const struct path_table *table, struct path_ref ref, char *buf, size_t size);
+void path_table_free(struct path_table *table);
+
+#endif
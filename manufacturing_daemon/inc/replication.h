@@ -0,0 +1,54 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include "durability.h"
+
+// Suffix of the file holding the log offset the standby acknowledged
+#define REPLICATION_ACK_SUFFIX ".ack"
+
+// Records shipped per batch, each batch is committed and acknowledged
+// by the standby as a whole
+#define REPLICATION_BATCH_RECORDS 256
+#define REPLICATION_BATCH_BYTES (8 * 1024 * 1024)
+
+// Batches sent ahead of the oldest unacknowledged one
+#define REPLICATION_WINDOW 4
+
+// Longest wait between attempts to reach an unavailable standby
+#define REPLICATION_RETRY_MAX_SEC 30
+
+// Tags of the outbound log records and of the frames on the wire
+#define REPLICATION_TAG_FILE 'F'    // Copy a file to the standby
+#define REPLICATION_TAG_REMOVE 'D'  // Remove a file or directory tree
+#define REPLICATION_TAG_BATCH 'B'   // End of a batch, commit and acknowledge
+#define REPLICATION_TAG_CHECK 'C'   // CRC32C trailing a file's data
+#define REPLICATION_TAG_ACK 'A'     // Standby acknowledged up to an offset
+
+// Top level directories on the standby
+#define REPLICA_REPORTING "reporting"
+#define REPLICA_BACKUP "backup"
+
+// Where a standby keeps its copy, written to by a shipper or receiver
+struct replica {
+    char root[PATH_MAX];
+    struct durability_batch batch;
+    size_t files, removed;
+};
+
+// Function declarations for the outbound replication log
+int replication_start(void);
+void replication_file(const char *local_path);
+void replication_remove(const char *local_path);
+void replication_flush(void);
+
+// Function declarations for applying replicated changes on a standby
+int replica_open(struct replica *replica, const char *root);
+int replica_store(struct replica *replica, const char *path, FILE *in, long long size, int checked);
+int replica_remove(struct replica *replica, const char *path);
+int replica_commit(struct replica *replica);
+int replica_connect(const char *target, int listen);
+
+#endif
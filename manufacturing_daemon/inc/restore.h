@@ -0,0 +1,44 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <stddef.h>
+#include <limits.h>
+#include "departments.h"
+
+// Upper bound on the threads copying files during a restore
+#define RESTORE_MAX_THREADS 16
+
+// Most departments a restore can be limited to
+#define RESTORE_MAX_DEPARTMENTS 32
+
+// The reporting directory is rebuilt next to itself under this suffix,
+// then swapped into place
+#define RESTORE_STAGING_SUFFIX ".restore"
+
+// The replaced reporting directory is kept under this suffix plus the
+// time of the restore, in case the restore has to be undone
+#define RESTORE_PREVIOUS_SUFFIX ".before_restore_"
+
+// Which reports of a snapshot to restore. With no departments and no
+// dates the whole snapshot replaces the reporting directory; otherwise
+// only matching reports are restored and everything else is kept.
+struct restore_filter {
+    const char *departments[RESTORE_MAX_DEPARTMENTS];
+    size_t department_count;
+    long from_day, to_day;      // Inclusive, 0 for open ended
+};
+
+// Totals for one restore
+struct restore_stats {
+    size_t files;
+    size_t files_failed;
+    unsigned long long bytes;
+    double seconds;
+    char previous_dir[PATH_MAX];    // Where the replaced directory was kept
+};
+
+// Function declarations for restoring snapshots
+int restore_snapshot(const char *snapshot_dir, const struct restore_filter *filter, int threads,
+                     struct restore_stats *stats);
+
+#endif
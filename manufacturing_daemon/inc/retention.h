@@ -0,0 +1,24 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stddef.h>
+
+// Pruning is rate limited so it never competes with a running cycle
+#define RETENTION_UNLINKS_PER_SEC 2000
+#define RETENTION_UNLINK_BATCH 64
+
+// Backup directories, one per site, that can be pruned at the same time
+#define RETENTION_MAX_RUNNING 64
+
+// Totals for one pruning run
+struct retention_stats {
+    size_t snapshots_pruned;
+    size_t files_unlinked;
+    size_t files_shared;
+    unsigned long long bytes_reclaimed;
+};
+
+// Function declarations for backup retention
+int prune_backups(int background);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include "departments.h"
+#include "dir_scan.h"
+
+// An upload is only transferred early once it has not changed for this
+// long, so a department still writing its report is not cut off
+#define SCHEDULER_SETTLE_SEC 10
+
+// Share of the standard deadline spent collecting uploads into one batch
+#define SCHEDULER_BATCH_PERCENT 50
+
+// Time the scheduled cycle has to move the bulk class before it counts
+// as a missed deadline
+#define SCHEDULER_BULK_GRACE_SEC 3600
+
+// Most uploads moved by one dispatch, so a flood of urgent reports cannot
+// keep the main loop from monitoring
+#define SCHEDULER_DISPATCH_MAX 256
+
+// Buckets of the table of queued uploads by name
+#define SCHEDULER_BUCKETS 1024
+
+// Counters of one transfer class
+struct scheduler_class_stats {
+    size_t queued;                  // Waiting to be transferred
+    unsigned long transferred;      // Moved since the daemon started
+    unsigned long missed;           // Moved after their deadline
+    long long latency_sec;          // Total time from upload to transfer
+    long long max_latency_sec;
+};
+
+struct scheduled_upload;
+
+// Uploads of one upload directory waiting to be transferred, as an array
+// to walk and a table to find them by name. The thread serving the
+// directory fills it, the intake pipeline takes moved uploads off it.
+struct scheduler_queue {
+    pthread_mutex_t lock;
+    struct scheduled_upload **pending;
+    size_t pending_count, pending_capacity;
+    struct scheduled_upload *buckets[SCHEDULER_BUCKETS];
+    struct scheduler_class_stats class_stats[TRANSFER_CLASS_COUNT];
+    int stats_changed;
+};
+
+// Function declarations for the transfer scheduler
+void scheduler_submit(const char *name, size_t len, time_t changed);
+void scheduler_transferred(const char *name);
+void scheduler_release(const char *name);
+void scheduler_sync(const struct dir_scan *uploads);
+int scheduler_dispatch(time_t now);
+void scheduler_stats(struct scheduler_class_stats stats[TRANSFER_CLASS_COUNT]);
+void scheduler_report(void);
+
+#endif
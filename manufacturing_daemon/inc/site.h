@@ -0,0 +1,68 @@
+#ifndef SITE_H
+#define SITE_H
+
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "config.h"
+#include "file_state.h"
+#include "scheduler.h"
+
+// Most upload roots one daemon serves
+#define SITE_MAX 256
+
+// Upper bound on the worker threads serving the sites
+#define SITE_MAX_WORKERS 16
+
+// How often every site is monitored and its due transfers dispatched
+#define SITE_TICK_SEC 10
+
+// How often the workers' counters are logged
+#define SITE_STATS_INTERVAL_SEC 3600
+
+// Directories and state files below a site's root
+#define SITE_UPLOAD_DIR "upload"
+#define SITE_REPORTING_DIR "reporting"
+#define SITE_BACKUP_DIR "backup"
+#define SITE_JOURNAL "transfer.journal"
+#define SITE_MONITOR_STATE "monitor.state"
+#define SITE_TRANSFER_STATS "transfer.stats"
+#define SITE_INTAKE_SUMMARY "intake.summary"
+
+// Characters allowed in a site name, it is used in paths on the standby
+#define SITE_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-."
+
+// Cycles a site still has to run
+#define SITE_CYCLE_SCHEDULED 1      // At the transfer time, at full speed
+#define SITE_CYCLE_REQUESTED 2      // On SIGUSR1, throttled
+
+// One upload, reporting and backup root and everything the daemon keeps
+// about it. Only the worker serving a site touches its monitor and
+// scheduler state, and a site is served by one worker at a time; the
+// intake pipeline shares the scheduler queue, which has a lock of its own.
+struct site {
+    char name[SITE_NAME_MAX];
+    char root[PATH_MAX];
+    struct config *config;              // The daemon's settings with the site's paths
+    struct file_state_table upload_state;
+    struct file_state_verify upload_verify;
+    struct scheduler_queue scheduler;
+    pthread_mutex_t transfer_lock;      // Held while the intake pipeline moves uploads
+    int opened;                         // Journal recovered and monitor state loaded
+    int queued;                         // Waiting for or being served by a worker
+    int cycles_due;                     // SITE_CYCLE_* flags
+    time_t last_scheduled;
+    size_t home;                        // Worker the site is sharded to
+    double busy_sec;                    // Time spent serving it
+};
+
+// Function declarations for serving several sites
+int sites_start(void);
+int sites_active(void);
+void sites_tick(time_t now, int scheduled, int requested);
+int sites_reload(void);
+struct site *site_current(void);
+void site_use(struct site *site);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+
+// Tokens that may build up while idle, as time at the full rate
+#define THROTTLE_BURST_MS 100
+
+// Above this mean latency per I/O the budget is cut, below it it grows back
+#define THROTTLE_TARGET_LATENCY_US 20000
+#define THROTTLE_ADJUST_INTERVAL_MS 250
+
+// The budget is never cut below this fraction of the configured one
+#define THROTTLE_MIN_FRACTION 16
+
+// ioprio_set() values, not exported by every libc
+#ifndef IOPRIO_CLASS_BE
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+// Kernel I/O priority level used while throttled in the best-effort
+// class, the class itself is the io_class setting
+#define THROTTLE_IO_LEVEL 7
+
+// Function declarations for the I/O throttle
+void io_throttle_begin(int throttled);
+long long io_throttle_clock(void);
+void io_throttle_account(size_t bytes, int ops, long long latency_ns);
+void io_throttle_end(void);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef VERSIONS_H
+#define VERSIONS_H
+
+#include "delta.h"
+#include "durability.h"
+
+// A report version stored as a delta against the next newer version
+// keeps its name with this suffix added
+#define VERSION_DELTA_SUFFIX ".delta"
+
+// Longest run of deltas that has to be applied to rebuild any version.
+// A version that would make a run longer stays a full copy.
+#define VERSION_CHAIN_MAX 8
+
+// A delta larger than this share of the full version is not worth it,
+// e.g. for a report that was rewritten from scratch
+#define VERSION_DELTA_MAX_PERCENT 75
+
+// How superseded versions of a report are stored, selected with the
+// report_versions setting (full or delta)
+enum version_storage {
+    VERSIONS_FULL,      // Every version is a full copy
+    VERSIONS_DELTA      // Only the newest version and keyframes are full copies
+};
+
+#define DEFAULT_VERSION_STORAGE VERSIONS_DELTA
+
+// Function declarations for report version storage
+int versions_compact(const char *dir, const char *const *names, size_t name_count,
+                     struct durability_batch *batch);
+int version_read(const char *path, struct delta_buffer *content);
+
+#endif
@@ -0,0 +1,184 @@
+// Heap allocation counter for the benchmark. bench.sh preloads it into a
+// test mode run with LD_PRELOAD; it forwards every allocation to the C
+// library and, when the run exits or is stopped with SIGTERM, writes the
+// number of allocations, the bytes they asked for and the peak heap in use
+// to the file named by ALLOC_COUNT_OUTPUT (stderr if unset).
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <errno.h>
+
+// The allocator the wrappers forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long long allocations = 0;
+static unsigned long long bytes_allocated = 0;
+static long long bytes_live = 0;
+static long long bytes_peak = 0;
+static int reported = 0;
+
+/**
+ * Count an allocation the C library made and raise the peak if needed
+ */
+static void count_alloc(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    long long size = (long long)malloc_usable_size(ptr);
+    long long live = __atomic_add_fetch(&bytes_live, size, __ATOMIC_RELAXED);
+    long long peak = __atomic_load_n(&bytes_peak, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bytes_allocated, (unsigned long long)size, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&bytes_peak, &peak, live, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Take memory about to be released out of the live total
+ */
+static void count_free(void *ptr) {
+    if (ptr != NULL) {
+        __atomic_sub_fetch(&bytes_live, (long long)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    }
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *realloc(void *old, size_t size) {
+    long long old_size = old ? (long long)malloc_usable_size(old) : 0;
+    void *ptr = __libc_realloc(old, size);
+
+    // A failed realloc leaves the old block alone
+    if (ptr != NULL || size == 0) {
+        __atomic_sub_fetch(&bytes_live, old_size, __ATOMIC_RELAXED);
+    }
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = __libc_memalign(alignment, size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    *ptr = memalign(alignment, size);
+    return *ptr != NULL || size == 0 ? 0 : ENOMEM;
+}
+
+void free(void *ptr) {
+    count_free(ptr);
+    __libc_free(ptr);
+}
+
+/**
+ * Append a decimal number to a buffer without calling into stdio, which
+ * is not safe from a signal handler
+ */
+static size_t put_number(char *buf, size_t len, unsigned long long value) {
+    char digits[24];
+    size_t count = 0;
+
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    while (count > 0) {
+        buf[len++] = digits[--count];
+    }
+
+    return len;
+}
+
+/**
+ * Append a string to a buffer
+ */
+static size_t put_string(char *buf, size_t len, const char *str) {
+    size_t str_len = strlen(str);
+
+    memcpy(buf + len, str, str_len);
+    return len + str_len;
+}
+
+/**
+ * Write the counters once, as "allocations bytes_allocated peak_bytes"
+ */
+static void report(void) {
+    char line[128];
+    size_t len = 0;
+    const char *output = getenv("ALLOC_COUNT_OUTPUT");
+    int fd = STDERR_FILENO;
+
+    if (__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    len = put_number(line, len, __atomic_load_n(&allocations, __ATOMIC_RELAXED));
+    len = put_string(line, len, " ");
+    len = put_number(line, len, __atomic_load_n(&bytes_allocated, __ATOMIC_RELAXED));
+    len = put_string(line, len, " ");
+    len = put_number(line, len, (unsigned long long)__atomic_load_n(&bytes_peak, __ATOMIC_RELAXED));
+    len = put_string(line, len, "\n");
+
+    if (output != NULL) {
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return;
+        }
+    }
+    if (write(fd, line, len) < 0) {
+        // Nothing more to do, the run is ending
+    }
+    if (output != NULL) {
+        close(fd);
+    }
+}
+
+/**
+ * Report and exit when the benchmark stops the run
+ */
+static void handle_term(int sig) {
+    (void)sig;
+    report();
+    _exit(0);
+}
+
+__attribute__((constructor)) static void alloc_count_start(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_term;
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+__attribute__((destructor)) static void alloc_count_stop(void) {
+    report();
+}
@@ -0,0 +1,82 @@
+#include "../inc/arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Alignment of every allocation, enough for any scalar or pointer
+#define ARENA_ALIGN 8
+
+/**
+ * Initialise an empty arena
+ *
+ * @param chunk_size Size of each block, 0 for ARENA_CHUNK_SIZE
+ */
+void arena_init(struct arena *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+    arena->bytes_used = 0;
+    arena->chunk_count = 0;
+}
+
+/**
+ * Allocate memory from the arena. The memory is released by arena_free().
+ *
+ * @return Pointer to the memory, or NULL if out of memory
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = arena->head;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // Oversized requests get a chunk of their own
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+
+        chunk = malloc(sizeof(*chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = arena->head;
+        arena->head = chunk;
+        arena->chunk_count++;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->bytes_used += size;
+
+    return ptr;
+}
+
+/**
+ * Copy len bytes of a string into the arena and null-terminate it
+ *
+ * @return The copy, or NULL if out of memory
+ */
+char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+
+    return copy;
+}
+
+/**
+ * Release every allocation made from the arena
+ */
+void arena_free(struct arena *arena) {
+    struct arena_chunk *chunk = arena->head;
+
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->head = NULL;
+    arena->bytes_used = 0;
+    arena->chunk_count = 0;
+}
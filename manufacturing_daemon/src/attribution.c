@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include "../inc/attribution.h"
+#include "../inc/company.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+
+// A process whose uid was read from /proc
+struct pid_cache_entry {
+    pid_t pid;
+    uid_t uid;
+    char comm[ATTRIBUTION_COMM_MAX];
+    long long loaded_ms;
+};
+
+// The last writer of one file, chained per bucket. Files are known by
+// inode rather than name, the same name can be uploaded to several sites.
+struct writer_entry {
+    dev_t dev;
+    ino_t ino;
+    struct attribution_writer writer;
+    struct writer_entry *next;
+};
+
+static int fan_fd = -1;
+static volatile int attribution_running = 0;
+
+// Only the event thread touches the pid cache, so it needs no lock
+static struct pid_cache_entry pid_cache[ATTRIBUTION_PID_CACHE_SIZE];
+
+static pthread_mutex_t writers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct writer_entry *writers[ATTRIBUTION_BUCKETS];
+
+/**
+ * Current monotonic time in milliseconds
+ */
+static long long attribution_clock_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * FNV-1a hash of a file's device and inode
+ */
+static size_t file_bucket(dev_t dev, ino_t ino) {
+    unsigned long long key[2] = { (unsigned long long)dev, (unsigned long long)ino };
+    const unsigned char *bytes = (const unsigned char *)key;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(key); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash & (ATTRIBUTION_BUCKETS - 1);
+}
+
+/**
+ * Read a process's real uid and name from /proc/<pid>/status
+ *
+ * @return 1 on success, 0 if the process is already gone
+ */
+static int read_process(pid_t pid, struct pid_cache_entry *entry) {
+    char path[64];
+    char buffer[1024];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    // Name and Uid are both within the first few lines
+    len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buffer[len] = '\0';
+
+    char *name = strstr(buffer, "Name:\t");
+    char *uid = strstr(buffer, "\nUid:\t");
+    if (name == NULL || uid == NULL) {
+        return 0;
+    }
+
+    name += 6;
+    size_t name_len = strcspn(name, "\n");
+    if (name_len >= sizeof(entry->comm)) {
+        name_len = sizeof(entry->comm) - 1;
+    }
+    memcpy(entry->comm, name, name_len);
+    entry->comm[name_len] = '\0';
+    entry->uid = (uid_t)strtoul(uid + 6, NULL, 10);
+    entry->pid = pid;
+
+    return 1;
+}
+
+/**
+ * Find the uid of a process, from the cache while the entry is fresh.
+ * Bursts of events mostly come from a handful of processes, so nearly
+ * every lookup is served without touching /proc.
+ *
+ * @return The cache entry, or NULL if the process is unknown
+ */
+static const struct pid_cache_entry *pid_lookup(pid_t pid) {
+    struct pid_cache_entry *entry = &pid_cache[pid & (ATTRIBUTION_PID_CACHE_SIZE - 1)];
+    long long now = attribution_clock_ms();
+
+    if (entry->pid == pid && now - entry->loaded_ms < ATTRIBUTION_PID_TTL_MS) {
+        return entry;
+    }
+
+    if (!read_process(pid, entry)) {
+        entry->pid = 0;
+        return NULL;
+    }
+    entry->loaded_ms = now;
+    return entry;
+}
+
+/**
+ * Record the writer of a file, replacing any earlier one
+ */
+static void writer_record(const struct stat *st, const struct pid_cache_entry *process) {
+    size_t bucket = file_bucket(st->st_dev, st->st_ino);
+    struct writer_entry *entry;
+
+    pthread_mutex_lock(&writers_lock);
+
+    for (entry = writers[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->dev == st->st_dev && entry->ino == st->st_ino) {
+            break;
+        }
+    }
+    if (entry == NULL) {
+        entry = malloc(sizeof(*entry));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&writers_lock);
+            return;
+        }
+        entry->dev = st->st_dev;
+        entry->ino = st->st_ino;
+        entry->next = writers[bucket];
+        writers[bucket] = entry;
+    }
+
+    entry->writer.pid = process->pid;
+    entry->writer.uid = process->uid;
+    memcpy(entry->writer.comm, process->comm, sizeof(entry->writer.comm));
+    entry->writer.when = time(NULL);
+
+    pthread_mutex_unlock(&writers_lock);
+}
+
+/**
+ * Attribute one fanotify event to the file it names
+ */
+static void attribution_event(const struct fanotify_event_metadata *event) {
+    const struct pid_cache_entry *process;
+    struct stat st;
+
+    // The daemon's own writes are not uploads
+    if (event->pid == getpid()) {
+        return;
+    }
+
+    process = pid_lookup(event->pid);
+    if (process == NULL) {
+        return;
+    }
+
+    // Deleted before the event was read
+    if (fstat(event->fd, &st) < 0 || st.st_nlink == 0) {
+        return;
+    }
+    writer_record(&st, process);
+}
+
+/**
+ * Drain fanotify events as fast as they arrive. The queue is unlimited,
+ * so events are never dropped, only delayed if this thread falls behind.
+ */
+static void *attribution_thread(void *arg) {
+    // fanotify records must be read into an aligned buffer
+    static union {
+        struct fanotify_event_metadata event;
+        char bytes[ATTRIBUTION_EVENT_BUFFER];
+    } buffer;
+    (void)arg;
+
+    while (1) {
+        ssize_t len = read(fan_fd, buffer.bytes, sizeof(buffer.bytes));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            log_message(LOG_ERR, "Failed to read fanotify events: %s, attributing changes to file owners",
+                        strerror(errno));
+            break;
+        }
+
+        struct fanotify_event_metadata *event = &buffer.event;
+        while (FAN_EVENT_OK(event, len)) {
+            if (event->vers != FANOTIFY_METADATA_VERSION) {
+                log_message(LOG_ERR, "Unsupported fanotify event version %d", event->vers);
+                attribution_running = 0;
+                return NULL;
+            }
+            if (event->mask & FAN_Q_OVERFLOW) {
+                log_message(LOG_WARNING, "fanotify queue overflowed, some changes are attributed to file owners");
+            } else if (event->fd >= 0) {
+                attribution_event(event);
+            }
+            if (event->fd >= 0) {
+                close(event->fd);
+            }
+            event = FAN_EVENT_NEXT(event, len);
+        }
+    }
+
+    attribution_running = 0;
+    return NULL;
+}
+
+/**
+ * Watch another upload directory with the running fanotify group
+ *
+ * @return 1 on success, 0 on failure
+ */
+int attribution_watch(const char *upload_dir) {
+    if (fan_fd < 0) {
+        return 0;
+    }
+
+    if (fanotify_mark(fan_fd, FAN_MARK_ADD, FAN_MODIFY | FAN_CLOSE_WRITE | FAN_EVENT_ON_CHILD,
+                      AT_FDCWD, upload_dir) < 0) {
+        log_message(LOG_WARNING, "Failed to watch %s with fanotify (%s), attributing its changes to file owners",
+                    upload_dir, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Watch the upload directory with fanotify so every change can be
+ * attributed to the process that wrote it. Needs CAP_SYS_ADMIN; without
+ * it changes keep being attributed to the file's owner.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int attribution_start(const char *upload_dir) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t signals;
+    int started;
+
+    fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_UNLIMITED_QUEUE,
+                           O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fan_fd < 0) {
+        log_message(LOG_WARNING, "fanotify unavailable (%s), attributing changes to file owners",
+                    strerror(errno));
+        return 0;
+    }
+
+    if (fanotify_mark(fan_fd, FAN_MARK_ADD, FAN_MODIFY | FAN_CLOSE_WRITE | FAN_EVENT_ON_CHILD,
+                      AT_FDCWD, upload_dir) < 0) {
+        log_message(LOG_WARNING, "Failed to watch %s with fanotify (%s), attributing changes to file owners",
+                    upload_dir, strerror(errno));
+        close(fan_fd);
+        fan_fd = -1;
+        return 0;
+    }
+
+    attribution_running = 1;
+    block_signals(&signals);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, attribution_thread, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    restore_signals(&signals);
+    if (!started) {
+        log_message(LOG_ERR, "Failed to start fanotify thread, attributing changes to file owners");
+        attribution_running = 0;
+        close(fan_fd);
+        fan_fd = -1;
+    }
+
+    if (attribution_running) {
+        log_message(LOG_INFO, "Attributing upload changes to the writing process with fanotify");
+    }
+    return attribution_running;
+}
+
+/**
+ * Take the last recorded writer of a file. Each writer is handed out
+ * once, the next change is attributed afresh.
+ *
+ * @return 1 if a writer was recorded, 0 otherwise
+ */
+int attribution_lookup(const struct stat *st, struct attribution_writer *writer) {
+    struct writer_entry **link, *entry;
+    int found = 0;
+
+    if (!attribution_running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&writers_lock);
+    for (link = &writers[file_bucket(st->st_dev, st->st_ino)]; (entry = *link) != NULL; link = &entry->next) {
+        if (entry->dev == st->st_dev && entry->ino == st->st_ino) {
+            *writer = entry->writer;
+            *link = entry->next;
+            free(entry);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&writers_lock);
+
+    return found;
+}
+
+/**
+ * Forget writers of files the monitor never asked about, e.g. ones
+ * transferred or deleted between two passes
+ */
+void attribution_expire(void) {
+    time_t cutoff = time(NULL) - ATTRIBUTION_MAX_AGE_SEC;
+
+    if (!attribution_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&writers_lock);
+    for (size_t i = 0; i < ATTRIBUTION_BUCKETS; i++) {
+        struct writer_entry **link = &writers[i], *entry;
+        while ((entry = *link) != NULL) {
+            if (entry->writer.when < cutoff) {
+                *link = entry->next;
+                free(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&writers_lock);
+}
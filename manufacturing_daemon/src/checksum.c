@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include "../inc/checksum.h"
+#include "../inc/company.h"
+#include "../inc/throttle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78u
+
+// Lookup tables for the portable slicing-by-8 implementation
+static uint32_t crc32c_table[8][256];
+
+// Implementation picked for this CPU on first use
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *data, size_t len);
+static const char *crc32c_impl_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * CRC32C in software, eight bytes per step
+ */
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *data, size_t len) {
+    while (len >= 8) {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 |
+                              (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^
+              crc32c_table[5][(low >> 16) & 0xff] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]] ^
+              crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0) {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+/**
+ * CRC32C with the SSE4.2 crc32 instruction, eight bytes per step
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t crc64;
+
+    // Align so the 8 byte loads never straddle a cache line
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        len--;
+    }
+
+    crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+
+    return crc;
+}
+#endif
+
+/**
+ * Build the software tables and pick the fastest implementation
+ */
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t prev = crc32c_table[slice - 1][i];
+            crc32c_table[slice][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    crc32c_impl = crc32c_software;
+    crc32c_impl_name = "software";
+#ifdef HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_sse42;
+        crc32c_impl_name = "sse4.2";
+    }
+#endif
+}
+
+/**
+ * Extend a CRC32C over more data. Start with a crc of 0.
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+    return ~crc32c_impl(~crc, data, len);
+}
+
+/**
+ * Name of the CRC32C implementation in use, for logging
+ */
+const char *crc32c_implementation(void) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+    return crc32c_impl_name;
+}
+
+/**
+ * Compute the CRC32C and size of a whole file
+ *
+ * @return 1 on success, 0 on failure
+ */
+int checksum_file(const char *path, uint32_t *crc, long long *size) {
+    unsigned char *buffer;
+    ssize_t bytes;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    buffer = malloc(CHECKSUM_BUFFER_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        return 0;
+    }
+
+    // Each file is read once from start to end
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    *crc = 0;
+    *size = 0;
+    for (;;) {
+        long long read_start = io_throttle_clock();
+        bytes = read(fd, buffer, CHECKSUM_BUFFER_SIZE);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        io_throttle_account((size_t)bytes, 1, io_throttle_clock() - read_start);
+        *crc = crc32c_update(*crc, buffer, (size_t)bytes);
+        *size += bytes;
+    }
+
+    free(buffer);
+    close(fd);
+
+    return bytes == 0;
+}
+
+/**
+ * Add a file to a checksum list
+ *
+ * @return 1 on success, 0 on failure
+ */
+int checksum_list_add(struct checksum_list *list, const char *path, long long size, uint32_t crc) {
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 256;
+        struct checksum_entry *grown = realloc(list->entries, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            log_message(LOG_ERR, "Out of memory growing checksum list");
+            return 0;
+        }
+        list->entries = grown;
+        list->capacity = new_capacity;
+    }
+
+    if (list->arena.chunk_size == 0) {
+        arena_init(&list->arena, 0);
+    }
+
+    struct checksum_entry *entry = &list->entries[list->count];
+    entry->path = arena_strndup(&list->arena, path, strlen(path));
+    if (entry->path == NULL) {
+        log_message(LOG_ERR, "Out of memory growing checksum list");
+        return 0;
+    }
+    entry->size = size;
+    entry->crc = crc;
+    list->count++;
+
+    return 1;
+}
+
+/**
+ * Sort checksum entries by path
+ */
+static int compare_checksum_entries(const void *a, const void *b) {
+    return strcmp(((const struct checksum_entry *)a)->path, ((const struct checksum_entry *)b)->path);
+}
+
+/**
+ * Read the checksum list of a snapshot. A snapshot without one (taken
+ * before checksums were recorded) gives an empty list.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int checksum_list_load(struct checksum_list *list, const char *snapshot_dir) {
+    char path[PATH_MAX];
+    char line[PATH_MAX + 64];
+    FILE *file;
+
+    memset(list, 0, sizeof(*list));
+
+    snprintf(path, sizeof(path), "%s/%s", snapshot_dir, BACKUP_CHECKSUMS);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        log_message(LOG_ERR, "Failed to open checksum list %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    // Each line is: crc32c (hex) <tab> size <tab> relative path
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long crc;
+        long long size;
+        int offset;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%8lx\t%lld\t%n", &crc, &size, &offset) != 2 || line[offset] == '\0') {
+            continue;
+        }
+
+        if (!checksum_list_add(list, line + offset, size, (uint32_t)crc)) {
+            fclose(file);
+            checksum_list_free(list);
+            return 0;
+        }
+    }
+
+    fclose(file);
+    qsort(list->entries, list->count, sizeof(*list->entries), compare_checksum_entries);
+
+    return 1;
+}
+
+/**
+ * Write a snapshot's checksum list, replacing any old one atomically
+ *
+ * @param batch Durability batch the list is added to
+ * @return 1 on success, 0 on failure
+ */
+int checksum_list_save(struct checksum_list *list, const char *snapshot_dir, struct durability_batch *batch) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    FILE *file;
+    int success = 1;
+
+    qsort(list->entries, list->count, sizeof(*list->entries), compare_checksum_entries);
+
+    if (!format_path(path, sizeof(path), "%s/%s", snapshot_dir, BACKUP_CHECKSUMS) ||
+        !format_path(tmp_path, sizeof(tmp_path), "%s%s", path, PARTIAL_SUFFIX)) {
+        return 0;
+    }
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_message(LOG_ERR, "Failed to write checksum list %s: %s", tmp_path, strerror(errno));
+        return 0;
+    }
+
+    for (size_t i = 0; i < list->count; i++) {
+        fprintf(file, "%08x\t%lld\t%s\n", (unsigned int)list->entries[i].crc,
+                list->entries[i].size, list->entries[i].path);
+    }
+
+    if (fflush(file) != 0 || !durability_file_written(batch, fileno(file), tmp_path)) {
+        success = 0;
+    }
+    if (fclose(file) != 0 || !success || rename(tmp_path, path) != 0) {
+        log_message(LOG_ERR, "Failed to write checksum list %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+    durability_entry_changed(batch, path);
+
+    return 1;
+}
+
+/**
+ * Look up a file in a sorted checksum list
+ *
+ * @return The entry, or NULL if the file is not listed
+ */
+const struct checksum_entry *checksum_list_find(const struct checksum_list *list, const char *path) {
+    struct checksum_entry key;
+
+    if (list->count == 0) {
+        return NULL;
+    }
+
+    key.path = (char *)path;
+    return bsearch(&key, list->entries, list->count, sizeof(*list->entries), compare_checksum_entries);
+}
+
+/**
+ * Release the memory held by a checksum list
+ */
+void checksum_list_free(struct checksum_list *list) {
+    arena_free(&list->arena);
+    free(list->entries);
+    memset(list, 0, sizeof(*list));
+}
+
+// Work shared by the threads verifying one snapshot
+struct verify_job {
+    const char *snapshot_dir;
+    const struct checksum_list *list;
+    pthread_mutex_t lock;
+    size_t next;
+    struct verify_stats stats;
+};
+
+/**
+ * Body of a verification thread: take the next file, re-read it and
+ * compare it against the list until none are left
+ */
+static void *verify_worker(void *arg) {
+    struct verify_job *job = arg;
+    char path[PATH_MAX];
+
+    for (;;) {
+        const struct checksum_entry *entry;
+        uint32_t crc;
+        long long size;
+        int ok, found;
+
+        pthread_mutex_lock(&job->lock);
+        if (job->next == job->list->count) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        entry = &job->list->entries[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        snprintf(path, sizeof(path), "%s/%s", job->snapshot_dir, entry->path);
+        found = checksum_file(path, &crc, &size);
+        ok = found && crc == entry->crc && size == entry->size;
+
+        if (!found) {
+            log_message(LOG_ERR, "Verify: %s is missing or unreadable", path);
+        } else if (!ok) {
+            log_message(LOG_ERR, "Verify: %s is corrupt (crc32c %08x, expected %08x, size %lld, expected %lld)",
+                        path, (unsigned int)crc, (unsigned int)entry->crc, size, entry->size);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (!found) {
+            job->stats.files_missing++;
+        } else if (!ok) {
+            job->stats.files_corrupt++;
+        } else {
+            job->stats.files_ok++;
+        }
+        if (found) {
+            job->stats.bytes_read += (unsigned long long)size;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Re-read every file of a snapshot and compare it against the
+ * snapshot's checksum list, spreading the files over several threads
+ *
+ * @param threads Number of threads, 0 for one per online CPU
+ * @return 1 if every file matched, 0 otherwise
+ */
+int verify_snapshot(const char *snapshot_dir, int threads, struct verify_stats *stats) {
+    struct checksum_list list;
+    struct verify_job job;
+    pthread_t workers[VERIFY_MAX_THREADS];
+    int started = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (!checksum_list_load(&list, snapshot_dir)) {
+        return 0;
+    }
+    if (list.count == 0) {
+        log_message(LOG_WARNING, "Snapshot %s has no checksums to verify", snapshot_dir);
+        checksum_list_free(&list);
+        return 0;
+    }
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > VERIFY_MAX_THREADS) {
+        threads = VERIFY_MAX_THREADS;
+    }
+    if ((size_t)threads > list.count) {
+        threads = (int)list.count;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.snapshot_dir = snapshot_dir;
+    job.list = &list;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, verify_worker, &job) == 0) {
+            started++;
+        }
+    }
+    // With no threads at all, verify in this one
+    if (started == 0) {
+        verify_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    checksum_list_free(&list);
+    *stats = job.stats;
+
+    return stats->files_corrupt == 0 && stats->files_missing == 0;
+}
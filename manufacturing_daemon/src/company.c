@@ -1,12 +1,25 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include "../inc/company.h"
+#include "../inc/journal.h"
+#include "../inc/departments.h"
+#include "../inc/partition.h"
+#include "../inc/retention.h"
+#include "../inc/checksum.h"
+#include "../inc/throttle.h"
+#include "../inc/file_state.h"
+#include "../inc/replication.h"
+#include "../inc/attribution.h"
+#include "../inc/versions.h"
+#include "../inc/scheduler.h"
+#include "../inc/site.h"
+#include "../inc/intake.h"
+#include "../inc/path_table.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
@@ -23,18 +36,19 @@
  * @return 1 on success, 0 on failure
  */
 int lock_directories(void) {
+    const struct config *config = config_current();
     int success = 1;
     
     log_message(LOG_INFO, "Locking directories for backup/transfer operations");
     
     // Change permissions to read-only for upload directory
-    if (chmod(UPLOAD_DIR, 0555) < 0) { // r-xr-xr-x
+    if (chmod(config->upload_dir, 0555) < 0) { // r-xr-xr-x
         log_message(LOG_ERR, "Failed to lock upload directory: %s", strerror(errno));
         success = 0;
     }
     
     // Change permissions to read-only for reporting directory
-    if (chmod(REPORTING_DIR, 0555) < 0) { // r-xr-xr-x
+    if (chmod(config->reporting_dir, 0555) < 0) { // r-xr-xr-x
         log_message(LOG_ERR, "Failed to lock reporting directory: %s", strerror(errno));
         success = 0;
     }
@@ -48,18 +62,19 @@ int lock_directories(void) {
  * @return 1 on success, 0 on failure
  */
 int unlock_directories(void) {
+    const struct config *config = config_current();
     int success = 1;
     
     log_message(LOG_INFO, "Unlocking directories after backup/transfer operations");
     
     // Restore normal permissions for upload directory
-    if (chmod(UPLOAD_DIR, 0755) < 0) { // rwxr-xr-x
+    if (chmod(config->upload_dir, 0755) < 0) { // rwxr-xr-x
         log_message(LOG_ERR, "Failed to unlock upload directory: %s", strerror(errno));
         success = 0;
     }
     
     // Restore normal permissions for reporting directory
-    if (chmod(REPORTING_DIR, 0755) < 0) { // rwxr-xr-x
+    if (chmod(config->reporting_dir, 0755) < 0) { // rwxr-xr-x
         log_message(LOG_ERR, "Failed to unlock reporting directory: %s", strerror(errno));
         success = 0;
     }
@@ -67,378 +82,1218 @@ int unlock_directories(void) {
     return success;
 }
 
+/**
+ * Find a backup snapshot, given as a path, as a name in the backup
+ * directory, or as NULL for the latest completed snapshot
+ * 
+ * @return 1 if there is one, 0 otherwise
+ */
+int backup_snapshot_dir(const char *name, char *snapshot_dir, size_t size) {
+    const struct config *config = config_current();
+    char latest_name[NAME_MAX + 1] = "";
+    
+    snapshot_dir[0] = '\0';
+    if (name != NULL && strchr(name, '/') != NULL) {
+        snprintf(snapshot_dir, size, "%s", name);
+        return 1;
+    }
+    
+    if (name == NULL) {
+        FILE *latest = fopen(config->latest_backup, "r");
+        if (latest == NULL) {
+            return 0;
+        }
+        if (fgets(latest_name, sizeof(latest_name), latest) != NULL) {
+            latest_name[strcspn(latest_name, "\n")] = '\0';
+        }
+        fclose(latest);
+        if (latest_name[0] == '\0') {
+            return 0;
+        }
+        name = latest_name;
+    }
+    
+    snprintf(snapshot_dir, size, "%s/%s", config->backup_dir, name);
+    return 1;
+}
+
+/**
+ * Hard link a file known to be unchanged from the previous snapshot,
+ * reusing its recorded checksum so the data is not read again
+ * 
+ * @return 1 if linked, 0 if it has to be copied instead, -1 on failure
+ */
+static int link_from_previous(const char *previous_dir, const char *relative_path, const char *dst_path,
+                              const struct checksum_list *previous_checksums,
+                              struct checksum_list *checksums) {
+    char src_path[PATH_MAX];
+    struct checksum_entry sum;
+    
+    snprintf(src_path, sizeof(src_path), "%s/%s", previous_dir, relative_path);
+    if (previous_dir[0] == '\0' || link(src_path, dst_path) != 0) {
+        // Not in the previous snapshot or a different filesystem
+        return 0;
+    }
+    
+    // Same file, so the same checksum, read it only if it was never recorded
+    const struct checksum_entry *before_sum = checksum_list_find(previous_checksums, relative_path);
+    if (before_sum != NULL) {
+        sum = *before_sum;
+    } else if (!checksum_file(dst_path, &sum.crc, &sum.size)) {
+        log_message(LOG_ERR, "Failed to checksum %s: %s", dst_path, strerror(errno));
+        return -1;
+    }
+    if (!checksum_list_add(checksums, relative_path, sum.size, sum.crc)) {
+        return -1;
+    }
+    replication_file(dst_path);
+    return 1;
+}
+
+/**
+ * Back up the partitions of the reporting directory. Partitions whose
+ * generation is unchanged since the previous snapshot are hard linked
+ * from it instead of being read and copied again.
+ * 
+ * @return 1 on success, 0 on failure
+ */
+static int backup_partitions(const char *backup_dir_path, struct durability_batch *batch,
+                             struct checksum_list *checksums) {
+    const struct config *config = config_current();
+    struct partition_index partitions, previous;
+    struct checksum_list previous_checksums;
+    char previous_dir[PATH_MAX] = "";
+    char partition_dir[PATH_MAX];
+    char src_path[PATH_MAX];
+    char dst_path[PATH_MAX];
+    size_t linked = 0, copied = 0;
+    int success = 1;
+    
+    if (!partition_index_load(&partitions, config->reporting_dir)) {
+        return 0;
+    }
+    
+    // Find the previous snapshot, if any, to link unchanged partitions from
+    if (!backup_snapshot_dir(NULL, previous_dir, sizeof(previous_dir)) ||
+        !partition_index_load(&previous, previous_dir)) {
+        memset(&previous, 0, sizeof(previous));
+    }
+    if (previous_dir[0] == '\0' || !checksum_list_load(&previous_checksums, previous_dir)) {
+        memset(&previous_checksums, 0, sizeof(previous_checksums));
+    }
+    
+    for (size_t i = 0; i < partitions.count; i++) {
+        const char *partition = partitions.entries[i].path;
+        const struct partition_entry *before = partition_index_find(&previous, partition);
+        int unchanged = before != NULL && before->generation == partitions.entries[i].generation;
+        struct dir_scan files;
+        
+        if (!partition_prepare(backup_dir_path, partition)) {
+            success = 0;
+            continue;
+        }
+        
+        if (!format_path(partition_dir, sizeof(partition_dir), "%s/%s", config->reporting_dir, partition) ||
+            !dir_scan(&files, partition_dir, NULL)) {
+            success = 0;
+            continue;
+        }
+        
+        // Reports plus the manifest, which is a regular file as well
+        for (size_t j = 0; j < files.count; j++) {
+            const char *name = files.entries[j].name;
+            char relative_path[PATH_MAX];
+            struct checksum_entry sum;
+            
+            if (!format_path(relative_path, sizeof(relative_path), "%s/%s", partition, name) ||
+                !format_path(dst_path, sizeof(dst_path), "%s/%s", backup_dir_path, relative_path)) {
+                success = 0;
+                continue;
+            }
+            
+            // Deltas never change once written, even in a changed partition
+            if (unchanged || has_suffix(name, files.entries[j].name_len, VERSION_DELTA_SUFFIX)) {
+                int linked_file = link_from_previous(previous_dir, relative_path, dst_path,
+                                                     &previous_checksums, checksums);
+                if (linked_file < 0) {
+                    success = 0;
+                }
+                if (linked_file != 0) {
+                    continue;
+                }
+            }
+            
+            if (!format_path(src_path, sizeof(src_path), "%s/%s", partition_dir, name) ||
+                !copy_file(src_path, dst_path, batch, &sum) ||
+                !checksum_list_add(checksums, relative_path, sum.size, sum.crc)) {
+                success = 0;
+                continue;
+            }
+            replication_file(dst_path);
+        }
+        
+        snprintf(dst_path, sizeof(dst_path), "%s/%s/%s", backup_dir_path, partition, PARTITION_MANIFEST);
+        durability_entry_changed(batch, dst_path);
+        dir_scan_free(&files);
+        
+        if (unchanged) {
+            linked++;
+        } else {
+            copied++;
+            log_message(LOG_INFO, "Backed up partition: %s", partition);
+        }
+    }
+    
+    // Keep the snapshot's own copy of the index for the next backup
+    if (partition_index_save(&partitions, backup_dir_path)) {
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", backup_dir_path, PARTITION_INDEX);
+        replication_file(dst_path);
+    } else {
+        success = 0;
+    }
+    
+    log_message(LOG_INFO, "Backed up %zu changed partitions, linked %zu unchanged partitions",
+                copied, linked);
+    
+    checksum_list_free(&previous_checksums);
+    partition_index_free(&previous);
+    partition_index_free(&partitions);
+    
+    return success;
+}
+
+/**
+ * Back up the report versions stored as deltas directly in the reporting
+ * directory. A delta never changes once written, so every delta the
+ * previous snapshot already has is hard linked from it and only the ones
+ * written since are copied.
+ * 
+ * @return 1 on success, 0 on failure
+ */
+static int backup_deltas(const char *backup_dir_path, struct durability_batch *batch,
+                         struct checksum_list *checksums) {
+    const struct config *config = config_current();
+    struct checksum_list previous_checksums;
+    struct dir_scan deltas;
+    char previous_dir[PATH_MAX];
+    char src_path[PATH_MAX];
+    char dst_path[PATH_MAX];
+    size_t linked = 0, copied = 0;
+    int success = 1;
+    
+    if (!dir_scan(&deltas, config->reporting_dir, VERSION_DELTA_SUFFIX)) {
+        return 0;
+    }
+    if (deltas.count == 0) {
+        dir_scan_free(&deltas);
+        return 1;
+    }
+    
+    if (!backup_snapshot_dir(NULL, previous_dir, sizeof(previous_dir)) ||
+        !checksum_list_load(&previous_checksums, previous_dir)) {
+        memset(&previous_checksums, 0, sizeof(previous_checksums));
+    }
+    
+    for (size_t i = 0; i < deltas.count; i++) {
+        const char *name = deltas.entries[i].name;
+        struct checksum_entry sum;
+        
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", backup_dir_path, name);
+        int linked_file = link_from_previous(previous_dir, name, dst_path, &previous_checksums, checksums);
+        if (linked_file > 0) {
+            linked++;
+            continue;
+        }
+        if (linked_file < 0) {
+            success = 0;
+            continue;
+        }
+        
+        if (!format_path(src_path, sizeof(src_path), "%s/%s", config->reporting_dir, name) ||
+            !copy_file(src_path, dst_path, batch, &sum) ||
+            !checksum_list_add(checksums, name, sum.size, sum.crc)) {
+            success = 0;
+            continue;
+        }
+        durability_entry_changed(batch, dst_path);
+        replication_file(dst_path);
+        copied++;
+    }
+    
+    log_message(LOG_INFO, "Backed up %zu new report deltas, linked %zu unchanged deltas", copied, linked);
+    
+    checksum_list_free(&previous_checksums);
+    dir_scan_free(&deltas);
+    
+    return success;
+}
+
+/**
+ * Point the latest backup file at a completed snapshot
+ * 
+ * @return 1 on success, 0 on failure
+ */
+static int set_latest_backup(const char *backup_dir_path) {
+    const struct config *config = config_current();
+    char tmp_path[PATH_MAX];
+    const char *name = strrchr(backup_dir_path, '/');
+    FILE *latest;
+    
+    if (!format_path(tmp_path, sizeof(tmp_path), "%s%s", config->latest_backup, PARTIAL_SUFFIX)) {
+        return 0;
+    }
+    latest = fopen(tmp_path, "w");
+    if (latest == NULL) {
+        log_message(LOG_ERR, "Failed to update %s: %s", config->latest_backup, strerror(errno));
+        return 0;
+    }
+    
+    fprintf(latest, "%s\n", name ? name + 1 : backup_dir_path);
+    
+    if (fclose(latest) != 0 || rename(tmp_path, config->latest_backup) != 0) {
+        log_message(LOG_ERR, "Failed to update %s: %s", config->latest_backup, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+    
+    // Last of the snapshot's records, so the standby switches once it has it all
+    replication_file(config->latest_backup);
+    return 1;
+}
+
 /**
  * Backup the reporting directory to the backup location
  * 
+ * @param reports Scan of the reporting directory, NULL to scan it now
  * @return 1 on success, 0 on failure
  */
-int backup_reporting_dir(void) {
-    DIR *dir;
-    struct dirent *entry;
+int backup_reporting_dir(const struct dir_scan *reports) {
+    const struct config *config = config_current();
+    struct dir_scan own_scan;
     char src_path[PATH_MAX];
     char dst_path[PATH_MAX];
-    FILE *src_file, *dst_file;
-    char buffer[4096];
-    size_t bytes;
+    struct durability_batch batch;
+    struct checksum_list checksums;
     int success = 1;
     time_t now;
-    struct tm *time_info;
+    struct tm time_info;
     char timestamp[20];
     
     log_message(LOG_INFO, "Starting backup of reporting directory");
     
     // Get current time for backup folder naming
     time(&now);
-    time_info = localtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", time_info);
+    localtime_r(&now, &time_info);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", &time_info);
     
     // Create a timestamped backup directory
     char backup_dir_path[PATH_MAX];
-    snprintf(backup_dir_path, sizeof(backup_dir_path), "%s/backup_%s", BACKUP_DIR, timestamp);
+    if (!format_path(backup_dir_path, sizeof(backup_dir_path), "%s/backup_%s", config->backup_dir, timestamp)) {
+        return 0;
+    }
+    
+    if (mkdir(backup_dir_path, 0755) < 0) {
+        log_message(LOG_ERR, "Failed to create backup directory %s: %s", 
+                    backup_dir_path, strerror(errno));
+        return 0;
+    }
+    
+    // Scan reporting directory for XML files unless the cycle already did
+    if (reports == NULL) {
+        if (!dir_scan(&own_scan, config->reporting_dir, REPORT_SUFFIX)) {
+            return 0;
+        }
+        reports = &own_scan;
+    }
+    
+    durability_begin(&batch);
+    durability_entry_changed(&batch, backup_dir_path);
+    memset(&checksums, 0, sizeof(checksums));
+    
+    // Copy each file in reporting directory to backup, checksumming it on the way
+    for (size_t i = 0; i < reports->count; i++) {
+        const char *name = reports->entries[i].name;
+        struct checksum_entry sum;
+        
+        // Create full path for source and destination
+        if (!format_path(src_path, sizeof(src_path), "%s/%s", config->reporting_dir, name) ||
+            !format_path(dst_path, sizeof(dst_path), "%s/%s", backup_dir_path, name) ||
+            !copy_file(src_path, dst_path, &batch, &sum)) {
+            success = 0;
+            continue;
+        }
+        durability_entry_changed(&batch, dst_path);
+        if (!checksum_list_add(&checksums, name, sum.size, sum.crc)) {
+            success = 0;
+        }
+        replication_file(dst_path);
+        
+        log_message(LOG_INFO, "Backed up file: %s", name);
+    }
+    
+    if (reports == &own_scan) {
+        dir_scan_free(&own_scan);
+    }
+    
+    // Superseded versions stored as deltas
+    if (!backup_deltas(backup_dir_path, &batch, &checksums)) {
+        success = 0;
+    }
+    
+    // Reports kept in department/YYYY/MM partitions
+    if (reporting_layout() == LAYOUT_PARTITIONED &&
+        !backup_partitions(backup_dir_path, &batch, &checksums)) {
+        success = 0;
+    }
+    
+    // The checksum list is what a later verify compares the snapshot against
+    if (checksum_list_save(&checksums, backup_dir_path, &batch)) {
+        log_message(LOG_INFO, "Recorded %zu checksums (crc32c, %s)",
+                    checksums.count, crc32c_implementation());
+        if (format_path(dst_path, sizeof(dst_path), "%s/%s", backup_dir_path, BACKUP_CHECKSUMS)) {
+            replication_file(dst_path);
+        }
+    } else {
+        success = 0;
+    }
+    checksum_list_free(&checksums);
+    
+    // Make the whole snapshot durable before reporting it as complete
+    if (!durability_commit(&batch)) {
+        success = 0;
+    }
+    
+    // Only a complete snapshot may serve as the base for the next one
+    if (success) {
+        set_latest_backup(backup_dir_path);
+    }
+    replication_flush();
+    
+    if (success) {
+        log_message(LOG_INFO, "Backup completed successfully to %s", backup_dir_path);
+    } else {
+        log_message(LOG_WARNING, "Backup completed with errors");
+    }
+    
+    return success;
+}
+
+/**
+ * Check whether a version of a report is already stored under a name,
+ * either as a full copy or as a delta
+ */
+static int version_name_taken(const char *path) {
+    char delta_path[PATH_MAX];
+    struct stat st;
+    
+    if (stat(path, &st) == 0) {
+        return 1;
+    }
+    snprintf(delta_path, sizeof(delta_path), "%s%s", path, VERSION_DELTA_SUFFIX);
+    return stat(delta_path, &st) == 0;
+}
+
+/**
+ * Pick a file name in the given reporting directory (or partition) that
+ * does not clash with an existing report, appending a timestamp to the
+ * upload's name if needed
+ *
+ * @param filename Receives the name picked
+ * @return 1 on success, 0 if no free name could be found
+ */
+static int build_transfer_destination(const char *dst_dir, const char *name,
+                                      char *filename, size_t size) {
+    time_t now;
+    struct tm time_info;
+    char timestamp[20];
+    char dst_path[PATH_MAX];
+    const char *dot_pos;
+    size_t basename_len;
+
+    snprintf(filename, size, "%s", name);
+    snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_dir, filename);
+    if (!version_name_taken(dst_path)) {
+        return 1;
+    }
+
+    // File exists, append timestamp to avoid overwrite
+    time(&now);
+    localtime_r(&now, &time_info);
+    strftime(timestamp, sizeof(timestamp), "_%Y%m%d_%H%M%S", &time_info);
+
+    dot_pos = strrchr(name, '.');
+    basename_len = dot_pos ? (size_t)(dot_pos - name) : strlen(name);
+    if (basename_len >= size) {
+        return 0;
+    }
+
+    // Insert timestamp before file extension, adding a counter if that
+    // name was also taken earlier in the same second
+    for (int attempt = 0; attempt < 100; attempt++) {
+        memcpy(filename, name, basename_len);
+        if (attempt == 0) {
+            snprintf(filename + basename_len, size - basename_len, "%s%s",
+                     timestamp, dot_pos ? dot_pos : "");
+        } else {
+            snprintf(filename + basename_len, size - basename_len, "%s_%d%s",
+                     timestamp, attempt, dot_pos ? dot_pos : "");
+        }
+
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_dir, filename);
+        if (!version_name_taken(dst_path)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy the contents of one file to another, computing the CRC32C of the
+ * data on the way through
+ * 
+ * @param batch Durability batch the written file is added to
+ * @param sum Receives the size and checksum of the data copied, may be NULL
+ * @return 1 on success, 0 on failure
+ */
+int copy_file(const char *src_path, const char *dst_path, struct durability_batch *batch,
+              struct checksum_entry *sum) {
+    int src_fd, dst_fd;
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t bytes;
+    uint32_t crc = 0;
+    long long size = 0;
+    int success = 1;
+    
+    // Open source file for reading. Full sized blocks go straight to the
+    // files, so stdio would only add a FILE allocation per file.
+    src_fd = open(src_path, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) {
+        log_message(LOG_ERR, "Failed to open source file %s: %s",
+                   src_path, strerror(errno));
+        return 0;
+    }
+    
+    // Open destination file for writing
+    dst_fd = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (dst_fd < 0) {
+        log_message(LOG_ERR, "Failed to create destination file %s: %s",
+                   dst_path, strerror(errno));
+        close(src_fd);
+        return 0;
+    }
+    
+    // Copy file contents, one read and one write per block
+    long long block_start = io_throttle_clock();
+    while ((bytes = read(src_fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_message(LOG_ERR, "Error reading from source file %s: %s",
+                       src_path, strerror(errno));
+            success = 0;
+            break;
+        }
+        
+        for (ssize_t written = 0, chunk; written < bytes; written += chunk) {
+            chunk = write(dst_fd, buffer + written, (size_t)(bytes - written));
+            if (chunk < 0 && errno == EINTR) {
+                chunk = 0;
+            } else if (chunk <= 0) {
+                log_message(LOG_ERR, "Error writing to destination file %s: %s",
+                           dst_path, strerror(errno));
+                success = 0;
+                break;
+            }
+        }
+        if (!success) {
+            break;
+        }
+        // The block is still in cache, so this costs no extra I/O
+        crc = crc32c_update(crc, buffer, (size_t)bytes);
+        size += bytes;
+        
+        long long block_end = io_throttle_clock();
+        io_throttle_account((size_t)bytes, 2, block_end - block_start);
+        block_start = io_throttle_clock();
+    }
+    
+    // Hand the written data to the durability layer before closing
+    if (success && !durability_file_written(batch, dst_fd, dst_path)) {
+        success = 0;
+    }
+    
+    // Close files
+    close(src_fd);
+    if (close(dst_fd) != 0) {
+        success = 0;
+    }
+    
+    if (sum != NULL) {
+        sum->crc = crc;
+        sum->size = size;
+    }
+    
+    return success;
+}
+
+/**
+ * Move a file, falling back to copy and delete when the source and
+ * destination are on different filesystems. The copy is written to a
+ * ".part" file and renamed into place so a crash never leaves a
+ * half-written file under the final name.
+ * 
+ * @param batch Durability batch covering the move
+ * @return 1 on success, 0 on failure
+ */
+int move_file(const char *src_path, const char *dst_path, struct durability_batch *batch) {
+    char part_path[PATH_MAX];
+    struct checksum_entry sum;
+    uint32_t written_crc;
+    long long written_size;
+    
+    // Use rename to move the file (atomic operation if on same filesystem)
+    if (rename(src_path, dst_path) == 0) {
+        durability_entry_changed(batch, dst_path);
+        durability_entry_changed(batch, src_path);
+        return 1;
+    }
+    
+    snprintf(part_path, sizeof(part_path), "%s%s", dst_path, PARTIAL_SUFFIX);
+    
+    if (!copy_file(src_path, part_path, batch, &sum)) {
+        unlink(part_path);
+        return 0;
+    }
+    
+    // The source is about to be deleted, so read the copy back first
+    if (!checksum_file(part_path, &written_crc, &written_size) ||
+        written_crc != sum.crc || written_size != sum.size) {
+        log_message(LOG_ERR, "Checksum mismatch copying %s to %s, keeping the source",
+                   src_path, dst_path);
+        unlink(part_path);
+        return 0;
+    }
+    
+    if (rename(part_path, dst_path) != 0) {
+        log_message(LOG_ERR, "Failed to rename %s to %s: %s",
+                   part_path, dst_path, strerror(errno));
+        unlink(part_path);
+        return 0;
+    }
+    durability_entry_changed(batch, dst_path);
+    
+    // If copy was successful, delete the source file once the copy is durable
+    if (!durability_unlink(batch, src_path)) {
+        log_message(LOG_WARNING, "Failed to delete source file after copy %s: %s",
+                   src_path, strerror(errno));
+        // Still consider the transfer successful
+    }
+    
+    return 1;
+}
+
+/**
+ * Record a report that was moved into a partition of the reporting
+ * directory in the partition's manifest and the partition index.
+ * Reports stored directly in the reporting directory are ignored.
+ * 
+ * @return 1 on success, 0 on failure
+ */
+int transfer_record(const char *dst_path, struct partition_index *partitions) {
+    const char *reporting_dir = config_current()->reporting_dir;
+    size_t base_len = strlen(reporting_dir);
+    char partition[PARTITION_PATH_MAX];
+    const char *name;
+    struct stat st;
+    
+    name = strrchr(dst_path, '/');
+    if (name == NULL || strncmp(dst_path, reporting_dir, base_len) != 0 ||
+        dst_path[base_len] != '/' || name == dst_path + base_len) {
+        return 1;
+    }
+    
+    size_t partition_len = name - (dst_path + base_len + 1);
+    if (partition_len >= sizeof(partition)) {
+        return 0;
+    }
+    memcpy(partition, dst_path + base_len + 1, partition_len);
+    partition[partition_len] = '\0';
+    
+    if (stat(dst_path, &st) < 0) {
+        log_message(LOG_ERR, "Failed to stat transferred file %s: %s", dst_path, strerror(errno));
+        return 0;
+    }
+    
+    if (!partition_manifest_add(reporting_dir, partition, name + 1, &st)) {
+        return 0;
+    }
+    
+    char manifest_path[PATH_MAX];
+    if (format_path(manifest_path, sizeof(manifest_path), "%s/%s/%s", reporting_dir, partition,
+                    PARTITION_MANIFEST)) {
+        replication_file(manifest_path);
+    }
+    
+    return partition_index_touch(partitions, partition);
+}
+
+// A move planned by transfer_uploads() and recorded in the journal. The
+// paths are interned in the transfer's path table, so a re-upload keeps
+// the name id of its upload unless it had to be renamed.
+struct transfer_plan {
+    long seq;
+    size_t entry;           // Index of the upload in the scan
+    struct path_ref src;
+    struct path_ref dst;
+    int superseding;        // Moved in next to an earlier version of the report
+};
+
+/**
+ * Store the versions superseded by this cycle's re-uploads as deltas,
+ * once for each directory that received one. Only the reports that were
+ * re-uploaded are looked at, not every report in the directory.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int compact_superseded_versions(struct path_table *paths, const struct transfer_plan *plan,
+                                       size_t count, struct durability_batch *batch) {
+    // Re-uploads chained per directory id: first[dir] and next[i] hold a
+    // plan index plus one, 0 ends the chain
+    size_t *first = arena_alloc(&paths->arena, paths->count * sizeof(*first));
+    size_t *next = arena_alloc(&paths->arena, (count ? count : 1) * sizeof(*next));
+    const char **names = arena_alloc(&paths->arena, (count ? count : 1) * sizeof(*names));
+    int success = 1;
+
+    if (first == NULL || next == NULL || names == NULL) {
+        log_message(LOG_ERR, "Out of memory compacting superseded versions");
+        return 0;
+    }
+    memset(first, 0, paths->count * sizeof(*first));
+
+    for (size_t i = count; i-- > 0;) {
+        if (plan[i].superseding) {
+            next[i] = first[plan[i].dst.dir];
+            first[plan[i].dst.dir] = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t dir = plan[i].dst.dir;
+        size_t name_count = 0;
+
+        if (!plan[i].superseding || first[dir] != i + 1) {
+            continue;
+        }
+
+        for (size_t j = first[dir]; j != 0; j = next[j - 1]) {
+            names[name_count++] = path_table_string(paths, plan[j - 1].dst.name);
+        }
+        if (!versions_compact(path_table_string(paths, dir), names, name_count, batch)) {
+            success = 0;
+        }
+    }
+
+    return success;
+}
+
+/**
+ * Transfer files from upload directory to reporting directory.
+ * Every move is first recorded in the transfer journal, so a cycle that
+ * is interrupted part way through is resumed by journal_recover().
+ * 
+ * @param uploads Scan of the upload directory, NULL to scan it now
+ * @param outcomes Receives where each upload of the scan went, one per
+ *                 entry, may be NULL
+ * @return 1 on success, 0 on failure
+ */
+int transfer_uploads(const struct dir_scan *uploads, struct transfer_outcome *outcomes) {
+    const struct config *config = config_current();
+    struct dir_scan own_scan;
+    char src_path[PATH_MAX];
+    char dst_path[PATH_MAX];
+    struct transfer_journal journal;
+    struct durability_batch batch;
+    struct partition_index partitions;
+    struct path_table paths;
+    int partitioned = reporting_layout() == LAYOUT_PARTITIONED;
+    struct transfer_plan *plan = NULL;
+    size_t plan_count = 0;
+    uint32_t upload_dir, reporting_dir;
+    int success = 1;
+    
+    log_message(LOG_INFO, "Starting transfer of uploads to reporting directory");
+    
+    // Scan upload directory for XML files unless the cycle already did
+    if (uploads == NULL) {
+        if (!dir_scan(&own_scan, config->upload_dir, REPORT_SUFFIX)) {
+            return 0;
+        }
+        uploads = &own_scan;
+        outcomes = NULL;
+    }
+    if (outcomes != NULL) {
+        memset(outcomes, 0, uploads->count * sizeof(*outcomes));
+    }
     
-    if (mkdir(backup_dir_path, 0755) < 0) {
-        log_message(LOG_ERR, "Failed to create backup directory %s: %s", 
-                    backup_dir_path, strerror(errno));
+    // The plan and every path it names live until the transfer ends
+    path_table_init(&paths);
+    upload_dir = path_table_intern(&paths, config->upload_dir, strlen(config->upload_dir));
+    reporting_dir = path_table_intern(&paths, config->reporting_dir, strlen(config->reporting_dir));
+    if (uploads->count > 0) {
+        plan = arena_alloc(&paths.arena, uploads->count * sizeof(*plan));
+    }
+    if (upload_dir == PATH_TABLE_NONE || reporting_dir == PATH_TABLE_NONE ||
+        (uploads->count > 0 && plan == NULL)) {
+        log_message(LOG_ERR, "Out of memory planning transfer");
+        path_table_free(&paths);
+        if (uploads == &own_scan) {
+            dir_scan_free(&own_scan);
+        }
         return 0;
     }
     
-    // Open reporting directory
-    dir = opendir(REPORTING_DIR);
-    if (dir == NULL) {
-        log_message(LOG_ERR, "Failed to open reporting directory: %s", strerror(errno));
+    if (!partition_index_load(&partitions, config->reporting_dir)) {
+        partitioned = 0;
+    }
+    
+    if (!journal_begin(&journal, config->transfer_journal)) {
+        partition_index_free(&partitions);
+        path_table_free(&paths);
+        if (uploads == &own_scan) {
+            dir_scan_free(&own_scan);
+        }
         return 0;
     }
     
-    // Copy each file in reporting directory to backup
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".." directories
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    // Plan the move of each file in the upload directory
+    for (size_t i = 0; i < uploads->count; i++) {
+        const struct scan_entry *upload = &uploads->entries[i];
+        struct transfer_plan *move = &plan[plan_count];
+        
+        // In the partitioned layout, reports go to department/YYYY/MM
+        char dst_dir[PATH_MAX];
+        char partition[PARTITION_PATH_MAX];
+        move->dst.dir = reporting_dir;
+        if (partitioned &&
+            partition_for_report(upload->name, upload->name_len, partition, sizeof(partition)) &&
+            partition_prepare(config->reporting_dir, partition)) {
+            move->dst.dir = PATH_TABLE_NONE;
+            if (format_path(dst_dir, sizeof(dst_dir), "%s/%s", config->reporting_dir, partition)) {
+                move->dst.dir = path_table_intern(&paths, dst_dir, strlen(dst_dir));
+            }
         }
         
-        // Only backup XML files
-        if (strstr(entry->d_name, ".xml") == NULL) {
+        // The destination keeps the upload's name unless that is taken
+        char filename[PATH_MAX];
+        if (move->dst.dir == PATH_TABLE_NONE ||
+            !build_transfer_destination(path_table_string(&paths, move->dst.dir), upload->name,
+                                        filename, sizeof(filename))) {
+            log_message(LOG_ERR, "No free destination name for %s", upload->name);
+            success = 0;
+            continue;
+        }
+        move->src.dir = upload_dir;
+        move->src.name = path_table_intern(&paths, upload->name, upload->name_len);
+        move->dst.name = path_table_intern(&paths, filename, strlen(filename));
+        if (move->src.name == PATH_TABLE_NONE || move->dst.name == PATH_TABLE_NONE ||
+            !path_table_format(&paths, move->src, src_path, sizeof(src_path)) ||
+            !path_table_format(&paths, move->dst, dst_path, sizeof(dst_path))) {
+            log_message(LOG_ERR, "Failed to plan the transfer of %s", upload->name);
+            success = 0;
             continue;
         }
         
-        // Create full path for source and destination
-        snprintf(src_path, sizeof(src_path), "%s/%s", REPORTING_DIR, entry->d_name);
-        snprintf(dst_path, sizeof(dst_path), "%s/%s", backup_dir_path, entry->d_name);
+        // Recovery tells the upload from a re-upload by what it is now
+        struct stat src_st;
+        if (lstat(src_path, &src_st) < 0) {
+            log_message(LOG_WARNING, "Upload %s is gone, not transferring it", upload->name);
+            continue;
+        }
         
-        // Open source file for reading
-        src_file = fopen(src_path, "rb");
-        if (src_file == NULL) {
-            log_message(LOG_ERR, "Failed to open source file %s: %s",
-                       src_path, strerror(errno));
+        move->seq = journal_intent(&journal, src_path, dst_path, &src_st);
+        if (move->seq < 0) {
             success = 0;
             continue;
         }
+        move->entry = i;
+        move->superseding = 0;
+        plan_count++;
+    }
+    
+    // All intents must be on disk before the first file moves
+    size_t move_count = plan_count;
+    if (!journal_sync(&journal)) {
+        success = 0;
+        move_count = 0;
+    }
+    
+    // Carry out the planned moves
+    durability_begin(&batch);
+    for (size_t i = 0; i < move_count; i++) {
+        const char *name = path_table_string(&paths, plan[i].src.name);
         
-        // Open destination file for writing
-        dst_file = fopen(dst_path, "wb");
-        if (dst_file == NULL) {
-            log_message(LOG_ERR, "Failed to create destination file %s: %s",
-                       dst_path, strerror(errno));
-            fclose(src_file);
+        path_table_format(&paths, plan[i].src, src_path, sizeof(src_path));
+        path_table_format(&paths, plan[i].dst, dst_path, sizeof(dst_path));
+        if (!move_file(src_path, dst_path, &batch)) {
             success = 0;
             continue;
         }
         
-        // Copy file contents
-        while ((bytes = fread(buffer, 1, sizeof(buffer), src_file)) > 0) {
-            if (fwrite(buffer, 1, bytes, dst_file) != bytes) {
-                log_message(LOG_ERR, "Error writing to destination file %s: %s",
-                           dst_path, strerror(errno));
-                success = 0;
-                break;
-            }
+        journal_done(&journal, plan[i].seq);
+        replication_file(dst_path);
+        if (partitioned && !transfer_record(dst_path, &partitions)) {
+            success = 0;
         }
-        
-        // Check for read error
-        if (ferror(src_file)) {
-            log_message(LOG_ERR, "Error reading from source file %s: %s",
-                       src_path, strerror(errno));
+        scheduler_transferred(name);
+        if (outcomes != NULL) {
+            outcomes[plan[i].entry].moved = 1;
+            snprintf(outcomes[plan[i].entry].dst, sizeof(outcomes[plan[i].entry].dst), "%s", dst_path);
+        }
+        plan[i].superseding = plan[i].dst.name != plan[i].src.name;
+        log_message(LOG_INFO, "Transferred file: %s to reporting directory", name);
+    }
+    
+    // Earlier versions of re-uploaded reports become deltas against the
+    // version that replaced them
+    if (config->report_versions == VERSIONS_DELTA &&
+        !compact_superseded_versions(&paths, plan, move_count, &batch)) {
+        success = 0;
+    }
+    
+    if (partitions.dirty) {
+        if (partition_index_save(&partitions, config->reporting_dir)) {
+            durability_dir_changed(&batch, config->reporting_dir);
+            if (format_path(dst_path, sizeof(dst_path), "%s/%s", config->reporting_dir, PARTITION_INDEX)) {
+                replication_file(dst_path);
+            }
+        } else {
             success = 0;
         }
-        
-        // Close files
-        fclose(src_file);
-        fclose(dst_file);
-        
-        log_message(LOG_INFO, "Backed up file: %s", entry->d_name);
     }
+    partition_index_free(&partitions);
+    
+    if (!durability_commit(&batch)) {
+        success = 0;
+    }
+    replication_flush();
     
-    closedir(dir);
+    // Failed moves leave their source in place and are simply planned
+    // again next cycle, only an interrupted cycle needs the journal
+    journal_commit(&journal);
+    
+    path_table_free(&paths);
+    
+    if (uploads == &own_scan) {
+        dir_scan_free(&own_scan);
+    }
     
     if (success) {
-        log_message(LOG_INFO, "Backup completed successfully to %s", backup_dir_path);
+        log_message(LOG_INFO, "File transfer completed successfully");
     } else {
-        log_message(LOG_WARNING, "Backup completed with errors");
+        log_message(LOG_WARNING, "File transfer completed with errors");
     }
     
     return success;
 }
 
 /**
- * Transfer files from upload directory to reporting directory
+ * Check for missing uploads from departments over the last
+ * MISSING_REPORT_WINDOW_DAYS days, including today.
+ * Uses a naming convention: department_YYYY-MM-DD.xml
  * 
- * @return 1 on success, 0 on failure
+ * Reports from earlier days have usually been transferred already, so
+ * both the upload and reporting directories are indexed.
+ * 
+ * @param uploads Scan of the upload directory, NULL to scan it now
+ * @param reports Scan of the reporting directory, NULL to scan it now
+ * @return 1 if all expected reports are present, 0 otherwise
  */
-int transfer_uploads(void) {
-    DIR *dir;
-    struct dirent *entry;
-    char src_path[PATH_MAX];
-    char dst_path[PATH_MAX];
-    int success = 1;
+int check_missing_uploads(const struct dir_scan *uploads, const struct dir_scan *reports) {
+    const struct config *config = config_current();
+    const struct department_registry *registry = departments_get();
+    struct dir_scan own_uploads, own_reports;
+    struct report_index index;
+    struct timespec start, end;
+    int all_found = 1;
+    time_t now;
+    struct tm time_info;
+    char today_date[11];  // Format: YYYY-MM-DD
     
-    log_message(LOG_INFO, "Starting transfer of uploads to reporting directory");
+    // Get today's date for checking report names
+    time(&now);
+    localtime_r(&now, &time_info);
+    strftime(today_date, sizeof(today_date), "%Y-%m-%d", &time_info);
+    long today = date_to_day(time_info.tm_year + 1900, time_info.tm_mon + 1, time_info.tm_mday);
+    
+    log_message(LOG_INFO, "Checking for missing uploads for the %d days up to %s",
+                config->missing_report_window_days, today_date);
+    
+    // Scan the directories unless the cycle already did
+    if (uploads == NULL) {
+        if (!dir_scan(&own_uploads, config->upload_dir, REPORT_SUFFIX)) {
+            return 0;
+        }
+        uploads = &own_uploads;
+    }
+    if (reports == NULL) {
+        if (!dir_scan(&own_reports, config->reporting_dir, REPORT_SUFFIX)) {
+            if (uploads == &own_uploads) {
+                dir_scan_free(&own_uploads);
+            }
+            return 0;
+        }
+        reports = &own_reports;
+    }
     
-    // Open upload directory
-    dir = opendir(UPLOAD_DIR);
-    if (dir == NULL) {
-        log_message(LOG_ERR, "Failed to open upload directory: %s", strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // Build the department x day bitmap in one pass over each scan
+    if (!report_index_init(&index, registry, today, config->missing_report_window_days)) {
+        log_message(LOG_ERR, "Out of memory building missing report index");
+        if (uploads == &own_uploads) {
+            dir_scan_free(&own_uploads);
+        }
+        if (reports == &own_reports) {
+            dir_scan_free(&own_reports);
+        }
         return 0;
     }
+    report_index_add_scan(&index, uploads);
+    report_index_add_scan(&index, reports);
     
-    // Process each file in the upload directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".." directories
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    // Partitioned reports are found through their manifests, only the
+    // months the window overlaps need to be read
+    if (reporting_layout() == LAYOUT_PARTITIONED) {
+        char last_date[16] = "", date[16], month[8];
+        for (long day = today - index.window_days + 1; day <= today; day++) {
+            day_to_date(day, date, sizeof(date));
+            if (strncmp(last_date, date, 7) == 0) {
+                continue;
+            }
+            memcpy(last_date, date, sizeof(date));
+            snprintf(month, sizeof(month), "%.4s/%.2s", date, date + 5);
+            for (size_t i = 0; i < registry->count; i++) {
+                char partition[PARTITION_PATH_MAX];
+                snprintf(partition, sizeof(partition), "%s/%s", registry->names[i], month);
+                partition_manifest_add_to_index(config->reporting_dir, partition, &index);
+            }
         }
-        
-        // Only process XML files
-        if (strstr(entry->d_name, ".xml") == NULL) {
+    }
+    
+    uint64_t window_mask = index.window_days == 64 ? ~(uint64_t)0
+                                                   : ((uint64_t)1 << index.window_days) - 1;
+    
+    // Write to specific missing report log as gaps are found
+    FILE *log_file = NULL;
+    
+    for (size_t i = 0; i < registry->count; i++) {
+        uint64_t missing = ~index.days[i] & window_mask;
+        if (missing == 0) {
             continue;
         }
         
-        // Create full path for source and destination
-        snprintf(src_path, sizeof(src_path), "%s/%s", UPLOAD_DIR, entry->d_name);
-        snprintf(dst_path, sizeof(dst_path), "%s/%s", REPORTING_DIR, entry->d_name);
-        
-        // Handle case where file already exists in reporting directory
-        struct stat st;
-        if (stat(dst_path, &st) == 0) {
-            // File exists, append timestamp to avoid overwrite
-            time_t now;
-            struct tm *time_info;
-            char timestamp[20];
-            
-            time(&now);
-            time_info = localtime(&now);
-            strftime(timestamp, sizeof(timestamp), "_%Y%m%d_%H%M%S", time_info);
-            
-            // Update destination path with timestamp
-            char filename[PATH_MAX];
-            char *dot_pos = strrchr(entry->d_name, '.');
-            if (dot_pos) {
-                // Insert timestamp before file extension
-                size_t basename_len = dot_pos - entry->d_name;
-                strncpy(filename, entry->d_name, basename_len);
-                filename[basename_len] = '\0';
-                strcat(filename, timestamp);
-                strcat(filename, dot_pos);
-            } else {
-                // No extension, just append timestamp
-                strcpy(filename, entry->d_name);
-                strcat(filename, timestamp);
+        if (all_found) {
+            all_found = 0;
+            char missing_log[PATH_MAX];
+            if (format_path(missing_log, sizeof(missing_log), "%s/missing_reports.log", config->log_dir)) {
+                log_file = fopen(missing_log, "a");
+            }
+            if (log_file) {
+                char timestamp[26];
+                strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &time_info);
+                fprintf(log_file, "[%s] Missing reports:", timestamp);
             }
-            
-            snprintf(dst_path, sizeof(dst_path), "%s/%s", REPORTING_DIR, filename);
         }
         
-        // Use rename to move the file (atomic operation if on same filesystem)
-        if (rename(src_path, dst_path) != 0) {
-            // If rename fails (possibly due to different filesystems), fall back to copy and delete
-            FILE *src_file, *dst_file;
-            char buffer[4096];
-            size_t bytes;
-            int copy_success = 1;
-            
-            // Open source file for reading
-            src_file = fopen(src_path, "rb");
-            if (src_file == NULL) {
-                log_message(LOG_ERR, "Failed to open source file %s: %s",
-                           src_path, strerror(errno));
-                success = 0;
-                continue;
-            }
-            
-            // Open destination file for writing
-            dst_file = fopen(dst_path, "wb");
-            if (dst_file == NULL) {
-                log_message(LOG_ERR, "Failed to create destination file %s: %s",
-                           dst_path, strerror(errno));
-                fclose(src_file);
-                success = 0;
-                continue;
-            }
-            
-            // Copy file contents
-            while ((bytes = fread(buffer, 1, sizeof(buffer), src_file)) > 0) {
-                if (fwrite(buffer, 1, bytes, dst_file) != bytes) {
-                    log_message(LOG_ERR, "Error writing to destination file %s: %s",
-                               dst_path, strerror(errno));
-                    copy_success = 0;
-                    break;
-                }
-            }
-            
-            // Check for read error
-            if (ferror(src_file)) {
-                log_message(LOG_ERR, "Error reading from source file %s: %s",
-                           src_path, strerror(errno));
-                copy_success = 0;
-            }
-            
-            // Close files
-            fclose(src_file);
-            fclose(dst_file);
-            
-            // If copy was successful, delete the source file
-            if (copy_success) {
-                if (unlink(src_path) != 0) {
-                    log_message(LOG_WARNING, "Failed to delete source file after copy %s: %s",
-                               src_path, strerror(errno));
-                    // Still consider the transfer successful
+        // Log any missing uploads, oldest day first
+        char dates[REPORT_INDEX_MAX_DAYS * 11];
+        size_t used = 0;
+        for (int age = index.window_days - 1; age >= 0; age--) {
+            if (missing & ((uint64_t)1 << age)) {
+                if (used > 0) {
+                    dates[used++] = ',';
                 }
-            } else {
-                success = 0;
-                continue;
+                day_to_date(today - age, dates + used, sizeof(dates) - used);
+                used += strlen(dates + used);
             }
         }
         
-        log_message(LOG_INFO, "Transferred file: %s to reporting directory", entry->d_name);
+        log_message(LOG_WARNING, "Missing upload: %s report for %s", registry->names[i], dates);
+        if (log_file) {
+            fprintf(log_file, " %s(%s)", registry->names[i], dates);
+        }
     }
     
-    closedir(dir);
+    if (log_file) {
+        fprintf(log_file, "\n");
+        fclose(log_file);
+    }
     
-    if (success) {
-        log_message(LOG_INFO, "File transfer completed successfully");
-    } else {
-        log_message(LOG_WARNING, "File transfer completed with errors");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    if (all_found) {
+        log_message(LOG_INFO, "All department reports have been received");
     }
+    log_message(LOG_INFO, "Missing report check of %zu departments took %ld us",
+                registry->count,
+                (long)((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000));
     
-    return success;
+    report_index_free(&index);
+    
+    if (uploads == &own_uploads) {
+        dir_scan_free(&own_uploads);
+    }
+    if (reports == &own_reports) {
+        dir_scan_free(&own_reports);
+    }
+    
+    return all_found;
 }
 
 /**
- * Check for missing uploads from departments
- * Uses a naming convention: department_date.xml
+ * Run the scheduled cycle: check for missing reports, back up the
+ * reporting directory and transfer the uploads. Each directory is
+ * scanned once and the scan is shared by every step that reads it.
+ * With streaming intake the uploads were moved as they arrived, so the
+ * cycle only checks that they reached the reporting directory and moves
+ * whatever the pipeline left behind.
  * 
- * @return 1 if all expected reports are present, 0 otherwise
+ * @return 1 on success, 0 on failure
  */
-int check_missing_uploads(void) {
-    DIR *dir;
-    struct dirent *entry;
-    int found_warehouse = 0;
-    int found_manufacturing = 0;
-    int found_sales = 0;
-    int found_distribution = 0;
-    int all_found = 1;
-    time_t now;
-    struct tm *time_info;
-    char today_date[11];  // Format: YYYY-MM-DD
-    
-    // Get today's date for checking report names
-    time(&now);
-    time_info = localtime(&now);
-    strftime(today_date, sizeof(today_date), "%Y-%m-%d", time_info);
+int run_cycle(int throttled) {
+    const struct config *config = config_current();
+    struct dir_scan uploads, reports;
+    int success = 1;
     
-    log_message(LOG_INFO, "Checking for missing uploads for date: %s", today_date);
+    // Lock directories before backup and transfer, and keep the intake
+    // pipeline from moving uploads meanwhile
+    lock_directories();
+    intake_pause();
+    io_throttle_begin(throttled);
     
-    // Open upload directory
-    dir = opendir(UPLOAD_DIR);
-    if (dir == NULL) {
-        log_message(LOG_ERR, "Failed to open upload directory: %s", strerror(errno));
+    if (!dir_scan(&uploads, config->upload_dir, REPORT_SUFFIX)) {
+        io_throttle_end();
+        intake_resume();
+        unlock_directories();
         return 0;
     }
-    
-    // Check each file in the upload directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".." directories
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        // Only check XML files
-        if (strstr(entry->d_name, ".xml") == NULL) {
-            continue;
-        }
-        
-        // Check if file matches expected naming pattern and today's date
-        if (strstr(entry->d_name, "warehouse") && strstr(entry->d_name, today_date)) {
-            found_warehouse = 1;
-        } else if (strstr(entry->d_name, "manufacturing") && strstr(entry->d_name, today_date)) {
-            found_manufacturing = 1;
-        } else if (strstr(entry->d_name, "sales") && strstr(entry->d_name, today_date)) {
-            found_sales = 1;
-        } else if (strstr(entry->d_name, "distribution") && strstr(entry->d_name, today_date)) {
-            found_distribution = 1;
-        }
+    if (!dir_scan(&reports, config->reporting_dir, REPORT_SUFFIX)) {
+        dir_scan_free(&uploads);
+        io_throttle_end();
+        intake_resume();
+        unlock_directories();
+        return 0;
     }
     
-    closedir(dir);
+    // Forget queued uploads deleted since they were seen
+    scheduler_sync(&uploads);
+    
+    // Check for missing uploads
+    check_missing_uploads(&uploads, &reports);
     
-    // Log any missing uploads
-    if (!found_warehouse) {
-        log_message(LOG_WARNING, "Missing upload: warehouse report for %s", today_date);
-        all_found = 0;
+    // Check the reports streamed since the last cycle are in place
+    if (config->intake == INTAKE_STREAMING && !intake_check()) {
+        success = 0;
     }
     
-    if (!found_manufacturing) {
-        log_message(LOG_WARNING, "Missing upload: manufacturing report for %s", today_date);
-        all_found = 0;
+    // Backup reporting directory, then prune old snapshots in the background
+    if (!backup_reporting_dir(&reports)) {
+        success = 0;
     }
+    prune_backups(1);
     
-    if (!found_sales) {
-        log_message(LOG_WARNING, "Missing upload: sales report for %s", today_date);
-        all_found = 0;
+    // Transfer files from upload to reporting
+    if (config->intake == INTAKE_STREAMING) {
+        if (uploads.count > 0) {
+            log_message(LOG_INFO, "%zu uploads were not streamed, moving them now", uploads.count);
+            if (!transfer_uploads(&uploads, NULL)) {
+                success = 0;
+            }
+        }
+    } else if (!transfer_uploads(&uploads, NULL)) {
+        success = 0;
     }
     
-    if (!found_distribution) {
-        log_message(LOG_WARNING, "Missing upload: distribution report for %s", today_date);
-        all_found = 0;
+    dir_scan_free(&reports);
+    dir_scan_free(&uploads);
+    io_throttle_end();
+    
+    // Unlock directories after operations
+    intake_resume();
+    unlock_directories();
+    
+    return success;
+}
+
+/**
+ * Log a change to an uploaded file, with the user who owns it, to the
+ * error log and the change log
+ */
+static void log_file_change(const char *name, const struct stat *st) {
+    struct attribution_writer writer;
+    struct passwd *pwd;
+    char process[ATTRIBUTION_COMM_MAX + 32] = "";
+    
+    // The process that wrote the file if fanotify saw it, else the owner
+    if (attribution_lookup(st, &writer)) {
+        pwd = getpwuid(writer.uid);
+        snprintf(process, sizeof(process), "%s[%d]", writer.comm, (int)writer.pid);
+    } else {
+        pwd = getpwuid(st->st_uid);
+    }
+    if (pwd == NULL) {
+        log_message(LOG_WARNING, "Failed to get owner of file %s: %s", 
+                   name, strerror(errno));
+        return;
     }
     
-    if (all_found) {
-        log_message(LOG_INFO, "All department reports have been received");
+    // Log the file change
+    if (process[0] != '\0') {
+        log_message(LOG_INFO, "File change detected: %s, modified by %s (%s)", 
+                   name, pwd->pw_name, process);
     } else {
-        // Write to specific missing report log
-        FILE *log_file = fopen(LOG_DIR"/missing_reports.log", "a");
-        if (log_file) {
-            time_t log_time;
-            struct tm *log_tm;
-            char timestamp[26];
-            
-            time(&log_time);
-            log_tm = localtime(&log_time);
-            strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", log_tm);
-            
-            fprintf(log_file, "[%s] Missing reports: ", timestamp);
-            if (!found_warehouse) fprintf(log_file, "warehouse ");
-            if (!found_manufacturing) fprintf(log_file, "manufacturing ");
-            if (!found_sales) fprintf(log_file, "sales ");
-            if (!found_distribution) fprintf(log_file, "distribution ");
-            fprintf(log_file, "\n");
-            
-            fclose(log_file);
-        }
+        log_message(LOG_INFO, "File change detected: %s, modified by %s", 
+                   name, pwd->pw_name);
     }
     
-    return all_found;
+    // Also log to specific change log, with the site the file came to
+    const struct config *config = config_current();
+    char file[SITE_NAME_MAX + NAME_MAX + 2];
+    snprintf(file, sizeof(file), "%s%s%s", config->site, config->site[0] ? "/" : "", name);
+    
+    FILE *log_file = fopen(config->change_log, "a");
+    if (log_file) {
+        time_t log_time;
+        struct tm log_tm;
+        char timestamp[26];
+        
+        time(&log_time);
+        localtime_r(&log_time, &log_tm);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &log_tm);
+        
+        if (process[0] != '\0') {
+            fprintf(log_file, "[%s] File: %s, User: %s, Process: %s, Action: modified\n", 
+                   timestamp, file, pwd->pw_name, process);
+        } else {
+            fprintf(log_file, "[%s] File: %s, User: %s, Action: modified\n", 
+                   timestamp, file, pwd->pw_name);
+        }
+        
+        fclose(log_file);
+    }
 }
 
 /**
  * Monitor uploads directory for changes and log them
  */
 void monitor_uploads(void) {
-    DIR *dir;
-    struct dirent *entry;
+    const struct config *config = config_current();
+    struct dir_scan uploads;
     static time_t last_check_time = 0;
     struct stat st;
     char filepath[PATH_MAX];
-    struct passwd *pwd;
     
     // Only check for changes every 5 seconds to reduce system load
     time_t now = time(NULL);
@@ -447,22 +1302,19 @@ void monitor_uploads(void) {
     }
     last_check_time = now;
     
-    // Open upload directory
-    dir = opendir(UPLOAD_DIR);
-    if (dir == NULL) {
-        log_message(LOG_ERR, "Failed to open upload directory for monitoring: %s", strerror(errno));
+    // Scan upload directory for regular files
+    if (!dir_scan(&uploads, config->upload_dir, NULL)) {
         return;
     }
     
     // Check each file in the upload directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".." directories
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+    for (size_t i = 0; i < uploads.count; i++) {
+        const char *name = uploads.entries[i].name;
         
         // Create full path
-        snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, entry->d_name);
+        if (!format_path(filepath, sizeof(filepath), "%s/%s", config->upload_dir, name)) {
+            continue;
+        }
         
         // Get file stats
         if (stat(filepath, &st) < 0) {
@@ -472,70 +1324,121 @@ void monitor_uploads(void) {
         
         // Check if file was modified recently (within last check interval)
         if (st.st_mtime >= last_check_time - 5) {
-            // Get the username of the file owner
-            pwd = getpwuid(st.st_uid);
-            if (pwd == NULL) {
-                log_message(LOG_WARNING, "Failed to get owner of file %s: %s", 
-                           filepath, strerror(errno));
-                continue;
-            }
-            
-            // Log the file change
-            log_message(LOG_INFO, "File change detected: %s, modified by %s", 
-                       entry->d_name, pwd->pw_name);
-            
-            // Also log to specific change log
-            FILE *log_file = fopen(CHANGE_LOG, "a");
-            if (log_file) {
-                time_t log_time;
-                struct tm *log_tm;
-                char timestamp[26];
-                
-                time(&log_time);
-                log_tm = localtime(&log_time);
-                strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", log_tm);
-                
-                fprintf(log_file, "[%s] File: %s, User: %s, Action: modified\n", 
-                       timestamp, entry->d_name, pwd->pw_name);
-                
-                fclose(log_file);
-            }
+            log_file_change(name, &st);
         }
     }
     
-    closedir(dir);
+    dir_scan_free(&uploads);
+}
+
+/**
+ * Load what the upload monitor saw before the last shutdown. The
+ * snapshot is trusted straight away and checked against the directory
+ * in the background, changes made while the daemon was down are
+ * reported once that check finishes.
+ * 
+ * @return 1 on success, 0 on failure
+ */
+int monitor_init(const char *upload_dir) {
+    struct site *site = site_current();
+    
+    if (!file_state_load(&site->upload_state, config_current()->monitor_state)) {
+        return 0;
+    }
+    
+    if (site->upload_state.count > 0 &&
+        !file_state_verify_start(&site->upload_verify, &site->upload_state, upload_dir)) {
+        log_message(LOG_WARNING, "Failed to verify monitor state, rescanning uploads");
+        file_state_free(&site->upload_state);
+    }
+    
+    return 1;
+}
+
+/**
+ * Report a file that changed and record its new state
+ */
+static void monitor_file_changed(struct file_state_table *state, struct file_state *entry,
+                                 const char *name, const struct stat *st) {
+    log_file_change(name, st);
+    scheduler_submit(name, strlen(name), st->st_mtime);
+    
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    state->dirty = 1;
 }
 
 /**
- * Monitor uploads directory for changes using an absolute path
+ * Monitor uploads directory for changes using an absolute path. New,
+ * replaced and modified files are reported once each, the state is
+ * saved so a restart does not report them again.
  */
 void monitor_uploads_with_path(const char *upload_dir) {
-    DIR *dir;
-    struct dirent *entry;
+    struct site *site = site_current();
+    struct file_state_table *upload_state = &site->upload_state;
+    struct file_state_verify *upload_verify = &site->upload_verify;
+    struct dir_scan uploads;
+    char full_path[PATH_MAX];
+    struct stat st;
+    int verifying = upload_verify->running && !file_state_verify_done(upload_verify);
+    
+    // Report what changed while the daemon was down
+    if (upload_verify->running && !verifying) {
+        for (size_t i = 0; i < upload_verify->changed_count; i++) {
+            const char *name = upload_verify->changed[i];
+            struct file_state *entry = file_state_find(upload_state, name);
+            
+            snprintf(full_path, sizeof(full_path), "%s/%s", upload_dir, name);
+            if (entry != NULL && stat(full_path, &st) == 0) {
+                monitor_file_changed(upload_state, entry, name, &st);
+            }
+        }
+        log_message(LOG_INFO, "Monitor state verified, %zu files changed while stopped",
+                    upload_verify->changed_count);
+        file_state_verify_free(upload_verify);
+    }
     
-    dir = opendir(upload_dir);
-    if (dir == NULL) {
-        log_message(LOG_ERR, "Failed to open upload directory for monitoring: %s", strerror(errno));
+    if (!dir_scan(&uploads, upload_dir, NULL)) {
         return;
     }
     
-    // Process each entry in the directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and .. entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    // Process each file in the directory
+    for (size_t i = 0; i < uploads.count; i++) {
+        const char *name = uploads.entries[i].name;
+        struct file_state *entry = file_state_find(upload_state, name);
+        
+        // Until verification is done, known files are left to it and only
+        // new or replaced ones are looked at
+        if (entry != NULL && verifying && entry->ino == uploads.entries[i].ino) {
+            entry->seen = 1;
             continue;
         }
         
-        // Process the file here
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", upload_dir, entry->d_name);
-        log_message(LOG_INFO, "Found file in upload directory: %s", full_path);
+        snprintf(full_path, sizeof(full_path), "%s/%s", upload_dir, name);
+        if (stat(full_path, &st) < 0) {
+            continue;
+        }
         
-        // You may want to call your existing transfer logic here
-        // Or simply identify files to be transferred later
+        if (entry == NULL) {
+            entry = file_state_insert(upload_state, name);
+            if (entry == NULL) {
+                log_message(LOG_ERR, "Out of memory tracking %s", full_path);
+                continue;
+            }
+            monitor_file_changed(upload_state, entry, name, &st);
+        } else if (entry->ino != st.st_ino || entry->size != st.st_size || entry->mtime != st.st_mtime) {
+            monitor_file_changed(upload_state, entry, name, &st);
+        }
+        entry->seen = 1;
     }
     
-    closedir(dir);
+    dir_scan_free(&uploads);
+    
+    // Forget files that were transferred or deleted
+    file_state_sweep(upload_state);
+    attribution_expire();
+    file_state_save(upload_state, config_current()->monitor_state);
 }
 
 /**
@@ -547,49 +1450,86 @@ void monitor_uploads_with_path(const char *upload_dir) {
  */
 void log_message(int priority, const char *format, ...) {
     va_list args;
+    char message[LOG_MESSAGE_MAX];
+    char site[SITE_NAME_MAX + 3] = "";
     
-    // Log to syslog
     va_start(args, format);
-    vsyslog(priority, format, args);
+    vsnprintf(message, sizeof(message), format, args);
     va_end(args);
     
-    // Also log to error log file
-    FILE *log_file = fopen(ERROR_LOG, "a");
-    if (log_file) {
+    // Logging happens on background threads too, so hold a reference
+    const struct config *config = config_get();
+    
+    // A daemon serving several sites tags each message with its site
+    if (config->site[0] != '\0') {
+        snprintf(site, sizeof(site), "[%s] ", config->site);
+    }
+    
+    // Log to syslog
+    syslog(priority, "%s%s", site, message);
+    
+    // Also log to the error log file, as one write so lines logged by
+    // different threads never interleave and no stdio buffer is allocated
+    int log_fd = open(config->error_log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    config_put(config);
+    if (log_fd >= 0) {
         time_t log_time;
-        struct tm *log_tm;
+        struct tm log_tm;
         char timestamp[26];
+        char label[16];
+        char line[LOG_MESSAGE_MAX + sizeof(site) + 64];
         
+        // localtime_r since background threads log as well
         time(&log_time);
-        log_tm = localtime(&log_time);
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", log_tm);
-        
-        fprintf(log_file, "[%s] ", timestamp);
+        localtime_r(&log_time, &log_tm);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &log_tm);
         
         // Add priority label
         switch(priority) {
             case LOG_ERR:
-                fprintf(log_file, "ERROR: ");
+                snprintf(label, sizeof(label), "ERROR");
                 break;
             case LOG_WARNING:
-                fprintf(log_file, "WARNING: ");
+                snprintf(label, sizeof(label), "WARNING");
                 break;
             case LOG_INFO:
-                fprintf(log_file, "INFO: ");
+                snprintf(label, sizeof(label), "INFO");
                 break;
             default:
-                fprintf(log_file, "[%d]: ", priority);
+                snprintf(label, sizeof(label), "[%d]", priority);
                 break;
         }
         
         // Write the actual message
-        va_start(args, format);
-        vfprintf(log_file, format, args);
-        va_end(args);
-        
-        fprintf(log_file, "\n");
-        fclose(log_file);
+        int len = snprintf(line, sizeof(line), "[%s] %s: %s%s\n", timestamp, label, site, message);
+        if (len > 0 && write(log_fd, line, (size_t)len) < 0) {
+            // Nowhere left to report it, syslog already has the message
+        }
+        close(log_fd);
+    }
+}
+
+/**
+ * Format a path into a buffer, as snprintf() does, refusing to truncate
+ * 
+ * @param path Buffer for the path
+ * @param size Size of the buffer
+ * @param format Format string for the path
+ * @param ... Variable arguments for format string
+ * @return 1 on success, 0 if the path does not fit, which is logged
+ */
+int format_path(char *path, size_t size, const char *format, ...) {
+    va_list args;
+    
+    va_start(args, format);
+    int len = vsnprintf(path, size, format, args);
+    va_end(args);
+    
+    if (len < 0 || (size_t)len >= size) {
+        log_message(LOG_ERR, "Path too long: %s...", path);
+        return 0;
     }
+    return 1;
 }
 
 /**
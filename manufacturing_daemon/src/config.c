@@ -0,0 +1,477 @@
+#include "../inc/config.h"
+#include "../inc/company.h"
+#include "../inc/checksum.h"
+#include "../inc/site.h"
+#include "../inc/intake.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <syslog.h>
+
+// How a setting's value is parsed
+enum config_type {
+    CONFIG_PATH,
+    CONFIG_INT,
+    CONFIG_LONG,
+    CONFIG_DURABILITY,
+    CONFIG_LAYOUT,
+    CONFIG_IO_CLASS,
+    CONFIG_TARGET,
+    CONFIG_ATTRIBUTION,
+    CONFIG_VERSIONS,
+    CONFIG_INTAKE
+};
+
+// A setting of the configuration file and where it is stored
+struct config_key {
+    const char *name;
+    enum config_type type;
+    size_t offset;
+    long long min, max;
+};
+
+static const struct config_key config_keys[] = {
+    { "upload_dir", CONFIG_PATH, offsetof(struct config, upload_dir), 0, 0 },
+    { "reporting_dir", CONFIG_PATH, offsetof(struct config, reporting_dir), 0, 0 },
+    { "backup_dir", CONFIG_PATH, offsetof(struct config, backup_dir), 0, 0 },
+    { "log_dir", CONFIG_PATH, offsetof(struct config, log_dir), 0, 0 },
+    { "change_log", CONFIG_PATH, offsetof(struct config, change_log), 0, 0 },
+    { "error_log", CONFIG_PATH, offsetof(struct config, error_log), 0, 0 },
+    { "transfer_journal", CONFIG_PATH, offsetof(struct config, transfer_journal), 0, 0 },
+    { "monitor_state", CONFIG_PATH, offsetof(struct config, monitor_state), 0, 0 },
+    { "departments_file", CONFIG_PATH, offsetof(struct config, departments_file), 0, 0 },
+    { "transfer_hour", CONFIG_INT, offsetof(struct config, transfer_hour), 0, 23 },
+    { "transfer_minute", CONFIG_INT, offsetof(struct config, transfer_minute), 0, 59 },
+    { "missing_report_window_days", CONFIG_INT, offsetof(struct config, missing_report_window_days),
+      1, REPORT_INDEX_MAX_DAYS },
+    { "durability", CONFIG_DURABILITY, offsetof(struct config, durability), 0, 0 },
+    { "reporting_layout", CONFIG_LAYOUT, offsetof(struct config, layout), 0, 0 },
+    { "retention_daily", CONFIG_INT, offsetof(struct config, retention_daily), 0, 10000 },
+    { "retention_weekly", CONFIG_INT, offsetof(struct config, retention_weekly), 0, 10000 },
+    { "retention_monthly", CONFIG_INT, offsetof(struct config, retention_monthly), 0, 10000 },
+    { "io_bytes_per_sec", CONFIG_LONG, offsetof(struct config, io_bytes_per_sec), 1, LLONG_MAX },
+    { "io_ops_per_sec", CONFIG_LONG, offsetof(struct config, io_ops_per_sec), 1, LLONG_MAX },
+    { "io_class", CONFIG_IO_CLASS, offsetof(struct config, io_class), 0, 0 },
+    { "verify_threads", CONFIG_INT, offsetof(struct config, verify_threads), 0, VERIFY_MAX_THREADS },
+    { "replication_target", CONFIG_TARGET, offsetof(struct config, replication_target), 0, 0 },
+    { "replication_log", CONFIG_PATH, offsetof(struct config, replication_log), 0, 0 },
+    { "attribution", CONFIG_ATTRIBUTION, offsetof(struct config, attribution), 0, 0 },
+    { "report_versions", CONFIG_VERSIONS, offsetof(struct config, report_versions), 0, 0 },
+    { "urgent_deadline_sec", CONFIG_INT, offsetof(struct config, urgent_deadline_sec), 1, 86400 },
+    { "standard_deadline_sec", CONFIG_INT, offsetof(struct config, standard_deadline_sec), 1, 86400 },
+    { "transfer_stats", CONFIG_PATH, offsetof(struct config, transfer_stats), 0, 0 },
+    { "sites_file", CONFIG_PATH, offsetof(struct config, sites_file), 0, 0 },
+    { "site_workers", CONFIG_INT, offsetof(struct config, site_workers), 0, SITE_MAX_WORKERS },
+    { "intake", CONFIG_INTAKE, offsetof(struct config, intake), 0, 0 },
+    { "intake_queue_depth", CONFIG_INT, offsetof(struct config, intake_queue_depth), 1, INTAKE_QUEUE_MAX },
+    { "intake_summary", CONFIG_PATH, offsetof(struct config, intake_summary), 0, 0 },
+};
+
+// The published configuration and the path it was read from
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct config *current_config = NULL;
+static struct config default_config;
+static char config_path[PATH_MAX] = CONFIG_FILE;
+
+// Settings a thread works with instead of the published ones, see config_use()
+static pthread_key_t thread_config_key;
+static pthread_once_t thread_config_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fill in the built-in defaults
+ */
+static void config_defaults(struct config *config) {
+    memset(config, 0, sizeof(*config));
+
+    snprintf(config->upload_dir, sizeof(config->upload_dir), "%s", DEFAULT_UPLOAD_DIR);
+    snprintf(config->reporting_dir, sizeof(config->reporting_dir), "%s", DEFAULT_REPORTING_DIR);
+    snprintf(config->backup_dir, sizeof(config->backup_dir), "%s", DEFAULT_BACKUP_DIR);
+    snprintf(config->log_dir, sizeof(config->log_dir), "%s", DEFAULT_LOG_DIR);
+    snprintf(config->change_log, sizeof(config->change_log), "%s", DEFAULT_CHANGE_LOG);
+    snprintf(config->error_log, sizeof(config->error_log), "%s", DEFAULT_ERROR_LOG);
+    snprintf(config->transfer_journal, sizeof(config->transfer_journal), "%s", DEFAULT_TRANSFER_JOURNAL);
+    snprintf(config->monitor_state, sizeof(config->monitor_state), "%s", DEFAULT_MONITOR_STATE);
+    snprintf(config->departments_file, sizeof(config->departments_file), "%s", DEFAULT_DEPARTMENTS_FILE);
+    snprintf(config->latest_backup, sizeof(config->latest_backup), "%s/%s",
+             DEFAULT_BACKUP_DIR, LATEST_BACKUP_NAME);
+    config->transfer_hour = DEFAULT_TRANSFER_HOUR;
+    config->transfer_minute = DEFAULT_TRANSFER_MINUTE;
+    config->missing_report_window_days = DEFAULT_MISSING_REPORT_WINDOW_DAYS;
+    config->durability = DEFAULT_DURABILITY_MODE;
+    config->layout = DEFAULT_REPORTING_LAYOUT;
+    config->retention_daily = DEFAULT_RETENTION_DAILY;
+    config->retention_weekly = DEFAULT_RETENTION_WEEKLY;
+    config->retention_monthly = DEFAULT_RETENTION_MONTHLY;
+    config->io_bytes_per_sec = DEFAULT_IO_BYTES_PER_SEC;
+    config->io_ops_per_sec = DEFAULT_IO_OPS_PER_SEC;
+    config->io_class = DEFAULT_IO_CLASS;
+    config->verify_threads = DEFAULT_VERIFY_THREADS;
+    snprintf(config->replication_target, sizeof(config->replication_target), "%s", DEFAULT_REPLICATION_TARGET);
+    snprintf(config->replication_log, sizeof(config->replication_log), "%s", DEFAULT_REPLICATION_LOG);
+    config->attribution = DEFAULT_ATTRIBUTION_MODE;
+    config->report_versions = DEFAULT_VERSION_STORAGE;
+    config->urgent_deadline_sec = DEFAULT_URGENT_DEADLINE_SEC;
+    config->standard_deadline_sec = DEFAULT_STANDARD_DEADLINE_SEC;
+    snprintf(config->transfer_stats, sizeof(config->transfer_stats), "%s", DEFAULT_TRANSFER_STATS);
+    snprintf(config->sites_file, sizeof(config->sites_file), "%s", DEFAULT_SITES_FILE);
+    config->site_workers = DEFAULT_SITE_WORKERS;
+    config->intake = DEFAULT_INTAKE_MODE;
+    config->intake_queue_depth = DEFAULT_INTAKE_QUEUE_DEPTH;
+    snprintf(config->intake_summary, sizeof(config->intake_summary), "%s", DEFAULT_INTAKE_SUMMARY);
+    config->refs = 1;
+}
+
+/**
+ * Parse the value of one setting into the configuration
+ *
+ * @return 1 on success, 0 if the value is invalid
+ */
+static int config_set(struct config *config, const struct config_key *key, const char *value) {
+    void *field = (char *)config + key->offset;
+    char *end;
+
+    switch (key->type) {
+        case CONFIG_PATH:
+            if (value[0] == '\0' || strlen(value) >= PATH_MAX - NAME_MAX) {
+                return 0;
+            }
+            snprintf(field, PATH_MAX, "%s", value);
+            return 1;
+
+        case CONFIG_INT:
+        case CONFIG_LONG: {
+            errno = 0;
+            long long number = strtoll(value, &end, 10);
+            if (errno != 0 || end == value || *end != '\0' || number < key->min || number > key->max) {
+                return 0;
+            }
+            if (key->type == CONFIG_INT) {
+                *(int *)field = (int)number;
+            } else {
+                *(long long *)field = number;
+            }
+            return 1;
+        }
+
+        case CONFIG_DURABILITY:
+            if (strcmp(value, "none") == 0) {
+                *(enum durability_mode *)field = DURABILITY_NONE;
+            } else if (strcmp(value, "batch") == 0) {
+                *(enum durability_mode *)field = DURABILITY_BATCH;
+            } else if (strcmp(value, "strict") == 0) {
+                *(enum durability_mode *)field = DURABILITY_STRICT;
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case CONFIG_LAYOUT:
+            if (strcmp(value, "flat") == 0) {
+                *(enum reporting_layout *)field = LAYOUT_FLAT;
+            } else if (strcmp(value, "partitioned") == 0) {
+                *(enum reporting_layout *)field = LAYOUT_PARTITIONED;
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case CONFIG_IO_CLASS:
+            if (strcmp(value, "best-effort") == 0) {
+                *(int *)field = IOPRIO_CLASS_BE;
+            } else if (strcmp(value, "idle") == 0) {
+                *(int *)field = IOPRIO_CLASS_IDLE;
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case CONFIG_TARGET:
+            // Empty switches replication off
+            if (value[0] != '\0' && strncmp(value, "dir:", 4) != 0 &&
+                strncmp(value, "unix:", 5) != 0 && strncmp(value, "tcp:", 4) != 0) {
+                return 0;
+            }
+            if (strlen(value) >= PATH_MAX) {
+                return 0;
+            }
+            snprintf(field, PATH_MAX, "%s", value);
+            return 1;
+
+        case CONFIG_ATTRIBUTION:
+            if (strcmp(value, "owner") == 0) {
+                *(enum attribution_mode *)field = ATTRIBUTION_OWNER;
+            } else if (strcmp(value, "fanotify") == 0) {
+                *(enum attribution_mode *)field = ATTRIBUTION_FANOTIFY;
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case CONFIG_VERSIONS:
+            if (strcmp(value, "full") == 0) {
+                *(enum version_storage *)field = VERSIONS_FULL;
+            } else if (strcmp(value, "delta") == 0) {
+                *(enum version_storage *)field = VERSIONS_DELTA;
+            } else {
+                return 0;
+            }
+            return 1;
+
+        case CONFIG_INTAKE:
+            if (strcmp(value, "scheduled") == 0) {
+                *(enum intake_mode *)field = INTAKE_SCHEDULED;
+            } else if (strcmp(value, "streaming") == 0) {
+                *(enum intake_mode *)field = INTAKE_STREAMING;
+            } else {
+                return 0;
+            }
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read a configuration file of "key = value" lines into a new version.
+ * Blank lines and lines starting with '#' are ignored. Any invalid line
+ * rejects the whole file.
+ *
+ * @param missing_ok A missing file gives the defaults instead of failing
+ * @return The new version, or NULL on failure
+ */
+static struct config *config_parse(const char *path, int missing_ok) {
+    struct config *config;
+    char line[PATH_MAX + 64];
+    int line_number = 0;
+    int backup_dir_set = 0;
+    FILE *file;
+
+    config = malloc(sizeof(*config));
+    if (config == NULL) {
+        log_message(LOG_ERR, "Out of memory loading configuration");
+        return NULL;
+    }
+    config_defaults(config);
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT && missing_ok) {
+            log_message(LOG_INFO, "No configuration file %s, using defaults", path);
+            return config;
+        }
+        log_message(LOG_ERR, "Failed to open configuration %s: %s", path, strerror(errno));
+        free(config);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *key = line, *value, *equals, *end;
+        size_t i;
+
+        line_number++;
+        while (isspace((unsigned char)*key)) {
+            key++;
+        }
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+
+        equals = strchr(key, '=');
+        if (equals == NULL) {
+            log_message(LOG_ERR, "%s:%d: expected key = value", path, line_number);
+            fclose(file);
+            free(config);
+            return NULL;
+        }
+
+        // Trim both sides of the '='
+        for (end = equals; end > key && isspace((unsigned char)end[-1]); end--) {
+        }
+        *end = '\0';
+        value = equals + 1;
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+        for (end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); end--) {
+        }
+        *end = '\0';
+
+        for (i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); i++) {
+            if (strcmp(config_keys[i].name, key) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(config_keys) / sizeof(config_keys[0])) {
+            log_message(LOG_WARNING, "%s:%d: ignoring unknown setting %s", path, line_number, key);
+            continue;
+        }
+
+        if (!config_set(config, &config_keys[i], value)) {
+            log_message(LOG_ERR, "%s:%d: invalid value '%s' for %s", path, line_number, value, key);
+            fclose(file);
+            free(config);
+            return NULL;
+        }
+        if (config_keys[i].offset == offsetof(struct config, backup_dir)) {
+            backup_dir_set = 1;
+        }
+    }
+
+    fclose(file);
+
+    if (backup_dir_set &&
+        !format_path(config->latest_backup, sizeof(config->latest_backup), "%s/%s",
+                     config->backup_dir, LATEST_BACKUP_NAME)) {
+        free(config);
+        return NULL;
+    }
+
+    return config;
+}
+
+/**
+ * Read the configuration file and publish it. Threads that already hold
+ * the previous version keep using it until they release it. Only the
+ * first load falls back to the defaults when the file is missing, so a
+ * file moved away during a deploy does not reset a running daemon.
+ *
+ * @return 1 on success, 0 if the file was invalid and nothing changed
+ */
+int config_load(const char *path) {
+    struct config *config, *old;
+
+    pthread_mutex_lock(&config_lock);
+    int first = current_config == NULL;
+    pthread_mutex_unlock(&config_lock);
+
+    config = config_parse(path, first);
+    if (config == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&config_lock);
+    if (path != config_path) {
+        snprintf(config_path, sizeof(config_path), "%s", path);
+    }
+    old = current_config;
+    config->generation = old ? old->generation + 1 : 1;
+    current_config = config;
+    pthread_mutex_unlock(&config_lock);
+
+    // Drop the reference the published slot held
+    if (old != NULL) {
+        config_put(old);
+    }
+
+    return 1;
+}
+
+/**
+ * Read the configuration file again, keeping the current version if the
+ * file is invalid
+ *
+ * @return 1 on success, 0 on failure
+ */
+int config_reload(void) {
+    if (!config_load(config_path)) {
+        log_message(LOG_ERR, "Configuration reload failed, keeping the current settings");
+        return 0;
+    }
+
+    log_message(LOG_INFO, "Configuration reloaded from %s (generation %lu)",
+                config_path, config_current()->generation);
+    return 1;
+}
+
+/**
+ * Get the published configuration, falling back to the built-in defaults
+ * before one was loaded. Must be called with config_lock held.
+ */
+static struct config *config_published(void) {
+    if (current_config == NULL) {
+        config_defaults(&default_config);
+        current_config = &default_config;
+    }
+
+    return current_config;
+}
+
+static void thread_config_init(void) {
+    pthread_key_create(&thread_config_key, NULL);
+}
+
+/**
+ * The settings the calling thread was given with config_use(), if any
+ */
+static struct config *config_override(void) {
+    pthread_once(&thread_config_once, thread_config_init);
+    return pthread_getspecific(thread_config_key);
+}
+
+/**
+ * Make the calling thread work with the given settings instead of the
+ * published ones, e.g. those of the site it is serving, until it is
+ * called again with NULL. The caller keeps the settings alive meanwhile.
+ */
+void config_use(const struct config *config) {
+    pthread_once(&thread_config_once, thread_config_init);
+    pthread_setspecific(thread_config_key, config);
+}
+
+/**
+ * Get the current configuration without taking a reference. Only the main
+ * thread may do this, it is the one that reloads so the version cannot
+ * be freed under it. A site worker gets its site's settings, which are
+ * only replaced while the workers are paused.
+ */
+const struct config *config_current(void) {
+    struct config *config = config_override();
+
+    if (config != NULL) {
+        return config;
+    }
+
+    pthread_mutex_lock(&config_lock);
+    config = config_published();
+    pthread_mutex_unlock(&config_lock);
+
+    return config;
+}
+
+/**
+ * Take a reference to the current configuration. Background threads use
+ * this so a reload cannot free the settings they are working with.
+ * Release it with config_put().
+ */
+const struct config *config_get(void) {
+    struct config *config = config_override();
+
+    pthread_mutex_lock(&config_lock);
+    if (config == NULL) {
+        config = config_published();
+    }
+    config->refs++;
+    pthread_mutex_unlock(&config_lock);
+
+    return config;
+}
+
+/**
+ * Release a reference taken with config_get()
+ */
+void config_put(const struct config *config) {
+    struct config *owned = (struct config *)config;
+    int last;
+
+    pthread_mutex_lock(&config_lock);
+    last = --owned->refs == 0;
+    pthread_mutex_unlock(&config_lock);
+
+    if (last && owned != &default_config) {
+        free(owned);
+    }
+}
@@ -1,6 +1,7 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include "../inc/daemon.h"
 #include "../inc/company.h"
+#include <dirent.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,15 +10,92 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/file.h>
 #include <syslog.h>
 #include <errno.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
 
+// Set by SIGUSR1, the main loop then runs a throttled cycle
+volatile sig_atomic_t cycle_requested = 0;
+
+// Set by SIGHUP, the main loop then reloads the configuration file
+volatile sig_atomic_t reload_requested = 0;
+
+// Set by SIGTERM and SIGINT, the main loop then cleans up and exits
+volatile sig_atomic_t terminate_requested = 0;
+
+// Holds the singleton lock, kept open across daemonize()
+static int lock_fd = -1;
+
 // Function declarations
 void log_message(int level, const char *format, ...);
 void cleanup(void);
 void signal_handler(int sig);
 
+/**
+ * Close every file descriptor except the singleton lock. close_range()
+ * does it in one system call; older kernels get the open descriptors from
+ * /proc/self/fd, so only those are closed instead of every possible one
+ * up to the nofile limit.
+ */
+static void close_all_fds(void) {
+#ifdef SYS_close_range
+    if (lock_fd < 0) {
+        if (syscall(SYS_close_range, 0U, ~0U, 0U) == 0) {
+            return;
+        }
+    } else if ((lock_fd == 0 || syscall(SYS_close_range, 0U, (unsigned int)lock_fd - 1, 0U) == 0) &&
+               syscall(SYS_close_range, (unsigned int)lock_fd + 1, ~0U, 0U) == 0) {
+        return;
+    }
+#endif
+
+    DIR *fd_dir = opendir("/proc/self/fd");
+    if (fd_dir != NULL) {
+        int dir_fd = dirfd(fd_dir);
+        int *fds = NULL;
+        size_t count = 0, capacity = 0;
+        struct dirent *entry;
+        
+        // Collect first, closing while reading would disturb the listing
+        while ((entry = readdir(fd_dir)) != NULL) {
+            int fd = atoi(entry->d_name);
+            if (entry->d_name[0] < '0' || entry->d_name[0] > '9' || fd == dir_fd || fd == lock_fd) {
+                continue;
+            }
+            if (count == capacity) {
+                size_t new_capacity = capacity ? capacity * 2 : 64;
+                int *grown = realloc(fds, new_capacity * sizeof(*grown));
+                if (grown == NULL) {
+                    break;
+                }
+                fds = grown;
+                capacity = new_capacity;
+            }
+            fds[count++] = fd;
+        }
+        closedir(fd_dir);
+        
+        if (entry == NULL) {
+            for (size_t i = 0; i < count; i++) {
+                close(fds[i]);
+            }
+            free(fds);
+            return;
+        }
+        free(fds);
+    }
+    
+    // Last resort without /proc
+    for (int i = sysconf(_SC_OPEN_MAX); i >= 0; i--) {
+        if (i != lock_fd) {
+            close(i);
+        }
+    }
+}
+
 /**
  * Daemonize the process - convert the process into a proper daemon
  * that runs in the background, detached from the terminal
@@ -74,9 +152,7 @@ void daemonize(void) {
     // }
     
     // Close all file descriptors
-    for (int i = sysconf(_SC_OPEN_MAX); i >= 0; i--) {
-        close(i);
-    }
+    close_all_fds();
     
     // Redirect standard file descriptors to /dev/null
     int stdin_fd = open("/dev/null", O_RDWR);
@@ -96,13 +172,17 @@ void signal_handler(int sig) {
     switch (sig) {
         case SIGTERM:
         case SIGINT:
-            log_message(LOG_INFO, "Received termination signal, cleaning up and exiting");
-            cleanup();
-            exit(EXIT_SUCCESS);
+            // Logging and cleanup take locks other threads may hold, so
+            // they are left to the main loop too
+            terminate_requested = 1;
             break;
         case SIGUSR1:
-            log_message(LOG_INFO, "Received user-defined signal, performing backup/transfer");
-            // Perform backup or transfer
+            // Perform backup and transfer from the main loop, not in the handler
+            cycle_requested = 1;
+            break;
+        case SIGHUP:
+            // Reload the configuration from the main loop as well
+            reload_requested = 1;
             break;
         default:
             log_message(LOG_WARNING, "Unhandled signal (%d) received", sig);
@@ -111,8 +191,30 @@ void signal_handler(int sig) {
 }
 
 /**
- * Set up signal handlers for the daemon
+ * Block the signals the daemon handles in the calling thread, saving the
+ * previous mask. Threads started while they are blocked inherit the mask,
+ * so the signals are delivered to the main thread and cut its sleep
+ * short. Every thread the daemon starts, at startup or later, is started
+ * this way.
+ */
+void block_signals(sigset_t *saved) {
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, saved);
+}
+
+/**
+ * Restore the signal mask saved by block_signals()
  */
+void restore_signals(const sigset_t *saved) {
+    pthread_sigmask(SIG_SETMASK, saved, NULL);
+}
+
 /**
  * Set up signal handlers for the daemon
  */
@@ -133,6 +235,11 @@ void setup_signals(void) {
         exit(EXIT_FAILURE);
     }
     
+    if (signal(SIGHUP, signal_handler) == SIG_ERR) {
+        log_message(LOG_ERR, "Failed to set up SIGHUP handler: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    
     log_message(LOG_INFO, "Signal handlers established");
 }
 
@@ -142,7 +249,6 @@ void setup_signals(void) {
  */
 int check_singleton(const char *lock_file) {
     int fd;
-    struct flock fl;
     
     // Open or create the lock file
     fd = open(lock_file, O_RDWR | O_CREAT, 0600);
@@ -151,16 +257,11 @@ int check_singleton(const char *lock_file) {
         return 0;
     }
     
-    // Initialize the flock structure for a write lock
-    fl.l_type = F_WRLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;
-    
-    // Try to lock the file
-    if (fcntl(fd, F_SETLK, &fl) < 0) {
+    // Try to lock the file. An flock() lock belongs to the open file, so
+    // unlike a record lock it survives the forks in daemonize()
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
         // Could not acquire lock, another instance is running
-        if (errno == EACCES || errno == EAGAIN) {
+        if (errno == EWOULDBLOCK) {
             close(fd);
             return 0;
         }
@@ -173,6 +274,7 @@ int check_singleton(const char *lock_file) {
     
     // Successfully acquired the lock, keep the file open
     // Note: We intentionally don't close fd since it would release the lock
+    lock_fd = fd;
     
     return 1;
 }
@@ -0,0 +1,315 @@
+#include "../inc/delta.h"
+#include "../inc/checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Multiplier of the rolling hash over DELTA_BLOCK_SIZE bytes
+#define DELTA_HASH_PRIME 1000003ULL
+
+// Most index slots one lookup probes, which bounds the cost of a target
+// position whatever the base looks like
+#define DELTA_MAX_PROBES 8
+
+// Header: magic, base CRC32C and size, target CRC32C and size
+#define DELTA_HEADER_SIZE (DELTA_MAGIC_LEN + 4 + 8 + 4 + 8)
+
+/**
+ * Make room for len more bytes
+ *
+ * @return 1 on success, 0 if out of memory
+ */
+static int buffer_reserve(struct delta_buffer *buffer, size_t len) {
+    if (buffer->size + len <= buffer->capacity) {
+        return 1;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->size + len) {
+        capacity *= 2;
+    }
+    unsigned char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+        return 0;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+    return 1;
+}
+
+static int buffer_append(struct delta_buffer *buffer, const void *data, size_t len) {
+    if (!buffer_reserve(buffer, len)) {
+        return 0;
+    }
+    memcpy(buffer->data + buffer->size, data, len);
+    buffer->size += len;
+    return 1;
+}
+
+/**
+ * Append an unsigned number, seven bits per byte
+ */
+static int buffer_append_varint(struct delta_buffer *buffer, uint64_t value) {
+    unsigned char bytes[10];
+    size_t len = 0;
+
+    do {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            bytes[len] |= 0x80;
+        }
+        len++;
+    } while (value);
+
+    return buffer_append(buffer, bytes, len);
+}
+
+/**
+ * Append a fixed width little-endian number
+ */
+static int buffer_append_le(struct delta_buffer *buffer, uint64_t value, size_t width) {
+    unsigned char bytes[8];
+
+    for (size_t i = 0; i < width; i++) {
+        bytes[i] = (value >> (8 * i)) & 0xff;
+    }
+    return buffer_append(buffer, bytes, width);
+}
+
+static int buffer_append_op(struct delta_buffer *buffer, unsigned char op) {
+    return buffer_append(buffer, &op, 1);
+}
+
+static uint64_t read_le(const unsigned char *data, size_t width) {
+    uint64_t value = 0;
+
+    for (size_t i = 0; i < width; i++) {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+/**
+ * Read a varint, advancing *pos
+ *
+ * @return 1 on success, 0 if it runs past the end
+ */
+static int read_varint(const unsigned char *data, size_t size, size_t *pos, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *pos < size; shift += 7) {
+        unsigned char byte = data[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int emit_add(struct delta_buffer *out, const unsigned char *data, size_t len) {
+    if (len == 0) {
+        return 1;
+    }
+    return buffer_append_op(out, DELTA_OP_ADD) && buffer_append_varint(out, len) &&
+           buffer_append(out, data, len);
+}
+
+/**
+ * Rolling hash of DELTA_BLOCK_SIZE bytes
+ */
+static uint64_t block_hash(const unsigned char *data) {
+    uint64_t hash = 0;
+
+    for (size_t i = 0; i < DELTA_BLOCK_SIZE; i++) {
+        hash = hash * DELTA_HASH_PRIME + data[i];
+    }
+    return hash;
+}
+
+/**
+ * Encode target as a delta against base. The first occurrence of every
+ * distinct aligned block of the base is indexed by its hash, then a
+ * rolling hash slides over the target one byte at a time; the first
+ * verified hit within DELTA_MAX_PROBES slots is extended in both
+ * directions into a common run, which becomes a copy. Bytes not covered
+ * by a copy are added literally. Repetitive reports would otherwise pile
+ * identical blocks into one probe cluster and make this quadratic.
+ *
+ * @return 1 on success, 0 if out of memory
+ */
+int delta_encode(const unsigned char *base, size_t base_size,
+                 const unsigned char *target, size_t target_size, struct delta_buffer *out) {
+    size_t blocks = base_size / DELTA_BLOCK_SIZE;
+    size_t slots = 64;
+    uint32_t *index;
+    uint64_t top_power = 1;
+    size_t literal_start = 0;
+    size_t pos = 0;
+    int success = 1;
+
+    memset(out, 0, sizeof(*out));
+    if (!buffer_append(out, DELTA_MAGIC, DELTA_MAGIC_LEN) ||
+        !buffer_append_le(out, crc32c_update(0, base, base_size), 4) ||
+        !buffer_append_le(out, base_size, 8) ||
+        !buffer_append_le(out, crc32c_update(0, target, target_size), 4) ||
+        !buffer_append_le(out, target_size, 8)) {
+        delta_buffer_free(out);
+        return 0;
+    }
+
+    // Open addressing, each slot holds a block number plus one
+    while (slots < blocks * 2) {
+        slots *= 2;
+    }
+    index = calloc(slots, sizeof(*index));
+    if (index == NULL) {
+        delta_buffer_free(out);
+        return 0;
+    }
+    for (size_t b = 0; b < blocks; b++) {
+        const unsigned char *block = base + b * DELTA_BLOCK_SIZE;
+        size_t slot = block_hash(block) & (slots - 1);
+        int duplicate = 0;
+        while (index[slot] != 0 && !duplicate) {
+            duplicate = memcmp(base + (size_t)(index[slot] - 1) * DELTA_BLOCK_SIZE, block,
+                               DELTA_BLOCK_SIZE) == 0;
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (!duplicate) {
+            index[slot] = (uint32_t)(b + 1);
+        }
+    }
+
+    for (size_t i = 1; i < DELTA_BLOCK_SIZE; i++) {
+        top_power *= DELTA_HASH_PRIME;
+    }
+
+    uint64_t hash = target_size >= DELTA_BLOCK_SIZE ? block_hash(target) : 0;
+    while (blocks > 0 && pos + DELTA_BLOCK_SIZE <= target_size) {
+        size_t match_offset = 0, match_len = 0;
+
+        size_t slot = hash & (slots - 1);
+        for (int probe = 0; probe < DELTA_MAX_PROBES && index[slot] != 0; probe++) {
+            size_t offset = (size_t)(index[slot] - 1) * DELTA_BLOCK_SIZE;
+            slot = (slot + 1) & (slots - 1);
+            if (memcmp(base + offset, target + pos, DELTA_BLOCK_SIZE) != 0) {
+                continue;
+            }
+            match_offset = offset;
+            match_len = DELTA_BLOCK_SIZE;
+            while (offset + match_len < base_size && pos + match_len < target_size &&
+                   base[offset + match_len] == target[pos + match_len]) {
+                match_len++;
+            }
+            break;
+        }
+
+        if (match_len == 0) {
+            // Slide the window one byte
+            if (pos + DELTA_BLOCK_SIZE < target_size) {
+                hash = (hash - target[pos] * top_power) * DELTA_HASH_PRIME + target[pos + DELTA_BLOCK_SIZE];
+            }
+            pos++;
+            continue;
+        }
+
+        // Grow the match backwards into bytes not yet emitted
+        while (match_offset > 0 && pos > literal_start &&
+               base[match_offset - 1] == target[pos - 1]) {
+            match_offset--;
+            pos--;
+            match_len++;
+        }
+
+        if (!emit_add(out, target + literal_start, pos - literal_start) ||
+            !buffer_append_op(out, DELTA_OP_COPY) || !buffer_append_varint(out, match_offset) ||
+            !buffer_append_varint(out, match_len)) {
+            success = 0;
+            break;
+        }
+
+        pos += match_len;
+        literal_start = pos;
+        if (pos + DELTA_BLOCK_SIZE <= target_size) {
+            hash = block_hash(target + pos);
+        }
+    }
+    free(index);
+
+    if (!success || !emit_add(out, target + literal_start, target_size - literal_start) ||
+        !buffer_append_op(out, DELTA_OP_END)) {
+        delta_buffer_free(out);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Rebuild the target from its base and a delta. The base and the result
+ * are both checked against the CRC32C recorded when the delta was made.
+ *
+ * @return 1 on success, 0 if the delta is corrupt or does not belong to base
+ */
+int delta_apply(const unsigned char *base, size_t base_size,
+                const unsigned char *delta, size_t delta_size, struct delta_buffer *out) {
+    size_t pos = DELTA_HEADER_SIZE;
+
+    memset(out, 0, sizeof(*out));
+    if (delta_size < DELTA_HEADER_SIZE || memcmp(delta, DELTA_MAGIC, DELTA_MAGIC_LEN) != 0) {
+        return 0;
+    }
+
+    uint32_t base_crc = (uint32_t)read_le(delta + 4, 4);
+    uint64_t expected_base_size = read_le(delta + 8, 8);
+    uint32_t target_crc = (uint32_t)read_le(delta + 16, 4);
+    uint64_t target_size = read_le(delta + 20, 8);
+
+    if (expected_base_size != base_size || crc32c_update(0, base, base_size) != base_crc ||
+        !buffer_reserve(out, target_size ? target_size : 1)) {
+        delta_buffer_free(out);
+        return 0;
+    }
+
+    while (pos < delta_size) {
+        unsigned char op = delta[pos++];
+        uint64_t offset, len;
+
+        if (op == DELTA_OP_END) {
+            break;
+        }
+        if (op == DELTA_OP_COPY) {
+            if (!read_varint(delta, delta_size, &pos, &offset) ||
+                !read_varint(delta, delta_size, &pos, &len) ||
+                offset > base_size || len > base_size - offset ||
+                !buffer_append(out, base + offset, len)) {
+                delta_buffer_free(out);
+                return 0;
+            }
+        } else if (op == DELTA_OP_ADD) {
+            if (!read_varint(delta, delta_size, &pos, &len) || len > delta_size - pos ||
+                !buffer_append(out, delta + pos, len)) {
+                delta_buffer_free(out);
+                return 0;
+            }
+            pos += len;
+        } else {
+            delta_buffer_free(out);
+            return 0;
+        }
+    }
+
+    if (out->size != target_size || crc32c_update(0, out->data, out->size) != target_crc) {
+        delta_buffer_free(out);
+        return 0;
+    }
+
+    return 1;
+}
+
+void delta_buffer_free(struct delta_buffer *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
@@ -0,0 +1,188 @@
+#include "../inc/delta.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Longest the repetitive report may take to encode, it took over 30 s
+// when identical blocks all landed in one probe cluster
+#define DELTA_TEST_TIME_LIMIT_SEC 2.0
+
+// Largest delta allowed for a report with one byte changed
+#define DELTA_TEST_ONE_EDIT_MAX 1024
+
+// Random edit rounds and the size of the report they are made to
+#define DELTA_TEST_ROUNDS 200
+#define DELTA_TEST_RANDOM_SIZE (64 * 1024)
+
+static int failures = 0;
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Encode target against base, apply the delta and compare the result
+ * byte for byte
+ *
+ * @param delta_size Receives the size of the delta, may be NULL
+ * @return 1 if the target came back unchanged, 0 otherwise
+ */
+static int roundtrip(const char *name, const unsigned char *base, size_t base_size,
+                     const unsigned char *target, size_t target_size, size_t *delta_size) {
+    struct delta_buffer delta, rebuilt;
+    int ok;
+
+    if (!delta_encode(base, base_size, target, target_size, &delta)) {
+        printf("FAIL %s: encode\n", name);
+        failures++;
+        return 0;
+    }
+    if (!delta_apply(base, base_size, delta.data, delta.size, &rebuilt)) {
+        printf("FAIL %s: apply\n", name);
+        delta_buffer_free(&delta);
+        failures++;
+        return 0;
+    }
+
+    ok = rebuilt.size == target_size &&
+         (target_size == 0 || memcmp(rebuilt.data, target, target_size) == 0);
+    if (!ok) {
+        printf("FAIL %s: rebuilt %zu bytes differ from the %zu bytes encoded\n",
+               name, rebuilt.size, target_size);
+        failures++;
+    }
+    if (delta_size != NULL) {
+        *delta_size = delta.size;
+    }
+
+    delta_buffer_free(&rebuilt);
+    delta_buffer_free(&delta);
+    return ok;
+}
+
+/**
+ * Empty inputs and inputs shorter than one block
+ */
+static void test_short_inputs(void) {
+    const unsigned char *text = (const unsigned char *)"<r>short</r>\n";
+    size_t len = strlen((const char *)text);
+
+    roundtrip("empty to empty", text, 0, text, 0, NULL);
+    roundtrip("empty to short", text, 0, text, len, NULL);
+    roundtrip("short to empty", text, len, text, 0, NULL);
+    roundtrip("short to same", text, len, text, len, NULL);
+    roundtrip("short to shorter", text, len, text + 3, len - 5, NULL);
+    printf("ok short inputs\n");
+}
+
+/**
+ * Random reports with random inserts, deletes and overwrites
+ */
+static void test_random_edits(void) {
+    unsigned char *base = malloc(DELTA_TEST_RANDOM_SIZE);
+    unsigned char *target = malloc(2 * DELTA_TEST_RANDOM_SIZE);
+
+    srand(12345);
+    for (int round = 0; round < DELTA_TEST_ROUNDS; round++) {
+        size_t base_size = (size_t)rand() % DELTA_TEST_RANDOM_SIZE;
+        size_t target_size = 0;
+        char name[64];
+
+        // Small alphabet, so blocks recur as they do in real reports
+        for (size_t i = 0; i < base_size; i++) {
+            base[i] = (unsigned char)("<>/abcdefgh0123\n"[rand() % 16]);
+        }
+
+        for (size_t pos = 0; pos < base_size;) {
+            size_t run = 1 + (size_t)rand() % 512;
+            if (run > base_size - pos) {
+                run = base_size - pos;
+            }
+            switch (rand() % 4) {
+                case 0:     // Delete the run
+                    break;
+                case 1:     // Insert random bytes before it
+                    for (size_t i = 0; i < run && target_size < DELTA_TEST_RANDOM_SIZE; i++) {
+                        target[target_size++] = (unsigned char)rand();
+                    }
+                    // Fall through
+                default:    // Keep it, now and then with a byte changed
+                    memcpy(target + target_size, base + pos, run);
+                    if (rand() % 3 == 0) {
+                        target[target_size + (size_t)rand() % run] ^= 0x5a;
+                    }
+                    target_size += run;
+                    break;
+            }
+            pos += run;
+        }
+
+        snprintf(name, sizeof(name), "random edits round %d", round);
+        if (!roundtrip(name, base, base_size, target, target_size, NULL)) {
+            break;
+        }
+    }
+    printf("ok random edits\n");
+
+    free(target);
+    free(base);
+}
+
+/**
+ * A large report of identical rows with one byte changed must encode in
+ * linear time
+ */
+static void test_repetitive_input(void) {
+    const char *row = "<row><qty>0</qty></row>\n";
+    size_t row_len = strlen(row);
+    size_t size = 768 * 1024;
+    unsigned char *base = malloc(size);
+    unsigned char *target = malloc(size);
+
+    for (size_t i = 0; i < size; i++) {
+        base[i] = (unsigned char)row[i % row_len];
+    }
+    memcpy(target, base, size);
+    target[size / 2 + 10] = '7';
+
+    size_t delta_size = 0;
+    double start = now_sec();
+    int ok = roundtrip("repetitive rows", base, size, target, size, &delta_size);
+    double elapsed = now_sec() - start;
+
+    if (ok && delta_size > DELTA_TEST_ONE_EDIT_MAX) {
+        printf("FAIL repetitive rows: %zu byte delta for one changed byte\n", delta_size);
+        failures++;
+    } else if (elapsed > DELTA_TEST_TIME_LIMIT_SEC) {
+        printf("FAIL repetitive rows: %.2f s to encode %zu KiB, limit %.1f s\n",
+               elapsed, size / 1024, DELTA_TEST_TIME_LIMIT_SEC);
+        failures++;
+    } else if (ok) {
+        printf("ok repetitive rows (%zu KiB in %.3f s, %zu byte delta)\n",
+               size / 1024, elapsed, delta_size);
+    }
+
+    free(target);
+    free(base);
+}
+
+/**
+ * Check that the delta codec rebuilds exactly what it encoded
+ *
+ * Usage: delta_test
+ */
+int main(void) {
+    test_short_inputs();
+    test_random_edits();
+    test_repetitive_input();
+
+    if (failures > 0) {
+        printf("%d delta checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+#include "../inc/departments.h"
+#include "../inc/company.h"
+#include "../inc/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+
+/**
+ * FNV-1a hash of a department name
+ */
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Names of the transfer classes as written in the registry file
+static const char *transfer_class_names[TRANSFER_CLASS_COUNT] = { "urgent", "standard", "bulk" };
+
+/**
+ * Add a department to the registry, ignoring duplicates
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int departments_add(struct department_registry *registry, const char *name,
+                           enum transfer_class class, size_t *capacity) {
+    if (department_lookup(registry, name, strlen(name)) >= 0) {
+        return 1;
+    }
+
+    if (registry->count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        char **grown = realloc(registry->names, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return 0;
+        }
+        registry->names = grown;
+        enum transfer_class *grown_classes = realloc(registry->classes, new_capacity * sizeof(*grown_classes));
+        if (grown_classes == NULL) {
+            return 0;
+        }
+        registry->classes = grown_classes;
+        *capacity = new_capacity;
+    }
+
+    registry->names[registry->count] = strdup(name);
+    if (registry->names[registry->count] == NULL) {
+        return 0;
+    }
+    registry->classes[registry->count] = class;
+    registry->count++;
+
+    // Rebuild the hash table so it stays at most half full
+    if (registry->count * 2 > registry->slot_count) {
+        size_t slot_count = registry->slot_count ? registry->slot_count * 2 : 32;
+        int *slots = malloc(slot_count * sizeof(*slots));
+        if (slots == NULL) {
+            return 0;
+        }
+        free(registry->slots);
+        registry->slots = slots;
+        registry->slot_count = slot_count;
+        for (size_t i = 0; i < slot_count; i++) {
+            slots[i] = -1;
+        }
+        for (size_t i = 0; i < registry->count; i++) {
+            size_t slot = hash_name(registry->names[i], strlen(registry->names[i])) & (slot_count - 1);
+            while (slots[slot] >= 0) {
+                slot = (slot + 1) & (slot_count - 1);
+            }
+            slots[slot] = (int)i;
+        }
+    } else {
+        const char *added = registry->names[registry->count - 1];
+        size_t slot = hash_name(added, strlen(added)) & (registry->slot_count - 1);
+        while (registry->slots[slot] >= 0) {
+            slot = (slot + 1) & (registry->slot_count - 1);
+        }
+        registry->slots[slot] = (int)(registry->count - 1);
+    }
+
+    return 1;
+}
+
+/**
+ * Load the department registry from a file with one department name per
+ * line, optionally followed by its transfer class (urgent, standard or
+ * bulk). Blank lines and lines starting with '#' are ignored. If the file
+ * does not exist the default departments are used.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int departments_load(struct department_registry *registry, const char *path) {
+    static const char *defaults[] = DEFAULT_DEPARTMENTS;
+    size_t capacity = 0;
+    char line[256];
+    FILE *file;
+
+    memset(registry, 0, sizeof(*registry));
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            log_message(LOG_WARNING, "Failed to open department registry %s: %s",
+                        path, strerror(errno));
+        }
+        for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+            if (!departments_add(registry, defaults[i], DEFAULT_TRANSFER_CLASS, &capacity)) {
+                departments_free(registry);
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *name = line;
+        size_t len;
+
+        while (isspace((unsigned char)*name)) {
+            name++;
+        }
+        len = strlen(name);
+        while (len > 0 && isspace((unsigned char)name[len - 1])) {
+            name[--len] = '\0';
+        }
+
+        if (len == 0 || name[0] == '#') {
+            continue;
+        }
+
+        // The class follows the name after whitespace
+        enum transfer_class class = DEFAULT_TRANSFER_CLASS;
+        char *class_name = name + strcspn(name, " \t");
+        if (*class_name != '\0') {
+            *class_name++ = '\0';
+            class_name += strspn(class_name, " \t");
+            int c = 0;
+            while (c < TRANSFER_CLASS_COUNT && strcmp(class_name, transfer_class_names[c]) != 0) {
+                c++;
+            }
+            if (c == TRANSFER_CLASS_COUNT) {
+                log_message(LOG_WARNING, "Unknown transfer class for %s in %s: %s, using %s",
+                            name, path, class_name, transfer_class_names[DEFAULT_TRANSFER_CLASS]);
+            } else {
+                class = (enum transfer_class)c;
+            }
+        }
+
+        if (strlen(name) >= DEPARTMENT_NAME_MAX || strchr(name, '/') != NULL) {
+            log_message(LOG_WARNING, "Ignoring invalid department name in %s: %s", path, name);
+            continue;
+        }
+
+        if (!departments_add(registry, name, class, &capacity)) {
+            log_message(LOG_ERR, "Out of memory loading department registry");
+            fclose(file);
+            departments_free(registry);
+            return 0;
+        }
+    }
+
+    fclose(file);
+
+    log_message(LOG_INFO, "Loaded %zu departments from %s", registry->count, path);
+    return 1;
+}
+
+/**
+ * Release the memory held by a department registry
+ */
+void departments_free(struct department_registry *registry) {
+    for (size_t i = 0; i < registry->count; i++) {
+        free(registry->names[i]);
+    }
+    free(registry->names);
+    free(registry->classes);
+    free(registry->slots);
+    memset(registry, 0, sizeof(*registry));
+}
+
+/**
+ * Get the daemon's department registry, loading it on first use and
+ * again after the configuration was reloaded
+ */
+const struct department_registry *departments_get(void) {
+    static struct department_registry registry;
+    static unsigned long loaded_generation = 0;
+    const struct config *config = config_current();
+
+    // Tried once per configuration version, site workers only read it
+    if (loaded_generation != config->generation) {
+        struct department_registry fresh;
+        if (departments_load(&fresh, config->departments_file)) {
+            departments_free(&registry);
+            registry = fresh;
+        }
+        loaded_generation = config->generation;
+    }
+
+    return &registry;
+}
+
+/**
+ * Find a department by name
+ *
+ * @return The department's index, or -1 if it is not registered
+ */
+int department_lookup(const struct department_registry *registry, const char *name, size_t len) {
+    if (registry->slot_count == 0) {
+        return -1;
+    }
+
+    size_t slot = hash_name(name, len) & (registry->slot_count - 1);
+    while (registry->slots[slot] >= 0) {
+        const char *candidate = registry->names[registry->slots[slot]];
+        if (strncmp(candidate, name, len) == 0 && candidate[len] == '\0') {
+            return registry->slots[slot];
+        }
+        slot = (slot + 1) & (registry->slot_count - 1);
+    }
+
+    return -1;
+}
+
+/**
+ * Find the transfer class of the department a report belongs to
+ *
+ * @return The class, DEFAULT_TRANSFER_CLASS for unknown departments
+ */
+enum transfer_class department_class(const struct department_registry *registry, const char *name, size_t len) {
+    size_t department_len;
+    long day_number;
+    int index;
+
+    if (!parse_report_name(name, len, &department_len, &day_number) ||
+        (index = department_lookup(registry, name, department_len)) < 0) {
+        return DEFAULT_TRANSFER_CLASS;
+    }
+    return registry->classes[index];
+}
+
+const char *transfer_class_name(enum transfer_class class) {
+    return class < TRANSFER_CLASS_COUNT ? transfer_class_names[class] : "unknown";
+}
+
+/**
+ * Convert a calendar date to a day number (days since 1970-01-01)
+ */
+long date_to_day(int year, int month, int day) {
+    // Count years from March so the leap day is the last day of the year
+    year -= month <= 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long year_of_era = year - era * 400;
+    long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return era * 146097 + day_of_era - 719468;
+}
+
+/**
+ * Format a day number as YYYY-MM-DD
+ */
+void day_to_date(long day_number, char *buffer, size_t size) {
+    day_number += 719468;
+    long era = (day_number >= 0 ? day_number : day_number - 146096) / 146097;
+    long day_of_era = day_number - era * 146097;
+    long year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    long day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    long month_index = (5 * day_of_year + 2) / 153;
+    int day = (int)(day_of_year - (153 * month_index + 2) / 5 + 1);
+    int month = (int)(month_index < 10 ? month_index + 3 : month_index - 9);
+    long year = year_of_era + era * 400 + (month <= 2);
+
+    snprintf(buffer, size, "%04ld-%02d-%02d", year, month, day);
+}
+
+/**
+ * Parse a two or four digit decimal field
+ *
+ * @return The value, or -1 if a character is not a digit
+ */
+static int parse_digits(const char *str, int count) {
+    int value = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (str[i] - '0');
+    }
+
+    return value;
+}
+
+/**
+ * Split a report name of the form department_YYYY-MM-DD[...].xml into
+ * the length of its department prefix and the day number of its date.
+ * Department names may themselves contain underscores.
+ *
+ * @return 1 if the name follows the convention, 0 otherwise
+ */
+int parse_report_name(const char *name, size_t len, size_t *department_len, long *day_number) {
+    for (size_t pos = 1; pos + 11 <= len; pos++) {
+        const char *date = name + pos + 1;
+
+        if (name[pos] != '_' || date[4] != '-' || date[7] != '-') {
+            continue;
+        }
+        if (pos + 11 < len && date[10] != '.' && date[10] != '_') {
+            continue;
+        }
+
+        int year = parse_digits(date, 4);
+        int month = parse_digits(date + 5, 2);
+        int day = parse_digits(date + 8, 2);
+        if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31) {
+            continue;
+        }
+
+        *department_len = pos;
+        *day_number = date_to_day(year, month, day);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Prepare an empty index covering the window_days days up to and
+ * including window_end
+ *
+ * @return 1 on success, 0 on failure
+ */
+int report_index_init(struct report_index *index, const struct department_registry *registry,
+                      long window_end, int window_days) {
+    if (window_days < 1) {
+        window_days = 1;
+    }
+    if (window_days > REPORT_INDEX_MAX_DAYS) {
+        window_days = REPORT_INDEX_MAX_DAYS;
+    }
+
+    index->registry = registry;
+    index->window_end = window_end;
+    index->window_days = window_days;
+    index->days = calloc(registry->count ? registry->count : 1, sizeof(*index->days));
+
+    return index->days != NULL;
+}
+
+/**
+ * Mark a single report in the index
+ */
+void report_index_add_name(struct report_index *index, const char *name, size_t len) {
+    size_t department_len;
+    long day_number;
+
+    if (!parse_report_name(name, len, &department_len, &day_number)) {
+        return;
+    }
+
+    long age = index->window_end - day_number;
+    if (age < 0 || age >= index->window_days) {
+        return;
+    }
+
+    int department = department_lookup(index->registry, name, department_len);
+    if (department >= 0) {
+        index->days[department] |= (uint64_t)1 << age;
+    }
+}
+
+/**
+ * Mark every report found by a directory scan in the index
+ */
+void report_index_add_scan(struct report_index *index, const struct dir_scan *scan) {
+    for (size_t i = 0; i < scan->count; i++) {
+        report_index_add_name(index, scan->entries[i].name, scan->entries[i].name_len);
+    }
+}
+
+/**
+ * Release the memory held by a report index
+ */
+void report_index_free(struct report_index *index) {
+    free(index->days);
+    index->days = NULL;
+}
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "../inc/dir_scan.h"
+#include "../inc/company.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Record layout returned by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * Check whether a name ends with the given suffix
+ *
+ * @return 1 if it does, 0 otherwise
+ */
+int has_suffix(const char *name, size_t name_len, const char *suffix) {
+    size_t suffix_len = strlen(suffix);
+
+    return name_len >= suffix_len &&
+           memcmp(name + name_len - suffix_len, suffix, suffix_len) == 0;
+}
+
+/**
+ * Read all regular files in a directory with getdents64. The d_type of
+ * each record is used to skip directories and other special files, so
+ * only filesystems that do not report it pay for an fstatat.
+ *
+ * @param suffix Only keep names ending in this suffix, NULL for all
+ * @return 1 on success, 0 on failure
+ */
+int dir_scan(struct dir_scan *scan, const char *path, const char *suffix) {
+    return dir_scan_type(scan, path, suffix, DT_REG);
+}
+
+/**
+ * Read the entries of one type (DT_REG, DT_DIR, ...) in a directory.
+ * "." and ".." are never returned.
+ *
+ * @param suffix Only keep names ending in this suffix, NULL for all
+ * @return 1 on success, 0 on failure
+ */
+int dir_scan_type(struct dir_scan *scan, const char *path, const char *suffix, unsigned char type_wanted) {
+    struct scan_entry *entries = NULL;
+    size_t capacity = 0;
+    char *buffer;
+    int fd;
+    int success = 1;
+
+    scan->path = path;
+    scan->entries = NULL;
+    scan->count = 0;
+    arena_init(&scan->arena, 0);
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_message(LOG_ERR, "Failed to open directory %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    buffer = malloc(DIR_SCAN_BUFFER_SIZE);
+    if (buffer == NULL) {
+        log_message(LOG_ERR, "Out of memory scanning %s", path);
+        close(fd);
+        return 0;
+    }
+
+    for (;;) {
+        long nread = syscall(SYS_getdents64, fd, buffer, DIR_SCAN_BUFFER_SIZE);
+        if (nread < 0) {
+            log_message(LOG_ERR, "Failed to read directory %s: %s", path, strerror(errno));
+            success = 0;
+            break;
+        }
+        if (nread == 0) {
+            break;
+        }
+
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *record = (struct linux_dirent64 *)(buffer + pos);
+            const char *name = record->d_name;
+            size_t name_len = strlen(name);
+            unsigned char type = record->d_type;
+
+            pos += record->d_reclen;
+
+            // Cheap checks first
+            if (suffix != NULL && !has_suffix(name, name_len, suffix)) {
+                continue;
+            }
+            if (name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.'))) {
+                continue;
+            }
+
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                    continue;
+                }
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+            }
+            if (type != type_wanted) {
+                continue;
+            }
+
+            if (scan->count == capacity) {
+                size_t new_capacity = capacity ? capacity * 2 : 256;
+                struct scan_entry *grown = realloc(entries, new_capacity * sizeof(*entries));
+                if (grown == NULL) {
+                    log_message(LOG_ERR, "Out of memory scanning %s", path);
+                    success = 0;
+                    break;
+                }
+                entries = grown;
+                capacity = new_capacity;
+            }
+
+            struct scan_entry *entry = &entries[scan->count];
+            entry->name = arena_strndup(&scan->arena, name, name_len);
+            entry->name_len = name_len;
+            entry->ino = record->d_ino;
+            if (entry->name == NULL) {
+                log_message(LOG_ERR, "Out of memory scanning %s", path);
+                success = 0;
+                break;
+            }
+            scan->count++;
+        }
+
+        if (!success) {
+            break;
+        }
+    }
+
+    free(buffer);
+    close(fd);
+
+    // Move the entries into the arena as one exactly sized array
+    if (success && scan->count > 0) {
+        scan->entries = arena_alloc(&scan->arena, scan->count * sizeof(*entries));
+        if (scan->entries == NULL) {
+            log_message(LOG_ERR, "Out of memory scanning %s", path);
+            success = 0;
+        } else {
+            memcpy(scan->entries, entries, scan->count * sizeof(*entries));
+        }
+    }
+    free(entries);
+
+    if (!success) {
+        dir_scan_free(scan);
+    }
+
+    return success;
+}
+
+/**
+ * Release the entries of a directory scan
+ */
+void dir_scan_free(struct dir_scan *scan) {
+    arena_free(&scan->arena);
+    scan->entries = NULL;
+    scan->count = 0;
+}
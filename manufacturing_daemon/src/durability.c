@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include "../inc/durability.h"
+#include "../inc/company.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+/**
+ * Nanoseconds on the monotonic clock, used to measure time spent syncing
+ */
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Open a directory and fsync it so renames and unlinks inside it persist
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int fsync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    int success = 1;
+
+    if (fd < 0) {
+        log_message(LOG_ERR, "Failed to open directory %s for sync: %s", dir, strerror(errno));
+        return 0;
+    }
+
+    if (fsync(fd) < 0) {
+        log_message(LOG_ERR, "Failed to sync directory %s: %s", dir, strerror(errno));
+        success = 0;
+    }
+
+    close(fd);
+    return success;
+}
+
+/**
+ * Copy the directory part of a path into dir
+ */
+static void parent_dir(const char *path, char *dir, size_t size) {
+    char *slash;
+
+    snprintf(dir, size, "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        snprintf(dir, size, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+}
+
+/**
+ * Get the configured durability mode
+ */
+enum durability_mode durability_get_mode(void) {
+    return config_current()->durability;
+}
+
+/**
+ * Get the printable name of a durability mode
+ */
+const char *durability_mode_name(enum durability_mode mode) {
+    switch (mode) {
+        case DURABILITY_NONE:
+            return "none";
+        case DURABILITY_BATCH:
+            return "batch";
+        case DURABILITY_STRICT:
+            return "strict";
+    }
+    return "unknown";
+}
+
+/**
+ * Start a new batch of writes using the configured durability mode
+ */
+void durability_begin(struct durability_batch *batch) {
+    memset(batch, 0, sizeof(*batch));
+    batch->mode = durability_get_mode();
+}
+
+/**
+ * Called once a file's contents have been fully written, before the
+ * descriptor is closed. In batch mode this only starts writeback so the
+ * data is already on its way to disk by the time the cycle commits.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int durability_file_written(struct durability_batch *batch, int fd, const char *path) {
+    long long start;
+
+    batch->files++;
+
+    switch (batch->mode) {
+        case DURABILITY_NONE:
+            break;
+        case DURABILITY_BATCH:
+            // Not supported everywhere (e.g. some network filesystems), the
+            // syncfs at commit time still covers the file
+            sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+            break;
+        case DURABILITY_STRICT:
+            start = monotonic_ns();
+            if (fdatasync(fd) < 0) {
+                log_message(LOG_ERR, "Failed to sync file %s: %s", path, strerror(errno));
+                return 0;
+            }
+            batch->sync_ns += monotonic_ns() - start;
+            break;
+    }
+
+    return 1;
+}
+
+/**
+ * Record that entries in a directory were created, renamed or removed
+ *
+ * @return 1 on success, 0 on failure
+ */
+int durability_dir_changed(struct durability_batch *batch, const char *dir) {
+    struct stat st;
+    long long start;
+    int success;
+
+    switch (batch->mode) {
+        case DURABILITY_NONE:
+            return 1;
+        case DURABILITY_STRICT:
+            start = monotonic_ns();
+            success = fsync_dir(dir);
+            batch->sync_ns += monotonic_ns() - start;
+            return success;
+        case DURABILITY_BATCH:
+            break;
+    }
+
+    for (size_t i = 0; i < batch->dir_count; i++) {
+        if (strcmp(batch->dirs[i].path, dir) == 0) {
+            return 1;
+        }
+    }
+
+    if (stat(dir, &st) < 0) {
+        log_message(LOG_ERR, "Failed to stat directory %s: %s", dir, strerror(errno));
+        return 0;
+    }
+
+    if (batch->dir_count == batch->dir_capacity) {
+        size_t new_capacity = batch->dir_capacity ? batch->dir_capacity * 2 : 8;
+        struct durability_dir *grown = realloc(batch->dirs, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            log_message(LOG_ERR, "Out of memory tracking directory %s", dir);
+            return 0;
+        }
+        batch->dirs = grown;
+        batch->dir_capacity = new_capacity;
+    }
+
+    batch->dirs[batch->dir_count].path = strdup(dir);
+    batch->dirs[batch->dir_count].dev = st.st_dev;
+    batch->dir_count++;
+
+    return 1;
+}
+
+/**
+ * Record that the directory containing path had an entry created,
+ * renamed or removed
+ *
+ * @return 1 on success, 0 on failure
+ */
+int durability_entry_changed(struct durability_batch *batch, const char *path) {
+    char dir[PATH_MAX];
+
+    if (batch->mode == DURABILITY_NONE) {
+        return 1;
+    }
+
+    parent_dir(path, dir, sizeof(dir));
+    return durability_dir_changed(batch, dir);
+}
+
+/**
+ * Remove the source of a copy. In batch mode the unlink is deferred until
+ * the copy is known to be on disk, so a crash can never lose both.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int durability_unlink(struct durability_batch *batch, const char *path) {
+    if (batch->mode != DURABILITY_BATCH) {
+        if (unlink(path) != 0) {
+            return 0;
+        }
+        return durability_entry_changed(batch, path);
+    }
+
+    if (batch->unlink_count == batch->unlink_capacity) {
+        size_t new_capacity = batch->unlink_capacity ? batch->unlink_capacity * 2 : 64;
+        char **grown = realloc(batch->unlinks, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            // Fall back to removing it now rather than leaking the source
+            return unlink(path) == 0;
+        }
+        batch->unlinks = grown;
+        batch->unlink_capacity = new_capacity;
+    }
+
+    batch->unlinks[batch->unlink_count++] = strdup(path);
+    return 1;
+}
+
+/**
+ * Make every write recorded in the batch durable, then release it.
+ * Batch mode issues one syncfs per filesystem touched and fsyncs each
+ * changed directory, then performs the deferred source unlinks.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int durability_commit(struct durability_batch *batch) {
+    long long start = monotonic_ns();
+    int success = 1;
+
+    if (batch->mode == DURABILITY_BATCH) {
+        // One syncfs flushes every file written on that filesystem
+        for (size_t i = 0; i < batch->dir_count; i++) {
+            int seen = 0;
+            for (size_t j = 0; j < i; j++) {
+                if (batch->dirs[j].dev == batch->dirs[i].dev) {
+                    seen = 1;
+                    break;
+                }
+            }
+            if (seen) {
+                continue;
+            }
+
+            int fd = open(batch->dirs[i].path, O_RDONLY | O_DIRECTORY);
+            if (fd < 0 || syncfs(fd) < 0) {
+                log_message(LOG_WARNING, "syncfs failed on %s, falling back to sync: %s",
+                            batch->dirs[i].path, strerror(errno));
+                sync();
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        for (size_t i = 0; i < batch->dir_count; i++) {
+            if (!fsync_dir(batch->dirs[i].path)) {
+                success = 0;
+            }
+        }
+
+        // Copies are on disk, so their sources can now go. If the sync
+        // failed the sources are kept and the next cycle sees duplicates
+        // rather than losing data.
+        for (size_t i = 0; i < batch->unlink_count; i++) {
+            if (success && unlink(batch->unlinks[i]) != 0) {
+                log_message(LOG_WARNING, "Failed to delete source file after copy %s: %s",
+                           batch->unlinks[i], strerror(errno));
+            }
+        }
+        // Sources are grouped by directory, sync each directory once
+        char dir[PATH_MAX], prev_dir[PATH_MAX] = "";
+        for (size_t i = 0; success && i < batch->unlink_count; i++) {
+            parent_dir(batch->unlinks[i], dir, sizeof(dir));
+            if (strcmp(dir, prev_dir) != 0) {
+                fsync_dir(dir);
+                memcpy(prev_dir, dir, sizeof(dir));
+            }
+        }
+
+        batch->sync_ns += monotonic_ns() - start;
+    }
+
+    if (batch->files > 0 || batch->dir_count > 0) {
+        log_message(LOG_INFO, "Durability (%s): %zu files, %.3f ms spent syncing",
+                    durability_mode_name(batch->mode), batch->files,
+                    batch->sync_ns / 1000000.0);
+    }
+
+    for (size_t i = 0; i < batch->dir_count; i++) {
+        free(batch->dirs[i].path);
+    }
+    for (size_t i = 0; i < batch->unlink_count; i++) {
+        free(batch->unlinks[i]);
+    }
+    free(batch->dirs);
+    free(batch->unlinks);
+    memset(batch, 0, sizeof(*batch));
+
+    return success;
+}
@@ -0,0 +1,323 @@
+#include "../inc/file_state.h"
+#include "../inc/company.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+/**
+ * Binary search the sorted table for a name
+ *
+ * @return Index of the name, or where it would be inserted
+ */
+static size_t file_state_position(const struct file_state_table *table, const char *name) {
+    size_t low = 0, high = table->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(table->entries[mid].name, name) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Look up a file in the table
+ *
+ * @return The entry, or NULL if the file is not known
+ */
+struct file_state *file_state_find(const struct file_state_table *table, const char *name) {
+    size_t pos = file_state_position(table, name);
+
+    if (pos < table->count && strcmp(table->entries[pos].name, name) == 0) {
+        return &table->entries[pos];
+    }
+    return NULL;
+}
+
+/**
+ * Add a file to the table, keeping it sorted. The new entry is zeroed
+ * apart from its name.
+ *
+ * @return The entry, or NULL if out of memory
+ */
+struct file_state *file_state_insert(struct file_state_table *table, const char *name) {
+    size_t pos = file_state_position(table, name);
+    char *copy;
+
+    if (table->count == table->capacity) {
+        size_t new_capacity = table->capacity ? table->capacity * 2 : 256;
+        struct file_state *grown = realloc(table->entries, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        table->entries = grown;
+        table->capacity = new_capacity;
+    }
+
+    copy = strdup(name);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    memmove(&table->entries[pos + 1], &table->entries[pos],
+            (table->count - pos) * sizeof(*table->entries));
+    table->count++;
+
+    memset(&table->entries[pos], 0, sizeof(table->entries[pos]));
+    table->entries[pos].name = copy;
+    table->dirty = 1;
+
+    return &table->entries[pos];
+}
+
+/**
+ * Drop the files not marked as seen since the last sweep, and clear the
+ * marks of the rest
+ */
+void file_state_sweep(struct file_state_table *table) {
+    size_t kept = 0;
+
+    for (size_t i = 0; i < table->count; i++) {
+        if (!table->entries[i].seen) {
+            free(table->entries[i].name);
+            table->dirty = 1;
+            continue;
+        }
+        table->entries[i].seen = 0;
+        table->entries[kept++] = table->entries[i];
+    }
+
+    table->count = kept;
+}
+
+/**
+ * Load the snapshot saved by a previous run. A missing snapshot gives an
+ * empty table.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int file_state_load(struct file_state_table *table, const char *path) {
+    char line[PATH_MAX + 96];
+    FILE *file;
+
+    memset(table, 0, sizeof(*table));
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        log_message(LOG_ERR, "Failed to open monitor state %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    // Each line is: inode <tab> size <tab> mtime <tab> name, sorted by name
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long ino;
+        long long size, mtime;
+        int offset;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%llu\t%lld\t%lld\t%n", &ino, &size, &mtime, &offset) != 3 ||
+            line[offset] == '\0') {
+            continue;
+        }
+
+        struct file_state *entry = file_state_insert(table, line + offset);
+        if (entry == NULL) {
+            log_message(LOG_ERR, "Out of memory loading monitor state");
+            fclose(file);
+            file_state_free(table);
+            return 0;
+        }
+        entry->ino = (ino_t)ino;
+        entry->size = (off_t)size;
+        entry->mtime = (time_t)mtime;
+    }
+
+    fclose(file);
+    table->dirty = 0;
+
+    return 1;
+}
+
+/**
+ * Save the table if it changed, replacing the old snapshot atomically
+ *
+ * @return 1 on success, 0 on failure
+ */
+int file_state_save(struct file_state_table *table, const char *path) {
+    char tmp_path[PATH_MAX];
+    FILE *file;
+
+    if (!table->dirty) {
+        return 1;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s%s", path, PARTIAL_SUFFIX);
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_message(LOG_ERR, "Failed to write monitor state %s: %s", tmp_path, strerror(errno));
+        return 0;
+    }
+
+    for (size_t i = 0; i < table->count; i++) {
+        const struct file_state *entry = &table->entries[i];
+        fprintf(file, "%llu\t%lld\t%lld\t%s\n", (unsigned long long)entry->ino,
+                (long long)entry->size, (long long)entry->mtime, entry->name);
+    }
+
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        log_message(LOG_ERR, "Failed to write monitor state %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+
+    table->dirty = 0;
+    return 1;
+}
+
+/**
+ * Release the memory held by a table
+ */
+void file_state_free(struct file_state_table *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        free(table->entries[i].name);
+    }
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Body of the verification thread: stat every file of the snapshot and
+ * note the ones that differ from it
+ */
+static void *file_state_verify_thread(void *arg) {
+    struct file_state_verify *verify = arg;
+    char path[PATH_MAX];
+    size_t capacity = 0;
+
+    for (size_t i = 0; i < verify->count; i++) {
+        const struct file_state *entry = &verify->entries[i];
+        struct stat st;
+
+        if (!format_path(path, sizeof(path), "%s/%s", verify->dir, entry->name)) {
+            continue;
+        }
+        // Removed files are noticed by the monitor's own directory scan
+        if (stat(path, &st) < 0 ||
+            (st.st_ino == entry->ino && st.st_size == entry->size && st.st_mtime == entry->mtime)) {
+            continue;
+        }
+
+        if (verify->changed_count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(verify->changed, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                break;
+            }
+            verify->changed = grown;
+            capacity = new_capacity;
+        }
+        verify->changed[verify->changed_count++] = entry->name;
+    }
+
+    pthread_mutex_lock(&verify->lock);
+    verify->done = 1;
+    pthread_mutex_unlock(&verify->lock);
+
+    return NULL;
+}
+
+/**
+ * Check a freshly loaded snapshot against the directory in the
+ * background, so the daemon can start monitoring straight away
+ *
+ * @return 1 on success, 0 on failure
+ */
+int file_state_verify_start(struct file_state_verify *verify, const struct file_state_table *table,
+                            const char *dir) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t signals;
+    int started;
+
+    memset(verify, 0, sizeof(*verify));
+    pthread_mutex_init(&verify->lock, NULL);
+    snprintf(verify->dir, sizeof(verify->dir), "%s", dir);
+
+    // The thread works on its own copy, the monitor keeps changing the table
+    verify->entries = malloc((table->count ? table->count : 1) * sizeof(*verify->entries));
+    if (verify->entries == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        verify->entries[i] = table->entries[i];
+        verify->entries[i].name = strdup(table->entries[i].name);
+        if (verify->entries[i].name == NULL) {
+            verify->count = i;
+            file_state_verify_free(verify);
+            return 0;
+        }
+    }
+    verify->count = table->count;
+    verify->running = 1;
+
+    block_signals(&signals);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, file_state_verify_thread, verify) == 0;
+    pthread_attr_destroy(&attr);
+    restore_signals(&signals);
+
+    if (!started) {
+        file_state_verify_thread(verify);
+    }
+
+    return 1;
+}
+
+/**
+ * Check whether the background verification has finished. Once it has,
+ * its changed list can be read without locking.
+ *
+ * @return 1 if it has finished, 0 if it is still running or never started
+ */
+int file_state_verify_done(struct file_state_verify *verify) {
+    int done;
+
+    if (!verify->running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&verify->lock);
+    done = verify->done;
+    pthread_mutex_unlock(&verify->lock);
+
+    return done;
+}
+
+/**
+ * Release a finished verification
+ */
+void file_state_verify_free(struct file_state_verify *verify) {
+    for (size_t i = 0; i < verify->count; i++) {
+        free(verify->entries[i].name);
+    }
+    free(verify->entries);
+    free(verify->changed);
+    verify->entries = NULL;
+    verify->changed = NULL;
+    verify->count = 0;
+    verify->changed_count = 0;
+    verify->running = 0;
+    pthread_mutex_destroy(&verify->lock);
+}
@@ -0,0 +1,686 @@
+#include "../inc/intake.h"
+#include "../inc/company.h"
+#include "../inc/site.h"
+#include "../inc/scheduler.h"
+#include "../inc/checksum.h"
+#include "../inc/departments.h"
+#include "../inc/versions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+// The steps every upload goes through, each run by a thread of its own
+// that takes uploads from the queue in front of it
+enum intake_stage {
+    STAGE_VALIDATE,     // Complete report under a report name
+    STAGE_CHECKSUM,     // CRC32C of the content that will be moved
+    STAGE_MOVE,         // Into the reporting directory, in batches
+    STAGE_SUMMARIZE,    // Recorded in the site's intake summary
+    STAGE_COUNT
+};
+
+static const char *stage_names[STAGE_COUNT] = { "validate", "checksum", "move", "summarize" };
+
+// A bounded queue in front of a stage. A stage that finds the next queue
+// full waits, and so does the dispatch feeding the first one, so a slow
+// disk holds back reading rather than piling up uploads in memory.
+struct intake_queue {
+    struct intake_item **items;     // Ring of capacity slots
+    size_t capacity, head, count;
+    size_t high_water;              // Deepest since the last check
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+
+static struct intake_queue queues[STAGE_COUNT];
+
+// Uploads a stage set aside because a scheduled cycle of their site holds
+// its transfer lock. Only the stage's own thread uses it.
+struct intake_held {
+    struct intake_item **items;
+    size_t count, capacity;
+};
+
+// Started on the first upload streamed, -1 if the threads could not be
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static int started = 0;
+
+// Totals since the daemon started
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long streamed, rejected, failed;
+static long long latency_sec;
+
+static int queue_init(struct intake_queue *queue, size_t capacity) {
+    memset(queue, 0, sizeof(*queue));
+    queue->items = calloc(capacity, sizeof(*queue->items));
+    if (queue->items == NULL) {
+        return 0;
+    }
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 1;
+}
+
+/**
+ * Add an upload to a queue, waiting for room
+ */
+static void queue_push(struct intake_queue *queue, struct intake_item *item) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    if (queue->count > queue->high_water) {
+        queue->high_water = queue->count;
+    }
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Take the oldest upload off a queue, waiting for one, followed by up to
+ * max - 1 more of the same site that are already queued behind it
+ *
+ * @param wait_ms Longest to wait for an upload, -1 to wait as long as it takes
+ * @return The number of uploads taken, 0 if none came in time
+ */
+static size_t queue_pop(struct intake_queue *queue, struct intake_item **items, size_t max, int wait_ms) {
+    struct timespec deadline;
+    size_t taken = 0;
+
+    if (wait_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (wait_ms < 0) {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        } else if (pthread_cond_timedwait(&queue->not_empty, &queue->lock, &deadline) == ETIMEDOUT &&
+                   queue->count == 0) {
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+    }
+    do {
+        items[taken++] = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    } while (taken < max && queue->count > 0 && queue->items[queue->head]->site == items[0]->site);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return taken;
+}
+
+/**
+ * Set uploads aside until their site's transfer lock is free
+ *
+ * @return 1 on success, 0 if out of memory
+ */
+static int held_add(struct intake_held *held, struct intake_item **items, size_t count) {
+    if (held->count + count > held->capacity) {
+        size_t capacity = held->capacity ? held->capacity * 2 : INTAKE_BATCH_MAX;
+        while (capacity < held->count + count) {
+            capacity *= 2;
+        }
+        struct intake_item **grown = realloc(held->items, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return 0;
+        }
+        held->items = grown;
+        held->capacity = capacity;
+    }
+    memcpy(held->items + held->count, items, count * sizeof(*items));
+    held->count += count;
+    return 1;
+}
+
+/**
+ * Take the next uploads of one site for a stage that works under the
+ * site's transfer lock, and take the lock. A site whose scheduled cycle
+ * holds the lock is not waited for: its uploads are held back and retried
+ * while the uploads of other sites go on, so one site's cycle does not
+ * stop streaming for every site. The cycle does not dispatch, so no more
+ * than the pipeline held when it started is held back.
+ *
+ * @return The number of uploads taken, all of one site whose transfer
+ *         lock the caller now holds
+ */
+static size_t take_locked(struct intake_queue *queue, struct intake_held *held,
+                          struct intake_item **items, size_t max) {
+    while (1) {
+        struct site *busy = NULL;
+
+        // Held uploads first, they were queued before any still queued
+        for (size_t i = 0; i < held->count; i++) {
+            struct site *site = held->items[i]->site;
+            if (site == busy) {
+                continue;
+            }
+            if (pthread_mutex_trylock(&site->transfer_lock) != 0) {
+                busy = site;
+                continue;
+            }
+
+            size_t taken = 0, kept = 0;
+            for (size_t j = 0; j < held->count; j++) {
+                if (taken < max && held->items[j]->site == site) {
+                    items[taken++] = held->items[j];
+                } else {
+                    held->items[kept++] = held->items[j];
+                }
+            }
+            held->count = kept;
+            return taken;
+        }
+
+        size_t count = queue_pop(queue, items, max, held->count > 0 ? INTAKE_HELD_RETRY_MS : -1);
+        if (count == 0) {
+            continue;
+        }
+        struct site *site = items[0]->site;
+        if (pthread_mutex_trylock(&site->transfer_lock) == 0) {
+            return count;
+        }
+        if (!held_add(held, items, count)) {
+            log_message(LOG_WARNING, "Out of memory holding back streamed uploads, waiting for their cycle");
+            pthread_mutex_lock(&site->transfer_lock);
+            return count;
+        }
+    }
+}
+
+/**
+ * Work on an upload's site with its settings, from a pipeline thread
+ */
+static void item_enter(const struct intake_item *item) {
+    site_use(item->site);
+    config_use(item->config);
+}
+
+static void item_leave(void) {
+    config_use(NULL);
+    site_use(NULL);
+}
+
+static void item_free(struct intake_item *item) {
+    config_put(item->config);
+    free(item);
+}
+
+/**
+ * Drop an upload the pipeline gave up on. With retry set the dispatch
+ * offers it again on a later tick; otherwise it waits until it changes,
+ * or for the scheduled transfer.
+ */
+static void item_drop(struct intake_item *item, int retry) {
+    if (retry) {
+        scheduler_release(item->name);
+    }
+    pthread_mutex_lock(&stats_lock);
+    if (retry) {
+        failed++;
+    } else {
+        rejected++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    item_free(item);
+}
+
+/**
+ * Check whether the last non-blank byte of a file closes an XML tag,
+ * which a report cut off part way through its upload does not
+ */
+static int ends_with_closing_tag(const char *path, off_t size) {
+    char tail[INTAKE_TAIL_SIZE];
+    off_t offset = size > INTAKE_TAIL_SIZE ? size - INTAKE_TAIL_SIZE : 0;
+    ssize_t bytes;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    bytes = pread(fd, tail, sizeof(tail), offset);
+    close(fd);
+
+    while (bytes > 0 && isspace((unsigned char)tail[bytes - 1])) {
+        bytes--;
+    }
+    return bytes > 0 && tail[bytes - 1] == '>';
+}
+
+/**
+ * Check that an upload is a complete report: a non-empty regular file
+ * named department_YYYY-MM-DD.xml that ends in a closing tag. Anything
+ * else is left for the scheduled transfer, which moves every upload.
+ *
+ * @return 1 if it is, 0 if not, -1 if it is gone
+ */
+static int intake_validate(struct intake_item *item) {
+    const struct config *config = item->config;
+    char path[PATH_MAX];
+    size_t department_len;
+    long day_number;
+    const char *problem = NULL;
+    struct stat st;
+
+    if (!format_path(path, sizeof(path), "%s/%s", config->upload_dir, item->name)) {
+        return 0;
+    }
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        problem = "it is empty";
+    } else if (!parse_report_name(item->name, strlen(item->name), &department_len, &day_number)) {
+        problem = "it is not named department_YYYY-MM-DD" REPORT_SUFFIX;
+    } else if (!ends_with_closing_tag(path, st.st_size)) {
+        problem = "it does not end in a closing tag";
+    }
+    if (problem != NULL) {
+        log_message(LOG_WARNING, "Not streaming %s: %s, leaving it for the scheduled transfer",
+                    item->name, problem);
+        return 0;
+    }
+
+    item->size = st.st_size;
+    item->mtime = st.st_mtime;
+    return 1;
+}
+
+static void *validate_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct intake_item *item;
+        queue_pop(&queues[STAGE_VALIDATE], &item, 1, -1);
+
+        item_enter(item);
+        int valid = intake_validate(item);
+        if (valid > 0) {
+            queue_push(&queues[STAGE_CHECKSUM], item);
+        } else if (valid == 0) {
+            item_drop(item, 0);
+        } else {
+            // Gone, the dispatch forgets it once it finds it gone too
+            scheduler_release(item->name);
+            item_free(item);
+        }
+        item_leave();
+    }
+
+    return NULL;
+}
+
+static void *checksum_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct intake_item *item;
+        char path[PATH_MAX];
+        long long size;
+
+        queue_pop(&queues[STAGE_CHECKSUM], &item, 1, -1);
+
+        item_enter(item);
+        if (!format_path(path, sizeof(path), "%s/%s", item->config->upload_dir, item->name) ||
+            !checksum_file(path, &item->crc, &size)) {
+            item_drop(item, 1);
+        } else if (size != item->size) {
+            // Changed since it was validated, the monitor queues it again
+            item_free(item);
+        } else {
+            queue_push(&queues[STAGE_MOVE], item);
+        }
+        item_leave();
+    }
+
+    return NULL;
+}
+
+/**
+ * Move a batch of uploads of one site into its reporting directory,
+ * under one journal and durability commit. Uploads that changed since
+ * they were checksummed are left for the monitor to queue again.
+ *
+ * @return The number of uploads moved, which are kept at the start of
+ *         items; the others are freed
+ */
+static size_t intake_move(struct intake_item **items, size_t count) {
+    const struct config *config = items[0]->config;
+    struct transfer_outcome *outcomes;
+    size_t *batch_item;
+    struct dir_scan batch;
+    size_t moved = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    arena_init(&batch.arena, 0);
+    batch.path = config->upload_dir;
+    batch.entries = arena_alloc(&batch.arena, count * sizeof(*batch.entries));
+    outcomes = malloc(count * sizeof(*outcomes));
+    batch_item = malloc(count * sizeof(*batch_item));
+    if (batch.entries == NULL || outcomes == NULL || batch_item == NULL) {
+        log_message(LOG_ERR, "Out of memory moving streamed uploads");
+        for (size_t i = 0; i < count; i++) {
+            item_drop(items[i], 1);
+        }
+        free(outcomes);
+        free(batch_item);
+        arena_free(&batch.arena);
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        if (!format_path(path, sizeof(path), "%s/%s", config->upload_dir, items[i]->name) ||
+            stat(path, &st) < 0 || st.st_size != items[i]->size || st.st_mtime != items[i]->mtime) {
+            continue;
+        }
+
+        struct scan_entry *entry = &batch.entries[batch.count];
+        entry->name_len = strlen(items[i]->name);
+        entry->name = arena_strndup(&batch.arena, items[i]->name, entry->name_len);
+        entry->ino = st.st_ino;
+        if (entry->name != NULL) {
+            batch_item[batch.count++] = i;
+        }
+    }
+
+    if (batch.count > 0) {
+        transfer_uploads(&batch, outcomes);
+    }
+
+    for (size_t i = 0, b = 0; i < count; i++) {
+        if (b < batch.count && batch_item[b] == i) {
+            if (outcomes[b].moved) {
+                memcpy(items[i]->dst, outcomes[b].dst, sizeof(items[i]->dst));
+                items[moved++] = items[i];
+            } else {
+                item_drop(items[i], 1);
+            }
+            b++;
+        } else {
+            // Changed or gone since it was checksummed
+            scheduler_release(items[i]->name);
+            item_free(items[i]);
+        }
+    }
+
+    free(outcomes);
+    free(batch_item);
+    dir_scan_free(&batch);
+
+    return moved;
+}
+
+static void *move_thread(void *arg) {
+    struct intake_item *items[INTAKE_BATCH_MAX];
+    struct intake_held held = { NULL, 0, 0 };
+    (void)arg;
+
+    while (1) {
+        size_t count = take_locked(&queues[STAGE_MOVE], &held, items, INTAKE_BATCH_MAX);
+        struct site *site = items[0]->site;
+
+        item_enter(items[0]);
+        // The batch's first upload may be freed before the move is done
+        const struct config *config = config_get();
+        size_t moved = intake_move(items, count);
+        item_leave();
+        config_put(config);
+        pthread_mutex_unlock(&site->transfer_lock);
+
+        // Only handed on once the lock is free, the summary needs it
+        for (size_t i = 0; i < moved; i++) {
+            queue_push(&queues[STAGE_SUMMARIZE], items[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Append a moved report to its site's intake summary: when it was moved,
+ * its size and CRC32C, how long it took from upload to reporting, its
+ * name and where it went
+ */
+static void intake_summarize(const struct intake_item *item) {
+    const struct config *config = item->config;
+    time_t now = time(NULL);
+    FILE *file;
+
+    file = fopen(config->intake_summary, "a");
+    if (file == NULL) {
+        log_message(LOG_WARNING, "Failed to open %s: %s", config->intake_summary, strerror(errno));
+        return;
+    }
+    if (ftell(file) == 0) {
+        fprintf(file, "# moved size crc32c latency_sec name destination\n");
+    }
+    fprintf(file, "%ld %lld %08x %ld %s %s\n", (long)now, (long long)item->size, (unsigned int)item->crc,
+            (long)(now - item->arrived), item->name, item->dst);
+    if (fclose(file) != 0) {
+        log_message(LOG_WARNING, "Failed to write %s: %s", config->intake_summary, strerror(errno));
+    }
+}
+
+static void *summarize_thread(void *arg) {
+    struct intake_item *items[INTAKE_BATCH_MAX];
+    struct intake_held held = { NULL, 0, 0 };
+    (void)arg;
+
+    while (1) {
+        // The scheduled cycle reads the summary while holding the lock
+        size_t count = take_locked(&queues[STAGE_SUMMARIZE], &held, items, INTAKE_BATCH_MAX);
+        struct site *site = items[0]->site;
+
+        for (size_t i = 0; i < count; i++) {
+            item_enter(items[i]);
+            intake_summarize(items[i]);
+            item_leave();
+        }
+        pthread_mutex_unlock(&site->transfer_lock);
+
+        time_t now = time(NULL);
+        pthread_mutex_lock(&stats_lock);
+        for (size_t i = 0; i < count; i++) {
+            streamed++;
+            latency_sec += now - items[i]->arrived;
+        }
+        pthread_mutex_unlock(&stats_lock);
+        for (size_t i = 0; i < count; i++) {
+            item_free(items[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the pipeline's threads, with queues as deep as the settings of
+ * the caller ask for
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int intake_start(void) {
+    void *(*const bodies[STAGE_COUNT])(void *) = {
+        validate_thread, checksum_thread, move_thread, summarize_thread
+    };
+    size_t depth = (size_t)config_current()->intake_queue_depth;
+    pthread_attr_t attr;
+    sigset_t signals;
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        if (!queue_init(&queues[stage], depth)) {
+            log_message(LOG_ERR, "Out of memory starting the intake pipeline");
+            return 0;
+        }
+    }
+
+    block_signals(&signals);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        pthread_t thread;
+        int error = pthread_create(&thread, &attr, bodies[stage], NULL);
+        if (error != 0) {
+            log_message(LOG_ERR, "Failed to start the intake %s stage: %s", stage_names[stage], strerror(error));
+            pthread_attr_destroy(&attr);
+            restore_signals(&signals);
+            return 0;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    restore_signals(&signals);
+
+    log_message(LOG_INFO, "Streaming intake started, %zu uploads per stage queue", depth);
+    return 1;
+}
+
+/**
+ * Hand a settled upload of the calling thread's site to the pipeline,
+ * starting it on first use. Waits while the pipeline is full, so a burst
+ * of uploads is fed in at the pace the disks take it.
+ *
+ * @param arrived When the monitor first saw the upload
+ * @return 1 if it was queued, 0 if the pipeline is not running
+ */
+int intake_submit(const char *name, time_t arrived) {
+    struct intake_item *item;
+
+    pthread_mutex_lock(&start_lock);
+    if (started == 0) {
+        started = intake_start() ? 1 : -1;
+    }
+    pthread_mutex_unlock(&start_lock);
+    if (started < 0 || strlen(name) > NAME_MAX) {
+        return 0;
+    }
+
+    item = calloc(1, sizeof(*item));
+    if (item == NULL) {
+        log_message(LOG_ERR, "Out of memory streaming %s", name);
+        return 0;
+    }
+    item->site = site_current();
+    item->config = config_get();
+    snprintf(item->name, sizeof(item->name), "%s", name);
+    item->arrived = arrived;
+
+    queue_push(&queues[STAGE_VALIDATE], item);
+    return 1;
+}
+
+/**
+ * Keep the pipeline from moving uploads of the calling thread's site and
+ * from writing its summary, until intake_resume()
+ */
+void intake_pause(void) {
+    pthread_mutex_lock(&site_current()->transfer_lock);
+}
+
+void intake_resume(void) {
+    pthread_mutex_unlock(&site_current()->transfer_lock);
+}
+
+/**
+ * Check that every report the pipeline moved since the last check is in
+ * the reporting directory with the size it was moved with, or was since
+ * stored as a delta by a newer version. This only costs a stat per
+ * report, the content was checksummed on the way in. The checked summary
+ * is kept next to the summary. Called by the scheduled cycle with the
+ * pipeline paused.
+ *
+ * @return 1 if every report is in place, 0 otherwise
+ */
+int intake_check(void) {
+    const struct config *config = config_current();
+    char checked_path[PATH_MAX];
+    char line[NAME_MAX + PATH_MAX + 128];
+    size_t in_place = 0, missing = 0;
+    size_t high_water[STAGE_COUNT] = { 0 };
+    FILE *file;
+
+    file = fopen(config->intake_summary, "r");
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            log_message(LOG_WARNING, "Failed to open %s: %s", config->intake_summary, strerror(errno));
+            return 0;
+        }
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[NAME_MAX + 1];
+        long moved, latency;
+        long long size;
+        unsigned int crc;
+        int consumed = 0;
+        struct stat st;
+
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%ld %lld %x %ld %255s %n", &moved, &size, &crc, &latency, name, &consumed) < 5 ||
+            consumed == 0) {
+            continue;
+        }
+        char *dst = line + consumed;
+        dst[strcspn(dst, "\n")] = '\0';
+
+        char delta_path[PATH_MAX];
+        snprintf(delta_path, sizeof(delta_path), "%s%s", dst, VERSION_DELTA_SUFFIX);
+        if ((stat(dst, &st) == 0 && st.st_size == size) || stat(delta_path, &st) == 0) {
+            in_place++;
+        } else {
+            missing++;
+            log_message(LOG_ERR, "Intake check: %s, streamed as %s (%lld bytes, crc32c %08x), is missing or changed",
+                        name, dst, size, crc);
+        }
+    }
+    fclose(file);
+
+    if (format_path(checked_path, sizeof(checked_path), "%s%s", config->intake_summary, INTAKE_CHECKED_SUFFIX) &&
+        rename(config->intake_summary, checked_path) != 0) {
+        log_message(LOG_WARNING, "Failed to rename %s: %s", config->intake_summary, strerror(errno));
+    }
+
+    for (int stage = 0; stage < STAGE_COUNT && started > 0; stage++) {
+        pthread_mutex_lock(&queues[stage].lock);
+        high_water[stage] = queues[stage].high_water;
+        queues[stage].high_water = queues[stage].count;
+        pthread_mutex_unlock(&queues[stage].lock);
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    log_message(LOG_INFO, "Intake check: %zu streamed reports in place, %zu missing or changed; "
+                "%lu streamed since startup (average %lld s from upload to reporting), %lu rejected, "
+                "%lu failed; queues peaked at %zu/%zu/%zu/%zu",
+                in_place, missing, streamed, streamed ? latency_sec / (long long)streamed : 0,
+                rejected, failed, high_water[STAGE_VALIDATE], high_water[STAGE_CHECKSUM],
+                high_water[STAGE_MOVE], high_water[STAGE_SUMMARIZE]);
+    pthread_mutex_unlock(&stats_lock);
+
+    return missing == 0;
+}
@@ -0,0 +1,435 @@
+#include "../inc/journal.h"
+#include "../inc/company.h"
+#include "../inc/durability.h"
+#include "../inc/partition.h"
+#include "../inc/replication.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+// A planned move read back from the journal during recovery
+struct journal_entry {
+    char *src;
+    char *dst;
+    struct journal_source source;
+    int identified;     // Source recorded, journals of older versions lack it
+    int done;
+};
+
+/**
+ * Write a whole buffer to the journal, retrying on short writes
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int journal_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 1;
+}
+
+/**
+ * Check whether a path exists
+ */
+static int path_exists(const char *path) {
+    struct stat st;
+    return lstat(path, &st) == 0;
+}
+
+/**
+ * Start a new transfer cycle in the journal. Any incomplete cycle left
+ * over from a previous run is recovered first so it is never overwritten;
+ * if that fails, its journal is kept aside under JOURNAL_FAILED_SUFFIX.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int journal_begin(struct transfer_journal *journal, const char *path) {
+    char failed_path[PATH_MAX];
+    struct stat st;
+    char record[64];
+    int len;
+
+    // Moves that still fail are left in the upload directory and get
+    // planned again as part of the new cycle, but their intents are kept
+    if (stat(path, &st) == 0 && st.st_size > 0 && !journal_recover(path)) {
+        snprintf(failed_path, sizeof(failed_path), "%s%s", path, JOURNAL_FAILED_SUFFIX);
+        if (path_exists(failed_path)) {
+            log_message(LOG_ERR, "Previous transfer cycle was only partially recovered and %s "
+                        "still holds an earlier one, not starting a new cycle", failed_path);
+            return 0;
+        }
+        if (rename(path, failed_path) < 0) {
+            log_message(LOG_ERR, "Failed to keep unrecovered transfer journal as %s: %s",
+                        failed_path, strerror(errno));
+            return 0;
+        }
+        log_message(LOG_WARNING, "Previous transfer cycle was only partially recovered, "
+                    "its journal is kept as %s", failed_path);
+    }
+
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (journal->fd < 0) {
+        log_message(LOG_ERR, "Failed to open transfer journal %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    journal->next_seq = 0;
+    journal->unsynced = 0;
+
+    len = snprintf(record, sizeof(record), "%c\t%ld\n", JOURNAL_TAG_BEGIN, (long)time(NULL));
+    if (!journal_write(journal->fd, record, len)) {
+        log_message(LOG_ERR, "Failed to write transfer journal header: %s", strerror(errno));
+        close(journal->fd);
+        journal->fd = -1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Record the intent to move src to dst. The record is not durable until
+ * journal_sync() is called, so all intents of a cycle share one fsync.
+ *
+ * @param src_st The source as it is now, recovery only finishes the move
+ *               of a source that still matches it
+ * @return The sequence number of the intent, or -1 on failure
+ */
+long journal_intent(struct transfer_journal *journal, const char *src, const char *dst,
+                    const struct stat *src_st) {
+    char record[2 * PATH_MAX + 128];
+    int len;
+
+    // Tabs and newlines are the record separators
+    if (strpbrk(src, "\t\n") || strpbrk(dst, "\t\n")) {
+        log_message(LOG_WARNING, "Skipping file with unsupported characters in name: %s", src);
+        return -1;
+    }
+
+    len = snprintf(record, sizeof(record), "%c\t%ld\t%s\t%s\t%llu\t%llu\t%lld\t%lld\n",
+                   JOURNAL_TAG_INTENT, journal->next_seq, src, dst,
+                   (unsigned long long)src_st->st_dev, (unsigned long long)src_st->st_ino,
+                   (long long)src_st->st_size, (long long)src_st->st_mtime);
+    if (len < 0 || (size_t)len >= sizeof(record)) {
+        log_message(LOG_WARNING, "Path too long for transfer journal: %s", src);
+        return -1;
+    }
+
+    if (!journal_write(journal->fd, record, len)) {
+        log_message(LOG_ERR, "Failed to write transfer journal intent: %s", strerror(errno));
+        return -1;
+    }
+
+    return journal->next_seq++;
+}
+
+/**
+ * Flush all journal records written so far to stable storage
+ *
+ * @return 1 on success, 0 on failure
+ */
+int journal_sync(struct transfer_journal *journal) {
+    if (fdatasync(journal->fd) < 0) {
+        log_message(LOG_ERR, "Failed to sync transfer journal: %s", strerror(errno));
+        return 0;
+    }
+    journal->unsynced = 0;
+    return 1;
+}
+
+/**
+ * Record that the move with the given sequence number has completed.
+ * Completions are flushed in batches of JOURNAL_SYNC_BATCH.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int journal_done(struct transfer_journal *journal, long seq) {
+    char record[32];
+    int len;
+
+    len = snprintf(record, sizeof(record), "%c\t%ld\n", JOURNAL_TAG_DONE, seq);
+    if (!journal_write(journal->fd, record, len)) {
+        log_message(LOG_ERR, "Failed to write transfer journal completion: %s", strerror(errno));
+        return 0;
+    }
+
+    if (++journal->unsynced >= JOURNAL_SYNC_BATCH) {
+        return journal_sync(journal);
+    }
+
+    return 1;
+}
+
+/**
+ * Mark the cycle as complete and empty the journal
+ *
+ * @return 1 on success, 0 on failure
+ */
+int journal_commit(struct transfer_journal *journal) {
+    char record[4];
+    int success = 1;
+    int len;
+
+    len = snprintf(record, sizeof(record), "%c\n", JOURNAL_TAG_COMMIT);
+    if (!journal_write(journal->fd, record, len) || !journal_sync(journal)) {
+        log_message(LOG_ERR, "Failed to commit transfer journal: %s", strerror(errno));
+        success = 0;
+    } else if (ftruncate(journal->fd, 0) < 0) {
+        // A committed journal is harmless, recovery will just discard it
+        log_message(LOG_WARNING, "Failed to truncate transfer journal: %s", strerror(errno));
+    }
+
+    close(journal->fd);
+    journal->fd = -1;
+
+    return success;
+}
+
+/**
+ * Check whether a file under a journaled source name is the upload the
+ * move was planned for, rather than one uploaded again under that name
+ */
+static int journal_source_matches(const struct journal_entry *entry, const struct stat *st) {
+    return !entry->identified ||
+           (st->st_dev == entry->source.dev && st->st_ino == entry->source.ino &&
+            st->st_size == entry->source.size && st->st_mtime == entry->source.mtime);
+}
+
+/**
+ * Check whether the upload a move was planned for is still in place
+ */
+static int journal_source_present(const struct journal_entry *entry) {
+    struct stat st;
+    return lstat(entry->src, &st) == 0 && journal_source_matches(entry, &st);
+}
+
+/**
+ * Bring a single interrupted move to completion. A move is either not
+ * started (source only), half copied (source plus a ".part" file), copied
+ * but not yet unlinked (source and destination) or finished (destination
+ * only). Partial copies are rolled back and the move is replayed. A source
+ * that is no longer the journaled upload was uploaded again while the
+ * daemon was down and is left for the next cycle.
+ *
+ * @return 1 if the move is complete, 0 on failure, -1 if nothing was moved
+ */
+static int journal_replay_entry(const struct journal_entry *entry, struct durability_batch *batch) {
+    char part_path[PATH_MAX];
+    struct stat src_st, dst_st;
+    int src_exists = lstat(entry->src, &src_st) == 0;
+    int dst_exists = lstat(entry->dst, &dst_st) == 0;
+
+    snprintf(part_path, sizeof(part_path), "%s%s", entry->dst, PARTIAL_SUFFIX);
+    if (path_exists(part_path)) {
+        log_message(LOG_INFO, "Rolling back partial copy %s", part_path);
+        if (unlink(part_path) < 0) {
+            log_message(LOG_ERR, "Failed to remove partial copy %s: %s",
+                        part_path, strerror(errno));
+            return 0;
+        }
+    }
+
+    if (src_exists && !journal_source_matches(entry, &src_st)) {
+        log_message(LOG_INFO, "%s was uploaded again since its move was journaled, leaving it for the next cycle",
+                    entry->src);
+        return dst_exists ? 1 : -1;
+    }
+
+    if (src_exists && dst_exists) {
+        // Copy finished but the source was never removed. If the copy's
+        // data did not reach the disk before the crash, redo it instead.
+        if (dst_st.st_size != src_st.st_size) {
+            log_message(LOG_INFO, "Discarding incomplete copy %s", entry->dst);
+            if (unlink(entry->dst) < 0) {
+                log_message(LOG_ERR, "Failed to remove incomplete copy %s: %s",
+                            entry->dst, strerror(errno));
+                return 0;
+            }
+            return move_file(entry->src, entry->dst, batch);
+        }
+        if (!durability_unlink(batch, entry->src)) {
+            log_message(LOG_ERR, "Failed to remove transferred source %s: %s",
+                        entry->src, strerror(errno));
+            return 0;
+        }
+        return 1;
+    }
+
+    if (src_exists) {
+        return move_file(entry->src, entry->dst, batch);
+    }
+
+    if (!dst_exists) {
+        const struct config *config = config_current();
+        log_message(LOG_WARNING, "Journaled file %s is missing from both %s and %s",
+                    entry->src, config->upload_dir, config->reporting_dir);
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Replay or roll back every incomplete move recorded in the journal so an
+ * interrupted transfer cycle resumes where it stopped. Called on startup
+ * and before a new cycle begins.
+ *
+ * @return 1 if the journal is clean afterwards, 0 otherwise
+ */
+int journal_recover(const char *path) {
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    struct journal_entry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    struct durability_batch batch;
+    struct partition_index partitions;
+    int in_cycle = 0;
+    int success = 1;
+    int replayed = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        log_message(LOG_ERR, "Failed to open transfer journal %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    while ((line_len = getline(&line, &line_size, file)) > 0) {
+        // A record without its newline was torn by the crash, ignore it
+        if (line[line_len - 1] != '\n') {
+            break;
+        }
+        line[line_len - 1] = '\0';
+
+        if (line[0] == JOURNAL_TAG_BEGIN) {
+            in_cycle = 1;
+        } else if (line[0] == JOURNAL_TAG_COMMIT) {
+            in_cycle = 0;
+        } else if (line[0] == JOURNAL_TAG_INTENT && in_cycle) {
+            char *save = NULL;
+            char *seq_str = strtok_r(line + 2, "\t", &save);
+            char *src = strtok_r(NULL, "\t", &save);
+            char *dst = strtok_r(NULL, "\t", &save);
+            char *dev_str = strtok_r(NULL, "\t", &save);
+            char *ino_str = strtok_r(NULL, "\t", &save);
+            char *size_str = strtok_r(NULL, "\t", &save);
+            char *mtime_str = strtok_r(NULL, "\t", &save);
+
+            if (seq_str == NULL || src == NULL || dst == NULL ||
+                strtol(seq_str, NULL, 10) != (long)count) {
+                log_message(LOG_WARNING, "Ignoring malformed transfer journal record");
+                continue;
+            }
+
+            if (count == capacity) {
+                size_t new_capacity = capacity ? capacity * 2 : 64;
+                struct journal_entry *grown = realloc(entries, new_capacity * sizeof(*entries));
+                if (grown == NULL) {
+                    log_message(LOG_ERR, "Out of memory reading transfer journal");
+                    success = 0;
+                    break;
+                }
+                entries = grown;
+                capacity = new_capacity;
+            }
+
+            entries[count].src = strdup(src);
+            entries[count].dst = strdup(dst);
+            entries[count].identified = mtime_str != NULL;
+            if (entries[count].identified) {
+                entries[count].source.dev = (dev_t)strtoull(dev_str, NULL, 10);
+                entries[count].source.ino = (ino_t)strtoull(ino_str, NULL, 10);
+                entries[count].source.size = (off_t)strtoll(size_str, NULL, 10);
+                entries[count].source.mtime = (time_t)strtoll(mtime_str, NULL, 10);
+            }
+            entries[count].done = 0;
+            count++;
+        } else if (line[0] == JOURNAL_TAG_DONE && in_cycle) {
+            long seq = strtol(line + 2, NULL, 10);
+            if (seq >= 0 && (size_t)seq < count) {
+                entries[seq].done = 1;
+            }
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    if (in_cycle && success) {
+        log_message(LOG_WARNING, "Found interrupted transfer cycle, resuming %zu journaled moves", count);
+
+        // The interrupted cycle never got as far as unlocking
+        unlock_directories();
+        const char *reporting_dir = config_current()->reporting_dir;
+
+        durability_begin(&batch);
+        partition_index_load(&partitions, reporting_dir);
+        for (size_t i = 0; i < count; i++) {
+            // A completed move may still have a deferred source unlink
+            // pending, so only skip it once the upload is really gone
+            if (entries[i].done && !journal_source_present(&entries[i])) {
+                continue;
+            }
+            int result = journal_replay_entry(&entries[i], &batch);
+            if (result > 0) {
+                replication_file(entries[i].dst);
+                transfer_record(entries[i].dst, &partitions);
+                log_message(LOG_INFO, "Transferred file: %s to reporting directory", entries[i].src);
+                replayed++;
+            } else if (result == 0) {
+                success = 0;
+            }
+        }
+
+        if (partitions.dirty) {
+            char index_path[PATH_MAX];
+            if (partition_index_save(&partitions, reporting_dir)) {
+                if (format_path(index_path, sizeof(index_path), "%s/%s", reporting_dir, PARTITION_INDEX)) {
+                    replication_file(index_path);
+                }
+            } else {
+                success = 0;
+            }
+        }
+        partition_index_free(&partitions);
+
+        if (!durability_commit(&batch)) {
+            success = 0;
+        }
+        replication_flush();
+
+        log_message(LOG_INFO, "Transfer journal recovery finished: %d moves completed", replayed);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].src);
+        free(entries[i].dst);
+    }
+    free(entries);
+
+    // Only discard the journal once every move it describes is complete
+    if (success && truncate(path, 0) < 0) {
+        log_message(LOG_WARNING, "Failed to truncate transfer journal: %s", strerror(errno));
+    }
+
+    return success;
+}
@@ -1,32 +1,46 @@
 #include "../inc/daemon.h"
 #include "../inc/company.h"
+#include "../inc/journal.h"
+#include "../inc/replication.h"
+#include "../inc/attribution.h"
+#include "../inc/scheduler.h"
+#include "../inc/site.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/select.h>
 
+/**
+ * Sleep for the given seconds or until one of the daemon's signals
+ * arrives. The main thread keeps the signals blocked outside this wait,
+ * so one that comes in during a cycle stays pending and ends the next
+ * wait at once instead of being missed.
+ */
+static void wait_for_signal(int seconds, const sigset_t *unblocked) {
+    struct timespec timeout = { seconds, 0 };
 
-int main(void) {
+    pselect(0, NULL, NULL, NULL, &timeout, unblocked);
+}
+
+int main(int argc, char *argv[]) {
     int msgid;
-    char cwd[PATH_MAX];
-    char upload_dir[PATH_MAX];
-    char reporting_dir[PATH_MAX];
-    char backup_dir[PATH_MAX];
-    char log_dir[PATH_MAX];
+    const char *config_file = argc > 1 ? argv[1] : CONFIG_FILE;
+    const struct config *config;
+    struct timespec startup_begin, startup_end;
+    time_t last_scheduled = 0;
+    sigset_t signals;
+    
+    // The monotonic clock carries over into the forked daemon
+    clock_gettime(CLOCK_MONOTONIC, &startup_begin);
     
-    // Get the current working directory before daemonizing
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
-        perror("Failed to get current directory");
+    // Read the settings before daemonizing so mistakes reach the terminal
+    if (!config_load(config_file)) {
+        fprintf(stderr, "Error: Could not load configuration from %s\n", config_file);
         exit(EXIT_FAILURE);
     }
-    
-    // Create absolute paths
-    snprintf(upload_dir, sizeof(upload_dir), "%s/data/upload", cwd);
-    snprintf(reporting_dir, sizeof(reporting_dir), "%s/data/reporting", cwd);
-    snprintf(backup_dir, sizeof(backup_dir), "%s/data/backup", cwd);
-    snprintf(log_dir, sizeof(log_dir), "%s/logs", cwd);
+    config = config_current();
 
-    // The rest of your main function remains the same
     // Check if daemon is already running
     if (!check_singleton(LOCK_FILE)) {
         fprintf(stderr, "Error: Daemon is already running or could not acquire lock\n");
@@ -53,56 +67,106 @@ int main(void) {
     log_message(LOG_INFO, "Company daemon started successfully");
     
     // Create necessary directories if they don't exist
-    mkdir(upload_dir, 0755);
-    mkdir(reporting_dir, 0755);
-    mkdir(backup_dir, 0755);
-    mkdir(log_dir, 0755);
+    mkdir(config->upload_dir, 0755);
+    mkdir(config->reporting_dir, 0755);
+    mkdir(config->backup_dir, 0755);
+    mkdir(config->log_dir, 0755);
+    
+    // The threads started below leave the daemon's signals to this one,
+    // which only takes them while it waits
+    block_signals(&signals);
     
-    // Override the default paths with absolute paths
-    // This ensures the daemon can find directories after changing working directory
-    char *abs_upload_dir = strdup(upload_dir);
-    char *abs_reporting_dir = strdup(reporting_dir);
-    char *abs_backup_dir = strdup(backup_dir);
-    char *abs_log_dir = strdup(log_dir);
+    // Ship whatever the standby has not acknowledged yet
+    replication_start();
+    
+    // Serve every root of the sites file from a pool of workers, if there
+    // is one; each site recovers its journal and monitor state itself
+    int multiple_sites = sites_start();
+    if (multiple_sites < 0) {
+        cleanup_ipc(msgid);
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+    
+    if (!multiple_sites) {
+        // Finish any transfer cycle that was interrupted by a crash or kill
+        journal_recover(config->transfer_journal);
+        
+        // Pick up the upload monitor's state from the last run, it is
+        // verified in the background while the daemon is already serving
+        monitor_init(config->upload_dir);
+        
+        // Attribute upload changes to the writing process rather than the owner
+        if (config->attribution == ATTRIBUTION_FANOTIFY) {
+            attribution_start(config->upload_dir);
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &startup_end);
+    log_message(LOG_INFO, "Startup completed in %.3f ms",
+                (startup_end.tv_sec - startup_begin.tv_sec) * 1e3 +
+                (startup_end.tv_nsec - startup_begin.tv_nsec) / 1e6);
 
-    // Main daemon loop
-    while (1) {
+    // Main daemon loop, a termination signal cuts its wait short
+    while (!terminate_requested) {
         time_t now;
-        struct tm *tm_now;
+        struct tm tm_now;
+        
+        // Apply a new configuration between cycles, never during one
+        if (reload_requested) {
+            reload_requested = 0;
+            if (multiple_sites) {
+                sites_reload();
+            } else {
+                config_reload();
+            }
+        }
+        config = config_current();
+        
+        // The workers serve the sites, this loop only keeps time for them
+        if (multiple_sites) {
+            time(&now);
+            localtime_r(&now, &tm_now);
+            sites_tick(now, tm_now.tm_hour == config->transfer_hour && tm_now.tm_min == config->transfer_minute,
+                       cycle_requested);
+            cycle_requested = 0;
+            wait_for_signal(SITE_TICK_SEC, &signals);
+            continue;
+        }
         
         // Monitor uploads directory for changes
-monitor_uploads_with_path(abs_upload_dir);        
-        // Check if it's time for the scheduled transfer (1 AM)
+        monitor_uploads_with_path(config->upload_dir);
+        
+        // Move urgent and standard reports ahead of the scheduled transfer
         time(&now);
-        tm_now = localtime(&now);
+        scheduler_dispatch(now);
+        
+        // Check if it's time for the scheduled transfer (1 AM)
+        localtime_r(&now, &tm_now);
         
-        if (tm_now->tm_hour == TRANSFER_TIME_HOUR && tm_now->tm_min == TRANSFER_TIME_MIN) {
+        // The scheduled minute spans several passes, run the cycle once
+        if (tm_now.tm_hour == config->transfer_hour && tm_now.tm_min == config->transfer_minute &&
+            now - last_scheduled >= 60) {
             log_message(LOG_INFO, "Starting scheduled transfer and backup");
+            last_scheduled = now;
             
-            // Lock directories before backup and transfer
-            lock_directories();
-            
-            // Check for missing uploads
-            check_missing_uploads();
-            
-            // Backup reporting directory
-            backup_reporting_dir();
-            
-            // Transfer files from upload to reporting
-            transfer_uploads();
-            
-            // Unlock directories after operations
-            unlock_directories();
-            
-            // Sleep for one minute to avoid running the task multiple times
-            sleep(60);
+            // Lock, check, back up, transfer and unlock in one pass
+            run_cycle(0);
+        }
+        
+        // A cycle requested during the day must not starve other disk users
+        if (cycle_requested && !terminate_requested) {
+            cycle_requested = 0;
+            log_message(LOG_INFO, "Received user-defined signal, performing throttled backup/transfer");
+            run_cycle(1);
         }
+        scheduler_report();
         
         // Sleep briefly to avoid high CPU usage
-        sleep(10);
+        wait_for_signal(10, &signals);
     }
     
-    // Clean up resources (though this is normally unreachable)
+    log_message(LOG_INFO, "Received termination signal, cleaning up and exiting");
     cleanup_ipc(msgid);
     cleanup();
     
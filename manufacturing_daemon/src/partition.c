@@ -0,0 +1,356 @@
+#include "../inc/partition.h"
+#include "../inc/company.h"
+#include "../inc/config.h"
+#include "../inc/replication.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+/**
+ * Get the configured reporting layout
+ */
+enum reporting_layout reporting_layout(void) {
+    return config_current()->layout;
+}
+
+/**
+ * Work out the partition (department/YYYY/MM) a report belongs in
+ *
+ * @return 1 on success, 0 if the name does not follow the naming convention
+ */
+int partition_for_report(const char *name, size_t len, char *partition, size_t size) {
+    size_t department_len;
+    long day_number;
+    char date[16];
+
+    if (!parse_report_name(name, len, &department_len, &day_number) ||
+        department_len >= DEPARTMENT_NAME_MAX) {
+        return 0;
+    }
+
+    // The date is always YYYY-MM-DD here, so year and month can be sliced
+    day_to_date(day_number, date, sizeof(date));
+    snprintf(partition, size, "%.*s/%.4s/%.2s", (int)department_len, name, date, date + 5);
+
+    return 1;
+}
+
+/**
+ * Create the directories of a partition below base_dir if needed
+ *
+ * @return 1 on success, 0 on failure
+ */
+int partition_prepare(const char *base_dir, const char *partition) {
+    char path[PATH_MAX];
+    size_t base_len;
+
+    snprintf(path, sizeof(path), "%s/%s", base_dir, partition);
+    base_len = strlen(base_dir) + 1;
+
+    // Create each level in turn, like mkdir -p
+    for (char *slash = path + base_len; ; slash++) {
+        if (*slash != '/' && *slash != '\0') {
+            continue;
+        }
+
+        char saved = *slash;
+        *slash = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            log_message(LOG_ERR, "Failed to create partition directory %s: %s",
+                        path, strerror(errno));
+            return 0;
+        }
+        *slash = saved;
+
+        if (saved == '\0') {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Append a report to its partition's manifest
+ *
+ * @return 1 on success, 0 on failure
+ */
+int partition_manifest_add(const char *base_dir, const char *partition,
+                           const char *name, const struct stat *st) {
+    char path[PATH_MAX];
+    FILE *manifest;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", base_dir, partition, PARTITION_MANIFEST);
+
+    manifest = fopen(path, "a");
+    if (manifest == NULL) {
+        log_message(LOG_ERR, "Failed to open partition manifest %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    fprintf(manifest, "%s\t%lld\t%lld\n", name, (long long)st->st_size, (long long)st->st_mtime);
+
+    if (fclose(manifest) != 0) {
+        log_message(LOG_ERR, "Failed to write partition manifest %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Rename a report in the manifest of the partition directory holding it,
+ * recording the size and time of the file now under the new name. The
+ * manifest is rewritten to a ".part" file and renamed into place. A
+ * directory without a manifest (the flat layout) is left alone.
+ *
+ * @param batch Durability batch the rewritten manifest is added to
+ * @return 1 on success, 0 on failure
+ */
+int partition_manifest_rename(const char *partition_dir, const char *old_name, const char *new_name,
+                              const struct stat *st, struct durability_batch *batch) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char line[NAME_MAX + 64];
+    size_t old_len = strlen(old_name);
+    FILE *manifest, *rewritten;
+    int success = 1;
+
+    if (!format_path(path, sizeof(path), "%s/%s", partition_dir, PARTITION_MANIFEST) ||
+        !format_path(tmp_path, sizeof(tmp_path), "%s%s", path, PARTIAL_SUFFIX)) {
+        return 0;
+    }
+
+    manifest = fopen(path, "r");
+    if (manifest == NULL) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        log_message(LOG_ERR, "Failed to open partition manifest %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    rewritten = fopen(tmp_path, "w");
+    if (rewritten == NULL) {
+        log_message(LOG_ERR, "Failed to rewrite partition manifest %s: %s", path, strerror(errno));
+        fclose(manifest);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        if (strcspn(line, "\t\n") == old_len && strncmp(line, old_name, old_len) == 0) {
+            fprintf(rewritten, "%s\t%lld\t%lld\n", new_name, (long long)st->st_size, (long long)st->st_mtime);
+        } else {
+            fputs(line, rewritten);
+        }
+    }
+    if (ferror(manifest)) {
+        success = 0;
+    }
+    fclose(manifest);
+
+    if (fflush(rewritten) != 0 || !durability_file_written(batch, fileno(rewritten), tmp_path)) {
+        success = 0;
+    }
+    if (fclose(rewritten) != 0 || !success || rename(tmp_path, path) != 0) {
+        log_message(LOG_ERR, "Failed to rewrite partition manifest %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+    durability_entry_changed(batch, path);
+    replication_file(path);
+
+    return 1;
+}
+
+/**
+ * Add every report listed in a partition's manifest to a missing report
+ * index, without listing the partition directory
+ *
+ * @return 1 on success, 0 if the manifest could not be read
+ */
+int partition_manifest_add_to_index(const char *base_dir, const char *partition,
+                                    struct report_index *index) {
+    char path[PATH_MAX];
+    char line[NAME_MAX + 64];
+    FILE *manifest;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", base_dir, partition, PARTITION_MANIFEST);
+
+    manifest = fopen(path, "r");
+    if (manifest == NULL) {
+        return errno == ENOENT;
+    }
+
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        size_t name_len = strcspn(line, "\t\n");
+        report_index_add_name(index, line, name_len);
+    }
+
+    fclose(manifest);
+    return 1;
+}
+
+/**
+ * Read the partition index of a reporting directory or snapshot.
+ * A missing index is treated as empty.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int partition_index_load(struct partition_index *index, const char *base_dir) {
+    char path[PATH_MAX];
+    char line[PARTITION_PATH_MAX + 32];
+    FILE *file;
+
+    memset(index, 0, sizeof(*index));
+
+    snprintf(path, sizeof(path), "%s/%s", base_dir, PARTITION_INDEX);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        log_message(LOG_ERR, "Failed to open partition index %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *tab = strchr(line, '\t');
+        if (tab == NULL || (size_t)(tab - line) >= PARTITION_PATH_MAX) {
+            continue;
+        }
+        *tab = '\0';
+
+        if (!partition_index_touch(index, line)) {
+            fclose(file);
+            partition_index_free(index);
+            return 0;
+        }
+        partition_index_find(index, line)->generation = strtoul(tab + 1, NULL, 10);
+    }
+
+    fclose(file);
+    index->dirty = 0;
+
+    return 1;
+}
+
+/**
+ * Write the partition index, replacing the old one atomically
+ *
+ * @return 1 on success, 0 on failure
+ */
+int partition_index_save(const struct partition_index *index, const char *base_dir) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    FILE *file;
+
+    if (!format_path(path, sizeof(path), "%s/%s", base_dir, PARTITION_INDEX) ||
+        !format_path(tmp_path, sizeof(tmp_path), "%s%s", path, PARTIAL_SUFFIX)) {
+        return 0;
+    }
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_message(LOG_ERR, "Failed to write partition index %s: %s", tmp_path, strerror(errno));
+        return 0;
+    }
+
+    for (size_t i = 0; i < index->count; i++) {
+        fprintf(file, "%s\t%lu\n", index->entries[i].path, index->entries[i].generation);
+    }
+
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        log_message(LOG_ERR, "Failed to write partition index %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Binary search the sorted index for a partition
+ *
+ * @return Index of the partition, or where it would be inserted
+ */
+static size_t partition_index_position(const struct partition_index *index, const char *partition) {
+    size_t low = 0, high = index->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(index->entries[mid].path, partition) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Look up a partition in the index
+ *
+ * @return The entry, or NULL if the partition is not in the index
+ */
+struct partition_entry *partition_index_find(const struct partition_index *index, const char *partition) {
+    size_t pos = partition_index_position(index, partition);
+
+    if (pos < index->count && strcmp(index->entries[pos].path, partition) == 0) {
+        return &index->entries[pos];
+    }
+    return NULL;
+}
+
+/**
+ * Record that a partition changed, adding it to the index if it is new.
+ * Entries are kept sorted by path.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int partition_index_touch(struct partition_index *index, const char *partition) {
+    size_t pos = partition_index_position(index, partition);
+    struct partition_entry *entry;
+
+    if (pos < index->count && strcmp(index->entries[pos].path, partition) == 0) {
+        entry = &index->entries[pos];
+    } else {
+        if (index->count == index->capacity) {
+            size_t new_capacity = index->capacity ? index->capacity * 2 : 64;
+            struct partition_entry *grown = realloc(index->entries, new_capacity * sizeof(*grown));
+            if (grown == NULL) {
+                log_message(LOG_ERR, "Out of memory growing partition index");
+                return 0;
+            }
+            index->entries = grown;
+            index->capacity = new_capacity;
+        }
+
+        memmove(&index->entries[pos + 1], &index->entries[pos],
+                (index->count - pos) * sizeof(*index->entries));
+        index->count++;
+
+        entry = &index->entries[pos];
+        snprintf(entry->path, sizeof(entry->path), "%s", partition);
+        entry->generation = 0;
+    }
+
+    entry->generation++;
+    index->dirty = 1;
+
+    return 1;
+}
+
+/**
+ * Release the memory held by a partition index
+ */
+void partition_index_free(struct partition_index *index) {
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+}
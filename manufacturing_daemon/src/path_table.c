@@ -0,0 +1,151 @@
+#include "../inc/path_table.h"
+#include "../inc/company.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+/**
+ * FNV-1a hash of a string
+ */
+static uint32_t path_hash(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Initialise an empty path table, nothing is allocated until the first
+ * string is interned
+ */
+void path_table_init(struct path_table *table) {
+    arena_init(&table->arena, 0);
+    table->strings = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->slots = NULL;
+    table->slot_count = 0;
+}
+
+/**
+ * Rebuild the hash index with twice as many slots
+ *
+ * @return 1 on success, 0 if out of memory
+ */
+static int path_table_grow(struct path_table *table) {
+    size_t slot_count = table->slot_count ? table->slot_count * 2 : PATH_TABLE_SLOTS;
+    uint32_t *slots = calloc(slot_count, sizeof(*slots));
+
+    if (slots == NULL) {
+        return 0;
+    }
+
+    for (size_t id = 0; id < table->count; id++) {
+        size_t slot = table->strings[id].hash & (slot_count - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = (uint32_t)id + 1;
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->slot_count = slot_count;
+
+    return 1;
+}
+
+/**
+ * Store a string in the table unless it is already there
+ *
+ * @return The string's id, or PATH_TABLE_NONE if out of memory
+ */
+uint32_t path_table_intern(struct path_table *table, const char *str, size_t len) {
+    uint32_t hash = path_hash(str, len);
+
+    if (table->count * 2 >= table->slot_count && !path_table_grow(table)) {
+        log_message(LOG_ERR, "Out of memory interning paths");
+        return PATH_TABLE_NONE;
+    }
+
+    size_t slot = hash & (table->slot_count - 1);
+    while (table->slots[slot] != 0) {
+        const struct path_string *string = &table->strings[table->slots[slot] - 1];
+        if (string->hash == hash && string->len == len && memcmp(string->str, str, len) == 0) {
+            return table->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+
+    if (table->count == PATH_TABLE_NONE) {
+        log_message(LOG_ERR, "Too many paths to intern");
+        return PATH_TABLE_NONE;
+    }
+    if (table->count == table->capacity) {
+        size_t new_capacity = table->capacity ? table->capacity * 2 : PATH_TABLE_SLOTS / 2;
+        struct path_string *grown = realloc(table->strings, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            log_message(LOG_ERR, "Out of memory interning paths");
+            return PATH_TABLE_NONE;
+        }
+        table->strings = grown;
+        table->capacity = new_capacity;
+    }
+
+    char *copy = arena_strndup(&table->arena, str, len);
+    if (copy == NULL) {
+        log_message(LOG_ERR, "Out of memory interning paths");
+        return PATH_TABLE_NONE;
+    }
+
+    uint32_t id = (uint32_t)table->count++;
+    table->strings[id].str = copy;
+    table->strings[id].len = (uint32_t)len;
+    table->strings[id].hash = hash;
+    table->slots[slot] = id + 1;
+
+    return id;
+}
+
+/**
+ * Look up an interned string by id
+ */
+const char *path_table_string(const struct path_table *table, uint32_t id) {
+    return table->strings[id].str;
+}
+
+/**
+ * Write the full path of a reference, directory and name joined by '/'
+ *
+ * @return 1 on success, 0 if the path does not fit in the buffer
+ */
+int path_table_format(const struct path_table *table, struct path_ref ref, char *buf, size_t size) {
+    const struct path_string *dir = &table->strings[ref.dir];
+    const struct path_string *name = &table->strings[ref.name];
+    size_t len = (size_t)dir->len + 1 + name->len;
+
+    if (len >= size) {
+        return 0;
+    }
+
+    memcpy(buf, dir->str, dir->len);
+    buf[dir->len] = '/';
+    memcpy(buf + dir->len + 1, name->str, name->len);
+    buf[len] = '\0';
+
+    return 1;
+}
+
+/**
+ * Release every string of a path table
+ */
+void path_table_free(struct path_table *table) {
+    arena_free(&table->arena);
+    free(table->strings);
+    free(table->slots);
+    path_table_init(table);
+}
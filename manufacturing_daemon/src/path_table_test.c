@@ -0,0 +1,87 @@
+#include "../inc/path_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Names interned to make the table grow several times past its first
+// PATH_TABLE_SLOTS slots
+#define PATH_TEST_NAMES (PATH_TABLE_SLOTS * 5)
+
+static int failures = 0;
+
+static void expect(int condition, const char *what) {
+    if (condition) {
+        printf("ok %s\n", what);
+    } else {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static void report_name(size_t i, char *name, size_t size) {
+    snprintf(name, size, "sales_%05zu.xml", i);
+}
+
+/**
+ * Check that equal strings share one id, that ids and strings survive
+ * the index growing, and that formatting refuses a buffer that is too
+ * small
+ *
+ * Usage: path_table_test
+ */
+int main(void) {
+    struct path_table table;
+    char name[32], path[64];
+    uint32_t *ids;
+    int stable = 1, distinct = 1;
+
+    path_table_init(&table);
+
+    uint32_t dir = path_table_intern(&table, "./data/reporting", strlen("./data/reporting"));
+    uint32_t again = path_table_intern(&table, "./data/reporting/extra", strlen("./data/reporting"));
+    uint32_t upload = path_table_intern(&table, "./data/upload", strlen("./data/upload"));
+    expect(dir != PATH_TABLE_NONE && dir == again, "equal strings interned once");
+    expect(upload != dir && table.count == 2, "different strings get their own id");
+    expect(strcmp(path_table_string(&table, dir), "./data/reporting") == 0,
+           "interned string is a terminated copy of the given length");
+
+    ids = malloc(PATH_TEST_NAMES * sizeof(*ids));
+    if (ids == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < PATH_TEST_NAMES; i++) {
+        report_name(i, name, sizeof(name));
+        ids[i] = path_table_intern(&table, name, strlen(name));
+        if (ids[i] == PATH_TABLE_NONE || (i > 0 && ids[i] == ids[i - 1])) {
+            distinct = 0;
+        }
+    }
+    for (size_t i = 0; i < PATH_TEST_NAMES; i++) {
+        report_name(i, name, sizeof(name));
+        if (path_table_intern(&table, name, strlen(name)) != ids[i] ||
+            strcmp(path_table_string(&table, ids[i]), name) != 0) {
+            stable = 0;
+        }
+    }
+    expect(distinct && table.count == PATH_TEST_NAMES + 2, "every new name gets a new id");
+    expect(stable && table.slot_count > PATH_TABLE_SLOTS, "ids and strings survive the index growing");
+
+    struct path_ref ref = { dir, ids[7] };
+    size_t len = strlen("./data/reporting/sales_00007.xml");
+    expect(path_table_format(&table, ref, path, sizeof(path)) &&
+           strcmp(path, "./data/reporting/sales_00007.xml") == 0, "reference formatted as dir/name");
+    expect(path_table_format(&table, ref, path, len + 1), "path that just fits is formatted");
+    expect(!path_table_format(&table, ref, path, len), "path one byte too long is refused");
+
+    path_table_free(&table);
+    expect(table.count == 0 && path_table_intern(&table, "x", 1) == 0, "freed table can be reused");
+    path_table_free(&table);
+    free(ids);
+
+    if (failures > 0) {
+        printf("%d path table checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
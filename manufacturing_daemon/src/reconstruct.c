@@ -0,0 +1,62 @@
+#include "../inc/company.h"
+#include "../inc/versions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Write out any stored version of a report, rebuilding it from deltas if
+ * it was stored as one.
+ *
+ * Usage: company_reconstruct <version> [output]
+ *
+ * The version is the path of a report version in the reporting directory
+ * or a backup snapshot, with or without its ".delta" suffix. The report
+ * is written to output, or to standard output if none is given.
+ */
+int main(int argc, char *argv[]) {
+    char path[PATH_MAX];
+    struct delta_buffer content;
+    FILE *out = stdout;
+
+    if (argc < 2 || argc > 3 || strcmp(argv[1], "--help") == 0) {
+        fprintf(stderr, "Usage: %s <version> [output]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!config_load(CONFIG_FILE)) {
+        fprintf(stderr, "Could not load configuration from %s\n", CONFIG_FILE);
+        return EXIT_FAILURE;
+    }
+
+    // A version that is no longer a full copy is found by its delta
+    snprintf(path, sizeof(path), "%s", argv[1]);
+    if (access(path, F_OK) != 0 && strlen(path) + strlen(VERSION_DELTA_SUFFIX) < sizeof(path)) {
+        strcat(path, VERSION_DELTA_SUFFIX);
+    }
+
+    if (!version_read(path, &content)) {
+        fprintf(stderr, "Could not read %s, see the error log\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 2 && (out = fopen(argv[2], "wb")) == NULL) {
+        perror(argv[2]);
+        delta_buffer_free(&content);
+        return EXIT_FAILURE;
+    }
+
+    int ok = fwrite(content.data, 1, content.size, out) == content.size;
+    if (fclose(out) != 0) {
+        ok = 0;
+    }
+    delta_buffer_free(&content);
+
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", argc > 2 ? argv[2] : "standard output");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+#include "../inc/company.h"
+#include "../inc/replication.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+/**
+ * Apply the frames of one connection to the replica, acknowledging each
+ * batch once it is durable. Returns when the daemon disconnects or sends
+ * something that does not check out; it then resends from the last
+ * acknowledged batch.
+ */
+static void serve_connection(struct replica *replica, int fd) {
+    FILE *in = fdopen(fd, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    size_t files = 0;
+
+    if (in == NULL) {
+        close(fd);
+        return;
+    }
+
+    while ((line_len = getline(&line, &line_size, in)) > 0) {
+        char ack[32];
+        int len;
+
+        if (line[line_len - 1] != '\n') {
+            break;
+        }
+        line[line_len - 1] = '\0';
+
+        if (line[0] == REPLICATION_TAG_FILE) {
+            char *save = NULL;
+            char *size_str = strtok_r(line + 1, "\t", &save);
+            char *path = strtok_r(NULL, "\t", &save);
+
+            // A file failing its checksum is discarded and the connection
+            // dropped, the daemon sends it again from the last batch
+            if (size_str == NULL || path == NULL ||
+                !replica_store(replica, path, in, strtoll(size_str, NULL, 10), 1)) {
+                break;
+            }
+            files++;
+        } else if (line[0] == REPLICATION_TAG_REMOVE && line[1] == '\t') {
+            if (!replica_remove(replica, line + 2)) {
+                break;
+            }
+        } else if (line[0] == REPLICATION_TAG_BATCH && line[1] == '\t') {
+            if (!replica_commit(replica)) {
+                break;
+            }
+            len = snprintf(ack, sizeof(ack), "%c\t%s\n", REPLICATION_TAG_ACK, line + 2);
+            if (write(fd, ack, len) != len) {
+                break;
+            }
+        } else {
+            log_message(LOG_ERR, "Unexpected replication frame");
+            break;
+        }
+    }
+
+    // Whatever was applied after the last batch is simply sent again
+    replica_commit(replica);
+    free(line);
+    fclose(in);
+
+    printf("Connection closed, %zu files received\n", files);
+    fflush(stdout);
+}
+
+/**
+ * Receive replication from a company daemon into a standby directory.
+ *
+ * Usage: company_replica <unix:path | tcp:[host]:port> <directory>
+ *
+ * Point the daemon's replication_target at the same address. Reports end
+ * up in <directory>/reporting and backups in <directory>/backup.
+ */
+int main(int argc, char *argv[]) {
+    struct replica replica;
+    int listen_fd;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <unix:path | tcp:[host]:port> <directory>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!config_load(CONFIG_FILE) || !replica_open(&replica, argv[2])) {
+        fprintf(stderr, "Could not open replica %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    listen_fd = replica_connect(argv[1], 1);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Could not listen on %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // A daemon that disconnects mid-ack must not end the receiver
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Receiving replication on %s into %s\n", argv[1], argv[2]);
+    fflush(stdout);
+
+    // One daemon at a time, it reconnects if it loses the connection
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        serve_connection(&replica, fd);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,998 @@
+#define _GNU_SOURCE
+#include "../inc/replication.h"
+#include "../inc/company.h"
+#include "../inc/checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// The outbound log, appended to by the cycles and read by the shipper
+static pthread_mutex_t replication_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replication_wake = PTHREAD_COND_INITIALIZER;
+static int replication_started = 0;
+static int log_fd = -1;
+static long long log_size = 0;
+static char log_path[PATH_MAX];
+static char ack_path[PATH_MAX];
+
+// A batch sent to the standby and not yet acknowledged
+struct replication_batch {
+    long long end;
+    long long oldest_ms;
+    size_t records;
+};
+
+// State of the shipping thread
+struct shipper {
+    char target[PATH_MAX];
+    int connected;
+    int fd;                 // Socket to the receiver, -1 for a directory target
+    FILE *out;
+    struct replica replica; // Directory target
+    FILE *log;
+    long long sent, acked;
+    struct replication_batch inflight[REPLICATION_WINDOW];
+    int inflight_count;
+    char ack_buf[256];
+    size_t ack_len;
+    size_t shipped_records;
+    long long lag_ms;
+};
+
+/**
+ * Current wall clock time in milliseconds, comparable across processes
+ */
+static long long replication_clock_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Write a whole buffer, retrying on short writes
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 1;
+}
+
+/**
+ * Read the log offset the standby acknowledged last
+ */
+static long long load_ack(void) {
+    long long offset = 0;
+    FILE *file = fopen(ack_path, "r");
+
+    if (file) {
+        if (fscanf(file, "%lld", &offset) != 1 || offset < 0) {
+            offset = 0;
+        }
+        fclose(file);
+    }
+    return offset;
+}
+
+/**
+ * Remember the acknowledged offset. It is not synced: losing it after a
+ * crash only means some records are sent again, and applying them twice
+ * is harmless.
+ */
+static void save_ack(long long offset) {
+    char tmp_path[PATH_MAX];
+    FILE *file;
+
+    if (!format_path(tmp_path, sizeof(tmp_path), "%s%s", ack_path, PARTIAL_SUFFIX)) {
+        return;
+    }
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_message(LOG_WARNING, "Failed to save replication offset: %s", strerror(errno));
+        return;
+    }
+    fprintf(file, "%lld\n", offset);
+    if (fclose(file) != 0 || rename(tmp_path, ack_path) != 0) {
+        log_message(LOG_WARNING, "Failed to save replication offset: %s", strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Check that a path received from the other side stays below the
+ * replica's root
+ */
+static int replica_path_valid(const char *path) {
+    const char *component = path;
+
+    if (path[0] == '\0' || path[0] == '/') {
+        return 0;
+    }
+    while (component != NULL) {
+        if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == '\0')) {
+            return 0;
+        }
+        component = strchr(component, '/');
+        if (component != NULL) {
+            component++;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Create every missing parent directory of a path, like mkdir -p
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int replica_make_parents(struct replica *replica, char *path) {
+    size_t root_len = strlen(replica->root) + 1;
+
+    for (char *slash = strchr(path + root_len, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0755) == 0) {
+            durability_entry_changed(&replica->batch, path);
+        } else if (errno != EEXIST) {
+            log_message(LOG_ERR, "Failed to create replica directory %s: %s", path, strerror(errno));
+            *slash = '/';
+            return 0;
+        }
+        *slash = '/';
+    }
+    return 1;
+}
+
+/**
+ * Open a standby's copy, creating its directories if needed
+ *
+ * @return 1 on success, 0 on failure
+ */
+int replica_open(struct replica *replica, const char *root) {
+    char path[PATH_MAX];
+
+    memset(replica, 0, sizeof(*replica));
+    snprintf(replica->root, sizeof(replica->root), "%s", root);
+
+    if (mkdir(root, 0755) < 0 && errno != EEXIST) {
+        log_message(LOG_ERR, "Failed to create replica directory %s: %s", root, strerror(errno));
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%s", root, REPLICA_REPORTING);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/%s", root, REPLICA_BACKUP);
+    mkdir(path, 0755);
+
+    durability_begin(&replica->batch);
+    return 1;
+}
+
+/**
+ * Write a replicated file of the given size read from a stream. The data
+ * goes to a ".part" file renamed into place once complete, so readers on
+ * the standby never see half a file. A file received over the wire is
+ * followed by the CRC32C the daemon read, and is only renamed into place
+ * if the data written matches it.
+ *
+ * @param checked Read and verify the CRC32C trailer after the data
+ * @return 1 on success, 0 on failure
+ */
+int replica_store(struct replica *replica, const char *path, FILE *in, long long size, int checked) {
+    char dst_path[PATH_MAX];
+    char part_path[PATH_MAX];
+    char buffer[COPY_BUFFER_SIZE];
+    char check[32];
+    FILE *dst_file;
+    uint32_t crc = 0;
+    int success = 1;
+
+    if (!replica_path_valid(path)) {
+        log_message(LOG_ERR, "Refusing to replicate to %s", path);
+        return 0;
+    }
+
+    if (!format_path(dst_path, sizeof(dst_path), "%s/%s", replica->root, path) ||
+        !format_path(part_path, sizeof(part_path), "%s%s", dst_path, PARTIAL_SUFFIX) ||
+        !replica_make_parents(replica, part_path)) {
+        return 0;
+    }
+
+    dst_file = fopen(part_path, "wb");
+    if (dst_file == NULL) {
+        log_message(LOG_ERR, "Failed to create replica file %s: %s", part_path, strerror(errno));
+        return 0;
+    }
+    setvbuf(dst_file, NULL, _IONBF, 0);
+
+    // Always consume the whole file from the stream, even after a write
+    // error, so the next frame is read from the right place
+    while (size > 0) {
+        size_t want = size < (long long)sizeof(buffer) ? (size_t)size : sizeof(buffer);
+        size_t bytes = fread(buffer, 1, want, in);
+        if (bytes == 0) {
+            log_message(LOG_ERR, "Replication stream ended inside %s", path);
+            success = 0;
+            break;
+        }
+        if (success && fwrite(buffer, 1, bytes, dst_file) != bytes) {
+            log_message(LOG_ERR, "Error writing replica file %s: %s", part_path, strerror(errno));
+            success = 0;
+        }
+        crc = crc32c_update(crc, buffer, bytes);
+        size -= bytes;
+    }
+
+    if (success && checked &&
+        (fgets(check, sizeof(check), in) == NULL || check[0] != REPLICATION_TAG_CHECK ||
+         check[1] != '\t' || (uint32_t)strtoul(check + 2, NULL, 16) != crc)) {
+        log_message(LOG_ERR, "Checksum mismatch receiving %s, discarding it", path);
+        success = 0;
+    }
+
+    if (success && !durability_file_written(&replica->batch, fileno(dst_file), part_path)) {
+        success = 0;
+    }
+    if (fclose(dst_file) != 0) {
+        success = 0;
+    }
+
+    if (success && rename(part_path, dst_path) != 0) {
+        log_message(LOG_ERR, "Failed to rename %s to %s: %s", part_path, dst_path, strerror(errno));
+        success = 0;
+    }
+    if (!success) {
+        unlink(part_path);
+        return 0;
+    }
+
+    durability_entry_changed(&replica->batch, dst_path);
+    replica->files++;
+    return 1;
+}
+
+/**
+ * Remove one entry of a tree, called by nftw() children first
+ */
+static int replica_remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+
+    if (remove(path) < 0 && errno != ENOENT) {
+        log_message(LOG_WARNING, "Failed to remove replica entry %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Remove a replicated file or directory tree, such as a pruned snapshot
+ *
+ * @return 1 on success, 0 on failure
+ */
+int replica_remove(struct replica *replica, const char *path) {
+    char full_path[PATH_MAX];
+    struct stat st;
+
+    if (!replica_path_valid(path)) {
+        log_message(LOG_ERR, "Refusing to remove %s from replica", path);
+        return 0;
+    }
+
+    if (!format_path(full_path, sizeof(full_path), "%s/%s", replica->root, path)) {
+        return 0;
+    }
+    if (lstat(full_path, &st) < 0) {
+        // Never replicated, or removed by an earlier attempt
+        return errno == ENOENT;
+    }
+
+    if (nftw(full_path, replica_remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        return 0;
+    }
+
+    durability_entry_changed(&replica->batch, full_path);
+    replica->removed++;
+    return 1;
+}
+
+/**
+ * Make everything applied since the last commit durable. Only after this
+ * may the batch be acknowledged.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int replica_commit(struct replica *replica) {
+    int success = durability_commit(&replica->batch);
+
+    durability_begin(&replica->batch);
+    return success;
+}
+
+/**
+ * Connect to, or listen on, a "unix:<path>" or "tcp:<host>:<port>"
+ * replication target. An empty host listens on every address.
+ *
+ * @return The socket, or -1 on failure
+ */
+int replica_connect(const char *target, int listen_mode) {
+    int fd = -1;
+
+    if (strncmp(target, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(target + 5) >= sizeof(addr.sun_path)) {
+            log_message(LOG_ERR, "Socket path too long: %s", target + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, target + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listen_mode) {
+            unlink(addr.sun_path);
+            if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+                log_message(LOG_ERR, "Failed to listen on %s: %s", target, strerror(errno));
+                close(fd);
+                return -1;
+            }
+        } else if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (strncmp(target, "tcp:", 4) == 0) {
+        char host[NI_MAXHOST];
+        const char *port = strrchr(target + 4, ':');
+        struct addrinfo hints, *addrs, *addr;
+        int one = 1;
+
+        if (port == NULL || (size_t)(port - (target + 4)) >= sizeof(host)) {
+            log_message(LOG_ERR, "Expected tcp:<host>:<port>, got %s", target);
+            return -1;
+        }
+        memcpy(host, target + 4, port - (target + 4));
+        host[port - (target + 4)] = '\0';
+        port++;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listen_mode ? AI_PASSIVE : 0;
+        if (getaddrinfo(host[0] ? host : NULL, port, &hints, &addrs) != 0) {
+            log_message(LOG_ERR, "Failed to resolve %s", target);
+            return -1;
+        }
+
+        for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (listen_mode) {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, 1) == 0) {
+                    break;
+                }
+            } else if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+                // Batches end with a flush, send it without waiting
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addrs);
+
+        if (fd < 0 && listen_mode) {
+            log_message(LOG_ERR, "Failed to listen on %s", target);
+        }
+        return fd;
+    }
+
+    log_message(LOG_ERR, "Unknown replication target %s", target);
+    return -1;
+}
+
+/**
+ * Map a local path below the reporting or backup directory to its path
+ * on the standby. Each site of a daemon serving several gets a directory
+ * of its own there.
+ *
+ * @return 1 on success, 0 if the path is not replicated
+ */
+static int replication_remote_path(const struct config *config, const char *local_path,
+                                   char *remote, size_t size) {
+    const char *roots[] = { config->reporting_dir, config->backup_dir };
+    const char *names[] = { REPLICA_REPORTING, REPLICA_BACKUP };
+
+    for (size_t i = 0; i < 2; i++) {
+        size_t len = strlen(roots[i]);
+        if (strncmp(local_path, roots[i], len) == 0 && local_path[len] == '/') {
+            if (config->site[0] != '\0') {
+                snprintf(remote, size, "%s/%s/%s", config->site, names[i], local_path + len + 1);
+            } else {
+                snprintf(remote, size, "%s/%s", names[i], local_path + len + 1);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *replication_thread(void *arg);
+
+/**
+ * Open the outbound log and start shipping it. Must be called with
+ * replication_lock held.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int replication_start_locked(const struct config *config) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t signals;
+    struct stat st;
+    int started;
+
+    if (replication_started) {
+        return 1;
+    }
+
+    snprintf(log_path, sizeof(log_path), "%s", config->replication_log);
+    if (!format_path(ack_path, sizeof(ack_path), "%s%s", log_path, REPLICATION_ACK_SUFFIX)) {
+        return 0;
+    }
+
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0 || fstat(log_fd, &st) < 0) {
+        log_message(LOG_ERR, "Failed to open replication log %s: %s", log_path, strerror(errno));
+        if (log_fd >= 0) {
+            close(log_fd);
+            log_fd = -1;
+        }
+        return 0;
+    }
+    log_size = st.st_size;
+
+    // A standby that goes away must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    block_signals(&signals);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, replication_thread, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    restore_signals(&signals);
+    if (!started) {
+        log_message(LOG_ERR, "Failed to start replication thread");
+        close(log_fd);
+        log_fd = -1;
+        return 0;
+    }
+
+    replication_started = 1;
+    log_message(LOG_INFO, "Replicating to %s, %lld bytes of the log still to ship",
+                config->replication_target, log_size - load_ack());
+    return 1;
+}
+
+/**
+ * Start shipping the outbound log if a replication target is set, so
+ * changes left over from the previous run reach the standby. Setting a
+ * target later with a reload starts it on the next change.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int replication_start(void) {
+    const struct config *config = config_get();
+    int success = 1;
+
+    if (config->replication_target[0] != '\0') {
+        pthread_mutex_lock(&replication_lock);
+        success = replication_start_locked(config);
+        pthread_mutex_unlock(&replication_lock);
+    }
+
+    config_put(config);
+    return success;
+}
+
+/**
+ * Append a record for a local path to the outbound log
+ */
+static void replication_append(char tag, const char *local_path) {
+    const struct config *config = config_get();
+    char remote[PATH_MAX];
+    char record[2 * PATH_MAX + 64];
+    int len;
+
+    if (config->replication_target[0] == '\0' ||
+        !replication_remote_path(config, local_path, remote, sizeof(remote))) {
+        config_put(config);
+        return;
+    }
+
+    // Tabs and newlines are the record separators
+    if (strpbrk(local_path, "\t\n")) {
+        log_message(LOG_WARNING, "Not replicating file with unsupported characters in name: %s", local_path);
+        config_put(config);
+        return;
+    }
+
+    if (tag == REPLICATION_TAG_FILE) {
+        len = snprintf(record, sizeof(record), "%c\t%lld\t%s\t%s\n",
+                       tag, replication_clock_ms(), remote, local_path);
+    } else {
+        len = snprintf(record, sizeof(record), "%c\t%lld\t%s\n", tag, replication_clock_ms(), remote);
+    }
+
+    pthread_mutex_lock(&replication_lock);
+    if (replication_start_locked(config)) {
+        if (write_all(log_fd, record, len)) {
+            log_size += len;
+        } else {
+            log_message(LOG_ERR, "Failed to write replication log: %s", strerror(errno));
+            // Drop a torn record so the next one starts on a line of its own
+            if (ftruncate(log_fd, log_size) < 0) {
+                log_message(LOG_ERR, "Failed to repair replication log: %s", strerror(errno));
+            }
+        }
+    }
+    pthread_mutex_unlock(&replication_lock);
+
+    config_put(config);
+}
+
+/**
+ * Queue a completed report or backup file for the standby
+ */
+void replication_file(const char *local_path) {
+    replication_append(REPLICATION_TAG_FILE, local_path);
+}
+
+/**
+ * Queue the removal of a file or directory tree, such as a pruned
+ * snapshot, on the standby
+ */
+void replication_remove(const char *local_path) {
+    replication_append(REPLICATION_TAG_REMOVE, local_path);
+}
+
+/**
+ * Make the records of a finished transfer or backup durable and wake the
+ * shipper. Called once per operation, so all of its records share one
+ * sync.
+ */
+void replication_flush(void) {
+    pthread_mutex_lock(&replication_lock);
+    if (log_fd >= 0) {
+        if (fdatasync(log_fd) < 0) {
+            log_message(LOG_ERR, "Failed to sync replication log: %s", strerror(errno));
+        }
+        pthread_cond_signal(&replication_wake);
+    }
+    pthread_mutex_unlock(&replication_lock);
+}
+
+/**
+ * Close the connection to the standby. Unacknowledged batches are sent
+ * again from the acknowledged offset on the next connection.
+ */
+static void shipper_disconnect(struct shipper *shipper, const char *reason) {
+    if (!shipper->connected) {
+        return;
+    }
+
+    if (reason != NULL) {
+        log_message(LOG_WARNING, "Lost replication target %s: %s, resuming from offset %lld",
+                    shipper->target, reason, shipper->acked);
+    }
+    if (shipper->out != NULL) {
+        fclose(shipper->out);
+        shipper->out = NULL;
+    } else if (shipper->fd < 0) {
+        replica_commit(&shipper->replica);
+    }
+    shipper->fd = -1;
+    shipper->connected = 0;
+    shipper->inflight_count = 0;
+    shipper->ack_len = 0;
+}
+
+/**
+ * Connect to the configured target
+ *
+ * @return 1 on success, 0 if it is unavailable
+ */
+static int shipper_connect(struct shipper *shipper, const char *target) {
+    snprintf(shipper->target, sizeof(shipper->target), "%s", target);
+    shipper->fd = -1;
+    shipper->out = NULL;
+
+    if (strncmp(target, "dir:", 4) == 0) {
+        if (!replica_open(&shipper->replica, target + 4)) {
+            return 0;
+        }
+    } else {
+        shipper->fd = replica_connect(target, 0);
+        if (shipper->fd < 0) {
+            return 0;
+        }
+        shipper->out = fdopen(shipper->fd, "w");
+        if (shipper->out == NULL) {
+            close(shipper->fd);
+            shipper->fd = -1;
+            return 0;
+        }
+        // Frames of a batch go out in large writes, flushed at its end
+        setvbuf(shipper->out, NULL, _IOFBF, COPY_BUFFER_SIZE);
+    }
+
+    shipper->connected = 1;
+    shipper->sent = shipper->acked;
+    shipper->inflight_count = 0;
+    shipper->ack_len = 0;
+    log_message(LOG_INFO, "Connected to replication target %s, resuming from offset %lld",
+                target, shipper->acked);
+    return 1;
+}
+
+/**
+ * Send one file, followed by the CRC32C of the data actually read so the
+ * standby can tell a torn transfer from a good one
+ *
+ * @return 1 on success, 0 if the connection failed
+ */
+static int ship_file(struct shipper *shipper, const char *remote, const char *local_path) {
+    char buffer[COPY_BUFFER_SIZE];
+    struct stat st;
+    uint32_t crc = 0;
+    FILE *file;
+
+    file = fopen(local_path, "rb");
+    if (file == NULL || fstat(fileno(file), &st) < 0) {
+        // Removed since, e.g. a pruned snapshot whose removal follows
+        if (file) {
+            fclose(file);
+        }
+        return 1;
+    }
+
+    if (shipper->fd < 0) {
+        int success = replica_store(&shipper->replica, remote, file, st.st_size, 0);
+        fclose(file);
+        return success;
+    }
+
+    setvbuf(file, NULL, _IONBF, 0);
+    fprintf(shipper->out, "%c\t%lld\t%s\n", REPLICATION_TAG_FILE, (long long)st.st_size, remote);
+
+    long long remaining = st.st_size;
+    while (remaining > 0) {
+        size_t want = remaining < (long long)sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+        size_t bytes = fread(buffer, 1, want, file);
+        if (bytes == 0) {
+            // The file shrank, the standby could not parse the rest
+            fclose(file);
+            return 0;
+        }
+        crc = crc32c_update(crc, buffer, bytes);
+        if (fwrite(buffer, 1, bytes, shipper->out) != bytes) {
+            fclose(file);
+            return 0;
+        }
+        remaining -= bytes;
+    }
+    fclose(file);
+
+    return fprintf(shipper->out, "%c\t%08x\n", REPLICATION_TAG_CHECK, crc) > 0;
+}
+
+/**
+ * Handle acknowledgements from the standby, waiting up to timeout_ms for
+ * the first one
+ *
+ * @return 1 on success, 0 if the connection failed
+ */
+static int shipper_read_acks(struct shipper *shipper, int timeout_ms) {
+    struct pollfd pfd = { shipper->fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+
+    if (ready < 0) {
+        return errno == EINTR;
+    }
+    if (ready == 0) {
+        return 1;
+    }
+
+    ssize_t bytes = read(shipper->fd, shipper->ack_buf + shipper->ack_len,
+                         sizeof(shipper->ack_buf) - shipper->ack_len - 1);
+    if (bytes <= 0) {
+        return bytes < 0 && errno == EINTR;
+    }
+    shipper->ack_len += bytes;
+    shipper->ack_buf[shipper->ack_len] = '\0';
+
+    char *line = shipper->ack_buf, *newline;
+    while ((newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+        long long offset = line[0] == REPLICATION_TAG_ACK ? strtoll(line + 2, NULL, 10) : -1;
+
+        // Batches are committed in order, so acks arrive in order too
+        if (shipper->inflight_count == 0 || offset != shipper->inflight[0].end) {
+            return 0;
+        }
+        shipper->acked = offset;
+        shipper->shipped_records += shipper->inflight[0].records;
+        shipper->lag_ms = replication_clock_ms() - shipper->inflight[0].oldest_ms;
+        memmove(&shipper->inflight[0], &shipper->inflight[1],
+                --shipper->inflight_count * sizeof(shipper->inflight[0]));
+        save_ack(offset);
+
+        line = newline + 1;
+    }
+
+    shipper->ack_len = strlen(line);
+    memmove(shipper->ack_buf, line, shipper->ack_len);
+    return 1;
+}
+
+// A record of the outbound log read back by the shipper
+struct replication_record {
+    char tag;
+    char *remote;
+    char *local_path;
+};
+
+/**
+ * Check whether a later record of the batch replaces this one, so a file
+ * written several times in a row, like a partition manifest, is only
+ * sent once
+ */
+static int record_superseded(const struct replication_record *records, size_t i, size_t count) {
+    for (size_t j = i + 1; j < count; j++) {
+        if (strcmp(records[j].remote, records[i].remote) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the next batch of records from the log and send it
+ *
+ * @return 1 on success, 0 if the connection failed
+ */
+static int ship_batch(struct shipper *shipper, long long end) {
+    struct replication_batch batch = { shipper->sent, 0, 0 };
+    struct replication_record records[REPLICATION_BATCH_RECORDS];
+    char *lines[REPLICATION_BATCH_RECORDS];
+    char *line = NULL;
+    size_t line_size = 0, bytes = 0, count = 0;
+    ssize_t line_len;
+    int success = 1;
+
+    if (fseeko(shipper->log, shipper->sent, SEEK_SET) < 0) {
+        return 0;
+    }
+    clearerr(shipper->log);
+
+    while (batch.end < end && batch.records < REPLICATION_BATCH_RECORDS &&
+           bytes < REPLICATION_BATCH_BYTES &&
+           (line_len = getline(&line, &line_size, shipper->log)) > 0) {
+        // Still being appended, pick it up with the next batch
+        if (line[line_len - 1] != '\n' || batch.end + line_len > end) {
+            break;
+        }
+        line[line_len - 1] = '\0';
+        batch.end += line_len;
+        batch.records++;
+
+        char tag = line[0];
+        char *save = NULL;
+        char *time_str = strtok_r(line + 1, "\t", &save);
+        char *remote = strtok_r(NULL, "\t", &save);
+        char *local_path = strtok_r(NULL, "\t", &save);
+
+        if (batch.records == 1) {
+            batch.oldest_ms = time_str ? strtoll(time_str, NULL, 10) : 0;
+        }
+        if (remote == NULL || (tag == REPLICATION_TAG_FILE && local_path == NULL)) {
+            log_message(LOG_WARNING, "Ignoring malformed replication log record");
+            continue;
+        }
+
+        // The batch owns the line, records point into it
+        lines[count] = line;
+        records[count].tag = tag;
+        records[count].remote = remote;
+        records[count].local_path = local_path;
+        count++;
+        line = NULL;
+        line_size = 0;
+
+        struct stat st;
+        if (tag == REPLICATION_TAG_FILE && stat(local_path, &st) == 0) {
+            bytes += st.st_size;
+        }
+    }
+    free(line);
+
+    for (size_t i = 0; i < count && success; i++) {
+        if (record_superseded(records, i, count)) {
+            continue;
+        }
+        if (records[i].tag == REPLICATION_TAG_FILE) {
+            success = ship_file(shipper, records[i].remote, records[i].local_path);
+        } else if (records[i].tag == REPLICATION_TAG_REMOVE) {
+            if (shipper->fd < 0) {
+                success = replica_remove(&shipper->replica, records[i].remote);
+            } else {
+                success = fprintf(shipper->out, "%c\t%s\n", records[i].tag, records[i].remote) > 0;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(lines[i]);
+    }
+
+    if (!success || batch.records == 0) {
+        return success;
+    }
+
+    shipper->sent = batch.end;
+    if (shipper->fd < 0) {
+        // A directory target is applied in place and acknowledged at once
+        if (!replica_commit(&shipper->replica)) {
+            return 0;
+        }
+        shipper->acked = batch.end;
+        shipper->shipped_records += batch.records;
+        shipper->lag_ms = replication_clock_ms() - batch.oldest_ms;
+        save_ack(batch.end);
+        return 1;
+    }
+
+    // Pipelined: the next batch goes out without waiting for this ack
+    shipper->inflight[shipper->inflight_count++] = batch;
+    return fprintf(shipper->out, "%c\t%lld\n", REPLICATION_TAG_BATCH, batch.end) > 0 &&
+           fflush(shipper->out) == 0;
+}
+
+/**
+ * Ship the outbound log to the standby, batch after batch, reconnecting
+ * with a growing delay when it is unavailable. Once the standby has
+ * acknowledged everything the log is emptied.
+ */
+static void *replication_thread(void *arg) {
+    struct shipper shipper;
+    int retry_sec = 1;
+    int unreachable_logged = 0;
+    (void)arg;
+
+    memset(&shipper, 0, sizeof(shipper));
+    shipper.fd = -1;
+    shipper.acked = load_ack();
+
+    shipper.log = fopen(log_path, "r");
+    if (shipper.log == NULL) {
+        log_message(LOG_ERR, "Failed to read replication log %s: %s", log_path, strerror(errno));
+        return NULL;
+    }
+
+    while (1) {
+        long long end;
+
+        pthread_mutex_lock(&replication_lock);
+        if (shipper.acked > log_size) {
+            // The log was replaced underneath us, start it over
+            shipper.acked = shipper.sent = 0;
+        }
+        if (shipper.acked == log_size && shipper.inflight_count == 0) {
+            if (log_size > 0 && ftruncate(log_fd, 0) == 0) {
+                log_size = 0;
+                shipper.acked = shipper.sent = 0;
+                save_ack(0);
+                // A seek alone could be served from the stale read buffer
+                FILE *reopened = freopen(log_path, "r", shipper.log);
+                if (reopened == NULL) {
+                    log_message(LOG_ERR, "Failed to reopen replication log %s: %s", log_path, strerror(errno));
+                    pthread_mutex_unlock(&replication_lock);
+                    return NULL;
+                }
+                shipper.log = reopened;
+            }
+            if (shipper.shipped_records > 0) {
+                log_message(LOG_INFO, "Replication caught up: %zu records shipped, lag %.1f s",
+                            shipper.shipped_records, shipper.lag_ms / 1000.0);
+                shipper.shipped_records = 0;
+            }
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&replication_wake, &replication_lock, &deadline);
+        }
+        end = log_size;
+        pthread_mutex_unlock(&replication_lock);
+
+        // Follow the target across a reload, and stop while none is set
+        const struct config *config = config_get();
+        if (shipper.connected && strcmp(shipper.target, config->replication_target) != 0) {
+            shipper_disconnect(&shipper, NULL);
+        }
+        if (!shipper.connected && config->replication_target[0] != '\0' && end > shipper.acked) {
+            if (shipper_connect(&shipper, config->replication_target)) {
+                retry_sec = 1;
+                unreachable_logged = 0;
+            } else {
+                if (!unreachable_logged) {
+                    log_message(LOG_WARNING, "Replication target %s is unavailable, retrying",
+                                config->replication_target);
+                    unreachable_logged = 1;
+                }
+                config_put(config);
+                sleep(retry_sec);
+                retry_sec = retry_sec * 2 > REPLICATION_RETRY_MAX_SEC ? REPLICATION_RETRY_MAX_SEC : retry_sec * 2;
+                continue;
+            }
+        }
+        config_put(config);
+
+        if (!shipper.connected) {
+            // Records are waiting but no target is set
+            if (end > shipper.acked) {
+                sleep(1);
+            }
+            continue;
+        }
+
+        if (shipper.sent < end && shipper.inflight_count < REPLICATION_WINDOW) {
+            if (!ship_batch(&shipper, end)) {
+                shipper_disconnect(&shipper, "send failed");
+                continue;
+            }
+        }
+
+        if (shipper.fd >= 0 && shipper.inflight_count > 0) {
+            // Block for an ack only when the window is full or all is sent
+            int wait_ms = shipper.inflight_count == REPLICATION_WINDOW || shipper.sent == end ? 1000 : 0;
+            if (!shipper_read_acks(&shipper, wait_ms)) {
+                shipper_disconnect(&shipper, "connection closed");
+            }
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include "../inc/restore.h"
+#include "../inc/company.h"
+#include "../inc/checksum.h"
+#include "../inc/partition.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+// The files of one restore, handed out to the copy threads in turn
+struct restore_job {
+    const char *snapshot_dir;
+    const char *staging_dir;
+    const struct checksum_entry **files;
+    size_t count;
+    pthread_mutex_t lock;
+    size_t next;
+    size_t files_done;
+    size_t files_failed;
+    unsigned long long bytes;
+};
+
+// A copy thread with its own durability batch, committed once all are done
+struct restore_worker {
+    pthread_t thread;
+    struct restore_job *job;
+    struct durability_batch batch;
+};
+
+/**
+ * Check whether a file of the snapshot is selected by the filter
+ */
+static int restore_selected(const struct restore_filter *filter, const char *path) {
+    const char *name = strrchr(path, '/');
+    size_t department_len;
+    long day;
+
+    if (filter->department_count == 0 && filter->from_day == 0 && filter->to_day == 0) {
+        return 1;
+    }
+
+    name = name ? name + 1 : path;
+    if (!parse_report_name(name, strlen(name), &department_len, &day)) {
+        return 0;
+    }
+    if ((filter->from_day != 0 && day < filter->from_day) || (filter->to_day != 0 && day > filter->to_day)) {
+        return 0;
+    }
+    if (filter->department_count == 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < filter->department_count; i++) {
+        if (strlen(filter->departments[i]) == department_len &&
+            strncmp(filter->departments[i], name, department_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Remove a directory tree, e.g. the staging directory of a restore that
+ * failed part way
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int remove_tree(const char *path) {
+    struct dir_scan files, dirs;
+    char child[PATH_MAX];
+    int success = 1;
+
+    if (!dir_scan(&files, path, NULL)) {
+        return 0;
+    }
+    for (size_t i = 0; i < files.count; i++) {
+        snprintf(child, sizeof(child), "%s/%s", path, files.entries[i].name);
+        if (unlink(child) != 0) {
+            success = 0;
+        }
+    }
+    dir_scan_free(&files);
+
+    if (!dir_scan_type(&dirs, path, NULL, DT_DIR)) {
+        return 0;
+    }
+    for (size_t i = 0; i < dirs.count; i++) {
+        snprintf(child, sizeof(child), "%s/%s", path, dirs.entries[i].name);
+        if (!remove_tree(child)) {
+            success = 0;
+        }
+    }
+    dir_scan_free(&dirs);
+
+    if (rmdir(path) != 0) {
+        log_message(LOG_ERR, "Failed to remove %s: %s", path, strerror(errno));
+        success = 0;
+    }
+    return success;
+}
+
+/**
+ * Fill the staging directory with hard links to every file of the
+ * reporting directory that the restore does not replace. Restored files
+ * are renamed over their links, so the live files are never written.
+ *
+ * @param relative Path below both directories, "" at the top
+ * @return 1 on success, 0 on failure
+ */
+static int seed_staging(const char *reporting_dir, const char *staging_dir, const char *relative,
+                        const struct restore_filter *filter, struct durability_batch *batch) {
+    struct dir_scan files, dirs;
+    char source[PATH_MAX], target[PATH_MAX], child[PATH_MAX];
+    int success = 1;
+
+    if (!format_path(source, sizeof(source), "%s%s%s", reporting_dir, relative[0] ? "/" : "", relative) ||
+        !dir_scan(&files, source, NULL)) {
+        return 0;
+    }
+    for (size_t i = 0; i < files.count; i++) {
+        if (!format_path(child, sizeof(child), "%s%s%s", relative, relative[0] ? "/" : "",
+                         files.entries[i].name)) {
+            success = 0;
+            continue;
+        }
+        if (restore_selected(filter, child)) {
+            continue;
+        }
+        if (!format_path(source, sizeof(source), "%s/%s", reporting_dir, child) ||
+            !format_path(target, sizeof(target), "%s/%s", staging_dir, child)) {
+            success = 0;
+            continue;
+        }
+
+        // Manifests are appended to in place, so they get a copy of their own
+        if (strcmp(files.entries[i].name, PARTITION_MANIFEST) == 0) {
+            struct checksum_entry sum;
+            if (!copy_file(source, target, batch, &sum)) {
+                success = 0;
+            }
+            continue;
+        }
+        if (link(source, target) != 0) {
+            log_message(LOG_ERR, "Failed to link %s into the staging directory: %s", source, strerror(errno));
+            success = 0;
+        }
+    }
+    dir_scan_free(&files);
+
+    if (!format_path(source, sizeof(source), "%s%s%s", reporting_dir, relative[0] ? "/" : "", relative) ||
+        !dir_scan_type(&dirs, source, NULL, DT_DIR)) {
+        return 0;
+    }
+    for (size_t i = 0; success && i < dirs.count; i++) {
+        if (!format_path(child, sizeof(child), "%s%s%s", relative, relative[0] ? "/" : "",
+                         dirs.entries[i].name) ||
+            !partition_prepare(staging_dir, child) ||
+            !seed_staging(reporting_dir, staging_dir, child, filter, batch)) {
+            success = 0;
+        }
+    }
+    dir_scan_free(&dirs);
+
+    return success;
+}
+
+/**
+ * Body of a copy thread: take the next file, copy it into the staging
+ * directory and check it against the snapshot's checksum on the way
+ */
+static void *restore_worker(void *arg) {
+    struct restore_worker *worker = arg;
+    struct restore_job *job = worker->job;
+    char src_path[PATH_MAX], dst_path[PATH_MAX], part_path[PATH_MAX];
+
+    for (;;) {
+        const struct checksum_entry *entry;
+        struct checksum_entry sum;
+        int ok;
+
+        pthread_mutex_lock(&job->lock);
+        if (job->next == job->count) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        entry = job->files[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        if (!format_path(src_path, sizeof(src_path), "%s/%s", job->snapshot_dir, entry->path) ||
+            !format_path(dst_path, sizeof(dst_path), "%s/%s", job->staging_dir, entry->path) ||
+            !format_path(part_path, sizeof(part_path), "%s%s", dst_path, PARTIAL_SUFFIX)) {
+            pthread_mutex_lock(&job->lock);
+            job->files_failed++;
+            pthread_mutex_unlock(&job->lock);
+            continue;
+        }
+
+        ok = copy_file(src_path, part_path, &worker->batch, &sum);
+        if (ok && (sum.crc != entry->crc || sum.size != entry->size)) {
+            log_message(LOG_ERR, "Restore: %s is corrupt (crc32c %08x, expected %08x), not restored",
+                        src_path, (unsigned int)sum.crc, (unsigned int)entry->crc);
+            ok = 0;
+        }
+        if (ok && rename(part_path, dst_path) != 0) {
+            log_message(LOG_ERR, "Failed to rename %s to %s: %s", part_path, dst_path, strerror(errno));
+            ok = 0;
+        }
+        if (ok) {
+            durability_entry_changed(&worker->batch, dst_path);
+        } else {
+            unlink(part_path);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (ok) {
+            job->files_done++;
+            job->bytes += (unsigned long long)sum.size;
+        } else {
+            job->files_failed++;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+static unsigned long partition_generation(const struct partition_index *index, const char *partition) {
+    const struct partition_entry *entry = partition_index_find(index, partition);
+    return entry != NULL ? entry->generation : 0;
+}
+
+/**
+ * Give every restored partition a generation above any it had in the
+ * reporting directory or the latest snapshot, so the next backup copies
+ * it instead of linking a different version of it from that snapshot
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int restore_partition_index(const char *staging_dir, const char *snapshot_dir, int whole,
+                                   const struct restore_job *job) {
+    const struct config *config = config_current();
+    struct partition_index staged, current, latest;
+    char latest_dir[PATH_MAX];
+    char last[PARTITION_PATH_MAX] = "";
+    int success = 1;
+
+    // A whole restore takes the snapshot's index, a partial one keeps the current one
+    if (!partition_index_load(&staged, whole ? snapshot_dir : staging_dir)) {
+        return 0;
+    }
+    if (!partition_index_load(&current, config->reporting_dir)) {
+        memset(&current, 0, sizeof(current));
+    }
+    if (!backup_snapshot_dir(NULL, latest_dir, sizeof(latest_dir)) ||
+        !partition_index_load(&latest, latest_dir)) {
+        memset(&latest, 0, sizeof(latest));
+    }
+
+    for (size_t i = 0; i < job->count; i++) {
+        const char *path = job->files[i]->path;
+        const char *slash = strrchr(path, '/');
+        char partition[PARTITION_PATH_MAX];
+
+        if (slash == NULL || (size_t)(slash - path) >= sizeof(partition)) {
+            continue;
+        }
+        memcpy(partition, path, slash - path);
+        partition[slash - path] = '\0';
+
+        // The list is sorted, so the files of a partition follow each other
+        if (strcmp(partition, last) == 0) {
+            continue;
+        }
+        snprintf(last, sizeof(last), "%s", partition);
+
+        unsigned long generation = partition_generation(&staged, partition);
+        if (partition_generation(&current, partition) > generation) {
+            generation = partition_generation(&current, partition);
+        }
+        if (partition_generation(&latest, partition) > generation) {
+            generation = partition_generation(&latest, partition);
+        }
+
+        if (!partition_index_touch(&staged, partition)) {
+            success = 0;
+            break;
+        }
+        partition_index_find(&staged, partition)->generation = generation + 1;
+    }
+
+    if (success && staged.count > 0) {
+        success = partition_index_save(&staged, staging_dir);
+    }
+
+    partition_index_free(&latest);
+    partition_index_free(&current);
+    partition_index_free(&staged);
+    return success;
+}
+
+/**
+ * Put the staging directory in place of the reporting directory in one
+ * step and keep the replaced directory under a dated name
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int restore_swap(const char *staging_dir, struct restore_stats *stats) {
+    const struct config *config = config_current();
+    char timestamp[20];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", &tm);
+    if (!format_path(stats->previous_dir, sizeof(stats->previous_dir), "%s%s%s",
+                     config->reporting_dir, RESTORE_PREVIOUS_SUFFIX, timestamp)) {
+        return 0;
+    }
+
+    // Several restores in one second each keep their own copy
+    for (int n = 1; access(stats->previous_dir, F_OK) == 0; n++) {
+        if (!format_path(stats->previous_dir, sizeof(stats->previous_dir), "%s%s%s_%d",
+                         config->reporting_dir, RESTORE_PREVIOUS_SUFFIX, timestamp, n)) {
+            return 0;
+        }
+    }
+
+    if (renameat2(AT_FDCWD, staging_dir, AT_FDCWD, config->reporting_dir, RENAME_EXCHANGE) == 0) {
+        // The staging name now holds the replaced directory
+        if (rename(staging_dir, stats->previous_dir) != 0) {
+            log_message(LOG_WARNING, "Restored, but failed to move the replaced directory to %s: %s",
+                        stats->previous_dir, strerror(errno));
+            snprintf(stats->previous_dir, sizeof(stats->previous_dir), "%s", staging_dir);
+        }
+    } else if (errno == ENOENT) {
+        // Nothing to replace
+        stats->previous_dir[0] = '\0';
+        if (rename(staging_dir, config->reporting_dir) != 0) {
+            log_message(LOG_ERR, "Failed to move %s into place: %s", staging_dir, strerror(errno));
+            return 0;
+        }
+    } else {
+        // Filesystems without RENAME_EXCHANGE, there is a moment without
+        // a reporting directory
+        log_message(LOG_WARNING, "Atomic exchange unavailable (%s), swapping with two renames",
+                    strerror(errno));
+        if (rename(config->reporting_dir, stats->previous_dir) != 0) {
+            log_message(LOG_ERR, "Failed to move %s aside: %s", config->reporting_dir, strerror(errno));
+            return 0;
+        }
+        if (rename(staging_dir, config->reporting_dir) != 0) {
+            log_message(LOG_ERR, "Failed to move %s into place: %s", staging_dir, strerror(errno));
+            rename(stats->previous_dir, config->reporting_dir);
+            return 0;
+        }
+    }
+
+    // Make the swap itself durable
+    struct durability_batch batch;
+    durability_begin(&batch);
+    durability_entry_changed(&batch, config->reporting_dir);
+    return durability_commit(&batch);
+}
+
+/**
+ * Restore a backup snapshot into the reporting directory.
+ *
+ * The restored tree is built in a staging directory next to the reporting
+ * directory, by several threads copying files in parallel and checking
+ * each against the snapshot's checksums. Only when every file is in place
+ * and durable is the staging directory swapped with the reporting
+ * directory in one atomic rename, so readers see either the old tree or
+ * the restored one. A filtered restore links the files it does not touch
+ * into the staging directory first, so only the selected reports are
+ * copied.
+ *
+ * @param threads Copy threads, 0 for one per CPU
+ * @return 1 on success, 0 on failure
+ */
+int restore_snapshot(const char *snapshot_dir, const struct restore_filter *filter, int threads,
+                     struct restore_stats *stats) {
+    const struct config *config = config_current();
+    struct restore_worker workers[RESTORE_MAX_THREADS];
+    struct checksum_list list;
+    struct restore_job job;
+    struct timespec start, end;
+    char staging_dir[PATH_MAX];
+    int whole = filter->department_count == 0 && filter->from_day == 0 && filter->to_day == 0;
+    int started = 0;
+    int success = 1;
+
+    memset(stats, 0, sizeof(*stats));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!checksum_list_load(&list, snapshot_dir)) {
+        return 0;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.snapshot_dir = snapshot_dir;
+    job.staging_dir = staging_dir;
+    job.files = malloc((list.count ? list.count : 1) * sizeof(*job.files));
+    if (job.files == NULL) {
+        log_message(LOG_ERR, "Out of memory planning restore");
+        checksum_list_free(&list);
+        return 0;
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        if (restore_selected(filter, list.entries[i].path)) {
+            job.files[job.count++] = &list.entries[i];
+        }
+    }
+    if (job.count == 0) {
+        log_message(LOG_WARNING, "Nothing in %s matches the restore filter", snapshot_dir);
+        free(job.files);
+        checksum_list_free(&list);
+        return 0;
+    }
+
+    // A staging directory left by an interrupted restore is discarded
+    if (!format_path(staging_dir, sizeof(staging_dir), "%s%s", config->reporting_dir, RESTORE_STAGING_SUFFIX) ||
+        (access(staging_dir, F_OK) == 0 && !remove_tree(staging_dir))) {
+        free(job.files);
+        checksum_list_free(&list);
+        return 0;
+    }
+    if (mkdir(staging_dir, 0755) != 0) {
+        log_message(LOG_ERR, "Failed to create %s: %s", staging_dir, strerror(errno));
+        free(job.files);
+        checksum_list_free(&list);
+        return 0;
+    }
+
+    if (!whole && access(config->reporting_dir, F_OK) == 0) {
+        struct durability_batch batch;
+        durability_begin(&batch);
+        if (!seed_staging(config->reporting_dir, staging_dir, "", filter, &batch) ||
+            !durability_commit(&batch)) {
+            success = 0;
+        }
+    }
+
+    // Directories are made up front so the threads only create files
+    for (size_t i = 0; success && i < job.count; i++) {
+        const char *slash = strrchr(job.files[i]->path, '/');
+        char partition[PATH_MAX];
+
+        if (slash != NULL) {
+            snprintf(partition, sizeof(partition), "%.*s", (int)(slash - job.files[i]->path), job.files[i]->path);
+            if (!partition_prepare(staging_dir, partition)) {
+                success = 0;
+            }
+        }
+    }
+
+    if (success) {
+        if (threads <= 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = cpus > 0 ? (int)cpus : 1;
+        }
+        if (threads > RESTORE_MAX_THREADS) {
+            threads = RESTORE_MAX_THREADS;
+        }
+        if ((size_t)threads > job.count) {
+            threads = (int)job.count;
+        }
+
+        pthread_mutex_init(&job.lock, NULL);
+        for (int i = 0; i < threads; i++) {
+            workers[started].job = &job;
+            durability_begin(&workers[started].batch);
+            if (pthread_create(&workers[started].thread, NULL, restore_worker, &workers[started]) == 0) {
+                started++;
+            } else {
+                durability_commit(&workers[started].batch);
+            }
+        }
+        // With no threads at all, copy in this one
+        if (started == 0) {
+            workers[0].job = &job;
+            durability_begin(&workers[0].batch);
+            restore_worker(&workers[0]);
+            started = 1;
+        } else {
+            for (int i = 0; i < started; i++) {
+                pthread_join(workers[i].thread, NULL);
+            }
+        }
+        pthread_mutex_destroy(&job.lock);
+
+        // The first commit syncs the staging filesystem, the rest find little left
+        for (int i = 0; i < started; i++) {
+            if (!durability_commit(&workers[i].batch)) {
+                success = 0;
+            }
+        }
+        if (job.files_failed > 0) {
+            success = 0;
+        }
+    }
+
+    if (success && !restore_partition_index(staging_dir, snapshot_dir, whole, &job)) {
+        success = 0;
+    }
+
+    stats->files = job.files_done;
+    stats->files_failed = job.files_failed;
+    stats->bytes = job.bytes;
+
+    if (success) {
+        success = restore_swap(staging_dir, stats);
+    } else {
+        log_message(LOG_ERR, "Restore of %s failed, the reporting directory was left untouched", snapshot_dir);
+        remove_tree(staging_dir);
+    }
+
+    free(job.files);
+    checksum_list_free(&list);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    return success;
+}
@@ -0,0 +1,118 @@
+#include "../inc/company.h"
+#include "../inc/restore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+/**
+ * Parse a YYYY-MM-DD date into a day number
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int parse_day(const char *text, long *day_number) {
+    int year, month, day;
+    char end;
+
+    if (sscanf(text, "%4d-%2d-%2d%c", &year, &month, &day, &end) != 3 ||
+        month < 1 || month > 12 || day < 1 || day > 31) {
+        return 0;
+    }
+    *day_number = date_to_day(year, month, day);
+    return 1;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-d department]... [-f YYYY-MM-DD] [-t YYYY-MM-DD] [-j threads] [snapshot]\n",
+            program);
+}
+
+/**
+ * Restore the reporting directory from a backup snapshot.
+ *
+ * Usage: company_restore [-d department]... [-f from] [-t to] [-j threads] [snapshot]
+ *
+ * Run from the daemon's working directory with the daemon stopped. The
+ * snapshot may be given as a name in the backup directory or as a path,
+ * and defaults to the latest completed backup. Without -d, -f or -t the
+ * whole snapshot replaces the reporting directory; with them only the
+ * reports of those departments and dates are restored. The thread count
+ * defaults to one per CPU. The replaced directory is kept next to the
+ * reporting directory.
+ */
+int main(int argc, char *argv[]) {
+    struct restore_filter filter;
+    struct restore_stats stats;
+    char snapshot_dir[PATH_MAX];
+    const struct config *config;
+    int threads = 0;
+    int option;
+
+    memset(&filter, 0, sizeof(filter));
+    while ((option = getopt(argc, argv, "d:f:t:j:h")) != -1) {
+        switch (option) {
+            case 'd':
+                if (filter.department_count == RESTORE_MAX_DEPARTMENTS) {
+                    fprintf(stderr, "At most %d departments can be restored at once\n", RESTORE_MAX_DEPARTMENTS);
+                    return EXIT_FAILURE;
+                }
+                filter.departments[filter.department_count++] = optarg;
+                break;
+            case 'f':
+            case 't':
+                if (!parse_day(optarg, option == 'f' ? &filter.from_day : &filter.to_day)) {
+                    fprintf(stderr, "Invalid date %s, expected YYYY-MM-DD\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!config_load(CONFIG_FILE)) {
+        fprintf(stderr, "Could not load configuration from %s\n", CONFIG_FILE);
+        return EXIT_FAILURE;
+    }
+    config = config_current();
+
+    // The daemon must not move reports while the directory is swapped;
+    // holding its lock also keeps it from starting during the restore
+    if (!check_singleton(LOCK_FILE)) {
+        fprintf(stderr, "The daemon is running, stop it before restoring\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!backup_snapshot_dir(optind < argc ? argv[optind] : NULL, snapshot_dir, sizeof(snapshot_dir))) {
+        fprintf(stderr, "No completed backup found in %s\n", config->latest_backup);
+        return EXIT_FAILURE;
+    }
+
+    printf("Restoring %s into %s\n", snapshot_dir, config->reporting_dir);
+
+    if (!restore_snapshot(snapshot_dir, &filter, threads, &stats)) {
+        fprintf(stderr, "Restore failed after %zu files (%zu failed), see the error log; "
+                "%s was left untouched\n", stats.files, stats.files_failed, config->reporting_dir);
+        return EXIT_FAILURE;
+    }
+
+    double seconds = stats.seconds > 0 ? stats.seconds : 1e-9;
+    printf("Restored %zu files, %.1f MB in %.3f s (%.1f MB/s)\n",
+           stats.files, stats.bytes / 1e6, stats.seconds, stats.bytes / 1e6 / seconds);
+    if (stats.previous_dir[0] != '\0') {
+        printf("The replaced reporting directory was kept as %s\n", stats.previous_dir);
+    }
+    log_message(LOG_INFO, "Restored %zu files (%.1f MB) from %s in %.3f s",
+                stats.files, stats.bytes / 1e6, snapshot_dir, stats.seconds);
+
+    return EXIT_SUCCESS;
+}
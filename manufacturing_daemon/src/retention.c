@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include "../inc/retention.h"
+#include "../inc/company.h"
+#include "../inc/departments.h"
+#include "../inc/replication.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Only one pruning run at a time per backup directory, a slow one simply
+// delays the next run of the same directory
+static pthread_mutex_t prune_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct config *prune_running[RETENTION_MAX_RUNNING];
+
+// Periods the policy keeps one snapshot for
+enum retention_tier {
+    TIER_DAILY,
+    TIER_WEEKLY,
+    TIER_MONTHLY
+};
+
+// A snapshot directory and the periods it falls in
+struct snapshot {
+    char name[NAME_MAX + 1];
+    long day;
+    long week;
+    long month;
+    int keep;
+};
+
+/**
+ * Parse backup_YYYYMMDD_HHMMSS into a snapshot's day, week and month
+ *
+ * @return 1 on success, 0 if the name is not a snapshot
+ */
+static int parse_snapshot_name(const char *name, struct snapshot *snapshot) {
+    int year, month, day;
+
+    if (strncmp(name, "backup_", 7) != 0 || strlen(name) < 15 ||
+        sscanf(name + 7, "%4d%2d%2d", &year, &month, &day) != 3) {
+        return 0;
+    }
+
+    snprintf(snapshot->name, sizeof(snapshot->name), "%s", name);
+    snapshot->day = date_to_day(year, month, day);
+    // Day 0 was a Thursday, shift so weeks start on Monday
+    snapshot->week = (snapshot->day + 3) / 7;
+    snapshot->month = year * 12L + month - 1;
+    snapshot->keep = 0;
+
+    return 1;
+}
+
+/**
+ * Sort snapshots newest first, the timestamped names sort by age
+ */
+static int compare_snapshots(const void *a, const void *b) {
+    return strcmp(((const struct snapshot *)b)->name, ((const struct snapshot *)a)->name);
+}
+
+/**
+ * Mark the newest snapshot of each of the last limit periods as kept.
+ * The periods are counted from the newest snapshot, not from today, so
+ * a daemon that was stopped for a while does not lose all its backups.
+ */
+static void retention_keep(struct snapshot *snapshots, size_t count, enum retention_tier tier, int limit) {
+    long last_period = 0;
+    int kept = 0;
+
+    for (size_t i = 0; i < count && kept < limit; i++) {
+        long period = tier == TIER_DAILY ? snapshots[i].day :
+                      tier == TIER_WEEKLY ? snapshots[i].week : snapshots[i].month;
+        if (kept == 0 || period != last_period) {
+            snapshots[i].keep = 1;
+            last_period = period;
+            kept++;
+        }
+    }
+}
+
+/**
+ * Sleep long enough to hold the unlink rate at RETENTION_UNLINKS_PER_SEC
+ */
+static void retention_throttle(size_t unlinks) {
+    if (unlinks % RETENTION_UNLINK_BATCH == 0) {
+        long long ns = 1000000000LL * RETENTION_UNLINK_BATCH / RETENTION_UNLINKS_PER_SEC;
+        struct timespec delay = { ns / 1000000000LL, ns % 1000000000LL };
+        nanosleep(&delay, NULL);
+    }
+}
+
+/**
+ * Remove a snapshot directory tree. Files hard linked into other
+ * snapshots only lose one link, their data stays and is not counted as
+ * reclaimed.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int remove_snapshot_tree(const char *path, struct retention_stats *stats) {
+    struct dir_scan files, dirs;
+    char child[PATH_MAX];
+    int success = 1;
+
+    if (dir_scan_type(&dirs, path, NULL, DT_DIR)) {
+        for (size_t i = 0; i < dirs.count; i++) {
+            snprintf(child, sizeof(child), "%s/%s", path, dirs.entries[i].name);
+            if (!remove_snapshot_tree(child, stats)) {
+                success = 0;
+            }
+        }
+        dir_scan_free(&dirs);
+    }
+
+    if (dir_scan(&files, path, NULL)) {
+        for (size_t i = 0; i < files.count; i++) {
+            struct stat st;
+
+            snprintf(child, sizeof(child), "%s/%s", path, files.entries[i].name);
+            if (lstat(child, &st) < 0) {
+                continue;
+            }
+
+            if (unlink(child) < 0) {
+                log_message(LOG_WARNING, "Failed to prune %s: %s", child, strerror(errno));
+                success = 0;
+                continue;
+            }
+
+            if (st.st_nlink > 1) {
+                stats->files_shared++;
+            } else {
+                stats->bytes_reclaimed += (unsigned long long)st.st_blocks * 512;
+            }
+            stats->files_unlinked++;
+            retention_throttle(stats->files_unlinked);
+        }
+        dir_scan_free(&files);
+    }
+
+    if (rmdir(path) < 0) {
+        log_message(LOG_WARNING, "Failed to remove %s: %s", path, strerror(errno));
+        success = 0;
+    }
+
+    return success;
+}
+
+/**
+ * Apply the retention policy to the backup directory
+ *
+ * @param config Settings to prune with, held for the whole run
+ * @return 1 on success, 0 on failure
+ */
+static int prune_backups_now(const struct config *config) {
+    struct dir_scan scan;
+    struct snapshot *snapshots;
+    struct retention_stats stats;
+    struct timespec start, end;
+    char latest[NAME_MAX + 1] = "";
+    char path[PATH_MAX];
+    size_t count = 0;
+    int success = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&stats, 0, sizeof(stats));
+
+    if (!dir_scan_type(&scan, config->backup_dir, NULL, DT_DIR)) {
+        return 0;
+    }
+
+    snapshots = malloc((scan.count ? scan.count : 1) * sizeof(*snapshots));
+    if (snapshots == NULL) {
+        log_message(LOG_ERR, "Out of memory applying backup retention");
+        dir_scan_free(&scan);
+        return 0;
+    }
+
+    for (size_t i = 0; i < scan.count; i++) {
+        if (parse_snapshot_name(scan.entries[i].name, &snapshots[count])) {
+            count++;
+        }
+    }
+    dir_scan_free(&scan);
+
+    qsort(snapshots, count, sizeof(*snapshots), compare_snapshots);
+
+    retention_keep(snapshots, count, TIER_DAILY, config->retention_daily);
+    retention_keep(snapshots, count, TIER_WEEKLY, config->retention_weekly);
+    retention_keep(snapshots, count, TIER_MONTHLY, config->retention_monthly);
+
+    // The latest snapshot is the base new backups link against
+    FILE *file = fopen(config->latest_backup, "r");
+    if (file) {
+        if (fgets(latest, sizeof(latest), file) != NULL) {
+            latest[strcspn(latest, "\n")] = '\0';
+        }
+        fclose(file);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (snapshots[i].keep || strcmp(snapshots[i].name, latest) == 0) {
+            continue;
+        }
+
+        if (!format_path(path, sizeof(path), "%s/%s", config->backup_dir, snapshots[i].name)) {
+            success = 0;
+            continue;
+        }
+        log_message(LOG_INFO, "Pruning backup snapshot %s", snapshots[i].name);
+        if (!remove_snapshot_tree(path, &stats)) {
+            success = 0;
+        }
+        replication_remove(path);
+        stats.snapshots_pruned++;
+    }
+    replication_flush();
+
+    free(snapshots);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    log_message(LOG_INFO, "Backup retention: kept %zu of %zu snapshots, reclaimed %llu bytes "
+                "from %zu files (%zu still linked from other snapshots) in %.3f s",
+                count - stats.snapshots_pruned, count, stats.bytes_reclaimed,
+                stats.files_unlinked, stats.files_shared,
+                (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    return success;
+}
+
+/**
+ * Claim the backup directory of the given settings for a pruning run
+ *
+ * @return 1 if claimed, 0 if it is already being pruned
+ */
+static int prune_claim(const struct config *config) {
+    size_t free_slot = RETENTION_MAX_RUNNING;
+
+    pthread_mutex_lock(&prune_lock);
+    for (size_t i = 0; i < RETENTION_MAX_RUNNING; i++) {
+        if (prune_running[i] == NULL) {
+            if (free_slot == RETENTION_MAX_RUNNING) {
+                free_slot = i;
+            }
+        } else if (strcmp(prune_running[i]->backup_dir, config->backup_dir) == 0) {
+            free_slot = RETENTION_MAX_RUNNING;
+            break;
+        }
+    }
+    if (free_slot < RETENTION_MAX_RUNNING) {
+        prune_running[free_slot] = config;
+    }
+    pthread_mutex_unlock(&prune_lock);
+
+    return free_slot < RETENTION_MAX_RUNNING;
+}
+
+static void prune_release(const struct config *config) {
+    pthread_mutex_lock(&prune_lock);
+    for (size_t i = 0; i < RETENTION_MAX_RUNNING; i++) {
+        if (prune_running[i] == config) {
+            prune_running[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prune_lock);
+}
+
+/**
+ * Body of the background pruning thread
+ */
+static void *prune_thread(void *arg) {
+    const struct config *config = arg;
+
+    // Pruned snapshots are logged and replicated as the site they belong to
+    config_use(config);
+    prune_backups_now(config);
+    config_use(NULL);
+
+    prune_release(config);
+    config_put(config);
+
+    return NULL;
+}
+
+/**
+ * Prune backup snapshots that fall outside the retention policy
+ *
+ * @param background Prune in a detached thread instead of waiting
+ * @return 1 on success or if pruning was started, 0 on failure
+ */
+int prune_backups(int background) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t signals;
+    int success;
+
+    // The thread keeps the settings it started with across a reload
+    const struct config *config = config_get();
+
+    if (!prune_claim(config)) {
+        config_put(config);
+        log_message(LOG_INFO, "Backup pruning still running, skipping this cycle");
+        return 1;
+    }
+
+    if (background) {
+        block_signals(&signals);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        success = pthread_create(&thread, &attr, prune_thread, (void *)config) == 0;
+        pthread_attr_destroy(&attr);
+        restore_signals(&signals);
+        if (success) {
+            return 1;
+        }
+        log_message(LOG_WARNING, "Failed to start pruning thread, pruning in the foreground");
+    }
+
+    success = prune_backups_now(config);
+
+    prune_release(config);
+    config_put(config);
+
+    return success;
+}
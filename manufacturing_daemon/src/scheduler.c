@@ -0,0 +1,535 @@
+#include "../inc/scheduler.h"
+#include "../inc/company.h"
+#include "../inc/site.h"
+#include "../inc/intake.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+// An upload waiting to be transferred
+struct scheduled_upload {
+    char *name;
+    enum transfer_class class;
+    time_t arrived;         // First seen by the monitor
+    time_t changed;         // Last change seen by the monitor
+    time_t deadline;
+    size_t position;        // In the queue's pending array
+    int streaming;          // Handed to the intake pipeline
+    struct scheduled_upload *next;
+};
+
+/**
+ * The queue of the upload directory the calling thread is serving
+ */
+static struct scheduler_queue *scheduler_queue(void) {
+    return &site_current()->scheduler;
+}
+
+/**
+ * FNV-1a hash of an upload's name
+ */
+static size_t name_bucket(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash & (SCHEDULER_BUCKETS - 1);
+}
+
+static struct scheduled_upload *scheduler_find(struct scheduler_queue *queue, const char *name, size_t len) {
+    struct scheduled_upload *entry;
+
+    for (entry = queue->buckets[name_bucket(name, len)]; entry != NULL; entry = entry->next) {
+        if (strncmp(entry->name, name, len) == 0 && entry->name[len] == '\0') {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take an upload off the queue and free it
+ */
+static void scheduler_remove(struct scheduler_queue *queue, struct scheduled_upload *entry) {
+    struct scheduled_upload **link = &queue->buckets[name_bucket(entry->name, strlen(entry->name))];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    queue->pending[entry->position] = queue->pending[--queue->pending_count];
+    queue->pending[entry->position]->position = entry->position;
+
+    queue->class_stats[entry->class].queued--;
+    queue->stats_changed = 1;
+
+    free(entry->name);
+    free(entry);
+}
+
+/**
+ * The next time the scheduled transfer runs after t
+ */
+static time_t next_scheduled_transfer(time_t t) {
+    const struct config *config = config_current();
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    tm.tm_hour = config->transfer_hour;
+    tm.tm_min = config->transfer_minute;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    time_t scheduled = mktime(&tm);
+    if (scheduled < t) {
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        scheduled = mktime(&tm);
+    }
+    return scheduled;
+}
+
+/**
+ * Queue a new or changed upload for transfer, called by the monitor.
+ * The deadline runs from the first time an upload is seen; a change only
+ * postpones the moment it has settled.
+ */
+void scheduler_submit(const char *name, size_t len, time_t changed) {
+    const struct config *config = config_current();
+    struct scheduler_queue *queue = scheduler_queue();
+    struct scheduled_upload *entry;
+    time_t now = time(NULL);
+
+    if (!has_suffix(name, len, REPORT_SUFFIX)) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    entry = scheduler_find(queue, name, len);
+    if (entry != NULL) {
+        // A changed upload is validated again once it has settled
+        entry->changed = changed > now ? now : changed;
+        entry->streaming = 0;
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    if (queue->pending_count == queue->pending_capacity) {
+        size_t new_capacity = queue->pending_capacity ? queue->pending_capacity * 2 : 64;
+        struct scheduled_upload **grown = realloc(queue->pending, new_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            log_message(LOG_ERR, "Out of memory queueing %.*s for transfer", (int)len, name);
+            pthread_mutex_unlock(&queue->lock);
+            return;
+        }
+        queue->pending = grown;
+        queue->pending_capacity = new_capacity;
+    }
+
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL || (entry->name = strndup(name, len)) == NULL) {
+        log_message(LOG_ERR, "Out of memory queueing %.*s for transfer", (int)len, name);
+        free(entry);
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    entry->class = department_class(departments_get(), name, len);
+    entry->arrived = now;
+    entry->changed = changed > now ? now : changed;
+    entry->streaming = 0;
+    switch (entry->class) {
+        case TRANSFER_URGENT:
+            entry->deadline = now + config->urgent_deadline_sec;
+            break;
+        case TRANSFER_STANDARD:
+            entry->deadline = now + config->standard_deadline_sec;
+            break;
+        default:
+            entry->deadline = next_scheduled_transfer(now) + SCHEDULER_BULK_GRACE_SEC;
+            break;
+    }
+
+    size_t bucket = name_bucket(name, len);
+    entry->next = queue->buckets[bucket];
+    queue->buckets[bucket] = entry;
+    entry->position = queue->pending_count;
+    queue->pending[queue->pending_count++] = entry;
+
+    queue->class_stats[entry->class].queued++;
+    queue->stats_changed = 1;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Account for an upload moved to the reporting directory, by a dispatch
+ * or by the scheduled cycle
+ */
+void scheduler_transferred(const char *name) {
+    struct scheduler_queue *queue = scheduler_queue();
+    struct scheduled_upload *entry;
+    struct scheduler_class_stats *stats;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&queue->lock);
+    entry = scheduler_find(queue, name, strlen(name));
+    if (entry == NULL) {
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    stats = &queue->class_stats[entry->class];
+    long long latency = now - entry->arrived;
+    stats->transferred++;
+    stats->latency_sec += latency;
+    if (latency > stats->max_latency_sec) {
+        stats->max_latency_sec = latency;
+    }
+    if (now > entry->deadline) {
+        stats->missed++;
+        log_message(LOG_WARNING, "Transfer of %s (%s) missed its deadline by %lld s",
+                    name, transfer_class_name(entry->class), (long long)(now - entry->deadline));
+    }
+
+    scheduler_remove(queue, entry);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Hand an upload the intake pipeline could not move back to the
+ * dispatch, which offers it again on a later tick
+ */
+void scheduler_release(const char *name) {
+    struct scheduler_queue *queue = scheduler_queue();
+    struct scheduled_upload *entry;
+
+    pthread_mutex_lock(&queue->lock);
+    entry = scheduler_find(queue, name, strlen(name));
+    if (entry != NULL) {
+        entry->streaming = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Drop the queued uploads that are gone from the upload directory, given
+ * the scheduled cycle's scan of it. The dispatch only checks the uploads
+ * it moves, so a bulk upload deleted before the cycle would otherwise
+ * stay queued, and counted, for good.
+ */
+void scheduler_sync(const struct dir_scan *uploads) {
+    struct scheduler_queue *queue = scheduler_queue();
+    unsigned char *present;
+    size_t dropped = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->pending_count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+    present = calloc(queue->pending_count, sizeof(*present));
+    if (present == NULL) {
+        log_message(LOG_ERR, "Out of memory checking queued uploads");
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    for (size_t i = 0; i < uploads->count; i++) {
+        struct scheduled_upload *entry = scheduler_find(queue, uploads->entries[i].name,
+                                                        uploads->entries[i].name_len);
+        if (entry != NULL) {
+            present[entry->position] = 1;
+        }
+    }
+
+    // From the end, removing moves the last entry, already kept, into the gap
+    for (size_t i = queue->pending_count; i-- > 0;) {
+        if (!present[i]) {
+            scheduler_remove(queue, queue->pending[i]);
+            dropped++;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    free(present);
+
+    if (dropped > 0) {
+        log_message(LOG_INFO, "Dropped %zu queued uploads that are gone from the upload directory", dropped);
+    }
+}
+
+/**
+ * Restore the heap property below position i, earliest deadline on top
+ */
+static void heap_down(struct scheduled_upload **heap, size_t count, size_t i) {
+    while (1) {
+        size_t earliest = i;
+        size_t left = 2 * i + 1, right = left + 1;
+
+        if (left < count && heap[left]->deadline < heap[earliest]->deadline) {
+            earliest = left;
+        }
+        if (right < count && heap[right]->deadline < heap[earliest]->deadline) {
+            earliest = right;
+        }
+        if (earliest == i) {
+            return;
+        }
+
+        struct scheduled_upload *swap = heap[i];
+        heap[i] = heap[earliest];
+        heap[earliest] = swap;
+        i = earliest;
+    }
+}
+
+/**
+ * Transfer the queued uploads that are due, earliest deadline first.
+ *
+ * Urgent uploads are due as soon as they have settled. Standard uploads
+ * are collected for part of their deadline, and once the oldest of them
+ * is due every settled standard upload goes in the same batch. Bulk
+ * uploads are left to the scheduled cycle. With streaming intake every
+ * settled upload is handed to the intake pipeline instead.
+ *
+ * @return The number of uploads handed to the transfer, -1 on failure
+ */
+int scheduler_dispatch(time_t now) {
+    const struct config *config = config_current();
+    struct scheduler_queue *queue = scheduler_queue();
+    time_t standard_hold = (time_t)config->standard_deadline_sec * SCHEDULER_BATCH_PERCENT / 100;
+    int streaming = config->intake == INTAKE_STREAMING;
+    struct scheduled_upload **ready;
+    size_t ready_count = 0;
+    int standard_due = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->pending_count == 0 || (!streaming && queue->class_stats[TRANSFER_URGENT].queued == 0 &&
+                                      queue->class_stats[TRANSFER_STANDARD].queued == 0)) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    for (size_t i = 0; i < queue->pending_count && !streaming; i++) {
+        const struct scheduled_upload *entry = queue->pending[i];
+        if (entry->class == TRANSFER_STANDARD && now >= entry->changed + SCHEDULER_SETTLE_SEC &&
+            now >= entry->arrived + standard_hold) {
+            standard_due = 1;
+            break;
+        }
+    }
+
+    ready = malloc(queue->pending_count * sizeof(*ready));
+    if (ready == NULL) {
+        log_message(LOG_ERR, "Out of memory dispatching transfers");
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    for (size_t i = 0; i < queue->pending_count; i++) {
+        struct scheduled_upload *entry = queue->pending[i];
+        int settled = now >= entry->changed + SCHEDULER_SETTLE_SEC;
+
+        if (streaming ? settled && !entry->streaming
+                      : settled && (entry->class == TRANSFER_URGENT ||
+                                    (entry->class == TRANSFER_STANDARD && standard_due))) {
+            ready[ready_count++] = entry;
+        }
+    }
+    if (ready_count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        free(ready);
+        return 0;
+    }
+
+    for (size_t i = ready_count / 2; i-- > 0;) {
+        heap_down(ready, ready_count, i);
+    }
+
+    if (streaming) {
+        size_t offered_count = 0;
+        char **names;
+        time_t *arrived;
+
+        names = malloc(SCHEDULER_DISPATCH_MAX * sizeof(*names));
+        arrived = malloc(SCHEDULER_DISPATCH_MAX * sizeof(*arrived));
+        if (names == NULL || arrived == NULL) {
+            log_message(LOG_ERR, "Out of memory dispatching transfers");
+            pthread_mutex_unlock(&queue->lock);
+            free(names);
+            free(arrived);
+            free(ready);
+            return -1;
+        }
+
+        // Taken out of the queue's hands first, the pipeline takes moved
+        // uploads off the queue and may wait for its lock
+        while (ready_count > 0 && offered_count < SCHEDULER_DISPATCH_MAX) {
+            struct scheduled_upload *entry = ready[0];
+            char path[PATH_MAX];
+            struct stat st;
+
+            ready[0] = ready[--ready_count];
+            heap_down(ready, ready_count, 0);
+
+            // Deleted or moved away since it was queued
+            if (!format_path(path, sizeof(path), "%s/%s", config->upload_dir, entry->name) ||
+                stat(path, &st) < 0) {
+                scheduler_remove(queue, entry);
+                continue;
+            }
+
+            names[offered_count] = strdup(entry->name);
+            if (names[offered_count] == NULL) {
+                break;
+            }
+            arrived[offered_count] = entry->arrived;
+            entry->streaming = 1;
+            offered_count++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (offered_count > 0) {
+            log_message(LOG_INFO, "Streaming %zu uploads into the intake pipeline", offered_count);
+        }
+
+        // Fed at the pace the pipeline moves them
+        for (size_t i = 0; i < offered_count; i++) {
+            if (!intake_submit(names[i], arrived[i])) {
+                scheduler_release(names[i]);
+            }
+            free(names[i]);
+        }
+        free(names);
+        free(arrived);
+        free(ready);
+
+        return (int)offered_count;
+    }
+
+    // Hand the earliest deadlines to the transfer as a scan of their own
+    struct dir_scan batch;
+    memset(&batch, 0, sizeof(batch));
+    arena_init(&batch.arena, 0);
+    batch.path = config->upload_dir;
+    batch.entries = arena_alloc(&batch.arena, SCHEDULER_DISPATCH_MAX * sizeof(*batch.entries));
+    if (batch.entries == NULL) {
+        pthread_mutex_unlock(&queue->lock);
+        free(ready);
+        arena_free(&batch.arena);
+        return -1;
+    }
+
+    while (ready_count > 0 && batch.count < SCHEDULER_DISPATCH_MAX) {
+        struct scheduled_upload *entry = ready[0];
+        char path[PATH_MAX];
+        struct stat st;
+
+        ready[0] = ready[--ready_count];
+        heap_down(ready, ready_count, 0);
+
+        // Deleted or moved away since it was queued
+        if (!format_path(path, sizeof(path), "%s/%s", config->upload_dir, entry->name) ||
+            stat(path, &st) < 0) {
+            scheduler_remove(queue, entry);
+            continue;
+        }
+
+        struct scan_entry *scan_entry = &batch.entries[batch.count];
+        scan_entry->name_len = strlen(entry->name);
+        scan_entry->name = arena_strndup(&batch.arena, entry->name, scan_entry->name_len);
+        scan_entry->ino = st.st_ino;
+        if (scan_entry->name == NULL) {
+            break;
+        }
+        batch.count++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    free(ready);
+
+    int dispatched = (int)batch.count;
+    if (batch.count > 0) {
+        log_message(LOG_INFO, "Dispatching %zu uploads ahead of the scheduled transfer", batch.count);
+        // Uploads still in the pipeline after a switch back from streaming
+        // intake are moved under the same journal
+        intake_pause();
+        if (!transfer_uploads(&batch, NULL)) {
+            dispatched = -1;
+        }
+        intake_resume();
+    }
+    dir_scan_free(&batch);
+
+    return dispatched;
+}
+
+/**
+ * Copy the counters of every transfer class
+ */
+void scheduler_stats(struct scheduler_class_stats stats[TRANSFER_CLASS_COUNT]) {
+    struct scheduler_queue *queue = scheduler_queue();
+
+    pthread_mutex_lock(&queue->lock);
+    memcpy(stats, queue->class_stats, sizeof(queue->class_stats));
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Log the queue depth and deadline misses of every class and write them
+ * to the transfer stats file, if anything changed since the last report
+ */
+void scheduler_report(void) {
+    const struct config *config = config_current();
+    struct scheduler_queue *queue = scheduler_queue();
+    struct scheduler_class_stats class_stats[TRANSFER_CLASS_COUNT];
+    char tmp_path[PATH_MAX];
+    char summary[512];
+    size_t used = 0;
+    FILE *file;
+
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->stats_changed) {
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+    queue->stats_changed = 0;
+    memcpy(class_stats, queue->class_stats, sizeof(class_stats));
+    pthread_mutex_unlock(&queue->lock);
+
+    if (!format_path(tmp_path, sizeof(tmp_path), "%s%s", config->transfer_stats, PARTIAL_SUFFIX)) {
+        return;
+    }
+    file = fopen(tmp_path, "w");
+    if (file != NULL) {
+        fprintf(file, "# class queued transferred missed avg_latency_sec max_latency_sec\n");
+    }
+
+    for (int c = 0; c < TRANSFER_CLASS_COUNT; c++) {
+        const struct scheduler_class_stats *stats = &class_stats[c];
+        long long average = stats->transferred ? stats->latency_sec / (long long)stats->transferred : 0;
+
+        if (used < sizeof(summary)) {
+            used += snprintf(summary + used, sizeof(summary) - used, "%s%s %zu queued, %lu moved, %lu missed",
+                             c ? "; " : "", transfer_class_name(c), stats->queued,
+                             stats->transferred, stats->missed);
+        }
+        if (file != NULL) {
+            fprintf(file, "%s %zu %lu %lu %lld %lld\n", transfer_class_name(c), stats->queued,
+                    stats->transferred, stats->missed, average, stats->max_latency_sec);
+        }
+    }
+
+    if (file == NULL || fclose(file) != 0 || rename(tmp_path, config->transfer_stats) != 0) {
+        log_message(LOG_WARNING, "Failed to write %s: %s", config->transfer_stats, strerror(errno));
+        unlink(tmp_path);
+    }
+    log_message(LOG_INFO, "Transfer queue: %s", summary);
+}
+
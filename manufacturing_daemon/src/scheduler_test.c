@@ -0,0 +1,174 @@
+#include "../inc/scheduler.h"
+#include "../inc/company.h"
+#include "../inc/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+// Uploads older than this have settled
+#define SCHEDULER_TEST_AGE_SEC (SCHEDULER_SETTLE_SEC * 6)
+
+static int failures = 0;
+static char test_dir[] = "/tmp/scheduler_test.XXXXXX";
+static char upload_dir[PATH_MAX];
+
+/**
+ * Write a small file, creating or replacing it
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int write_file(const char *path, const char *text) {
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    fputs(text, file);
+    return fclose(file) == 0;
+}
+
+/**
+ * Build the path of an upload
+ *
+ * @return 1 on success, 0 if it does not fit
+ */
+static int upload_path(const char *name, char *path, size_t size) {
+    int len = snprintf(path, size, "%s/%s", upload_dir, name);
+
+    if (len < 0 || (size_t)len >= size) {
+        printf("FAIL path of %s too long\n", name);
+        failures++;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Create an upload and queue it as the monitor would
+ */
+static void upload(const char *name, time_t now) {
+    char path[PATH_MAX];
+
+    if (upload_path(name, path, sizeof(path)) && write_file(path, "<report></report>\n")) {
+        scheduler_submit(name, strlen(name), now - SCHEDULER_TEST_AGE_SEC);
+    }
+}
+
+static void delete_upload(const char *name) {
+    char path[PATH_MAX];
+
+    if (upload_path(name, path, sizeof(path))) {
+        unlink(path);
+    }
+}
+
+/**
+ * Compare the queued count of every transfer class with what is expected
+ */
+static void expect_queued(const char *step, size_t urgent, size_t bulk) {
+    struct scheduler_class_stats stats[TRANSFER_CLASS_COUNT];
+
+    scheduler_stats(stats);
+    if (stats[TRANSFER_URGENT].queued != urgent || stats[TRANSFER_BULK].queued != bulk ||
+        stats[TRANSFER_STANDARD].queued != 0) {
+        printf("FAIL %s: queued urgent %zu, standard %zu, bulk %zu; expected %zu, 0, %zu\n",
+               step, stats[TRANSFER_URGENT].queued, stats[TRANSFER_STANDARD].queued,
+               stats[TRANSFER_BULK].queued, urgent, bulk);
+        failures++;
+    } else {
+        printf("ok %s\n", step);
+    }
+    if (stats[TRANSFER_URGENT].transferred != 0 || stats[TRANSFER_BULK].transferred != 0) {
+        printf("FAIL %s: deleted uploads counted as transferred\n", step);
+        failures++;
+    }
+}
+
+/**
+ * Remove the files of one directory and the directory itself
+ */
+static void remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char file[PATH_MAX];
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/**
+ * Check that queued uploads deleted before they are moved stop being
+ * counted: urgent ones by the dispatch, bulk ones by the cycle's scan
+ *
+ * Usage: scheduler_test
+ */
+int main(void) {
+    char path[PATH_MAX], text[3 * PATH_MAX];
+    struct dir_scan uploads;
+    time_t now = time(NULL);
+
+    if (mkdtemp(test_dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(upload_dir, sizeof(upload_dir), "%s/upload", test_dir);
+    mkdir(upload_dir, 0755);
+
+    snprintf(path, sizeof(path), "%s/departments.conf", test_dir);
+    write_file(path, "rush urgent\nstock bulk\n");
+    snprintf(text, sizeof(text), "upload_dir = %s\nerror_log = %s/error.log\ndepartments_file = %s\n",
+             upload_dir, test_dir, path);
+    snprintf(path, sizeof(path), "%s/company.conf", test_dir);
+    if (!write_file(path, text) || !config_load(path)) {
+        printf("FAIL loading %s\n", path);
+        remove_dir(upload_dir);
+        remove_dir(test_dir);
+        return EXIT_FAILURE;
+    }
+
+    upload("rush_2024-03-01.xml", now);
+    upload("stock_2024-03-01.xml", now);
+    upload("stock_2024-03-02.xml", now);
+    expect_queued("submitted", 1, 2);
+
+    delete_upload("rush_2024-03-01.xml");
+    delete_upload("stock_2024-03-01.xml");
+    if (scheduler_dispatch(now) != 0) {
+        printf("FAIL dispatch moved a deleted upload\n");
+        failures++;
+    }
+    expect_queued("deleted urgent upload dropped by the dispatch", 0, 2);
+
+    if (!dir_scan(&uploads, upload_dir, REPORT_SUFFIX)) {
+        printf("FAIL scanning %s\n", upload_dir);
+        failures++;
+    } else {
+        scheduler_sync(&uploads);
+        dir_scan_free(&uploads);
+        expect_queued("deleted bulk upload dropped by the cycle's scan", 0, 1);
+    }
+
+    remove_dir(upload_dir);
+    remove_dir(test_dir);
+
+    if (failures > 0) {
+        printf("%d scheduler checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
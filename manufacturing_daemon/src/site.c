@@ -0,0 +1,592 @@
+#include "../inc/site.h"
+#include "../inc/company.h"
+#include "../inc/journal.h"
+#include "../inc/attribution.h"
+#include "../inc/departments.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+// A worker thread and the sites sharded to it. The worker serves its own
+// sites oldest first; once it runs out it steals the newest site from the
+// worker with the most sites queued, so a site that keeps one worker busy
+// for long does not hold up the sites queued behind it.
+struct site_worker {
+    pthread_t thread;
+    size_t id;
+    pthread_mutex_t lock;
+    struct site *queue[SITE_MAX];   // Ring, each site is queued at most once
+    size_t head, count;
+    unsigned long served, stolen;   // Under pool_lock
+};
+
+// The only root of a daemon without a sites file
+static struct site default_site = {
+    .scheduler.lock = PTHREAD_MUTEX_INITIALIZER,
+    .transfer_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct site *sites = NULL;
+static size_t site_count = 0;
+static struct site_worker workers[SITE_MAX_WORKERS];
+static size_t worker_count = 0;
+
+// Sites waiting in the workers' queues and being served. The main loop
+// queues every idle site each tick; the workers take them from there.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static size_t waiting = 0, serving = 0;
+
+// Cycles share the I/O throttle and the disks, so one runs at a time
+static pthread_mutex_t cycle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The site the calling worker is serving
+static pthread_key_t site_key;
+static pthread_once_t site_key_once = PTHREAD_ONCE_INIT;
+
+static time_t last_stats = 0;
+
+static void site_key_init(void) {
+    pthread_key_create(&site_key, NULL);
+}
+
+/**
+ * Get the site the calling thread is serving, or the daemon's only root
+ * when it serves a single one
+ */
+struct site *site_current(void) {
+    struct site *site;
+
+    pthread_once(&site_key_once, site_key_init);
+    site = pthread_getspecific(site_key);
+    return site != NULL ? site : &default_site;
+}
+
+/**
+ * Make the calling thread work on a site, or on the daemon's only root
+ * again with NULL
+ */
+void site_use(struct site *site) {
+    pthread_once(&site_key_once, site_key_init);
+    pthread_setspecific(site_key, site);
+}
+
+/**
+ * Check whether the daemon serves the sites of a sites file
+ */
+int sites_active(void) {
+    return site_count > 0;
+}
+
+/**
+ * Build a site's settings: the daemon's, with the site's directories and
+ * state files below its root. Logs, departments and replication stay
+ * shared by all sites.
+ *
+ * @return The settings, or NULL on failure
+ */
+static struct config *site_config(const struct config *base, const struct site *site) {
+    struct config *config = malloc(sizeof(*config));
+
+    if (config == NULL) {
+        log_message(LOG_ERR, "Out of memory building the settings of site %s", site->name);
+        return NULL;
+    }
+
+    memcpy(config, base, sizeof(*config));
+    if (!format_path(config->upload_dir, sizeof(config->upload_dir), "%s/%s", site->root, SITE_UPLOAD_DIR) ||
+        !format_path(config->reporting_dir, sizeof(config->reporting_dir), "%s/%s",
+                     site->root, SITE_REPORTING_DIR) ||
+        !format_path(config->backup_dir, sizeof(config->backup_dir), "%s/%s", site->root, SITE_BACKUP_DIR) ||
+        !format_path(config->latest_backup, sizeof(config->latest_backup), "%s/%s/%s",
+                     site->root, SITE_BACKUP_DIR, LATEST_BACKUP_NAME) ||
+        !format_path(config->transfer_journal, sizeof(config->transfer_journal), "%s/%s",
+                     site->root, SITE_JOURNAL) ||
+        !format_path(config->monitor_state, sizeof(config->monitor_state), "%s/%s",
+                     site->root, SITE_MONITOR_STATE) ||
+        !format_path(config->transfer_stats, sizeof(config->transfer_stats), "%s/%s",
+                     site->root, SITE_TRANSFER_STATS) ||
+        !format_path(config->intake_summary, sizeof(config->intake_summary), "%s/%s",
+                     site->root, SITE_INTAKE_SUMMARY)) {
+        free(config);
+        return NULL;
+    }
+    snprintf(config->site, sizeof(config->site), "%s", site->name);
+    config->refs = 1;
+
+    return config;
+}
+
+/**
+ * Create a directory and every missing parent, like mkdir -p
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int make_dirs(const char *path) {
+    char partial[PATH_MAX];
+
+    snprintf(partial, sizeof(partial), "%s", path);
+    for (char *slash = strchr(partial + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(partial, 0755) < 0 && errno != EEXIST) {
+            break;
+        }
+        *slash = '/';
+    }
+    if (mkdir(partial, 0755) < 0 && errno != EEXIST) {
+        log_message(LOG_ERR, "Failed to create %s: %s", path, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Read the sites file: one "name root" line per site. Blank lines and
+ * lines starting with '#' are ignored.
+ *
+ * @return The number of sites, 0 if there is no sites file, -1 on failure
+ */
+static int sites_load(const char *path, struct site **loaded) {
+    struct site *list;
+    char line[SITE_NAME_MAX + PATH_MAX + 8];
+    int line_number = 0;
+    int count = 0;
+    FILE *file;
+
+    *loaded = NULL;
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        log_message(LOG_ERR, "Failed to open sites file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    list = calloc(SITE_MAX, sizeof(*list));
+    if (list == NULL) {
+        log_message(LOG_ERR, "Out of memory loading sites");
+        fclose(file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *name = line, *root, *end;
+        size_t name_len;
+
+        line_number++;
+        while (isspace((unsigned char)*name)) {
+            name++;
+        }
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+
+        name_len = strcspn(name, " \t\r\n");
+        root = name + name_len;
+        while (isspace((unsigned char)*root)) {
+            root++;
+        }
+        for (end = root + strlen(root); end > root && isspace((unsigned char)end[-1]); end--) {
+        }
+        *end = '\0';
+        name[name_len] = '\0';
+
+        if (name_len >= SITE_NAME_MAX || strspn(name, SITE_NAME_CHARS) != name_len || name[0] == '.' ||
+            root[0] == '\0' || strlen(root) >= PATH_MAX - NAME_MAX) {
+            log_message(LOG_ERR, "%s:%d: expected a site name and its root directory", path, line_number);
+            free(list);
+            fclose(file);
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            if (strcmp(list[i].name, name) == 0) {
+                log_message(LOG_ERR, "%s:%d: site %s is listed twice", path, line_number, name);
+                free(list);
+                fclose(file);
+                return -1;
+            }
+        }
+        if (count == SITE_MAX) {
+            log_message(LOG_ERR, "%s: more than %d sites", path, SITE_MAX);
+            free(list);
+            fclose(file);
+            return -1;
+        }
+
+        // Both lengths were checked above
+        memcpy(list[count].name, name, name_len + 1);
+        memcpy(list[count].root, root, strlen(root) + 1);
+        count++;
+    }
+
+    fclose(file);
+    *loaded = list;
+    return count;
+}
+
+/**
+ * Queue a site on its home worker. Must be called with pool_lock held.
+ */
+static void worker_push(struct site_worker *worker, struct site *site) {
+    pthread_mutex_lock(&worker->lock);
+    worker->queue[(worker->head + worker->count) % SITE_MAX] = site;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/**
+ * Take the oldest site queued on a worker, or the newest when stealing
+ *
+ * @return The site, or NULL if the worker has none queued
+ */
+static struct site *worker_take(struct site_worker *worker, int steal) {
+    struct site *site = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0) {
+        if (steal) {
+            site = worker->queue[(worker->head + worker->count - 1) % SITE_MAX];
+        } else {
+            site = worker->queue[worker->head];
+            worker->head = (worker->head + 1) % SITE_MAX;
+        }
+        worker->count--;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return site;
+}
+
+/**
+ * Pick the site a worker serves next: its own oldest, or else the newest
+ * of the worker with the most sites queued. Called with pool_lock held
+ * after taking a site counted as waiting; sites are queued under the same
+ * lock before they are counted, so one is always found.
+ *
+ * @param stolen Set if the site came from another worker
+ * @return The site
+ */
+static struct site *worker_next(struct site_worker *self, int *stolen) {
+    struct site_worker *busiest = NULL;
+    size_t most = 0;
+    struct site *site;
+
+    site = worker_take(self, 0);
+    *stolen = site == NULL;
+    if (site != NULL) {
+        return site;
+    }
+
+    for (size_t i = 1; i < worker_count; i++) {
+        struct site_worker *other = &workers[(self->id + i) % worker_count];
+        pthread_mutex_lock(&other->lock);
+        size_t count = other->count;
+        pthread_mutex_unlock(&other->lock);
+        if (count > most) {
+            most = count;
+            busiest = other;
+        }
+    }
+
+    return busiest != NULL ? worker_take(busiest, 1) : NULL;
+}
+
+/**
+ * Serve one site for a tick: watch its uploads, move what is due and run
+ * its pending cycle, all with the site's settings
+ *
+ * @return Seconds spent
+ */
+static double site_serve(struct site *site) {
+    const struct config *config = site->config;
+    struct timespec start, end;
+    int due;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    site_use(site);
+    config_use(config);
+
+    // Finish a transfer cycle interrupted by a crash and pick up the
+    // monitor's state, on the site's first tick
+    if (!site->opened) {
+        journal_recover(config->transfer_journal);
+        monitor_init(config->upload_dir);
+        site->opened = 1;
+    }
+
+    monitor_uploads_with_path(config->upload_dir);
+    scheduler_dispatch(time(NULL));
+
+    pthread_mutex_lock(&pool_lock);
+    due = site->cycles_due;
+    site->cycles_due = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    if (due != 0) {
+        if (pthread_mutex_trylock(&cycle_lock) == 0) {
+            if (due & SITE_CYCLE_SCHEDULED) {
+                log_message(LOG_INFO, "Starting scheduled transfer and backup");
+            } else {
+                log_message(LOG_INFO, "Received user-defined signal, performing throttled backup/transfer");
+            }
+            run_cycle(!(due & SITE_CYCLE_SCHEDULED));
+            pthread_mutex_unlock(&cycle_lock);
+        } else {
+            // Another site's cycle is running, try again next tick
+            pthread_mutex_lock(&pool_lock);
+            site->cycles_due |= due;
+            pthread_mutex_unlock(&pool_lock);
+        }
+    }
+
+    scheduler_report();
+
+    config_use(NULL);
+    site_use(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Body of a worker thread
+ */
+static void *site_worker_thread(void *arg) {
+    struct site_worker *self = arg;
+
+    while (1) {
+        struct site *site;
+        int stolen;
+
+        pthread_mutex_lock(&pool_lock);
+        while (waiting == 0) {
+            pthread_cond_wait(&work_ready, &pool_lock);
+        }
+        waiting--;
+        serving++;
+        site = worker_next(self, &stolen);
+        pthread_mutex_unlock(&pool_lock);
+
+        double seconds = site_serve(site);
+
+        pthread_mutex_lock(&pool_lock);
+        site->queued = 0;
+        site->busy_sec += seconds;
+        self->served++;
+        self->stolen += stolen;
+        serving--;
+        if (waiting == 0 && serving == 0) {
+            pthread_cond_broadcast(&work_done);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Serve the roots listed in the sites file, if there is one: make their
+ * directories, build their settings and start the workers. Each site is
+ * opened by a worker on its first tick, so large sites load their state
+ * in parallel.
+ *
+ * @return 1 if sites are served, 0 if there is no sites file and the
+ *         daemon serves its single root, -1 on failure
+ */
+int sites_start(void) {
+    const struct config *config = config_current();
+    pthread_attr_t attr;
+    size_t wanted;
+    int count;
+
+    count = sites_load(config->sites_file, &sites);
+    if (count <= 0) {
+        return count;
+    }
+    site_count = (size_t)count;
+
+    for (size_t i = 0; i < site_count; i++) {
+        struct site *site = &sites[i];
+
+        pthread_mutex_init(&site->scheduler.lock, NULL);
+        pthread_mutex_init(&site->transfer_lock, NULL);
+        site->config = site_config(config, site);
+        if (site->config == NULL) {
+            return -1;
+        }
+        if (!make_dirs(site->config->upload_dir) || !make_dirs(site->config->reporting_dir) ||
+            !make_dirs(site->config->backup_dir)) {
+            return -1;
+        }
+    }
+
+    // Loaded once here, the workers only read it
+    departments_get();
+
+    // One fanotify group watches every site's uploads
+    if (config->attribution == ATTRIBUTION_FANOTIFY && attribution_start(sites[0].config->upload_dir)) {
+        for (size_t i = 1; i < site_count; i++) {
+            attribution_watch(sites[i].config->upload_dir);
+        }
+    }
+
+    wanted = config->site_workers;
+    if (wanted == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        wanted = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (wanted > SITE_MAX_WORKERS) {
+        wanted = SITE_MAX_WORKERS;
+    }
+    if (wanted > site_count) {
+        wanted = site_count;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (size_t i = 0; i < wanted; i++) {
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (pthread_create(&workers[i].thread, &attr, site_worker_thread, &workers[i]) != 0) {
+            log_message(LOG_WARNING, "Failed to start site worker %zu: %s", i, strerror(errno));
+            break;
+        }
+        worker_count++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (worker_count == 0) {
+        log_message(LOG_ERR, "No site worker could be started");
+        return -1;
+    }
+
+    // Shard the sites across the workers that did start
+    for (size_t i = 0; i < site_count; i++) {
+        sites[i].home = i % worker_count;
+    }
+
+    last_stats = time(NULL);
+    log_message(LOG_INFO, "Serving %zu sites from %s with %zu workers",
+                site_count, config->sites_file, worker_count);
+    return 1;
+}
+
+/**
+ * Log how much work the workers did and how much of it they stole since
+ * the last report
+ */
+static void sites_log_stats(void) {
+    unsigned long served = 0, stolen = 0;
+    const struct site *busiest = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (size_t i = 0; i < worker_count; i++) {
+        served += workers[i].served;
+        stolen += workers[i].stolen;
+        workers[i].served = 0;
+        workers[i].stolen = 0;
+    }
+    for (size_t i = 0; i < site_count; i++) {
+        if (busiest == NULL || sites[i].busy_sec > busiest->busy_sec) {
+            busiest = &sites[i];
+        }
+    }
+    log_message(LOG_INFO, "Sites: %lu ticks served by %zu workers, %lu of them stolen; busiest site %s "
+                "(%.1f s)", served, worker_count, stolen, busiest->name, busiest->busy_sec);
+    for (size_t i = 0; i < site_count; i++) {
+        sites[i].busy_sec = 0;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Queue every site that is not already waiting or being served, called
+ * by the main loop every SITE_TICK_SEC. A site still busy, e.g. with a
+ * long cycle, is simply picked up again on a later tick.
+ *
+ * @param scheduled It is the scheduled transfer time
+ * @param requested A throttled cycle was requested with SIGUSR1
+ */
+void sites_tick(time_t now, int scheduled, int requested) {
+    pthread_mutex_lock(&pool_lock);
+    for (size_t i = 0; i < site_count; i++) {
+        struct site *site = &sites[i];
+
+        // The scheduled minute spans several ticks, run the cycle once
+        if (scheduled && now - site->last_scheduled >= 60) {
+            site->cycles_due |= SITE_CYCLE_SCHEDULED;
+            site->last_scheduled = now;
+        }
+        if (requested) {
+            site->cycles_due |= SITE_CYCLE_REQUESTED;
+        }
+
+        if (!site->queued) {
+            site->queued = 1;
+            worker_push(&workers[site->home], site);
+            waiting++;
+        }
+    }
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&pool_lock);
+
+    if (now - last_stats >= SITE_STATS_INTERVAL_SEC) {
+        sites_log_stats();
+        last_stats = now;
+    }
+}
+
+/**
+ * Reload the configuration file and rebuild every site's settings from
+ * it. Like the reload of a single root, it waits until no site is being
+ * served, so settings never change during a tick or a cycle. Sites are
+ * only added or removed by a restart.
+ *
+ * @return 1 on success, 0 if the current settings were kept
+ */
+int sites_reload(void) {
+    struct site *listed;
+    int count;
+    int success;
+
+    pthread_mutex_lock(&pool_lock);
+    while (waiting > 0 || serving > 0) {
+        pthread_cond_wait(&work_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    success = config_reload();
+    if (success) {
+        const struct config *config = config_current();
+
+        for (size_t i = 0; i < site_count; i++) {
+            struct config *fresh = site_config(config, &sites[i]);
+            if (fresh != NULL) {
+                config_put(sites[i].config);
+                sites[i].config = fresh;
+            }
+        }
+        departments_get();
+
+        count = sites_load(config->sites_file, &listed);
+        int changed = count != (int)site_count;
+        for (int i = 0; !changed && i < count; i++) {
+            changed = strcmp(listed[i].name, sites[i].name) != 0 || strcmp(listed[i].root, sites[i].root) != 0;
+        }
+        if (changed) {
+            log_message(LOG_WARNING, "The list of sites in %s changed, restart the daemon to apply it",
+                        config->sites_file);
+        }
+        free(listed);
+    }
+
+    return success;
+}
@@ -1,5 +1,8 @@
 #include "../inc/daemon.h"
 #include "../inc/company.h"
+#include "../inc/journal.h"
+#include "../inc/replication.h"
+#include "../inc/retention.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,10 +13,8 @@
 int main(int argc, char *argv[]) {
     int msgid;
     char cwd[PATH_MAX];
-    char upload_dir[PATH_MAX];
-    char reporting_dir[PATH_MAX];
-    char backup_dir[PATH_MAX];
-    char log_dir[PATH_MAX];
+    const char *config_file = argc > 1 ? argv[1] : CONFIG_FILE;
+    const struct config *config;
     
     printf("Starting Company Daemon in test mode (foreground)\n");
     
@@ -25,23 +26,29 @@ int main(int argc, char *argv[]) {
     
     printf("Working directory: %s\n", cwd);
     
-    // Create absolute paths
-    snprintf(upload_dir, sizeof(upload_dir), "%s/data/upload", cwd);
-    snprintf(reporting_dir, sizeof(reporting_dir), "%s/data/reporting", cwd);
-    snprintf(backup_dir, sizeof(backup_dir), "%s/data/backup", cwd);
-    snprintf(log_dir, sizeof(log_dir), "%s/logs", cwd);
+    if (!config_load(config_file)) {
+        fprintf(stderr, "Failed to load configuration from %s\n", config_file);
+        exit(EXIT_FAILURE);
+    }
+    config = config_current();
     
     printf("Paths:\n");
-    printf("  Upload: %s\n", upload_dir);
-    printf("  Reporting: %s\n", reporting_dir);
-    printf("  Backup: %s\n", backup_dir);
-    printf("  Logs: %s\n", log_dir);
+    printf("  Upload: %s\n", config->upload_dir);
+    printf("  Reporting: %s\n", config->reporting_dir);
+    printf("  Backup: %s\n", config->backup_dir);
+    printf("  Logs: %s\n", config->log_dir);
     
     // Create necessary directories if they don't exist
-    mkdir(upload_dir, 0755);
-    mkdir(reporting_dir, 0755);
-    mkdir(backup_dir, 0755);
-    mkdir(log_dir, 0755);
+    mkdir(config->upload_dir, 0755);
+    mkdir(config->reporting_dir, 0755);
+    mkdir(config->backup_dir, 0755);
+    mkdir(config->log_dir, 0755);
+    
+    // Finish any transfer cycle that was interrupted by a crash or kill
+    journal_recover(config->transfer_journal);
+    
+    // Ship whatever the standby has not acknowledged yet
+    replication_start();
     
     // Initialize IPC message queue
     msgid = msgget(IPC_PRIVATE, 0666 | IPC_CREAT);
@@ -54,13 +61,16 @@ int main(int argc, char *argv[]) {
     
     // Process files immediately (instead of waiting for 1AM)
     printf("Starting transfer of uploads...\n");
-    transfer_uploads();
+    transfer_uploads(NULL, NULL);
     
     printf("Starting backup of reporting directory...\n");
-    backup_reporting_dir();
+    backup_reporting_dir(NULL);
+    
+    printf("Applying backup retention...\n");
+    prune_backups(0);
     
     printf("Checking for missing uploads...\n");
-    check_missing_uploads();
+    check_missing_uploads(NULL, NULL);
     
     printf("Test completed successfully!\n");
     
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "../inc/throttle.h"
+#include "../inc/company.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+
+// Token buckets for bytes and operations, shared by every copy path
+struct io_throttle {
+    int enabled;
+    long long max_bytes_per_sec, max_ops_per_sec;
+    long long bytes_per_sec, ops_per_sec;
+    double byte_tokens, op_tokens;
+    long long last_refill_ns;
+
+    // Latency seen since the budget was last adjusted
+    long long window_start_ns;
+    long long window_latency_ns;
+    long long window_ops;
+
+    // Totals for the cycle and the priority to restore afterwards
+    unsigned long long total_bytes, total_ops;
+    long long total_latency_ns, total_sleep_ns;
+    long long start_ns;
+    int saved_ioprio;
+};
+
+static struct io_throttle throttle;
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Current monotonic time in nanoseconds
+ */
+long long io_throttle_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Lower the kernel I/O priority of the daemon for the throttled cycle
+ */
+static void throttle_set_ioprio(int io_class) {
+    throttle.saved_ioprio = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                io_class << IOPRIO_CLASS_SHIFT | (io_class == IOPRIO_CLASS_IDLE ? 0 : THROTTLE_IO_LEVEL)) < 0) {
+        log_message(LOG_WARNING, "Failed to lower I/O priority: %s", strerror(errno));
+    }
+}
+
+/**
+ * Start a transfer or backup cycle. Throttled cycles are limited to the
+ * configured bytes and operations per second and run at a low I/O
+ * priority, unthrottled ones run at full speed.
+ */
+void io_throttle_begin(int throttled) {
+    pthread_mutex_lock(&throttle_lock);
+
+    memset(&throttle, 0, sizeof(throttle));
+    throttle.saved_ioprio = -1;
+    throttle.enabled = throttled;
+    throttle.start_ns = io_throttle_clock();
+
+    if (throttled) {
+        const struct config *config = config_current();
+        throttle.max_bytes_per_sec = config->io_bytes_per_sec;
+        throttle.max_ops_per_sec = config->io_ops_per_sec;
+        throttle.bytes_per_sec = throttle.max_bytes_per_sec;
+        throttle.ops_per_sec = throttle.max_ops_per_sec;
+        throttle.last_refill_ns = throttle.start_ns;
+        throttle.window_start_ns = throttle.start_ns;
+        throttle_set_ioprio(config->io_class);
+
+        log_message(LOG_INFO, "I/O throttled to %.1f MB/s and %lld ops/s",
+                    throttle.bytes_per_sec / 1e6, throttle.ops_per_sec);
+    }
+
+    pthread_mutex_unlock(&throttle_lock);
+}
+
+/**
+ * Cut the budget when the mean latency of recent I/O is above the target
+ * and let it grow back slowly when it is below, so the cycle backs off
+ * while foreground users are busy with the same disks
+ */
+static void throttle_adjust(long long now) {
+    if (now - throttle.window_start_ns < THROTTLE_ADJUST_INTERVAL_MS * 1000000LL ||
+        throttle.window_ops == 0) {
+        return;
+    }
+
+    long long mean_latency = throttle.window_latency_ns / throttle.window_ops;
+    if (mean_latency > THROTTLE_TARGET_LATENCY_US * 1000LL) {
+        throttle.bytes_per_sec = throttle.bytes_per_sec * 3 / 4;
+        throttle.ops_per_sec = throttle.ops_per_sec * 3 / 4;
+    } else {
+        throttle.bytes_per_sec += throttle.max_bytes_per_sec / 16;
+        throttle.ops_per_sec += throttle.max_ops_per_sec / 16;
+    }
+
+    if (throttle.bytes_per_sec < throttle.max_bytes_per_sec / THROTTLE_MIN_FRACTION) {
+        throttle.bytes_per_sec = throttle.max_bytes_per_sec / THROTTLE_MIN_FRACTION;
+    }
+    if (throttle.bytes_per_sec > throttle.max_bytes_per_sec) {
+        throttle.bytes_per_sec = throttle.max_bytes_per_sec;
+    }
+    if (throttle.ops_per_sec < throttle.max_ops_per_sec / THROTTLE_MIN_FRACTION + 1) {
+        throttle.ops_per_sec = throttle.max_ops_per_sec / THROTTLE_MIN_FRACTION + 1;
+    }
+    if (throttle.ops_per_sec > throttle.max_ops_per_sec) {
+        throttle.ops_per_sec = throttle.max_ops_per_sec;
+    }
+
+    throttle.window_start_ns = now;
+    throttle.window_latency_ns = 0;
+    throttle.window_ops = 0;
+}
+
+/**
+ * Charge an I/O against the budget, sleeping until the buckets have
+ * paid off the debt if it overdrew them
+ *
+ * @param latency_ns How long the I/O took, used to adapt the budget
+ */
+void io_throttle_account(size_t bytes, int ops, long long latency_ns) {
+    long long now, sleep_ns = 0;
+
+    pthread_mutex_lock(&throttle_lock);
+
+    throttle.total_bytes += bytes;
+    throttle.total_ops += ops;
+    throttle.total_latency_ns += latency_ns;
+
+    if (!throttle.enabled) {
+        pthread_mutex_unlock(&throttle_lock);
+        return;
+    }
+
+    now = io_throttle_clock();
+    throttle.window_latency_ns += latency_ns;
+    throttle.window_ops += ops;
+    throttle_adjust(now);
+
+    // Refill both buckets, capped at one burst
+    double elapsed = (now - throttle.last_refill_ns) / 1e9;
+    double byte_burst = throttle.bytes_per_sec * (THROTTLE_BURST_MS / 1000.0);
+    double op_burst = throttle.ops_per_sec * (THROTTLE_BURST_MS / 1000.0);
+    throttle.last_refill_ns = now;
+    throttle.byte_tokens += elapsed * throttle.bytes_per_sec;
+    throttle.op_tokens += elapsed * throttle.ops_per_sec;
+    if (throttle.byte_tokens > byte_burst) {
+        throttle.byte_tokens = byte_burst;
+    }
+    if (throttle.op_tokens > op_burst) {
+        throttle.op_tokens = op_burst;
+    }
+
+    throttle.byte_tokens -= bytes;
+    throttle.op_tokens -= ops;
+
+    // Whichever bucket is deeper in debt decides the wait
+    if (throttle.byte_tokens < 0) {
+        sleep_ns = (long long)(-throttle.byte_tokens / throttle.bytes_per_sec * 1e9);
+    }
+    if (throttle.op_tokens < 0) {
+        long long op_sleep_ns = (long long)(-throttle.op_tokens / throttle.ops_per_sec * 1e9);
+        if (op_sleep_ns > sleep_ns) {
+            sleep_ns = op_sleep_ns;
+        }
+    }
+    throttle.total_sleep_ns += sleep_ns;
+
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (sleep_ns > 0) {
+        struct timespec delay = { sleep_ns / 1000000000LL, sleep_ns % 1000000000LL };
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+/**
+ * Finish a cycle, logging what the throttle did and restoring the
+ * daemon's I/O priority
+ */
+void io_throttle_end(void) {
+    pthread_mutex_lock(&throttle_lock);
+
+    if (throttle.enabled) {
+        double seconds = (io_throttle_clock() - throttle.start_ns) / 1e9;
+
+        log_message(LOG_INFO, "I/O throttle: %.1f MB in %llu ops over %.3f s, %.3f s spent waiting, "
+                    "mean latency %.3f ms, budget ended at %.1f MB/s",
+                    throttle.total_bytes / 1e6, throttle.total_ops, seconds,
+                    throttle.total_sleep_ns / 1e9,
+                    throttle.total_ops ? throttle.total_latency_ns / 1e6 / throttle.total_ops : 0.0,
+                    throttle.bytes_per_sec / 1e6);
+
+        if (throttle.saved_ioprio >= 0) {
+            syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, throttle.saved_ioprio);
+        }
+        throttle.enabled = 0;
+    }
+
+    pthread_mutex_unlock(&throttle_lock);
+}
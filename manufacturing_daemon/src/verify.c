@@ -0,0 +1,63 @@
+#include "../inc/company.h"
+#include "../inc/checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+/**
+ * Verify a backup snapshot against its recorded checksums.
+ *
+ * Usage: company_verify [snapshot] [threads]
+ *
+ * Run from the daemon's working directory, its configuration file names
+ * the backup directory. The snapshot may be given as a name in the backup
+ * directory or as a path, and defaults to the latest completed backup.
+ * The thread count defaults to the verify_threads setting. Exits with 0
+ * if every file matched.
+ */
+int main(int argc, char *argv[]) {
+    char snapshot_dir[PATH_MAX];
+    struct verify_stats stats;
+    struct timespec start, end;
+    const struct config *config;
+    int threads;
+    int ok;
+
+    if (argc > 3 || (argc > 1 && strcmp(argv[1], "--help") == 0)) {
+        fprintf(stderr, "Usage: %s [snapshot] [threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!config_load(CONFIG_FILE)) {
+        fprintf(stderr, "Could not load configuration from %s\n", CONFIG_FILE);
+        return EXIT_FAILURE;
+    }
+    config = config_current();
+    threads = config->verify_threads;
+
+    if (!backup_snapshot_dir(argc > 1 ? argv[1] : NULL, snapshot_dir, sizeof(snapshot_dir))) {
+        fprintf(stderr, "No completed backup found in %s\n", config->latest_backup);
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 2) {
+        threads = atoi(argv[2]);
+    }
+
+    printf("Verifying %s (crc32c, %s)\n", snapshot_dir, crc32c_implementation());
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ok = verify_snapshot(snapshot_dir, threads, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%zu ok, %zu corrupt, %zu missing, %.1f MB in %.3f s\n",
+           stats.files_ok, stats.files_corrupt, stats.files_missing,
+           stats.bytes_read / 1e6, seconds);
+    log_message(ok ? LOG_INFO : LOG_ERR, "Verified %s: %zu ok, %zu corrupt, %zu missing",
+                snapshot_dir, stats.files_ok, stats.files_corrupt, stats.files_missing);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
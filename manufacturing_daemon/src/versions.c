@@ -0,0 +1,539 @@
+#include "../inc/versions.h"
+#include "../inc/company.h"
+#include "../inc/replication.h"
+#include "../inc/partition.h"
+#include "../inc/throttle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+// Length of the "_YYYYmmdd_HHMMSS" a re-upload's name is given
+#define VERSION_STAMP_LEN 16
+
+// One version of a report found in a directory
+struct version {
+    const char *name;                   // In the scan's arena
+    size_t base_len;                    // Length of the report name it is a version of
+    char stamp[VERSION_STAMP_LEN];      // YYYYmmdd_HHMMSS, empty for the first version
+    int counter;                        // Added when two versions arrive in the same second
+    int delta;
+};
+
+// A report a version list is limited to, by its name without version
+struct report_key {
+    const char *name;
+    size_t len;
+};
+
+// Every version in a directory, grouped by report, oldest first
+struct version_list {
+    struct dir_scan scan;
+    struct version *versions;
+    size_t count;
+};
+
+/**
+ * Check for "_YYYYmmdd_HHMMSS" at the start of s
+ */
+static int is_stamp(const char *s) {
+    for (int i = 0; i < VERSION_STAMP_LEN; i++) {
+        int want_separator = i == 0 || i == 9;
+        if (want_separator ? s[i] != '_' : !isdigit((unsigned char)s[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Split a file name into the report it is a version of and the time the
+ * version arrived, following the names build_transfer_destination()
+ * hands out: report.xml, then report_YYYYmmdd_HHMMSS[_N].xml
+ *
+ * @return 1 if the name is a report version, 0 otherwise
+ */
+static int parse_version(const char *name, size_t name_len, struct version *version) {
+    size_t stem_len;
+
+    memset(version, 0, sizeof(*version));
+    version->name = name;
+
+    if (has_suffix(name, name_len, REPORT_SUFFIX VERSION_DELTA_SUFFIX)) {
+        version->delta = 1;
+        stem_len = name_len - strlen(REPORT_SUFFIX VERSION_DELTA_SUFFIX);
+    } else if (has_suffix(name, name_len, REPORT_SUFFIX)) {
+        stem_len = name_len - strlen(REPORT_SUFFIX);
+    } else {
+        return 0;
+    }
+    version->base_len = stem_len;
+
+    // A counter is only ever added after a stamp
+    size_t stamp_end = stem_len;
+    size_t digits = 0;
+    while (digits < stem_len && isdigit((unsigned char)name[stem_len - 1 - digits])) {
+        digits++;
+    }
+    if (digits > 0 && digits < stem_len && name[stem_len - 1 - digits] == '_' &&
+        stem_len - 1 - digits >= VERSION_STAMP_LEN && is_stamp(name + stem_len - 1 - digits - VERSION_STAMP_LEN)) {
+        stamp_end = stem_len - 1 - digits;
+        version->counter = atoi(name + stamp_end + 1);
+    }
+
+    if (stamp_end >= VERSION_STAMP_LEN && is_stamp(name + stamp_end - VERSION_STAMP_LEN)) {
+        memcpy(version->stamp, name + stamp_end - VERSION_STAMP_LEN + 1, VERSION_STAMP_LEN - 1);
+        version->base_len = stamp_end - VERSION_STAMP_LEN;
+    } else {
+        version->counter = 0;
+    }
+
+    return 1;
+}
+
+static int same_report(const struct version *a, const struct version *b) {
+    return a->base_len == b->base_len && memcmp(a->name, b->name, a->base_len) == 0;
+}
+
+/**
+ * Order by report, then oldest version first. A version found both full
+ * and as a delta sorts its full copy first.
+ */
+static int compare_versions(const void *a, const void *b) {
+    const struct version *va = a, *vb = b;
+    size_t len = va->base_len < vb->base_len ? va->base_len : vb->base_len;
+    int result = memcmp(va->name, vb->name, len);
+
+    if (result != 0) {
+        return result;
+    }
+    if (va->base_len != vb->base_len) {
+        return va->base_len < vb->base_len ? -1 : 1;
+    }
+    result = strcmp(va->stamp, vb->stamp);
+    if (result != 0) {
+        return result;
+    }
+    if (va->counter != vb->counter) {
+        return va->counter < vb->counter ? -1 : 1;
+    }
+    return va->delta - vb->delta;
+}
+
+static int compare_report_keys(const void *a, const void *b) {
+    const struct report_key *ka = a, *kb = b;
+    int result = memcmp(ka->name, kb->name, ka->len < kb->len ? ka->len : kb->len);
+
+    if (result != 0) {
+        return result;
+    }
+    return ka->len < kb->len ? -1 : ka->len > kb->len;
+}
+
+/**
+ * List the versions of the given reports in a directory. The directory
+ * is read once, but only versions of those reports are kept and sorted,
+ * so a large reporting directory costs one pass over its names.
+ *
+ * @param names Names of any version of each report to list
+ * @return 1 on success, 0 on failure
+ */
+static int version_list_load(struct version_list *list, const char *dir,
+                             const char *const *names, size_t name_count) {
+    struct report_key *keys;
+    size_t key_count = 0;
+
+    memset(list, 0, sizeof(*list));
+
+    keys = malloc((name_count ? name_count : 1) * sizeof(*keys));
+    if (keys == NULL) {
+        log_message(LOG_ERR, "Out of memory listing report versions in %s", dir);
+        return 0;
+    }
+    for (size_t i = 0; i < name_count; i++) {
+        struct version version;
+        if (parse_version(names[i], strlen(names[i]), &version)) {
+            keys[key_count].name = names[i];
+            keys[key_count].len = version.base_len;
+            key_count++;
+        }
+    }
+    qsort(keys, key_count, sizeof(*keys), compare_report_keys);
+
+    if (key_count == 0) {
+        free(keys);
+        return 1;
+    }
+    if (!dir_scan(&list->scan, dir, NULL)) {
+        free(keys);
+        return 0;
+    }
+
+    list->versions = malloc((list->scan.count ? list->scan.count : 1) * sizeof(*list->versions));
+    if (list->versions == NULL) {
+        log_message(LOG_ERR, "Out of memory listing report versions in %s", dir);
+        dir_scan_free(&list->scan);
+        free(keys);
+        return 0;
+    }
+
+    for (size_t i = 0; i < list->scan.count; i++) {
+        struct version *version = &list->versions[list->count];
+        struct report_key key;
+
+        if (!parse_version(list->scan.entries[i].name, list->scan.entries[i].name_len, version)) {
+            continue;
+        }
+        key.name = version->name;
+        key.len = version->base_len;
+        if (bsearch(&key, keys, key_count, sizeof(*keys), compare_report_keys) != NULL) {
+            list->count++;
+        }
+    }
+    free(keys);
+    qsort(list->versions, list->count, sizeof(*list->versions), compare_versions);
+
+    // A crash between writing a delta and removing the full copy leaves
+    // both, the full copy wins and the delta is written again
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (kept > 0 && list->versions[i].delta && !list->versions[kept - 1].delta &&
+            same_report(&list->versions[i], &list->versions[kept - 1]) &&
+            strcmp(list->versions[i].stamp, list->versions[kept - 1].stamp) == 0 &&
+            list->versions[i].counter == list->versions[kept - 1].counter) {
+            continue;
+        }
+        list->versions[kept++] = list->versions[i];
+    }
+    list->count = kept;
+
+    return 1;
+}
+
+static void version_list_free(struct version_list *list) {
+    free(list->versions);
+    dir_scan_free(&list->scan);
+}
+
+/**
+ * Read a whole file into a buffer
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int read_file(const char *path, struct delta_buffer *content) {
+    struct stat st;
+    int fd;
+
+    memset(content, 0, sizeof(*content));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        log_message(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    content->capacity = st.st_size > 0 ? (size_t)st.st_size : 1;
+    content->data = malloc(content->capacity);
+    if (content->data == NULL) {
+        log_message(LOG_ERR, "Out of memory reading %s", path);
+        close(fd);
+        return 0;
+    }
+
+    while (content->size < (size_t)st.st_size) {
+        ssize_t bytes = read(fd, content->data + content->size, (size_t)st.st_size - content->size);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            log_message(LOG_ERR, "Failed to read %s: %s", path, bytes < 0 ? strerror(errno) : "file shrank");
+            close(fd);
+            delta_buffer_free(content);
+            return 0;
+        }
+        content->size += (size_t)bytes;
+    }
+
+    close(fd);
+    return 1;
+}
+
+/**
+ * Rebuild one version of a report: read the nearest newer full copy and
+ * apply the deltas between it and the version, newest first
+ *
+ * @param index Position of the version in the list
+ * @return 1 on success, 0 on failure
+ */
+static int version_rebuild(const struct version_list *list, const char *dir, size_t index,
+                           struct delta_buffer *content) {
+    char path[PATH_MAX];
+    size_t top = index;
+
+    while (top < list->count && list->versions[top].delta &&
+           same_report(&list->versions[top], &list->versions[index])) {
+        top++;
+    }
+    if (top == list->count || !same_report(&list->versions[top], &list->versions[index])) {
+        log_message(LOG_ERR, "No full copy to rebuild %s/%s from", dir, list->versions[index].name);
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, list->versions[top].name);
+    if (!read_file(path, content)) {
+        return 0;
+    }
+
+    while (top-- > index) {
+        struct delta_buffer delta, older;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, list->versions[top].name);
+        if (!read_file(path, &delta)) {
+            delta_buffer_free(content);
+            return 0;
+        }
+        int applied = delta_apply(content->data, content->size, delta.data, delta.size, &older);
+        delta_buffer_free(&delta);
+        delta_buffer_free(content);
+        if (!applied) {
+            log_message(LOG_ERR, "Delta %s is corrupt or does not match its newer version", path);
+            return 0;
+        }
+        *content = older;
+    }
+
+    return 1;
+}
+
+/**
+ * Read any version of a report, full or stored as a delta. At most
+ * VERSION_CHAIN_MAX deltas are applied.
+ *
+ * @return 1 on success, 0 on failure
+ */
+int version_read(const char *path, struct delta_buffer *content) {
+    char dir[PATH_MAX];
+    const char *name;
+    struct version_list list;
+    int success = 0;
+
+    if (!has_suffix(path, strlen(path), VERSION_DELTA_SUFFIX)) {
+        return read_file(path, content);
+    }
+
+    name = strrchr(path, '/');
+    if (name == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+        name = path;
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(name - path), path);
+        name++;
+    }
+
+    if (!version_list_load(&list, dir, &name, 1)) {
+        return 0;
+    }
+    size_t i = 0;
+    while (i < list.count && strcmp(list.versions[i].name, name) != 0) {
+        i++;
+    }
+    if (i < list.count) {
+        success = version_rebuild(&list, dir, i, content);
+    } else {
+        log_message(LOG_ERR, "%s is not a stored report version", path);
+    }
+    version_list_free(&list);
+
+    return success;
+}
+
+/**
+ * Replace a full version by its delta. The delta is written to a ".part"
+ * file and renamed into place; the full copy is only removed once the
+ * delta is durable. A partition's manifest then lists the delta instead.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int store_delta(const char *dir, const char *name, const struct delta_buffer *delta,
+                       struct durability_batch *batch) {
+    char full_path[PATH_MAX];
+    char delta_path[PATH_MAX];
+    char part_path[PATH_MAX];
+    char delta_name[NAME_MAX + 1];
+    struct stat st;
+    size_t written = 0;
+    int fd;
+
+    if (!format_path(full_path, sizeof(full_path), "%s/%s", dir, name) ||
+        !format_path(delta_path, sizeof(delta_path), "%s%s", full_path, VERSION_DELTA_SUFFIX) ||
+        !format_path(part_path, sizeof(part_path), "%s%s", delta_path, PARTIAL_SUFFIX)) {
+        return 0;
+    }
+
+    fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_message(LOG_ERR, "Failed to create %s: %s", part_path, strerror(errno));
+        return 0;
+    }
+    while (written < delta->size) {
+        ssize_t bytes = write(fd, delta->data + written, delta->size - written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            log_message(LOG_ERR, "Error writing %s: %s", part_path, strerror(errno));
+            close(fd);
+            unlink(part_path);
+            return 0;
+        }
+        written += (size_t)bytes;
+    }
+    if (!durability_file_written(batch, fd, part_path)) {
+        close(fd);
+        unlink(part_path);
+        return 0;
+    }
+    close(fd);
+
+    if (rename(part_path, delta_path) != 0) {
+        log_message(LOG_ERR, "Failed to rename %s to %s: %s", part_path, delta_path, strerror(errno));
+        unlink(part_path);
+        return 0;
+    }
+    durability_entry_changed(batch, delta_path);
+    replication_file(delta_path);
+
+    if (!durability_unlink(batch, full_path)) {
+        log_message(LOG_WARNING, "Failed to remove %s after storing its delta: %s",
+                    full_path, strerror(errno));
+    }
+    replication_remove(full_path);
+
+    // The version is stored either way, a stale entry only misnames it
+    snprintf(delta_name, sizeof(delta_name), "%s%s", name, VERSION_DELTA_SUFFIX);
+    if (stat(delta_path, &st) != 0 ||
+        !partition_manifest_rename(dir, name, delta_name, &st, batch)) {
+        log_message(LOG_WARNING, "Partition manifest in %s still lists %s instead of its delta",
+                    dir, name);
+    }
+
+    return 1;
+}
+
+/**
+ * Store superseded report versions in a directory as reverse deltas.
+ *
+ * The newest version of a report always stays a full copy, so reading
+ * the current report costs nothing extra. Each older version becomes a
+ * delta against the next newer one, so it is never touched again when
+ * later versions arrive and a backup can link it from the previous
+ * snapshot. Only the run of full copies at the newest end of each report
+ * is visited; a version stays full when converting it would make a chain
+ * longer than VERSION_CHAIN_MAX or when its delta saves too little, and
+ * then serves as a keyframe for the versions before it.
+ *
+ * @param names The versions that arrived this cycle, only their reports
+ *              are looked at
+ * @return 1 on success, 0 on failure
+ */
+int versions_compact(const char *dir, const char *const *names, size_t name_count,
+                     struct durability_batch *batch) {
+    struct version_list list;
+    char path[PATH_MAX];
+    size_t converted = 0;
+    long long saved = 0;
+    int success = 1;
+
+    if (!version_list_load(&list, dir, names, name_count)) {
+        return 0;
+    }
+
+    for (size_t first = 0, end; first < list.count; first = end) {
+        const struct version *versions = list.versions;
+        end = first + 1;
+        while (end < list.count && same_report(&versions[end], &versions[first])) {
+            end++;
+        }
+
+        size_t newest = end - 1;
+        if (newest == first || versions[newest].delta || versions[newest - 1].delta) {
+            continue;
+        }
+
+        // Lowest full copy of the run at the newest end, and the deltas
+        // that lean on it
+        size_t run_start = newest - 1;
+        while (run_start > first && !versions[run_start - 1].delta) {
+            run_start--;
+        }
+        size_t below = 0;
+        while (run_start - below > first && versions[run_start - below - 1].delta) {
+            below++;
+        }
+
+        struct delta_buffer newer;
+        snprintf(path, sizeof(path), "%s/%s", dir, versions[newest].name);
+        if (!read_file(path, &newer)) {
+            success = 0;
+            continue;
+        }
+
+        size_t full_above = newest;
+        for (size_t k = newest; k-- > run_start;) {
+            struct delta_buffer current, delta;
+            long long start = io_throttle_clock();
+
+            snprintf(path, sizeof(path), "%s/%s", dir, versions[k].name);
+            if (!read_file(path, &current)) {
+                success = 0;
+                break;
+            }
+
+            size_t chain = full_above - k + (k == run_start ? below : 0);
+            int keep = chain > VERSION_CHAIN_MAX;
+            if (!keep) {
+                if (!delta_encode(newer.data, newer.size, current.data, current.size, &delta)) {
+                    log_message(LOG_ERR, "Out of memory encoding %s", path);
+                    keep = 1;
+                    success = 0;
+                } else if (delta.size * 100 > current.size * VERSION_DELTA_MAX_PERCENT) {
+                    keep = 1;
+                    delta_buffer_free(&delta);
+                } else {
+                    if (store_delta(dir, versions[k].name, &delta, batch)) {
+                        converted++;
+                        saved += (long long)current.size - (long long)delta.size;
+                    } else {
+                        keep = 1;
+                        success = 0;
+                    }
+                    io_throttle_account(current.size + delta.size, 2, io_throttle_clock() - start);
+                    delta_buffer_free(&delta);
+                }
+            }
+            if (keep) {
+                full_above = k;
+            }
+
+            delta_buffer_free(&newer);
+            newer = current;
+        }
+        delta_buffer_free(&newer);
+    }
+
+    version_list_free(&list);
+
+    if (converted > 0) {
+        log_message(LOG_INFO, "Stored %zu report versions in %s as deltas, saving %lld bytes",
+                    converted, dir, saved);
+    }
+    return success;
+}
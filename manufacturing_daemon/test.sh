@@ -45,4 +45,685 @@ cat logs/error.log
 echo -e "\nStopping daemon..."
 kill $DAEMON_PID
 
+echo -e "\nChecking the delta codec..."
+make check || exit 1
+
+# Run one test mode cycle in the current directory and stop it once done
+run_test_cycle() {
+    : > logs/error.log
+    "$BIN_DIR/test_mode" > output.txt 2>&1 &
+    local pid=$!
+    while ! grep -q "IPC message queue cleaned up" logs/error.log 2>/dev/null; do
+        if ! kill -0 $pid 2>/dev/null; then
+            echo "ERROR: test mode exited early"
+            return 1
+        fi
+        sleep 0.1
+    done
+    kill $pid
+    wait $pid 2>/dev/null
+    return 0
+}
+
+BIN_DIR="$(pwd)/bin"
+TEST_DIR=$(mktemp -d)
+trap 'rm -rf "$TEST_DIR"' EXIT
+
+echo -e "\nChecking recovery of an interrupted transfer cycle..."
+mkdir -p "$TEST_DIR/journal/data/upload" "$TEST_DIR/journal/data/reporting" \
+         "$TEST_DIR/journal/data/backup" "$TEST_DIR/journal/logs" "$TEST_DIR/journal/expected"
+cp departments.conf "$TEST_DIR/journal/"
+printf "durability = none\nreport_versions = full\n" > "$TEST_DIR/journal/company.conf"
+cd "$TEST_DIR/journal" || exit 1
+
+# Upload a report and journal its move as transfer_uploads() does, with
+# the identity of the file now under its name
+journal_upload() {
+    echo "<report>sales $2</report>" > "expected/sales_2024-02-$2.xml"
+    cp "expected/sales_2024-02-$2.xml" "data/upload/sales_2024-02-$2.xml"
+    printf "I\t%d\t./data/upload/sales_2024-02-%s.xml\t./data/reporting/sales_2024-02-%s.xml\t%s\n" \
+        "$1" "$2" "$2" "$(stat -c '%d	%i	%s	%Y' "data/upload/sales_2024-02-$2.xml")" \
+        >> data/transfer.journal
+}
+
+printf "B\t%d\n" "$(date +%s)" > data/transfer.journal
+# Crashed while copying: the partial copy is rolled back and the move redone
+journal_upload 0 01
+echo "<rep" > data/reporting/sales_2024-02-01.xml.part
+# Crashed after copying, before the source was removed
+journal_upload 1 02
+cp data/upload/sales_2024-02-02.xml data/reporting/
+# Crashed after the move, before it was marked done
+journal_upload 2 03
+mv data/upload/sales_2024-02-03.xml data/reporting/
+# Crashed before the move started
+journal_upload 3 04
+# Moved, then uploaded again while the daemon was down
+journal_upload 4 05
+mv data/upload/sales_2024-02-05.xml data/reporting/
+echo "<report>sales 05, uploaded again</report>" > expected/reupload.xml
+cp expected/reupload.xml data/upload/sales_2024-02-05.xml
+
+run_test_cycle || exit 1
+if ! grep -q "resuming 5 journaled moves" logs/error.log ||
+   ! grep -q "Rolling back partial copy" logs/error.log ||
+   ! grep -q "sales_2024-02-05.xml was uploaded again" logs/error.log; then
+    echo "ERROR: the interrupted cycle was not recovered from its journal"
+    exit 1
+fi
+for day in 01 02 03 04 05; do
+    if ! cmp -s "expected/sales_2024-02-$day.xml" "data/reporting/sales_2024-02-$day.xml"; then
+        echo "ERROR: the journaled move of sales_2024-02-$day.xml did not complete intact"
+        exit 1
+    fi
+done
+REUPLOAD=$(ls data/reporting/sales_2024-02-05_*.xml 2>/dev/null)
+if [ "$(echo "$REUPLOAD" | wc -w)" -ne 1 ] || ! cmp -s expected/reupload.xml "$REUPLOAD"; then
+    echo "ERROR: the re-upload was not kept for the next cycle as a new version"
+    exit 1
+fi
+if [ -n "$(ls data/upload)" ] || [ -n "$(find data -name '*.part')" ] ||
+   [ -s data/transfer.journal ] || [ -e data/transfer.journal.failed ]; then
+    echo "ERROR: recovery left uploads, partial copies or journal records behind"
+    exit 1
+fi
+echo "Interrupted moves resumed from the journal in every state"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking report versions in a partitioned layout..."
+mkdir -p "$TEST_DIR/versions/data/upload" "$TEST_DIR/versions/data/reporting" \
+         "$TEST_DIR/versions/data/backup" "$TEST_DIR/versions/logs"
+cp departments.conf "$TEST_DIR/versions/"
+printf "durability = none\nreporting_layout = partitioned\nreport_versions = delta\n" \
+    > "$TEST_DIR/versions/company.conf"
+cd "$TEST_DIR/versions" || exit 1
+PARTITION=data/reporting/sales/2024/03
+seq 1 3000 | sed 's/^/<row>/' > original.xml
+cp original.xml data/upload/sales_2024-03-05.xml
+run_test_cycle || exit 1
+sed '5s/$/x/' original.xml > data/upload/sales_2024-03-05.xml
+# Versions of a report that was not re-uploaded this cycle are left alone
+cp original.xml "$PARTITION/sales_2024-03-07.xml"
+sed '7s/$/x/' original.xml > "$PARTITION/sales_2024-03-07_20240308_090000.xml"
+run_test_cycle || exit 1
+if [ ! -f "$PARTITION/sales_2024-03-07.xml" ] || [ -e "$PARTITION/sales_2024-03-07.xml.delta" ]; then
+    echo "ERROR: versions of a report that was not re-uploaded were compacted"
+    exit 1
+fi
+if [ ! -f "$PARTITION/sales_2024-03-05.xml.delta" ] || [ -f "$PARTITION/sales_2024-03-05.xml" ]; then
+    echo "ERROR: the superseded version was not stored as a delta"
+    exit 1
+fi
+if ! grep -q "^sales_2024-03-05.xml.delta	" "$PARTITION/.manifest" ||
+   grep -q "^sales_2024-03-05.xml	" "$PARTITION/.manifest"; then
+    echo "ERROR: the partition manifest does not list the delta"
+    exit 1
+fi
+"$BIN_DIR/company_reconstruct" "$PARTITION/sales_2024-03-05.xml" rebuilt.xml || exit 1
+if ! cmp -s original.xml rebuilt.xml; then
+    echo "ERROR: the reconstructed version differs from the original upload"
+    exit 1
+fi
+echo "Superseded version stored as a delta and reconstructed byte for byte"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking replication to a standby receiver..."
+mkdir -p "$TEST_DIR/replica/data/upload" "$TEST_DIR/replica/data/reporting" \
+         "$TEST_DIR/replica/data/backup" "$TEST_DIR/replica/logs"
+cp departments.conf "$TEST_DIR/replica/"
+REPLICA_PORT=$((20000 + $$ % 20000))
+printf "durability = none\nreplication_target = tcp:127.0.0.1:%d\n" "$REPLICA_PORT" \
+    > "$TEST_DIR/replica/company.conf"
+cd "$TEST_DIR/replica" || exit 1
+"$BIN_DIR/company_replica" "tcp:127.0.0.1:$REPLICA_PORT" standby > replica.txt 2>&1 &
+REPLICA_PID=$!
+trap 'kill $REPLICA_PID 2>/dev/null; rm -rf "$TEST_DIR"' EXIT
+sleep 0.5
+for day in 01 02 03; do
+    echo "<report>sales $day</report>" > "data/upload/sales_2024-03-$day.xml"
+done
+
+# Shipping runs in the background, keep test mode running until the
+# standby has the reports
+: > logs/error.log
+"$BIN_DIR/test_mode" > output.txt 2>&1 &
+TEST_PID=$!
+for attempt in $(seq 1 100); do
+    [ "$(ls standby/reporting/sales_*.xml 2>/dev/null | wc -l)" -ge 3 ] && break
+    sleep 0.2
+done
+kill $TEST_PID
+wait $TEST_PID 2>/dev/null
+for day in 01 02 03; do
+    if ! cmp -s "data/reporting/sales_2024-03-$day.xml" "standby/reporting/sales_2024-03-$day.xml"; then
+        echo "ERROR: sales_2024-03-$day.xml did not reach the standby intact"
+        exit 1
+    fi
+done
+echo "Reports shipped to the standby"
+
+# A frame whose trailing CRC32C does not match its data must be discarded
+BAD_DATA="<report>corrupted in transit</report>"
+exec 3<>"/dev/tcp/127.0.0.1/$REPLICA_PORT" || exit 1
+printf "F\t%d\treporting/sales_2024-03-09.xml\n%sC\t00000000\nB\t1\n" \
+    "${#BAD_DATA}" "$BAD_DATA" >&3
+if read -r -t 5 ack <&3 && [ "${ack:0:1}" = "A" ]; then
+    echo "ERROR: the standby acknowledged a batch with a corrupted file"
+    exit 1
+fi
+exec 3<&-
+if [ -e standby/reporting/sales_2024-03-09.xml ] || [ -e standby/reporting/sales_2024-03-09.xml.part ]; then
+    echo "ERROR: the corrupted file was stored on the standby"
+    exit 1
+fi
+if ! grep -q "Checksum mismatch receiving reporting/sales_2024-03-09.xml" logs/error.log; then
+    echo "ERROR: the standby did not report the checksum mismatch"
+    exit 1
+fi
+echo "Corrupted file rejected by the standby"
+kill $REPLICA_PID
+cd - > /dev/null || exit 1
+
+# Wait up to the given seconds for a command to succeed
+wait_until() {
+    local deadline=$((SECONDS + $1))
+    shift
+    until "$@"; do
+        [ $SECONDS -ge $deadline ] && return 1
+        sleep 0.5
+    done
+    return 0
+}
+
+# Stop a daemon and wait for it to exit, it holds its lock until then
+stop_daemon() {
+    kill "$1"
+    wait_until 10 daemon_stopped "$1"
+}
+
+daemon_stopped() {
+    ! kill -0 "$1" 2>/dev/null
+}
+
+# Check that at least the given number of April sales reports are in
+# the reporting directory
+reports_in_place() {
+    [ "$(ls data/reporting/sales_2024-04-*.xml 2>/dev/null | wc -l)" -ge "$1" ]
+}
+
+echo -e "\nChecking streaming intake across a requested cycle..."
+mkdir -p "$TEST_DIR/streaming/data/upload" "$TEST_DIR/streaming/data/reporting" \
+         "$TEST_DIR/streaming/data/backup" "$TEST_DIR/streaming/logs" "$TEST_DIR/streaming/expected"
+cp departments.conf "$TEST_DIR/streaming/"
+# The throttle makes the requested cycle's backup take a few seconds
+printf "durability = none\nintake = streaming\nio_bytes_per_sec = 1048576\n" \
+    > "$TEST_DIR/streaming/company.conf"
+cd "$TEST_DIR/streaming" || exit 1
+for day in 01 02 03 04; do
+    head -c 1000000 /dev/zero | tr '\0' 'x' > "data/reporting/warehouse_2024-01-$day.xml"
+done
+
+# Dropped in a batch, copied to expected/ first so content can be compared
+drop_uploads() {
+    for day in "$@"; do
+        echo "<report>sales $day</report>" > "expected/sales_2024-04-$day.xml"
+        cp "expected/sales_2024-04-$day.xml" "data/upload/"
+    done
+}
+
+"$BIN_DIR/company_daemon" company.conf || exit 1
+wait_until 10 grep -q "Startup completed" logs/error.log || exit 1
+STREAM_PID=$(cat /tmp/company_daemon.pid)
+trap 'kill $STREAM_PID 2>/dev/null; rm -rf "$TEST_DIR"' EXIT
+
+# Streamed on their own, then uploads dropped just before and during a
+# cycle requested with SIGUSR1
+drop_uploads 01 02 03 04 05
+if ! wait_until 60 reports_in_place 5; then
+    echo "ERROR: uploads were not streamed into the reporting directory"
+    exit 1
+fi
+drop_uploads 06 07 08 09 10 11 12 13 14 15
+kill -USR1 "$STREAM_PID"
+if ! wait_until 30 grep -q "Starting backup of reporting directory" logs/error.log; then
+    echo "ERROR: the requested cycle did not start"
+    exit 1
+fi
+drop_uploads 16 17 18 19 20 21 22 23 24 25
+if grep -q "Unlocking directories" logs/error.log; then
+    echo "ERROR: the requested cycle ended before uploads were dropped during it"
+    exit 1
+fi
+if ! wait_until 120 reports_in_place 25; then
+    echo "ERROR: uploads dropped around the cycle did not all reach the reporting directory"
+    exit 1
+fi
+sleep 2
+stop_daemon "$STREAM_PID"
+
+for expected in expected/*.xml; do
+    name=$(basename "$expected" .xml)
+    if [ "$(ls data/reporting | grep -c "^$name")" -ne 1 ] || ! cmp -s "$expected" "data/reporting/$name.xml"; then
+        echo "ERROR: $name.xml did not land in the reporting directory exactly once"
+        exit 1
+    fi
+done
+if [ -n "$(ls data/upload)" ] || [ -n "$(find data -name '*.part')" ]; then
+    echo "ERROR: uploads or partial copies were left behind"
+    exit 1
+fi
+if ! grep -q "Intake check: 5 streamed reports in place, 0 missing" logs/error.log; then
+    echo "ERROR: the cycle did not find the streamed reports in place"
+    exit 1
+fi
+if grep -q "ERROR" logs/error.log; then
+    echo "ERROR: streaming intake logged errors"
+    grep "ERROR" logs/error.log
+    exit 1
+fi
+echo "Every upload streamed or moved by the cycle exactly once"
+
+# The requested cycle backed up 4 MB at 1 MB/s, the adaptive budget can
+# only slow it down further
+THROTTLE=$(grep -o "I/O throttle: [0-9.]* MB in [0-9]* ops over [0-9.]* s" logs/error.log | head -n 1)
+if [ -z "$THROTTLE" ] || ! echo "$THROTTLE" | awk '{ exit !($3 >= 4 && $9 >= $3 - 1.5) }'; then
+    echo "ERROR: the requested cycle was not held to the configured I/O rate"
+    exit 1
+fi
+echo "Requested cycle held to the configured I/O rate"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking that batch and strict durability write the same trees..."
+for mode in batch strict; do
+    mkdir -p "$TEST_DIR/$mode/data/upload" "$TEST_DIR/$mode/data/reporting" \
+             "$TEST_DIR/$mode/data/backup" "$TEST_DIR/$mode/logs"
+    cp departments.conf "$TEST_DIR/$mode/"
+    printf "durability = %s\n" "$mode" > "$TEST_DIR/$mode/company.conf"
+    cp test_files/*.xml "$TEST_DIR/$mode/data/upload/"
+    cd "$TEST_DIR/$mode" || exit 1
+    run_test_cycle || exit 1
+    SYNCED=$(sed -n "s/.*Durability ($mode): \([0-9]*\) files.*/\1/p" logs/error.log |
+             awk '{ total += $1 } END { print total + 0 }')
+    if [ "$SYNCED" -eq 0 ]; then
+        echo "ERROR: the $mode cycle did not make its files durable"
+        exit 1
+    fi
+    if [ -n "$(ls data/upload)" ] || [ -n "$(find data -name '*.part')" ]; then
+        echo "ERROR: the $mode cycle left uploads or partial copies behind"
+        exit 1
+    fi
+    cd - > /dev/null || exit 1
+done
+if ! diff -r "$TEST_DIR/batch/data/reporting" "$TEST_DIR/strict/data/reporting" > /dev/null ||
+   ! diff -r "$TEST_DIR/batch/data/backup"/backup_* "$TEST_DIR/strict/data/backup"/backup_* > /dev/null; then
+    echo "ERROR: batch and strict durability wrote different trees"
+    exit 1
+fi
+echo "Batch and strict cycles synced their files and wrote the same trees"
+
+echo -e "\nChecking that only regular report files are picked up from a large upload directory..."
+mkdir -p "$TEST_DIR/scan/data/upload" "$TEST_DIR/scan/data/reporting" \
+         "$TEST_DIR/scan/data/backup" "$TEST_DIR/scan/logs"
+cp departments.conf "$TEST_DIR/scan/"
+printf "durability = none\n" > "$TEST_DIR/scan/company.conf"
+cd "$TEST_DIR/scan" || exit 1
+# More entries than one getdents64 buffer holds, next to entries that
+# are not regular report files
+seq -f "data/upload/scan_%05g.xml" 1 8000 | xargs touch
+mkdir data/upload/folder.xml
+echo "<notes/>" > data/upload/notes.txt
+ln -s ../reporting data/upload/link.xml
+run_test_cycle || exit 1
+if [ "$(ls data/reporting | grep -c '^scan_[0-9]*\.xml$')" -ne 8000 ] ||
+   [ -n "$(ls data/upload | grep '^scan_')" ]; then
+    echo "ERROR: not every report in the upload directory was transferred"
+    exit 1
+fi
+if [ ! -d data/upload/folder.xml ] || [ ! -f data/upload/notes.txt ] || [ ! -L data/upload/link.xml ] ||
+   [ "$(ls data/reporting | wc -l)" -ne 8000 ]; then
+    echo "ERROR: entries that are not regular report files were transferred"
+    exit 1
+fi
+echo "All 8000 reports transferred, directories, symlinks and other files left alone"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking the missing report check against a custom department list..."
+mkdir -p "$TEST_DIR/missing/data/upload" "$TEST_DIR/missing/data/reporting" \
+         "$TEST_DIR/missing/data/backup" "$TEST_DIR/missing/logs"
+printf "alpha\nbeta standard\ngamma urgent\n" > "$TEST_DIR/missing/departments.conf"
+printf "durability = none\nmissing_report_window_days = 3\n" > "$TEST_DIR/missing/company.conf"
+cd "$TEST_DIR/missing" || exit 1
+DAY0=$(date +%Y-%m-%d)
+DAY1=$(date -d yesterday +%Y-%m-%d)
+DAY2=$(date -d "2 days ago" +%Y-%m-%d)
+# alpha has every day, beta only today, gamma nothing
+for day in "$DAY0" "$DAY1" "$DAY2"; do
+    echo "<report>alpha</report>" > "data/upload/alpha_$day.xml"
+done
+echo "<report>beta</report>" > "data/reporting/beta_$DAY0.xml"
+run_test_cycle || exit 1
+if grep -q "Missing upload: alpha" logs/error.log ||
+   ! grep -q "Missing upload: beta report for $DAY2,$DAY1\$" logs/error.log ||
+   ! grep -q "Missing upload: gamma report for $DAY2,$DAY1,$DAY0\$" logs/error.log; then
+    echo "ERROR: the missing report warnings do not match the department list"
+    exit 1
+fi
+if ! grep -q "Missing reports: beta($DAY2,$DAY1) gamma($DAY2,$DAY1,$DAY0)\$" logs/missing_reports.log; then
+    echo "ERROR: missing_reports.log does not list the missing reports"
+    exit 1
+fi
+echo "Missing reports found for each department and day in the window"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking the partition manifests and index..."
+mkdir -p "$TEST_DIR/partitions/data/upload" "$TEST_DIR/partitions/data/reporting" \
+         "$TEST_DIR/partitions/data/backup" "$TEST_DIR/partitions/logs"
+cp departments.conf "$TEST_DIR/partitions/"
+printf "durability = none\nreporting_layout = partitioned\n" > "$TEST_DIR/partitions/company.conf"
+cd "$TEST_DIR/partitions" || exit 1
+echo "<report>sales 05</report>" > data/upload/sales_2024-03-05.xml
+echo "<report>warehouse 01</report>" > data/upload/warehouse_2024-04-01.xml
+run_test_cycle || exit 1
+if [ ! -f data/reporting/sales/2024/03/sales_2024-03-05.xml ] ||
+   [ ! -f data/reporting/warehouse/2024/04/warehouse_2024-04-01.xml ] ||
+   ! grep -q "^sales_2024-03-05.xml	$(stat -c %s data/reporting/sales/2024/03/sales_2024-03-05.xml)	" \
+       data/reporting/sales/2024/03/.manifest; then
+    echo "ERROR: reports were not placed in their partitions and manifests"
+    exit 1
+fi
+if [ "$(cat data/reporting/.partitions)" != "$(printf 'sales/2024/03\t1\nwarehouse/2024/04\t1')" ]; then
+    echo "ERROR: the partition index does not list both new partitions"
+    exit 1
+fi
+# Snapshots are named to the second
+sleep 1
+echo "<report>sales 06</report>" > data/upload/sales_2024-03-06.xml
+run_test_cycle || exit 1
+if [ "$(cat data/reporting/.partitions)" != "$(printf 'sales/2024/03\t2\nwarehouse/2024/04\t1')" ] ||
+   [ "$(grep -c . data/reporting/sales/2024/03/.manifest)" -ne 2 ]; then
+    echo "ERROR: only the changed partition should have a new generation"
+    exit 1
+fi
+LATEST=$(ls -d data/backup/backup_* | tail -n 1)
+if ! grep -q "Backed up 1 changed partitions, linked 1 unchanged partitions" logs/error.log ||
+   grep -q "Backed up partition: warehouse" logs/error.log ||
+   ! cmp -s data/reporting/warehouse/2024/04/warehouse_2024-04-01.xml \
+       "$LATEST/warehouse/2024/04/warehouse_2024-04-01.xml" ||
+   [ ! -f "$LATEST/sales/2024/03/sales_2024-03-06.xml" ]; then
+    echo "ERROR: the backup did not link the unchanged partition from the previous snapshot"
+    exit 1
+fi
+echo "Partition manifests and index updated, unchanged partition linked by the backup"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking backup retention..."
+mkdir -p "$TEST_DIR/retention/data/upload" "$TEST_DIR/retention/data/reporting" \
+         "$TEST_DIR/retention/data/backup" "$TEST_DIR/retention/logs"
+cp departments.conf "$TEST_DIR/retention/"
+printf "durability = none\nretention_daily = 3\nretention_weekly = 3\nretention_monthly = 3\n" \
+    > "$TEST_DIR/retention/company.conf"
+cd "$TEST_DIR/retention" || exit 1
+echo "<report>sales 05</report>" > data/upload/sales_2024-03-05.xml
+# Older snapshots, newest first; today's backup comes before all of them
+for snapshot in 20240315_120000 20240315_080000 20240314_120000 20240310_120000 \
+                20240301_120000 20240215_120000 20240115_120000; do
+    mkdir -p "data/backup/backup_$snapshot/sub"
+    echo "<report>$snapshot</report>" > "data/backup/backup_$snapshot/sub/sales.xml"
+done
+run_test_cycle || exit 1
+# Days: today, 03-15 and 03-14. Weeks: this one, 03-11 and 03-04.
+# Months: this one, March and February.
+KEPT="$(ls data/backup | grep -v "^backup_$(date +%Y%m%d)_" | tr '\n' ' ')"
+if [ "$KEPT" != "backup_20240215_120000 backup_20240310_120000 backup_20240314_120000 backup_20240315_120000 latest " ] ||
+   [ "$(ls -d data/backup/backup_"$(date +%Y%m%d)"_* | wc -l)" -ne 1 ]; then
+    echo "ERROR: retention kept the wrong snapshots: $KEPT"
+    exit 1
+fi
+if ! grep -q "Backup retention: kept 5 of 8 snapshots" logs/error.log; then
+    echo "ERROR: retention did not report the pruned snapshots"
+    exit 1
+fi
+echo "Newest snapshot of each retained day, week and month kept, the rest pruned"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking backup checksum verification..."
+mkdir -p "$TEST_DIR/verify/data/upload" "$TEST_DIR/verify/data/reporting" \
+         "$TEST_DIR/verify/data/backup" "$TEST_DIR/verify/logs"
+cp departments.conf "$TEST_DIR/verify/"
+printf "durability = none\n" > "$TEST_DIR/verify/company.conf"
+cp test_files/*.xml "$TEST_DIR/verify/data/upload/"
+cd "$TEST_DIR/verify" || exit 1
+run_test_cycle || exit 1
+if ! "$BIN_DIR/company_verify" > verify.txt 2>&1 || ! grep -q "^4 ok, 0 corrupt, 0 missing" verify.txt; then
+    echo "ERROR: the new backup did not verify"
+    cat verify.txt
+    exit 1
+fi
+# Flip one byte without changing the size, and lose another file
+SNAPSHOT=$(ls -d data/backup/backup_* | tail -n 1)
+printf 'X' | dd of="$SNAPSHOT/sales_2024-03-05.xml" bs=1 seek=1 conv=notrunc 2> /dev/null
+rm "$SNAPSHOT/warehouse_2024-03-05.xml"
+if "$BIN_DIR/company_verify" > verify.txt 2>&1 || ! grep -q "^2 ok, 1 corrupt, 1 missing" verify.txt; then
+    echo "ERROR: the damaged backup was not reported"
+    cat verify.txt
+    exit 1
+fi
+echo "Backup verified, corrupted and missing files reported"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking that the monitor state survives a restart..."
+mkdir -p "$TEST_DIR/restart/data/upload" "$TEST_DIR/restart/data/reporting" \
+         "$TEST_DIR/restart/data/backup" "$TEST_DIR/restart/logs"
+cp departments.conf "$TEST_DIR/restart/"
+# Keep the scheduled transfer away from the test run
+printf "durability = none\ntransfer_hour = %d\n" $(( ($(date +%-H) + 12) % 24 )) \
+    > "$TEST_DIR/restart/company.conf"
+cd "$TEST_DIR/restart" || exit 1
+for day in 01 02; do
+    echo "<report>sales $day</report>" > "data/upload/sales_2024-05-$day.xml"
+done
+
+"$BIN_DIR/company_daemon" company.conf || exit 1
+wait_until 10 grep -q "Startup completed" logs/error.log || exit 1
+RESTART_PID=$(cat /tmp/company_daemon.pid)
+trap 'kill $RESTART_PID 2>/dev/null; rm -rf "$TEST_DIR"' EXIT
+if ! wait_until 15 grep -q "	sales_2024-05-02.xml$" data/monitor.state ||
+   ! grep -q "	sales_2024-05-01.xml$" data/monitor.state; then
+    echo "ERROR: the monitor state was not saved"
+    exit 1
+fi
+stop_daemon "$RESTART_PID"
+
+# Changed and added while the daemon was down
+echo "<report>sales 02, corrected</report>" > data/upload/sales_2024-05-02.xml
+echo "<report>sales 03</report>" > data/upload/sales_2024-05-03.xml
+: > logs/error.log
+"$BIN_DIR/company_daemon" company.conf || exit 1
+wait_until 10 grep -q "Startup completed" logs/error.log || exit 1
+RESTART_PID=$(cat /tmp/company_daemon.pid)
+if ! wait_until 30 grep -q "Monitor state verified, 1 files changed while stopped" logs/error.log; then
+    echo "ERROR: the saved monitor state was not verified against the upload directory"
+    exit 1
+fi
+sleep 1
+stop_daemon "$RESTART_PID"
+if grep -q "File change detected: sales_2024-05-01.xml" logs/error.log ||
+   ! grep -q "File change detected: sales_2024-05-02.xml" logs/error.log ||
+   ! grep -q "File change detected: sales_2024-05-03.xml" logs/error.log; then
+    echo "ERROR: the restart did not report exactly the files changed while stopped"
+    exit 1
+fi
+echo "Monitor state reloaded, only files changed while stopped reported again"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking configuration reload..."
+mkdir -p "$TEST_DIR/reload/data/upload" "$TEST_DIR/reload/data/reporting" \
+         "$TEST_DIR/reload/data/backup" "$TEST_DIR/reload/logs"
+cp departments.conf "$TEST_DIR/reload/"
+printf "durability = none\nmissing_report_window_days = 3\n" > "$TEST_DIR/reload/company.conf"
+cd "$TEST_DIR/reload" || exit 1
+
+# Request a cycle and wait for its missing report check to show the window
+cycle_window() {
+    : > logs/error.log
+    kill -USR1 "$RELOAD_PID"
+    wait_until 30 grep -q "Checking for missing uploads for the $1 days" logs/error.log
+}
+
+"$BIN_DIR/company_daemon" company.conf || exit 1
+wait_until 10 grep -q "Startup completed" logs/error.log || exit 1
+RELOAD_PID=$(cat /tmp/company_daemon.pid)
+trap 'kill $RELOAD_PID 2>/dev/null; rm -rf "$TEST_DIR"' EXIT
+if ! cycle_window 3; then
+    echo "ERROR: the daemon did not start with the configured settings"
+    exit 1
+fi
+
+printf "durability = none\nmissing_report_window_days = 5\n" > company.conf
+kill -HUP "$RELOAD_PID"
+if ! wait_until 15 grep -q "Configuration reloaded from company.conf (generation 2)" logs/error.log ||
+   ! cycle_window 5; then
+    echo "ERROR: the changed setting was not reloaded"
+    exit 1
+fi
+
+# An invalid file and a missing file both keep the current settings
+printf "durability = sometimes\nmissing_report_window_days = 9\n" > company.conf
+kill -HUP "$RELOAD_PID"
+if ! wait_until 15 grep -q "invalid value 'sometimes' for durability" logs/error.log ||
+   ! cycle_window 5; then
+    echo "ERROR: an invalid configuration file replaced the current settings"
+    exit 1
+fi
+mv company.conf company.conf.moved
+kill -HUP "$RELOAD_PID"
+if ! wait_until 15 grep -q "Configuration reload failed, keeping the current settings" logs/error.log ||
+   ! cycle_window 5; then
+    echo "ERROR: a missing configuration file replaced the current settings"
+    exit 1
+fi
+stop_daemon "$RELOAD_PID"
+echo "Changed settings reloaded, invalid and missing files rejected"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking attribution of upload changes..."
+mkdir -p "$TEST_DIR/attribution/data/upload" "$TEST_DIR/attribution/data/reporting" \
+         "$TEST_DIR/attribution/data/backup" "$TEST_DIR/attribution/logs"
+cp departments.conf "$TEST_DIR/attribution/"
+printf "durability = none\nattribution = fanotify\ntransfer_hour = %d\n" $(( ($(date +%-H) + 12) % 24 )) \
+    > "$TEST_DIR/attribution/company.conf"
+cd "$TEST_DIR/attribution" || exit 1
+"$BIN_DIR/company_daemon" company.conf || exit 1
+wait_until 10 grep -q "Startup completed" logs/error.log || exit 1
+ATTRIBUTION_PID=$(cat /tmp/company_daemon.pid)
+trap 'kill $ATTRIBUTION_PID 2>/dev/null; rm -rf "$TEST_DIR"' EXIT
+echo "<report>sales 01</report>" | dd of=data/upload/sales_2024-06-01.xml 2> /dev/null
+if ! wait_until 30 grep -qs "File: sales_2024-06-01.xml, User: $(id -un)," logs/change.log; then
+    echo "ERROR: the upload was not recorded in the change log with its user"
+    exit 1
+fi
+stop_daemon "$ATTRIBUTION_PID"
+# Without the privileges fanotify needs the daemon falls back to owners
+if grep -q "Attributing upload changes to the writing process with fanotify" logs/error.log; then
+    if ! grep -q "File: sales_2024-06-01.xml, User: $(id -un), Process: dd\[[0-9]*\]" logs/change.log; then
+        echo "ERROR: the upload was not attributed to the process that wrote it"
+        exit 1
+    fi
+    echo "Upload attributed to the process that wrote it"
+elif grep -q "attributing changes to file owners" logs/error.log; then
+    echo "fanotify unavailable, upload attributed to its owner"
+else
+    echo "ERROR: the daemon did not report how it attributes changes"
+    exit 1
+fi
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking restore from a backup snapshot..."
+mkdir -p "$TEST_DIR/restore/data/upload" "$TEST_DIR/restore/data/reporting" \
+         "$TEST_DIR/restore/data/backup" "$TEST_DIR/restore/logs"
+cp departments.conf "$TEST_DIR/restore/"
+printf "durability = none\n" > "$TEST_DIR/restore/company.conf"
+cp test_files/*.xml "$TEST_DIR/restore/data/upload/"
+cd "$TEST_DIR/restore" || exit 1
+run_test_cycle || exit 1
+SNAPSHOT=$(ls -d data/backup/backup_* | tail -n 1)
+
+# Lose one report, damage another and add one the snapshot does not have
+rm data/reporting/sales_2024-03-05.xml
+echo "<damaged/>" > data/reporting/warehouse_2024-03-05.xml
+echo "<report>sales 06</report>" > data/reporting/sales_2024-03-06.xml
+"$BIN_DIR/company_restore" -j 2 > restore.txt 2>&1 || { cat restore.txt; exit 1; }
+if ! diff -r -x .checksums "$SNAPSHOT" data/reporting > /dev/null ||
+   [ ! -f data/reporting.before_restore_*/sales_2024-03-06.xml ]; then
+    echo "ERROR: the whole snapshot was not restored, or the replaced directory was not kept"
+    exit 1
+fi
+
+# Only the selected department is restored
+rm data/reporting/sales_2024-03-05.xml
+echo "<damaged/>" > data/reporting/warehouse_2024-03-05.xml
+"$BIN_DIR/company_restore" -d sales -f 2024-03-01 -t 2024-03-31 > restore.txt 2>&1 || { cat restore.txt; exit 1; }
+if ! cmp -s "$SNAPSHOT/sales_2024-03-05.xml" data/reporting/sales_2024-03-05.xml ||
+   [ "$(cat data/reporting/warehouse_2024-03-05.xml)" != "<damaged/>" ]; then
+    echo "ERROR: the filtered restore did not restore exactly the selected reports"
+    exit 1
+fi
+echo "Whole and filtered restores rebuilt the reports from the snapshot"
+cd - > /dev/null || exit 1
+
+echo -e "\nChecking several sites served by one daemon..."
+mkdir -p "$TEST_DIR/sites/logs" "$TEST_DIR/sites/data"
+cp departments.conf "$TEST_DIR/sites/"
+echo "rush urgent" >> "$TEST_DIR/sites/departments.conf"
+printf "north sites/north\nsouth sites/south\neast sites/east\n" > "$TEST_DIR/sites/sites.conf"
+printf "durability = none\nsites_file = sites.conf\nsite_workers = 2\ntransfer_hour = %d\n" \
+    $(( ($(date +%-H) + 12) % 24 )) > "$TEST_DIR/sites/company.conf"
+cd "$TEST_DIR/sites" || exit 1
+
+# Check that every site has its own rush report in its reporting directory
+rush_in_place() {
+    for site in north south east; do
+        [ -f "sites/$site/reporting/rush_2024-07-01.xml" ] || return 1
+    done
+}
+
+sites_uploads_gone() {
+    [ -z "$(find sites/*/upload -type f)" ]
+}
+
+"$BIN_DIR/company_daemon" company.conf || exit 1
+wait_until 10 grep -q "Startup completed" logs/error.log || exit 1
+SITES_PID=$(cat /tmp/company_daemon.pid)
+trap 'kill $SITES_PID 2>/dev/null; rm -rf "$TEST_DIR"' EXIT
+for site in north south east; do
+    echo "<report>rush $site</report>" > "sites/$site/upload/rush_2024-07-01.xml"
+    echo "<report>sales $site</report>" > "sites/$site/upload/sales_2024-07-01.xml"
+done
+if ! wait_until 60 rush_in_place; then
+    echo "ERROR: urgent uploads were not moved at every site"
+    exit 1
+fi
+# Cycles share the I/O throttle, the sites take turns a tick apart
+kill -USR1 "$SITES_PID"
+if ! wait_until 60 sites_uploads_gone; then
+    echo "ERROR: the requested cycle did not run at every site"
+    exit 1
+fi
+stop_daemon "$SITES_PID"
+for site in north south east; do
+    for report in rush sales; do
+        if [ "$(cat "sites/$site/reporting/${report}_2024-07-01.xml")" != "<report>$report $site</report>" ]; then
+            echo "ERROR: the $report upload of site $site did not reach its own reporting directory"
+            exit 1
+        fi
+    done
+    if [ "$(ls "sites/$site/reporting" | wc -l)" -ne 2 ] ||
+       ! ls "sites/$site/backup"/backup_*/rush_2024-07-01.xml > /dev/null 2>&1; then
+        echo "ERROR: site $site has reports of other sites or no backup of its own"
+        exit 1
+    fi
+done
+echo "Each site's uploads moved to and backed up in its own root"
+cd - > /dev/null || exit 1
+
 echo "Test completed successfully!"
\ No newline at end of file